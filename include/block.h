@@ -3,18 +3,24 @@
 
 #include <sys/stat.h>
 
+#include <atomic>
 #include <bitset>
 #include <functional>
 #include <map>
+#include <memory>
 #include <vector>
 
+#include "checksum.h"
 #include "common.h"
 #include "ext2/dentry.h"
 #include "ext2/inode.h"
 #include "ext2/super.h"
 #include "utils/bitmap.h"
+#include "utils/crc32c.h"
 #include "utils/disk.h"
 #include "utils/logging.h"
+#include "utils/pool.h"
+#include "utils/stats.h"
 
 namespace naivefs {
 
@@ -25,58 +31,510 @@ namespace naivefs {
   ((__bytes) / BLOCK_SIZE + ((__bytes) % BLOCK_SIZE ? 1 : 0))
 
 #define MALLOC_BLOCKS(__blks) (malloc(BLOCKS2BYTES(__blks)))
+
+// small files and directories are stored in i_block (60 bytes)
+#define INLINE_DATA_SIZE (EXT2_N_BLOCKS * sizeof(uint32_t))
+#define INLINE_BLOCK_INDEX ((uint32_t)-1)
+#define INODE_IS_INLINE(__i) ((__i)->i_flags & EXT2_INLINE_DATA_FL)
 #define ALIGN_TO_BLOCKSIZE(__n) (ALIGN_TO(__n, BLOCK_SIZE))
 
-class Block {
+// block group descriptors live in block 0 after the super block
+#define MAX_BLOCK_GROUPS \
+  ((BLOCK_SIZE - sizeof(ext2_super_block)) / sizeof(ext2_group_desc))
+
+// past s_first_meta_bg, groups are described by meta groups: one block of
+// descriptors for every DESCS_PER_BLOCK groups
+#define DESCS_PER_BLOCK (BLOCK_SIZE / sizeof(ext2_group_desc))
+
+/**
+ * @brief Geometry of the block groups recorded in the super block. A group is
+ * an inode bitmap, a block bitmap, the inode table and the data blocks, and
+ * s_blocks_per_group is the whole group (block indexes of group n start at
+ * n * s_blocks_per_group). Images formatted on first mount use the
+ * build-time defaults, mkfs.naivefs may choose others.
+ */
+inline uint32_t inode_table_blocks(const ext2_super_block* super) {
+  return super->s_inodes_per_group / INODES_PER_BLOCK;
+}
+
+inline uint32_t data_blocks_per_group(const ext2_super_block* super) {
+  return super->s_blocks_per_group - 2 - inode_table_blocks(super);
+}
+
+inline uint32_t num_block_groups(const ext2_super_block* super) {
+  if (super->s_groups_count) return super->s_groups_count;
+  // images of older versions only count used blocks and inodes
+  uint32_t block_n = (super->s_blocks_count + super->s_blocks_per_group - 1) /
+                     super->s_blocks_per_group;
+  uint32_t inode_n = (super->s_inodes_count + super->s_inodes_per_group - 1) /
+                     super->s_inodes_per_group;
+  uint32_t n = std::max(inode_n, block_n);
+  return n ? n : 1;
+}
+
+inline uint32_t first_meta_bg(const ext2_super_block* super) {
+  // older images keep every descriptor in block 0
+  return super->s_first_meta_bg ? super->s_first_meta_bg : MAX_BLOCK_GROUPS;
+}
+
+/**
+ * @brief Number of groups whose block and inode indexes fit in 32 bits, the
+ * width of i_block and of directory entries
+ */
+inline uint32_t max_block_groups(const ext2_super_block* super) {
+  uint64_t limit = (uint64_t)UINT32_MAX + 1;
+  return std::min(limit / super->s_blocks_per_group,
+                  limit / super->s_inodes_per_group);
+}
+
+/**
+ * @brief Disk offset of the region of block group index: s_blocks_per_group
+ * blocks from there
+ */
+inline off_t block_group_offset(const ext2_super_block* super,
+                                uint32_t index) {
+  return BLOCK_SIZE + BLOCKS2BYTES((uint64_t)index * super->s_blocks_per_group);
+}
+
+/**
+ * @brief Layout of the groups. In the plain layout, a group region is its
+ * inode bitmap, block bitmap, inode table and data blocks, data block 0
+ * sharing its offset with the last inode table block. With FLEX_BG, the
+ * regions of 2^s_log_groups_per_flex groups are merged: all their block
+ * bitmaps, then their inode bitmaps, their inode tables, and their data
+ * blocks back to back, so that the metadata is read and written
+ * sequentially and data runs on across groups.
+ */
+#define MAX_GROUPS_PER_FLEX 1024
+
+inline uint32_t groups_per_flex(const ext2_super_block* super) {
+  return 1U << super->s_log_groups_per_flex;
+}
+
+inline bool flex_layout(const ext2_super_block* super) {
+  return super->s_log_groups_per_flex != 0;
+}
+
+inline uint32_t first_flex_group(const ext2_super_block* super,
+                                 uint32_t index) {
+  return index & ~(groups_per_flex(super) - 1);
+}
+
+inline off_t data_block_offset(const ext2_super_block* super, uint32_t index,
+                               uint32_t data_block_index) {
+  uint64_t blocks = inode_table_blocks(super) + 1 + data_block_index;
+  if (flex_layout(super)) {
+    uint32_t n = index - first_flex_group(super, index);
+    // past the metadata of the flex group and the data of the groups before
+    blocks = (uint64_t)groups_per_flex(super) *
+                 (2 + inode_table_blocks(super)) +
+             (uint64_t)n * data_blocks_per_group(super) + data_block_index;
+    index -= n;
+  }
+  return block_group_offset(super, index) + BLOCKS2BYTES(blocks);
+}
+
+/**
+ * @brief Point desc at the bitmaps and inode table of group index
+ */
+inline void set_group_offsets(const ext2_super_block* super, uint32_t index,
+                              ext2_group_desc* desc) {
+  off_t inode_bitmap = block_group_offset(super, index);
+  off_t block_bitmap = inode_bitmap + BLOCK_SIZE;
+  off_t inode_table = block_bitmap + BLOCK_SIZE;
+  if (flex_layout(super)) {
+    uint32_t n = index - first_flex_group(super, index);
+    off_t base = block_group_offset(super, index - n);
+    block_bitmap = base + BLOCKS2BYTES(n);
+    inode_bitmap = base + BLOCKS2BYTES(groups_per_flex(super) + n);
+    inode_table = base + BLOCKS2BYTES(2 * groups_per_flex(super) +
+                                      (uint64_t)n * inode_table_blocks(super));
+  }
+  desc->bg_inode_bitmap = (uint32_t)inode_bitmap;
+  desc->bg_inode_bitmap_hi = (uint64_t)inode_bitmap >> 32;
+  desc->bg_block_bitmap = (uint32_t)block_bitmap;
+  desc->bg_block_bitmap_hi = (uint64_t)block_bitmap >> 32;
+  desc->bg_inode_table = (uint32_t)inode_table;
+  desc->bg_inode_table_hi = (uint64_t)inode_table >> 32;
+}
+
+inline bool is_meta_desc_group(const ext2_super_block* super, uint32_t index) {
+  return index >= first_meta_bg(super) &&
+         (index - first_meta_bg(super)) % DESCS_PER_BLOCK == 0;
+}
+
+/**
+ * @brief Disk offset of the descriptor block of the meta group holding group
+ * index (past first_meta_bg()). It is kept by the first group of the meta
+ * group, in the last block of its region, which no data block reaches, or
+ * in data block 0 with FLEX_BG.
+ */
+inline off_t meta_desc_block_offset(const ext2_super_block* super,
+                                    uint32_t index) {
+  uint32_t first = index - (index - first_meta_bg(super)) % DESCS_PER_BLOCK;
+  if (flex_layout(super)) return data_block_offset(super, first, 0);
+  return block_group_offset(super, first + 1) - BLOCK_SIZE;
+}
+
+/**
+ * @brief Checksums (METADATA_CSUM): every group keeps a table of the CRC32C
+ * of each block it lays out, 0 if unknown. The table has one slot per block
+ * of a group region: the inode bitmap, the block bitmap, the inode table
+ * blocks, then the data blocks (from slot itb + 1 in the plain layout, where
+ * data block 0 overlaps the inode table and the descriptor block of a meta
+ * group takes the last slot, and from slot itb + 2 with FLEX_BG).
+ */
+inline bool has_checksums(const ext2_super_block* super) {
+  return super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+}
+
+inline uint32_t csum_table_blocks(const ext2_super_block* super) {
+  if (!has_checksums(super)) return 0;
+  return (super->s_blocks_per_group * sizeof(uint32_t) + BLOCK_SIZE - 1) /
+         BLOCK_SIZE;
+}
+
+/**
+ * @brief Group and table slot of the block at offset
+ *
+ * @return false for block 0, which has its own checksum in the super block
+ */
+inline bool csum_slot(const ext2_super_block* super, off_t offset,
+                      uint32_t* group, uint32_t* slot) {
+  if (offset < BLOCK_SIZE) return false;
+  uint64_t block = (offset - BLOCK_SIZE) / BLOCK_SIZE;
+  uint32_t bpg = super->s_blocks_per_group;
+  if (!flex_layout(super)) {
+    *group = block / bpg;
+    *slot = block % bpg;
+    return true;
+  }
+  uint64_t gpf = groups_per_flex(super);
+  uint64_t itb = inode_table_blocks(super);
+  uint64_t first = block / (gpf * bpg) * gpf;
+  uint64_t n = block % (gpf * bpg);
+  if (n < gpf) {
+    *group = first + n;
+    *slot = 1;
+  } else if (n < 2 * gpf) {
+    *group = first + n - gpf;
+    *slot = 0;
+  } else if (n < gpf * (2 + itb)) {
+    n -= 2 * gpf;
+    *group = first + n / itb;
+    *slot = 2 + n % itb;
+  } else {
+    n -= gpf * (2 + itb);
+    *group = first + n / data_blocks_per_group(super);
+    *slot = 2 + itb + n % data_blocks_per_group(super);
+  }
+  return true;
+}
+
+/**
+ * @brief Group and data block index of the block at offset, the bit of the
+ * block in the block bitmap of the group
+ *
+ * @return false for block 0 and the group metadata, which are not data blocks
+ */
+inline bool data_block_index(const ext2_super_block* super, off_t offset,
+                             uint32_t* group, uint32_t* index) {
+  uint32_t slot;
+  if (!csum_slot(super, offset, group, &slot)) return false;
+  uint32_t first = inode_table_blocks(super) + (flex_layout(super) ? 2 : 1);
+  if (slot < first || slot - first >= data_blocks_per_group(super))
+    return false;
+  *index = slot - first;
+  return true;
+}
+
+/**
+ * @brief Deduplication (NAIVEFS_FEATURE_RO_COMPAT_DEDUP): every group keeps a
+ * table of the references to each of its data blocks, 16 bits each: 0 for a
+ * block that is never shared, otherwise the number of block map entries
+ * naming it. Then comes its part of the index of block hashes, sets of
+ * DEDUP_WAYS entries that the groups below s_dedup_groups hold in turn.
+ */
+struct dedup_entry {
+  uint64_t de_hash;  // 0 if unused
+  uint32_t de_block;
+  uint32_t de_reserved;
+};
+
+inline bool has_dedup(const ext2_super_block* super) {
+  return super->s_feature_ro_compat & NAIVEFS_FEATURE_RO_COMPAT_DEDUP;
+}
+
+inline uint32_t dedup_ref_blocks(const ext2_super_block* super) {
+  if (!has_dedup(super)) return 0;
+  return (data_blocks_per_group(super) * sizeof(uint16_t) + BLOCK_SIZE - 1) /
+         BLOCK_SIZE;
+}
+
+inline uint32_t dedup_index_blocks(const ext2_super_block* super) {
+  if (!has_dedup(super)) return 0;
+  return (data_blocks_per_group(super) / DEDUP_BLOCKS_PER_ENTRY *
+              sizeof(dedup_entry) +
+          BLOCK_SIZE - 1) /
+         BLOCK_SIZE;
+}
+
+inline uint32_t dedup_table_blocks(const ext2_super_block* super) {
+  return dedup_ref_blocks(super) + dedup_index_blocks(super);
+}
+
+/**
+ * @brief Data blocks at the start of group index that are never allocated:
+ * block 0 overlaps the inode table in the plain layout, and holds the
+ * descriptors of a meta group with FLEX_BG. The dedup and checksum tables
+ * follow.
+ */
+inline uint32_t reserved_data_blocks(const ext2_super_block* super,
+                                     uint32_t index) {
+  return (!flex_layout(super) || is_meta_desc_group(super, index)) +
+         dedup_table_blocks(super) + csum_table_blocks(super);
+}
+
+/**
+ * @brief Data block of group index where its dedup table starts
+ */
+inline uint32_t dedup_table_start(const ext2_super_block* super,
+                                  uint32_t index) {
+  return reserved_data_blocks(super, index) - csum_table_blocks(super) -
+         dedup_table_blocks(super);
+}
+
+/**
+ * @brief Checksum of block 0, the super block and the descriptors that follow
+ * it, as if s_checksum were 0
+ */
+inline uint32_t super_block_checksum(const uint8_t* block) {
+  static const uint8_t zero[sizeof(uint32_t)] = {};
+  size_t at = offsetof(ext2_super_block, s_checksum);
+  uint32_t crc = crc32c(0, block, at);
+  crc = crc32c(crc, zero, sizeof(zero));
+  return crc32c(crc, block + at + sizeof(zero),
+                BLOCK_SIZE - at - sizeof(zero));
+}
+
+inline off_t csum_table_offset(const ext2_super_block* super,
+                               uint32_t index) {
+  return data_block_offset(
+      super, index,
+      reserved_data_blocks(super, index) - csum_table_blocks(super));
+}
+
+/**
+ * @brief Disk offsets of the group metadata, kept as two 32-bit halves in
+ * the descriptor
+ */
+inline off_t inode_bitmap_offset(const ext2_group_desc* desc) {
+  return (off_t)desc->bg_inode_bitmap_hi << 32 | desc->bg_inode_bitmap;
+}
+
+inline off_t block_bitmap_offset(const ext2_group_desc* desc) {
+  return (off_t)desc->bg_block_bitmap_hi << 32 | desc->bg_block_bitmap;
+}
+
+inline off_t inode_table_offset(const ext2_group_desc* desc) {
+  return (off_t)desc->bg_inode_table_hi << 32 | desc->bg_inode_table;
+}
+
+class Block : public SlabObject {
  public:
-  Block() : offset_(0), data_(nullptr) {}
+  Block()
+      : offset_(0),
+        data_(nullptr),
+        capacity_(BLOCK_SIZE),
+        own_data_(true),
+        file_data_(false),
+        corrupt_(false) {}
 
-  Block(off_t offset, bool alloc = false) : offset_(offset) {
-    data_ = (uint8_t*)alloc_aligned(BLOCK_SIZE);
+  /**
+   * @param file_data the block holds data of a file, only checksummed with
+   * DATA_CSUM
+   */
+  Block(off_t offset, bool alloc = false, bool file_data = false)
+      : offset_(offset),
+        capacity_(BLOCK_SIZE),
+        own_data_(true),
+        file_data_(file_data),
+        corrupt_(false) {
+    data_ = (uint8_t*)BufferPool::block_pool()->alloc();
     if (!alloc) {
-      int ret = disk_read(offset_, BLOCK_SIZE, data_);
-      ASSERT(ret == 0);
+      read();
     } else {
       memset(data_, 0, BLOCK_SIZE);
     }
   }
 
+  /**
+   * @brief Read the block straight into memory owned by someone else (a slot
+   * of the block cache arena, see BlockCache::reserve()), which it does not
+   * free
+   */
+  Block(off_t offset, uint8_t* data, bool file_data)
+      : offset_(offset),
+        data_(data),
+        capacity_(BLOCK_SIZE),
+        own_data_(false),
+        file_data_(file_data),
+        corrupt_(false) {
+    read();
+  }
+
   ~Block() {
     // we need to flush the dirty block manually
     // flush();
-    free(data_);
+    if (own_data_) BufferPool::block_pool()->free(data_);
+  }
+
+  /**
+   * @brief Move the data of a block built in memory into memory owned by
+   * someone else (a slot of the block cache arena). The block no longer frees
+   * its data. Nothing is copied for a block read straight into it.
+   */
+  void rebind(uint8_t* data) {
+    if (data == data_) return;
+    memcpy(data, data_, BLOCK_SIZE);
+    if (own_data_) BufferPool::block_pool()->free(data_);
+    data_ = data;
+    own_data_ = false;
+  }
+
+  int flush() {
+    ChecksumTable* table = checksums();
+    if (table == nullptr || !table->covers(file_data_))
+      return disk_write(offset_, BLOCK_SIZE, data_);
+    // the checksum of a copy, metadata may change while it is written back
+    uint8_t* copy = (uint8_t*)BufferPool::block_pool()->alloc();
+    memcpy(copy, data_, BLOCK_SIZE);
+    table->update(offset_, copy);
+    int ret = disk_write(offset_, BLOCK_SIZE, copy);
+    BufferPool::block_pool()->free(copy);
+    return ret;
   }
 
-  int flush() { return disk_write(offset_, BLOCK_SIZE, data_); }
+  /**
+   * @brief Whether the data read from disk does not match its checksum
+   */
+  bool corrupt() { return corrupt_; }
 
   off_t offset() { return offset_; }
 
+  bool file_data() { return file_data_; }
+
   uint8_t* get() { return data_; }
 
+  size_t capacity() { return capacity_; }
+
  protected:
   // index in the block group
   off_t offset_;
   // block data read from disk
   uint8_t* data_;
+  // number of usable bytes in data_
+  size_t capacity_;
+  // whether data_ comes from the block buffer pool
+  bool own_data_;
+  bool file_data_;
+  bool corrupt_;
+
+ private:
+  void read() {
+    int ret = disk_read(offset_, BLOCK_SIZE, data_);
+    ASSERT(ret == 0);
+    ChecksumTable* table = checksums();
+    if (table != nullptr && table->covers(file_data_))
+      corrupt_ = !table->verify(offset_, data_);
+  }
+};
+
+/**
+ * @brief View of the data stored inline in i_block of an inode. It does not
+ * own the memory, so it is neither cached nor flushed.
+ */
+class InlineBlock : public Block {
+ public:
+  InlineBlock(ext2_inode* inode) : Block() {
+    data_ = (uint8_t*)inode->i_block;
+    capacity_ = INLINE_DATA_SIZE;
+    own_data_ = false;
+  }
 };
 
 class SuperBlock : public Block {
  public:
-  SuperBlock() : Block(0), super_((ext2_super_block*)data_) {
+  SuperBlock()
+      : Block(0),
+        super_((ext2_super_block*)data_),
+        n_descs_(0),
+        formatted_(false),
+        error_(0),
+        checksums_(nullptr) {
     init_super_block();
   }
 
+  ~SuperBlock() {
+    for (auto block : meta_blocks_) delete block;
+    if (checksums_ != nullptr) {
+      set_checksums(nullptr);
+      delete checksums_;
+    }
+  }
+
   void init_super_block();
 
+  /**
+   * @brief Whether init_super_block() formatted the device, the first group
+   * is then new
+   */
+  inline bool formatted() { return formatted_; }
+
+  /**
+   * @brief Negative errno when the group descriptors could not be read, the
+   * file system must not be mounted then
+   */
+  inline int error() { return error_; }
+
+  /**
+   * @brief Write the super block and the descriptor blocks of meta groups
+   */
+  int flush();
+
+  /**
+   * @brief Append block 0, its checksum brought up to date, and the loaded
+   * descriptor blocks of meta groups, which flush() writes
+   */
+  void get_metadata(std::vector<Block*>* blocks);
+
+  /**
+   * @brief Write back the checksum table, once the blocks it covers are
+   */
+  int flush_checksums() {
+    return checksums_ != nullptr ? checksums_->flush() : 0;
+  }
+
   inline ext2_super_block* get_super() { return super_; }
 
-  inline ext2_group_desc* get_group_desc(int index) {
-    if ((size_t)index >= desc_table_.size()) return nullptr;
+  inline ext2_group_desc* get_group_desc(uint32_t index) {
+    if (index >= n_descs_.load(std::memory_order_acquire)) return nullptr;
     return desc_table_[index];
   }
 
-  inline void put_group_desc(ext2_group_desc* desc) {
-    desc_table_.push_back(desc);
+  /**
+   * @brief Descriptor of the group following the last one, zeroed. The
+   * first group of a meta group also gets a new descriptor block.
+   */
+  ext2_group_desc* new_group_desc();
+
+  /**
+   * @brief Group index has been loaded and may change its counters, flush()
+   * writes its descriptor block from now on
+   */
+  inline void track_group_desc(uint32_t index) {
+    uint32_t first = first_meta_bg(super_);
+    if (index >= first) meta_loaded_[(index - first) / DESCS_PER_BLOCK] = true;
   }
 
   inline uint64_t block_group_size() {
@@ -84,14 +542,7 @@ class SuperBlock : public Block {
   }
 
   inline uint32_t num_block_groups() {
-    uint32_t block_n =
-        (super_->s_blocks_count + super_->s_blocks_per_group - 1) /
-        super_->s_blocks_per_group;
-    uint32_t inode_n =
-        (super_->s_inodes_count + super_->s_inodes_per_group - 1) /
-        super_->s_inodes_per_group;
-    uint32_t n = std::max(inode_n, block_n);
-    return n ? n : 1;
+    return naivefs::num_block_groups(super_);
   }
 
   inline uint32_t block_size() {
@@ -102,28 +553,11 @@ class SuperBlock : public Block {
 
   inline uint32_t inodes_per_group() { return super_->s_inodes_per_group; }
 
-  inline uint32_t inode_size() { return super_->s_inode_size; }
-
-  inline off_t block_bitmap_offset(uint32_t block_index) {
-    uint32_t n_group = block_index / blocks_per_group();
-    ASSERT(n_group < num_block_groups());
-    DEBUG("Block bitmap offset: 0x%x", desc_table_[n_group]->bg_block_bitmap);
-    return BLOCKS2BYTES(desc_table_[n_group]->bg_block_bitmap);
+  inline uint32_t data_blocks_per_group() {
+    return naivefs::data_blocks_per_group(super_);
   }
 
-  inline off_t inode_bitmap_offset(uint32_t inode_index) {
-    uint32_t n_group = inode_index / inodes_per_group();
-    ASSERT(n_group < num_block_groups());
-    DEBUG("Inode bitmap offset: 0x%x", desc_table_[n_group]->bg_inode_bitmap);
-    return BLOCKS2BYTES(desc_table_[n_group]->bg_inode_bitmap);
-  }
-
-  inline off_t inode_table_offset(uint32_t inode_index) {
-    uint32_t n_group = inode_index / inodes_per_group();
-    ASSERT(n_group < num_block_groups());
-    DEBUG("Inode table offset: 0x%x", desc_table_[n_group]->bg_inode_table);
-    return BLOCKS2BYTES(desc_table_[n_group]->bg_inode_table);
-  }
+  inline uint32_t inode_size() { return super_->s_inode_size; }
 
   inline uint32_t num_aligned_blocks(uint32_t iblocks) {
     return iblocks / (2 << super_->s_log_block_size);
@@ -131,7 +565,37 @@ class SuperBlock : public Block {
 
  private:
   ext2_super_block* super_;
+  // indexed by group, points into block 0 or into meta_blocks_. Both are
+  // sized for every addressable group at mount and never move, so that
+  // get_group_desc() needs no lock.
   std::vector<ext2_group_desc*> desc_table_;
+  // the groups of desc_table_ that are mapped
+  std::atomic<uint32_t> n_descs_;
+  bool formatted_;
+  // set by load_group_descs()
+  int error_;
+  // descriptor blocks of the meta groups, in group order, nullptr until a
+  // group they describe is mapped
+  std::vector<Block*> meta_blocks_;
+  // whether a group described by the meta block is loaded
+  std::unique_ptr<std::atomic<bool>[]> meta_loaded_;
+  // set up at mount with METADATA_CSUM
+  ChecksumTable* checksums_;
+
+  ext2_group_desc* map_group_desc(uint32_t index, bool alloc);
+
+  /**
+   * @brief Size the descriptor table for every addressable group
+   */
+  void size_group_descs();
+
+  /**
+   * @brief Map the descriptors of every group at mount
+   *
+   * @return 0, or the negative errno of a descriptor block that could not be
+   * read
+   */
+  int load_group_descs();
 };
 
 class BitmapBlock : public Block {
@@ -139,7 +603,21 @@ class BitmapBlock : public Block {
   BitmapBlock(off_t offset, bool alloc = false)
       : Block(offset, alloc), bitmap_(data_) {}
 
-  int64_t alloc_new();
+  /**
+   * @brief Set the first unset bit at or after goal, or the first one of the
+   * bitmap if there is none past goal. Held bits are skipped.
+   */
+  int64_t alloc_new(int64_t goal = 0);
+
+  /**
+   * @brief Set a run of up to count unset bits: the first run of count bits
+   * at or after goal (wrapping around), or the first run of at least min
+   * bits if there is none
+   *
+   * @param len returns the length of the run
+   * @return the first bit of the run, -1 if there is no such run
+   */
+  int64_t alloc_run(int64_t goal, uint32_t count, uint32_t min, uint32_t* len);
 
   inline void set(int i) { bitmap_.set(i); }
 
@@ -147,23 +625,40 @@ class BitmapBlock : public Block {
 
   inline void clear(int i) { bitmap_.clear(i); }
 
+  // first unset bit in [start, end), -1 if there is none
+  inline int64_t find(int end, int start) { return bitmap_.find(end, start); }
+
+  /**
+   * @brief Keep the unset bits [first, first + len) out of alloc_new() and
+   * alloc_run() without setting them, so that they are never written
+   */
+  void hold(uint32_t first, uint32_t len);
+
+  /**
+   * @brief Let the first len bits of the held run starting at first be
+   * allocated again
+   */
+  void unhold(uint32_t first, uint32_t len);
+
  private:
   Bitmap bitmap_;
+  // held runs, first bit to the bit past them
+  std::map<uint32_t, uint32_t> held_;
+
+  bool held(int64_t i);
+
+  // first unset bit in [start, end) out of the held runs, -1 if there is none
+  int64_t find_free(int end, int64_t start);
 };
 
 class InodeTableBlock : public Block {
  public:
-  InodeTableBlock(off_t offset) : Block(offset) {
-    ext2_inode* ptr = (ext2_inode*)data_;
-    for (uint32_t i = 0; i < INODES_PER_BLOCK; ++i) {
-      inodes_.push_back(ptr++);
-    }
-  }
-
-  inline ext2_inode* get(uint32_t index) { return inodes_[index]; }
+  InodeTableBlock(off_t offset) : Block(offset) {}
 
- private:
-  std::vector<ext2_inode*> inodes_;
+  inline ext2_inode* get(uint32_t index) {
+    ASSERT(index < INODES_PER_BLOCK);
+    return (ext2_inode*)data_ + index;
+  }
 };
 
 class DentryBlock {
@@ -184,7 +679,7 @@ class DentryBlock {
       }
       dentries_.push_back(dentry);
       size_ += dentry->rec_len;
-      if (size_ + sizeof(ext2_dir_entry_2) > BLOCK_SIZE) {
+      if (size_ + sizeof(ext2_dir_entry_2) > block->capacity()) {
         // Avoid pointer reaching the undefined area
         break;
       }
@@ -217,31 +712,123 @@ class DentryBlock {
 
 class BlockGroup {
  public:
-  BlockGroup(ext2_group_desc* desc, bool alloc = false);
+  /**
+   * @param alloc a new group: bitmaps start zeroed, with the reserved data
+   * blocks and the bits past the group geometry set so they are never
+   * allocated
+   */
+  BlockGroup(ext2_group_desc* desc, const ext2_super_block* super,
+             uint32_t index, bool alloc = false);
 
   ~BlockGroup();
 
   void flush();
 
+  /**
+   * @brief Append the bitmaps and the loaded inode table blocks, so that they
+   * are written back along with those of other groups
+   */
+  void get_metadata(std::vector<Block*>* blocks);
+
   ext2_group_desc* get_desc() { return desc_; }
 
+  /**
+   * @brief Copy the block bitmap into data, BLOCK_SIZE bytes, the blocks of
+   * preallocation windows free
+   */
+  void copy_block_bitmap(uint8_t* data);
+
+  /**
+   * @brief Guards the bitmaps, the loaded inode table and the descriptor
+   * counters of the group, held by the caller of the methods below
+   */
+  TimedSharedMutex& mutex() { return lock_; }
+
   bool get_inode(uint32_t index, ext2_inode** inode);
 
-  bool get_block(uint32_t index, Block** block);
+  /**
+   * @param file_data see Block::Block()
+   * @param data memory to read the block into, owned by the caller (see
+   * BlockCache::reserve()), a block pool buffer if nullptr
+   * @return false if the block is free or does not match its checksum
+   */
+  bool get_block(uint32_t index, Block** block, bool file_data = false,
+                 uint8_t* data = nullptr);
 
   bool alloc_inode(ext2_inode** inode, uint32_t* index, mode_t mode);
 
-  bool alloc_block(Block** block, uint32_t* index);
+  /**
+   * @param goal preferred data block, the next free one past it is taken
+   */
+  bool alloc_block(Block** block, uint32_t* index, uint32_t goal = 0);
+
+  /**
+   * @brief Allocate a run of min to count adjacent data blocks, see
+   * BitmapBlock::alloc_run()
+   *
+   * @param index returns the first block of the run
+   * @return the number of blocks allocated, 0 if there is no such run
+   */
+  uint32_t alloc_blocks(uint32_t goal, uint32_t count, uint32_t min,
+                        uint32_t* index);
 
   bool free_inode(uint32_t index);
 
   bool free_block(uint32_t index);
 
+  /**
+   * @brief Turn len blocks just allocated into a preallocation window: they
+   * are free again in the bitmap and the descriptor, but held out of the
+   * allocations until take_held() or drop_held()
+   */
+  void hold_blocks(uint32_t first, uint32_t len);
+
+  /**
+   * @brief Allocate the first len blocks of the window starting at first
+   */
+  void take_held(uint32_t first, uint32_t len);
+
+  /**
+   * @brief Give back the rest of a window, starting at first
+   */
+  void drop_held(uint32_t first, uint32_t len);
+
+  /**
+   * @brief Visit the runs of at least min free data blocks in [first, end)
+   *
+   * @param visitor gets the first block and the length of each run
+   */
+  void visit_free_runs(uint32_t first, uint32_t end, uint32_t min,
+                       const std::function<void(uint32_t, uint32_t)>& visitor);
+
+  /**
+   * @brief Whether the free blocks were all trimmed, in runs of min blocks or
+   * more, and none was freed since
+   */
+  bool trimmed(uint32_t min) { return trimmed_min_ != 0 && trimmed_min_ <= min; }
+
+  void set_trimmed(uint32_t min) { trimmed_min_ = min; }
+
+  /**
+   * @brief Disk offset of an inode table block of the group described by
+   * desc. It does not need the group to be loaded, so readers of frozen
+   * images share it with data_block_offset().
+   */
+  static off_t inode_block_offset(const ext2_group_desc* desc,
+                                  uint32_t inode_block_index);
+
  private:
   ext2_group_desc* desc_;
+  const ext2_super_block* super_;
+  uint32_t index_;
   BitmapBlock* block_bitmap_;
   BitmapBlock* inode_bitmap_;
   std::map<uint32_t, InodeTableBlock*> inode_table_;
+  TimedSharedMutex lock_;
+  // shortest run the last trim discarded, 0 once a block is freed
+  uint32_t trimmed_min_;
+  // a bitmap does not match its checksum
+  bool corrupt_;
 
   off_t inode_block_offset(uint32_t inode_block_index);
 
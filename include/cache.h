@@ -5,18 +5,33 @@
 #include <string.h>
 
 #include <algorithm>
+#include <functional>
 #include <unordered_map>
 #include <vector>
 
 #include "block.h"
 #include "common.h"
+#include "utils/pool.h"
+#include "utils/stats.h"
 
 namespace naivefs {
 
+// back the block cache arena with explicit huge pages (MAP_HUGETLB)
+#ifndef BLOCK_CACHE_HUGE_PAGE
+#define BLOCK_CACHE_HUGE_PAGE 1
+#endif
+
+/**
+ * @brief LRU cache of data blocks. The data of all cached blocks lives in one
+ * arena mapped at construction, the i-th node owning the i-th BLOCK_SIZE slot,
+ * so the memory footprint is fixed and the whole cache is covered by a few
+ * (huge) TLB entries. Blocks are keyed by their index, keys past 32 bits hold
+ * the decompressed blocks of compressed clusters (see cluster_key()).
+ */
 class BlockCache {
   struct Node {
     bool dirty_;
-    uint32_t index_;
+    uint64_t index_;
     Block* block_;
     Node* prev_;
     Node* next_;
@@ -31,26 +46,45 @@ class BlockCache {
 
   void flush(uint32_t inode_index);
 
-  void insert(uint32_t index, Block* block, bool dirty = false);
+  void insert(uint64_t index, Block* block, bool dirty = false);
 
-  void remove(uint32_t index);
+  /**
+   * @brief Slot of the node the next insert() of a new index takes, evicting
+   * the least recently used block if none is free. A block read from disk into
+   * it is inserted without a copy; the slot stays free if it is not inserted.
+   */
+  uint8_t* reserve();
+
+  void remove(uint64_t index);
 
-  Block* get(uint32_t index, bool dirty = false);
+  Block* get(uint64_t index, bool dirty = false);
 
-  void modify(uint32_t index);
+  void modify(uint64_t index);
+
+  /**
+   * @brief Visit the dirty blocks with their keys
+   */
+  void visit_dirty(const std::function<void(uint64_t, Block*)>& visitor);
+
+  inline bool huge_page() const { return huge_page_; }
 
  private:
+  inline uint8_t* slot(Node* node) {
+    return arena_ + (size_t)(node - entries_) * BLOCK_SIZE;
+  }
+
   inline void detach(Node* node) {
     node->prev_->next_ = node->next_;
     node->next_->prev_ = node->prev_;
   }
 
   inline void release(Node* node) {
-    INFO("block cache release %d", node->index_);
+    INFO("block cache release %lu", node->index_);
     if (node->dirty_) {
       // write back modified block
-      INFO("block cache release %d dirty", node->index_);
+      INFO("block cache release %lu dirty", node->index_);
       node->block_->flush();
+      stat_add(STAT_CACHE_WRITEBACK);
       // release the memory
       delete node->block_;
     } else delete node->block_;
@@ -58,6 +92,19 @@ class BlockCache {
     free_entries_.push_back(node);
   }
 
+  /**
+   * @brief Evict the least recently used block if no node is free
+   */
+  inline void make_room() {
+    if (!free_entries_.empty()) return;
+    Node* node = tail_->prev_;
+    ASSERT(node != nullptr);
+    detach(node);
+    release(node);
+    stat_add(STAT_CACHE_EVICT);
+    map_.erase(node->index_);
+  }
+
   inline void attach(Node* node) {
     node->prev_ = head_;
     node->next_ = head_->next_;
@@ -66,13 +113,27 @@ class BlockCache {
   }
 
  private:
-  std::unordered_map<uint32_t, Node*> map_;
+  std::unordered_map<uint64_t, Node*, std::hash<uint64_t>,
+                     std::equal_to<uint64_t>,
+                     SlabAllocator<std::pair<const uint64_t, Node*>>>
+      map_;
   std::vector<Node*> free_entries_;
   Node* entries_;
   Node *head_, *tail_;
   size_t size_;
+  uint8_t* arena_;
+  size_t arena_size_;
+  bool huge_page_;
 };
 
+/**
+ * @brief Key of the decompressed block k of the compressed cluster stored
+ * from data block head on
+ */
+inline uint64_t cluster_key(uint32_t head, uint32_t k) {
+  return (uint64_t)(k + 1) << 32 | head;
+}
+
 class DentryCache {
  public:
   struct Node {
@@ -114,6 +175,13 @@ class DentryCache {
 
   void release_node(Node* parent);
 
+  inline bool full() const { return size_ >= max_size_; }
+
+  /**
+   * @brief Drop every entry except the root
+   */
+  void clear();
+
   void alloc_new_node(Node** node, const char* name, size_t name_len);
 
  private:
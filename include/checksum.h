@@ -0,0 +1,141 @@
+#ifndef NAIVEFS_INCLUDE_CHECKSUM_H_
+#define NAIVEFS_INCLUDE_CHECKSUM_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct ext2_super_block;
+
+namespace naivefs {
+
+/**
+ * @brief CRC32C of the blocks of a file system with METADATA_CSUM, kept in
+ * the checksum table of each group (see csum_slot()). Blocks verify their
+ * data against it when read from disk and record their checksum when written
+ * back: the group metadata, directory, indirect and symlink blocks, and the
+ * data blocks of files with DATA_CSUM. The tables of the groups are loaded on
+ * first use, written back by flush() after the blocks they cover, and the
+ * least recently used clean ones dropped past CSUM_TABLE_CACHE. Until then, a
+ * table block whose disk copy could name an old checksum of a block being
+ * rewritten is first zeroed on disk, so a crash leaves its slots unknown
+ * instead of stale: by prepare() for a whole writeback, or by update() for a
+ * block written on its own.
+ */
+class ChecksumTable {
+ public:
+  explicit ChecksumTable(const ext2_super_block* super);
+
+  ~ChecksumTable();
+
+  /**
+   * @brief Whether blocks of the kind are checksummed, file data only with
+   * DATA_CSUM
+   */
+  inline bool covers(bool file_data) const { return !file_data || data_; }
+
+  /**
+   * @brief Check the block read at offset, a mismatch is logged and counted
+   * (csum_errors in the statistics)
+   *
+   * @return false on a mismatch, true if the block matches or has no checksum
+   */
+  bool verify(off_t offset, const uint8_t* data);
+
+  /**
+   * @brief Record the checksum of the block about to be written at offset
+   */
+  void update(off_t offset, const uint8_t* data);
+
+  /**
+   * @brief Zero on disk, in runs, the table blocks which could name an old
+   * checksum of one of the blocks at offsets, about to be written back, so
+   * that update() does not have to zero them one at a time
+   */
+  void prepare(const std::vector<off_t>& offsets);
+
+  /**
+   * @brief Forget the checksum of a freed block
+   */
+  void clear(off_t offset);
+
+  /**
+   * @brief Start the table of a newly formatted group empty, instead of
+   * reading what was on the disk
+   */
+  void init_group(uint32_t index);
+
+  /**
+   * @brief Write back the table blocks that changed
+   */
+  int flush();
+
+ private:
+  struct Table {
+    uint32_t* slots_;
+    // by table block
+    std::vector<bool> dirty_;
+    // by table block, the disk copy is zero until the next flush
+    std::vector<bool> zeroed_;
+    // by table block, being zeroed on disk
+    std::vector<bool> zeroing_;
+    // tick of the last use, to drop the least recently used
+    uint64_t used_;
+  };
+
+  /**
+   * @brief Slot of the block at offset, loading the table of its group,
+   * nullptr for block 0 and blocks of groups that do not exist. The caller
+   * holds mutex_.
+   */
+  uint32_t* slot(off_t offset, uint32_t* group, uint32_t* index);
+
+  Table* table(uint32_t group, bool load);
+
+  /**
+   * @brief Drop the least recently used clean table, if any
+   */
+  void evict();
+
+  /**
+   * @brief Whether a table block has to be zeroed on disk before the block of
+   * a slot holding crc is written, marking it to be zeroed if so
+   */
+  bool stale(Table* table, uint32_t block, uint32_t crc);
+
+  /**
+   * @brief Zero the marked (group, table block)s on disk, with mutex_
+   * released, held by lck
+   */
+  void zero(std::unique_lock<std::mutex>& lck,
+            std::vector<std::pair<uint32_t, uint32_t>>* blocks);
+
+  const ext2_super_block* super_;
+  // file data is checksummed too
+  bool data_;
+  // blocks of the table of a group
+  uint32_t table_blocks_;
+  // a zero table, to write over the disk copy of stale blocks
+  uint8_t* zero_;
+  std::unordered_map<uint32_t, Table> tables_;
+  uint64_t tick_;
+  // table blocks being zeroed, flush() waits for them
+  uint32_t zeroing_;
+  std::condition_variable zeroed_;
+  std::mutex mutex_;
+};
+
+/**
+ * @brief Checksums of the mounted file system, nullptr without METADATA_CSUM
+ */
+ChecksumTable* checksums();
+
+void set_checksums(ChecksumTable* table);
+
+}  // namespace naivefs
+#endif
@@ -34,6 +34,10 @@ namespace naivefs {
 #define NUM_INODE_TABLE_BLOCKS (INODES_PER_GROUP / INODES_PER_BLOCK)
 #define TOTAL_BLOCKS_PER_GROUP (BLOCKS_PER_GROUP + NUM_INODE_TABLE_BLOCKS + 2)
 #define MAX_BLOCK_GROUP_SIZE (TOTAL_BLOCKS_PER_GROUP * BLOCK_SIZE)
+// 2^4 block groups share a flex group, which packs their metadata together
+#define LOG_GROUPS_PER_FLEX 4
+// threads reading the descriptor blocks of meta groups at mount
+#define MOUNT_READ_THREADS 8
 
 #define ROOT_INODE 0
 
@@ -50,7 +54,41 @@ enum FSState { UNINIT = 0x0, NORMAL = 0x1 };
 #define ACCESS_INODE(__i) UPDATE_TIME(__i->i_atime)
 #define MODIFY_INODE(__i) UPDATE_TIME(__i->i_mtime)
 
+// defaults of the cache_blocks and dentry_cache mount options
 #define BLOCK_CACHE_SIZE 1024  // TODO: maybe larger ?
+#define DENTRY_CACHE_SIZE 65536
+
+// first preallocation window of files and directories (s_prealloc_blocks and
+// s_prealloc_dir_blocks), windows double up to PREALLOC_MAX_BLOCKS
+#define PREALLOC_BLOCKS 8
+#define PREALLOC_DIR_BLOCKS 0
+#define PREALLOC_MAX_BLOCKS 1024
+
+// blocks an open file buffers before delayed allocation writes them back
+#define DELALLOC_MAX_BLOCKS 1024
+// blocks of closed files kept buffered, past it they are written at release
+#define DELALLOC_PARKED_BLOCKS 16384
+
+// file blocks compressed together in files with EXT2_COMPR_FL (64 KiB), a
+// divisor of DELALLOC_MAX_BLOCKS
+#define COMPRESS_CLUSTER_BLOCKS 16
+
+// data blocks per entry of the dedup index, and entries of a set of it, which
+// a hash may take any of
+#define DEDUP_BLOCKS_PER_ENTRY 4
+#define DEDUP_WAYS 8
+
+// copies of a file a defragmentation makes while writes race with it
+#define DEFRAG_RETRIES 4
+
+// freed blocks the discard thread coalesces before releasing them on the
+// device, or the delay after the first of them, whichever comes first
+#define DISCARD_BATCH_BLOCKS 4096
+#define DISCARD_INTERVAL_MS 1000
+
+// checksum tables of groups kept loaded, the least recently used clean ones
+// are dropped past it
+#define CSUM_TABLE_CACHE 64
 
 // dentry types
 
@@ -0,0 +1,44 @@
+#ifndef NAIVEFS_INCLUDE_COMPRESS_H_
+#define NAIVEFS_INCLUDE_COMPRESS_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+namespace naivefs {
+
+/**
+ * Files with EXT2_COMPR_FL are stored by clusters of COMPRESS_CLUSTER_BLOCKS
+ * file blocks. A cluster that compresses into fewer data blocks is stored in
+ * the first entries of its block map, the rest of them being
+ * EXT2_COMPRESSED_BLKADDR, so a cluster is compressed iff its last entry is.
+ * Its first data block starts with a cluster_header.
+ */
+#define CLUSTER_MAGIC 0x315a4c4e  // "NLZ1"
+#define CLUSTER_BYTES (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE)
+
+struct cluster_header {
+  uint32_t ch_magic;
+  uint32_t ch_size;      // bytes of compressed data after the header
+  uint32_t ch_checksum;  // CRC32C of them
+  uint32_t ch_reserved;
+};
+
+/**
+ * @brief Compress the CLUSTER_BYTES of data into packed, header included
+ *
+ * @param packed room for CLUSTER_BYTES
+ * @return the number of blocks of packed, 0 if it saves no block
+ */
+uint32_t compress_cluster(const uint8_t* data, uint8_t* packed);
+
+/**
+ * @brief Decompress the blocks of packed into the CLUSTER_BYTES of data
+ *
+ * @return false if packed is not a well-formed compressed cluster
+ */
+bool decompress_cluster(const uint8_t* packed, uint32_t blocks, uint8_t* data);
+
+}  // namespace naivefs
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef NAIVEFS_INCLUDE_DEDUP_H_
+#define NAIVEFS_INCLUDE_DEDUP_H_
+
+#include <stdint.h>
+
+#include <mutex>
+
+#include "block.h"
+
+namespace naivefs {
+
+class FileSystem;
+
+/**
+ * @brief Data blocks shared by files of identical content (the dedup tables
+ * of the groups, see has_dedup()). Full blocks written back to files with
+ * EXT2_DEDUP_FL are hashed: the index maps a hash to a block that held such
+ * data when it was written, which is compared before it gets one more
+ * reference. Blocks of 0 references in their table are never shared, so the
+ * entries of freed blocks are just left behind. The tables are read and
+ * written through the block cache, which bounds the memory they take.
+ *
+ * Every method expects the caller to hold mutex(), which also keeps a block
+ * from being freed or written in place while it is shared.
+ */
+class DedupIndex {
+ public:
+  DedupIndex(FileSystem* fs, const ext2_super_block* super);
+
+  ~DedupIndex();
+
+  inline std::mutex& mutex() { return mutex_; }
+
+  /**
+   * @brief Find a block holding data under its hash and take a reference to
+   * it
+   *
+   * @return false if no shareable block holds the same data
+   */
+  bool share(uint64_t hash, const uint8_t* data, uint32_t* index);
+
+  /**
+   * @brief Make block index, just written, shareable under the hash of its
+   * data
+   */
+  void insert(uint64_t hash, uint32_t index);
+
+  /**
+   * @brief Drop a reference to block index, about to be freed
+   *
+   * @return true if other references are left: the block stays allocated
+   */
+  bool release(uint32_t index);
+
+  /**
+   * @brief Whether block index may be written in place, as it is not shared.
+   * It is not shareable anymore then.
+   */
+  bool exclusive(uint32_t index);
+
+ private:
+  /**
+   * @brief Block and offset in it of the set of the index a hash belongs to
+   */
+  bool locate(uint64_t hash, uint32_t* block, uint32_t* offset);
+
+  /**
+   * @brief Block and offset in it of the reference count of block index
+   */
+  bool locate_refs(uint32_t index, uint32_t* block, uint32_t* offset);
+
+  bool get_refs(uint32_t index, uint16_t* refs);
+
+  bool set_refs(uint32_t index, uint16_t refs);
+
+  FileSystem* fs_;
+  const ext2_super_block* super_;
+  uint32_t sets_per_block_;
+  uint64_t sets_;
+  // way of a full set replaced next
+  uint32_t victim_;
+  // a candidate block, compared with the data to share
+  uint8_t* buf_;
+  std::mutex mutex_;
+};
+
+}  // namespace naivefs
+#endif
@@ -0,0 +1,52 @@
+#ifndef NAIVEFS_INCLUDE_DISCARD_H_
+#define NAIVEFS_INCLUDE_DISCARD_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace naivefs {
+
+/**
+ * Releases a run of count blocks from first on, called on the thread of the
+ * queue.
+ */
+typedef std::function<void(uint32_t, uint32_t)> Discarder;
+
+/**
+ * @brief Freed blocks waiting to be discarded on the device (online discard).
+ * Adjacent blocks are merged into runs, and a thread hands the runs over once
+ * DISCARD_BATCH_BLOCKS are pending or DISCARD_INTERVAL_MS after the first
+ * one, so that deletes do not wait for the device and it gets few large
+ * requests instead of one per block.
+ */
+class DiscardQueue {
+ public:
+  explicit DiscardQueue(const Discarder& discarder);
+
+  /**
+   * @brief Release what is pending and stop the thread
+   */
+  ~DiscardQueue();
+
+  void add(uint32_t index);
+
+ private:
+  void run();
+
+  Discarder discarder_;
+  // first block mapped to the length of the run
+  std::map<uint32_t, uint32_t> runs_;
+  uint64_t pending_;
+  bool stop_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::thread thread_;
+};
+
+}  // namespace naivefs
+#endif
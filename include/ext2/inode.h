@@ -12,6 +12,12 @@
 #define EXT2_TIND_BLOCK (EXT2_DIND_BLOCK + 1)
 #define EXT2_N_BLOCKS (EXT2_TIND_BLOCK + 1)
 
+/*
+ * Entry of the block map for the file blocks of a compressed cluster past
+ * the data blocks it is stored in (e2compr value)
+ */
+#define EXT2_COMPRESSED_BLKADDR 0xffffffff
+
 /*
  *  Defined i_mode values
  */
@@ -35,6 +41,16 @@
 #define EXT2_S_IWOTH 0x0002  /* others write */
 #define EXT2_S_IXOTH 0x0001  /* others execute */
 
+/*
+ * Inode flags (i_flags)
+ */
+#define EXT2_COMPR_FL 0x00000004       /* Compress file */
+#define EXT2_COMPRBLK_FL 0x00000200    /* One or more compressed clusters */
+#define EXT2_INLINE_DATA_FL 0x10000000 /* Data stored in i_block (ext4 value) */
+/* NaiveFS, bits unused by ext2 */
+#define EXT2_DEDUP_FL 0x01000000    /* Share the blocks of identical data */
+#define EXT2_DEDUPBLK_FL 0x04000000 /* One or more shareable blocks */
+
 /*
  * Structure of an inode on the disk
  */
@@ -92,4 +108,11 @@ struct ext2_inode {
   } osd2; /* OS dependent 2 */
 };
 
+/*
+ * File blocks of the compressed clusters of an inode stored without a data
+ * block of their own (EXT2_COMPRESSED_BLKADDR entries). i_blocks counts the
+ * entries of the block map, the space used is the difference.
+ */
+#define i_compr_saved osd1.linux1.l_i_reserved1
+
 #endif
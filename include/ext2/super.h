@@ -14,9 +14,27 @@ struct ext2_group_desc {
   __le16 bg_free_inodes_count; /* Free inodes count */
   __le16 bg_used_dirs_count;   /* Directories count */
   __le16 bg_pad;
-  __le32 bg_reserved[3];
+  __le32 bg_block_bitmap_hi; /* Blocks bitmap block MSB */
+  __le32 bg_inode_bitmap_hi; /* Inodes bitmap block MSB */
+  __le32 bg_inode_table_hi;  /* Inodes table block MSB */
 };
 
+/*
+ * Incompatible features (ext4 values)
+ */
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010 /* Descriptors in meta groups */
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080   /* Group offsets past 4 GiB */
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200 /* Metadata packed by flex group */
+
+/*
+ * Read-only compatible features
+ */
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400 /* Metadata checksums */
+/* NaiveFS: the data blocks of files are checksummed too */
+#define NAIVEFS_FEATURE_RO_COMPAT_DATA_CSUM 0x80000000
+/* NaiveFS: data blocks are shared by files through reference counts */
+#define NAIVEFS_FEATURE_RO_COMPAT_DEDUP 0x40000000
+
 /*
  * Structure of the super block
  */
@@ -89,7 +107,11 @@ struct ext2_super_block {
   __u16 s_reserved_word_pad;
   __le32 s_default_mount_opts;
   __le32 s_first_meta_bg; /* First metablock block group */
-  __u32 s_reserved[190];  /* Padding to the end of the block */
+  __le32 s_groups_count;  /* NaiveFS: initialized block groups, 0 if unknown */
+  __le32 s_log_groups_per_flex; /* FLEX_BG group size */
+  __le32 s_dedup_groups;        /* NaiveFS: groups holding the dedup index */
+  __u32 s_reserved[186];        /* Padding to the end of the block */
+  __le32 s_checksum; /* crc32c of block 0, 0 in the field itself */
 };
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <sys/time.h>
 
+#include <atomic>
 #include <functional>
 #include <string>
 #include <unordered_map>
@@ -12,16 +13,72 @@
 
 #include "block.h"
 #include "cache.h"
+#include "dedup.h"
+#include "discard.h"
+#include "freespace.h"
+#include "snapshot.h"
+#include "utils/option.h"
 #include "utils/path.h"
+#include "utils/stats.h"
 
 namespace naivefs {
 
+/**
+ * Hook invoked with the index of every inode deleted, so that state kept
+ * about it outside of the file system can be dropped.
+ */
+typedef std::function<void(uint32_t)> InodeHook;
+
+/**
+ * Visitor of the block map of an inode, called with a block index and its
+ * level in the tree (0 for data blocks). Returning true stops the walk.
+ */
+typedef std::function<bool(uint32_t, int)> MapVisitor;
+
+/**
+ * @brief Allocation state of a CPU. Allocations whose goal group is busy fall
+ * back to the group the CPU has reserved, and the blocks and inodes taken are
+ * counted here until they are folded into the super block.
+ */
+struct alignas(64) AllocContext {
+  // group reserved by the CPU, -1 before its first fallback
+  std::atomic<int64_t> group_{-1};
+  // blocks and inodes allocated minus freed since the last fold
+  std::atomic<int64_t> blocks_{0};
+  std::atomic<int64_t> inodes_{0};
+};
+
+/**
+ * @brief Blocks set aside ahead of a growing inode (ext2's reservation
+ * window). Its next blocks come from there, so that files growing side by
+ * side do not interleave. The window doubles each time the inode uses it up.
+ * Its blocks stay free in the bitmap on disk and in the counters, only the
+ * searches of the loaded bitmap skip them, so a crash leaks none.
+ */
+struct PreallocWindow {
+  // first block left, the block after the window once it is used up
+  uint32_t start_;
+  uint32_t len_;
+  // blocks of the next window
+  uint32_t size_;
+};
+
 class FileSystem {
  public:
-  FileSystem();
+  /**
+   * @brief Mount the file system on the opened disk, sizing the caches from
+   * the mount options. See error() for whether the mount succeeded.
+   */
+  FileSystem(const options& opts);
 
   ~FileSystem();
 
+  /**
+   * @brief Negative errno when the file system could not be mounted, it is
+   * then only fit to be deleted
+   */
+  inline int error() { return super_block_->error(); }
+
   inline ext2_super_block* super() { return super_block_->get_super(); }
 
   void flush();
@@ -45,7 +102,8 @@ class FileSystem {
    * the parent.
    */
   RetCode dentry_create(Block* last_block, uint32_t last_block_index,
-                        ext2_inode* parent, const char* name, size_t name_len,
+                        ext2_inode* parent, uint32_t parent_index,
+                        const char* name, size_t name_len,
                         uint32_t inode_index, mode_t mode);
 
   /**
@@ -101,6 +159,116 @@ class FileSystem {
   bool visit_indirect_blocks(Block* block, uint32_t num,
                              const BlockVisitor& visitor);
 
+  /**
+   * @brief Visit the block map of an inode without reading its data blocks:
+   * the data blocks in file order, each indirect block after the blocks it
+   * maps. EXT2_COMPRESSED_BLKADDR entries are skipped.
+   *
+   * @return false if the walk was stopped or an indirect block is missing
+   */
+  bool visit_block_map(ext2_inode* inode, const MapVisitor& visitor);
+
+  /**
+   * @brief Number of runs of adjacent data blocks mapped by the inode, 1 for
+   * a file laid out contiguously
+   */
+  uint32_t count_extents(ext2_inode* inode);
+
+  /**
+   * @brief Copy the data blocks of the inode through the block cache into one
+   * run of adjacent blocks, mapped by a new block tree in donor, a copy of
+   * the inode (online defragmentation). The inode itself is left unchanged,
+   * swapping its i_block for the one of donor is up to the caller.
+   *
+   * @return FS_ALLOC_ERR if there is no free run as long as the file
+   */
+  RetCode defrag_copy(ext2_inode* inode, uint32_t inode_index,
+                      ext2_inode* donor);
+
+  /**
+   * @brief Free the data and indirect blocks mapped by the inode, e.g. the
+   * block tree replaced by defrag_copy()
+   */
+  void free_block_map(ext2_inode* inode);
+
+  /**
+   * @brief Data block mapped to file block of the inode, or
+   * EXT2_COMPRESSED_BLKADDR
+   */
+  bool lookup_block(ext2_inode* inode, uint32_t file_block, uint32_t* index);
+
+  /**
+   * @brief Map file block of the inode to another data block
+   */
+  bool remap_block(ext2_inode* inode, uint32_t file_block, uint32_t index);
+
+  /**
+   * @brief Whether cluster of the inode is stored compressed (see
+   * store_cluster())
+   *
+   * @param head returns the data block the cluster starts in
+   */
+  bool compressed_cluster(ext2_inode* inode, uint32_t cluster,
+                          uint32_t* head);
+
+  /**
+   * @brief Store the COMPRESS_CLUSTER_BLOCKS file blocks of cluster of the
+   * inode (EXT2_COMPR_FL) in new data blocks: compressed if it saves at least
+   * one block, the entries left in the block map set to
+   * EXT2_COMPRESSED_BLKADDR, else as they are. The blocks the cluster had are
+   * freed, and its entries past the end of the map appended. The caller holds
+   * the inode exclusively.
+   *
+   * @param data the CLUSTER_BYTES of the cluster
+   * @return false if the disk is full or the map cannot be read
+   */
+  bool store_cluster(ext2_inode* inode, uint32_t inode_index,
+                     uint32_t cluster, const uint8_t* data);
+
+  /**
+   * @brief Copy between buf and the compressed cluster starting in data block
+   * head: into it if dirty, storing it again, else out of it. The clusters
+   * read are decompressed into the block cache.
+   *
+   * @param offset in the cluster
+   * @return false if the cluster cannot be read or stored
+   */
+  bool copy_cluster(ext2_inode* inode, uint32_t inode_index, uint32_t cluster,
+                    uint32_t head, off_t offset, char* buf, size_t size,
+                    bool dirty);
+
+  /**
+   * @brief Whether data blocks are shared by files of identical content
+   * (mkfs -d)
+   */
+  inline bool dedup() const { return dedup_ != nullptr; }
+
+  /**
+   * @brief Take a reference to a data block holding the same data as the
+   * full block data, of the hash block_hash() gave
+   *
+   * @return false if there is none
+   */
+  bool dedup_share(uint64_t hash, const uint8_t* data, uint32_t* index);
+
+  /**
+   * @brief Make the data block index, just written with data of the hash,
+   * shareable
+   */
+  void dedup_insert(uint64_t hash, uint32_t index);
+
+  /**
+   * @brief Copy size bytes of buf into file block of the inode
+   * (EXT2_DEDUPBLK_FL), data block index: in place unless the block is
+   * shared, else into a copy of it mapped instead (copy-on-write). The
+   * caller holds the inode exclusively.
+   *
+   * @param moved set if the file block is mapped to a new data block
+   */
+  bool write_data_block(ext2_inode* inode, uint32_t file_block, uint32_t index,
+                        off_t offset, const char* buf, size_t size,
+                        bool* moved);
+
   /**
    * @brief Get the inode from target block group
    *
@@ -117,10 +285,11 @@ class FileSystem {
    * @param offset src is blk->get() + offset
    * @param buf dst
    * @param copy_size  
+   * @param file_data the block holds data of a regular file, see Block::Block()
    * @return true 
-   * @return false 
+   * @return false if the block is free or does not match its checksum
    */
-  bool get_block(uint32_t index, Block** block, bool dirty = false, off_t offset = 0, const char* buf = nullptr, size_t copy_size = 0);
+  bool get_block(uint32_t index, Block** block, bool dirty = false, off_t offset = 0, const char* buf = nullptr, size_t copy_size = 0, bool file_data = false);
 
 
   /**
@@ -130,34 +299,175 @@ class FileSystem {
    *
    * @param inode new inode allocated
    * @param index returns inode index
+   * @param parent directory the inode is created in, files go to its group
+   * and directories are spread over the groups (Orlov)
    * @return @return true always true (we assume disk space will not ne used up)
    */
-  bool alloc_inode(ext2_inode** inode, uint32_t* index, mode_t mode);
+  bool alloc_inode(ext2_inode** inode, uint32_t* index, mode_t mode,
+                   uint32_t parent);
 
   /**
    * @brief Allocate a new block in the file system. This operation changes: 1.
    * super block; 2. group descriptors (maybe a new block group); 3. block
    * bitmap
    *
+   * @param goal preferred block, the first free one from there is taken
    * @return always true (we assume disk space will not be used up)
    */
-  bool alloc_block(Block** block, uint32_t* index);
+  bool alloc_block(Block** block, uint32_t* index, uint32_t goal = 0);
 
   /**
-   * @brief Allocate a new block for the inode
+   * @brief Allocate a new block for the inode, from its preallocation window,
+   * after its last block or in its group for the first one. The caller holds
+   * the inode exclusively.
    *
    * @return always true (we assume disk space will not be used up)
    */
-  bool alloc_block(Block** block, uint32_t* index, ext2_inode* inode);
+  bool alloc_block(Block** block, uint32_t* index, ext2_inode* inode,
+                   uint32_t inode_index);
+
+  /**
+   * @brief Append count data blocks to the inode at once (delayed
+   * allocation): from its preallocation window, then as one run of adjacent
+   * blocks after its last block when the group has one, together with the
+   * next window. The new blocks are in the block cache. The caller holds the
+   * inode exclusively.
+   *
+   * @param indexes returns the indexes of the blocks
+   * @return the number of blocks appended, short if the disk is full
+   */
+  uint32_t alloc_blocks(ext2_inode* inode, uint32_t inode_index,
+                        uint32_t count, uint32_t* indexes);
+
+  /**
+   * @brief Map the allocated block index after the last block of the inode,
+   * allocating the indirect blocks on the way
+   */
+  bool append_block(ext2_inode* inode, uint32_t block_index);
+
+  /**
+   * @brief Set aside n data blocks for writes that get their blocks later
+   * from alloc_blocks()
+   *
+   * @return false if the free blocks left do not cover them
+   */
+  bool reserve_blocks(uint32_t n);
+
+  /**
+   * @brief Give back n reserved blocks, once allocated or dropped
+   */
+  void release_blocks(uint32_t n);
+
+  /**
+   * @brief Number of data blocks mapped by the inode
+   */
+  inline uint32_t num_blocks(const ext2_inode* inode) {
+    return super_block_->num_aligned_blocks(inode->i_blocks);
+  }
+
+  /**
+   * @brief Free the blocks left in the preallocation window of the inode,
+   * once it is closed or deleted
+   */
+  void discard_window(uint32_t inode_index);
+
+  void set_delete_hook(const InodeHook& hook) { delete_hook_ = hook; }
+
+  /**
+   * @brief Move the inline data of the inode into a newly allocated data block
+   * and clear EXT2_INLINE_DATA_FL. An empty regular file gets no block.
+   *
+   * @param block the new block, nullptr if nothing has been allocated
+   */
+  bool inline_to_block(ext2_inode* inode, uint32_t inode_index, Block** block,
+                       uint32_t* index);
+
+  /**
+   * @brief The block group with the index, its bitmaps are read on first use
+   *
+   * @return nullptr if the group does not exist
+   */
+  BlockGroup* block_group(uint32_t index);
 
   /**
    * @brief Allocatea a new block group
    *
    * @param index newly allocated index
-   * @return always true (we assume disk space will not be used up)
+   * @return false if its blocks or inodes could not be addressed
    */
   bool alloc_block_group(uint32_t* index);
 
+  /**
+   * @brief Group for a new directory under parent, Orlov style: top level
+   * directories go to the group with the fewest directories among those with
+   * above average free inodes and blocks, others stay near their parent
+   * unless its groups are crowded
+   *
+   * @return -1 if no group has a free inode
+   */
+  int64_t find_dir_group(uint32_t parent);
+
+  /**
+   * @brief Refresh the free space summary from the descriptor of group index
+   */
+  void update_free_space(uint32_t index);
+
+  /**
+   * @brief Allocate an inode in group, waiting for its lock
+   *
+   * @param index returns the inode index in the whole file system
+   */
+  bool group_alloc_inode(uint32_t group, ext2_inode** inode, uint32_t* index,
+                         mode_t mode);
+
+  /**
+   * @brief Allocate a block in group from the data block goal on
+   *
+   * @param wait whether to wait for the group lock, or to give up if
+   * another allocation holds it
+   * @param index returns the block index in the whole file system
+   */
+  bool group_alloc_block(uint32_t group, uint32_t goal, bool wait,
+                         Block** block, uint32_t* index);
+
+  /**
+   * @brief Allocate a run of min to count blocks in group from the data block
+   * goal on, waiting for its lock
+   *
+   * @param index returns the first block index in the whole file system
+   * @return the number of blocks allocated, 0 if there is no such run
+   */
+  uint32_t group_alloc_blocks(uint32_t group, uint32_t goal, uint32_t count,
+                              uint32_t min, uint32_t* index);
+
+  /**
+   * @brief Context of the CPU the caller runs on
+   */
+  AllocContext* alloc_context();
+
+  /**
+   * @brief Add the counts of the allocation contexts to the super block and
+   * bring the free space summary of the loaded groups up to date
+   */
+  void fold_alloc_contexts();
+
+  /**
+   * @brief Have the checksum table zero the stale table blocks of the loaded
+   * metadata and the dirty cached blocks at once, ahead of writing them back
+   */
+  void prepare_checksums();
+
+  /**
+   * @brief Fold the allocation contexts and write the super block
+   */
+  void flush_super_block();
+
+  /**
+   * @brief Write back the bitmaps and inode tables of the loaded groups in
+   * disk order, each run of adjacent blocks at once
+   */
+  void flush_block_groups();
+
   /**
    * @brief Free inode with inode index
    *
@@ -169,6 +479,45 @@ class FileSystem {
    */
   bool free_block(uint32_t index);
 
+  /**
+   * @brief Discard the blocks first...first + count - 1 on the device, those
+   * of them still free (online discard and trim)
+   *
+   * @return the number of blocks discarded
+   */
+  uint64_t discard_blocks(uint32_t first, uint32_t count);
+
+  /**
+   * @brief Discard the runs of at least min free blocks between the blocks
+   * first and end (FITRIM). Groups trimmed since their last free are skipped.
+   *
+   * @return the number of blocks discarded
+   */
+  uint64_t trim(uint64_t first, uint64_t end, uint32_t min);
+
+  /**
+   * @brief First step of taking a read-only snapshot of the whole file
+   * system, while it is in use: write the dirty blocks back, so that few are
+   * left to freeze, create the store and read the block bitmaps of the groups
+   * not loaded. The caller holds SnapshotManager::changes().
+   *
+   * @param bitmaps passed on to snapshot_freeze()
+   */
+  RetCode snapshot_prepare(const char* name, size_t name_len,
+                           Snapshot** snapshot, std::vector<uint8_t>* bitmaps);
+
+  /**
+   * @brief Freeze the file system image in the snapshot, with the metadata
+   * and the dirty blocks in memory instead of writing them back. The caller
+   * keeps the file system from changing, for as short as this takes; the
+   * snapshot is settled afterwards (SnapshotManager::settle()).
+   */
+  void snapshot_freeze(Snapshot* snapshot, std::vector<uint8_t>* bitmaps);
+
+  RetCode snapshot_delete(const char* name, size_t name_len);
+
+  inline SnapshotManager* snapshots() { return snapshots_; }
+
   /**
    * @brief Write data to block
    */
@@ -179,16 +528,144 @@ class FileSystem {
   }
 
  private:
+  /**
+   * @brief Block to allocate the next block of the inode from: after the
+   * block last added to i_block, or the start of the group of the inode
+   */
+  uint32_t block_goal(ext2_inode* inode, uint32_t inode_index);
+
+  /**
+   * @brief Allocate a block after the last block of the inode, without
+   * preallocation
+   */
+  bool alloc_next_block(Block** block, uint32_t* index, ext2_inode* inode,
+                        uint32_t inode_index);
+
+  /**
+   * @brief Allocate a run of count blocks from goal on, else in one of the
+   * next groups, else as many as there are from goal on
+   *
+   * @param index returns the first block
+   * @return the number of blocks allocated, 0 if the goal group is full
+   */
+  uint32_t alloc_run(uint32_t goal, uint32_t count, uint32_t* index);
+
+  /**
+   * @brief Put the newly allocated blocks first...first + count - 1 in the
+   * block cache, zeroed
+   */
+  void cache_new_blocks(uint32_t first, uint32_t count);
+
+  /**
+   * @brief Copy the block bitmap of every group into bitmaps, BLOCK_SIZE
+   * bytes each, for the snapshot taken
+   *
+   * @param loaded copy those of the loaded groups from memory, else read
+   * those of the others from the disk
+   */
+  bool copy_block_bitmaps(std::vector<uint8_t>* bitmaps, bool loaded);
+
+  bool visit_map_level(uint32_t index, int level, uint32_t* left,
+                       const MapVisitor& visitor);
+
+  /**
+   * @brief Locate the entry of file block in the block map of the inode
+   *
+   * @param holder returns the indirect block holding the entry, 0 if it is
+   * one of i_block
+   * @param slot returns the position of the entry in there
+   */
+  bool map_entry(ext2_inode* inode, uint32_t file_block, uint32_t* holder,
+                 uint32_t* slot);
+
+  /**
+   * @brief Decompress cluster of the inode into the CLUSTER_BYTES of data
+   */
+  bool read_cluster(ext2_inode* inode, uint32_t cluster, uint8_t* data);
+
+  /**
+   * @brief Size of the first preallocation window of the inode,
+   * s_prealloc_blocks or s_prealloc_dir_blocks, 0 unless mounted with
+   * EXT2_MOUNT_RESERVATION
+   */
+  uint32_t prealloc_blocks(ext2_inode* inode);
+
+  /**
+   * @brief Take up to count blocks from the window of the inode
+   *
+   * @param first returns the first block taken
+   * @param goal set to the block after the window if it is used up
+   * @param size set to the size of the next window if it is used up
+   * @return the number of blocks taken
+   */
+  uint32_t take_window(uint32_t inode_index, uint32_t count, uint32_t* first,
+                       uint32_t* goal, uint32_t* size);
+
+  enum WindowOp { WINDOW_HOLD, WINDOW_TAKE, WINDOW_DROP };
+
+  /**
+   * @brief Hold len blocks just allocated from first as a window, take the
+   * first len blocks of a window, or drop what is left of it, in the group
+   * of the blocks (see BlockGroup::hold_blocks())
+   */
+  void update_window(uint32_t first, uint32_t len, WindowOp op);
+
+  /**
+   * @brief Drop the windows of every inode, once the blocks out of them ran
+   * out
+   *
+   * @return false if there was none
+   */
+  bool discard_windows();
+
+  /**
+   * @brief Discard the free blocks first...first + len - 1 of a group, but
+   * those the newest snapshot still refers to. The caller holds the group
+   * lock.
+   *
+   * @return the number of blocks discarded
+   */
+  uint32_t discard_run(uint32_t group, uint32_t first, uint32_t len);
+
   // Timestamp
   timeval time_;
+  // Snapshots (must be set up before anything is written)
+  SnapshotManager* snapshots_;
   // Super block
   SuperBlock* super_block_;
   // Root inode
   ext2_inode* root_inode_;
-  // Block Groups
-  std::map<uint32_t, BlockGroup*> block_groups_;
+  // Block Groups, loaded on demand
+  std::unordered_map<uint32_t, BlockGroup*> block_groups_;
+  // guards block_groups_ and the number of groups
+  std::shared_mutex groups_lock_;
+  // free blocks and inodes of every group
+  FreeSpaceIndex free_space_;
+  // guards free_space_ and the counters of the super block
+  std::mutex free_space_lock_;
+  // one per CPU
+  AllocContext* contexts_;
+  uint32_t n_contexts_;
+  // blocks set aside by reserve_blocks(), guarded by free_space_lock_
+  uint64_t reserved_blocks_;
+  // free blocks of the created groups when the contexts were last folded,
+  // the allocations since are counted by the contexts. Guarded by
+  // free_space_lock_.
+  uint64_t folded_free_blocks_;
+  // EXT2_MOUNT_* flags
+  uint32_t mount_opts_;
+  // preallocation windows by inode
+  std::unordered_map<uint32_t, PreallocWindow> windows_;
+  std::mutex windows_lock_;
+  InodeHook delete_hook_;
+  // freed blocks waiting for discard, nullptr unless mounted with discard
+  DiscardQueue* discards_;
+  // shared data blocks, nullptr without NAIVEFS_FEATURE_RO_COMPAT_DEDUP
+  DedupIndex* dedup_;
   // block index mapped to block allocated in memory
   BlockCache* block_cache_;
+  // guards block_cache_
+  TimedSharedMutex cache_lock_;
   // name mapped to directory entry metadata
   DentryCache* dentry_cache_;
 };
@@ -0,0 +1,81 @@
+#ifndef NAIVEFS_INCLUDE_FREESPACE_H_
+#define NAIVEFS_INCLUDE_FREESPACE_H_
+
+#include <stdint.h>
+
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace naivefs {
+
+enum FreeSpaceKind {
+  FREE_BLOCKS = 0,
+  FREE_INODES,
+  NUM_FREE_SPACE_KINDS,
+};
+
+/**
+ * @brief In-memory summary of the free blocks and inodes of every block
+ * group, built from the group descriptors at mount. Allocation picks a group
+ * in O(log n) from it instead of scanning the descriptors, and only the
+ * bitmaps of the picked group are then loaded.
+ */
+class FreeSpaceIndex {
+ public:
+  /**
+   * @brief Record the free count of group, groups past the last known one
+   * are added
+   */
+  void update(FreeSpaceKind kind, uint32_t group, uint32_t free);
+
+  /**
+   * @brief First group at or after goal with a free block or inode
+   *
+   * @return -1 if there is none
+   */
+  int64_t find(FreeSpaceKind kind, uint32_t goal = 0) const;
+
+  /**
+   * @brief Group with the most free blocks or inodes, the first one on ties
+   *
+   * @return -1 if every group is full
+   */
+  int64_t most_free(FreeSpaceKind kind) const;
+
+  inline uint32_t free(FreeSpaceKind kind, uint32_t group) const {
+    const Summary& summary = summary_[kind];
+    return group < summary.free_.size() ? summary.free_[group] : 0;
+  }
+
+  /**
+   * @brief Number of groups recorded so far
+   */
+  inline uint32_t groups(FreeSpaceKind kind) const {
+    return summary_[kind].free_.size();
+  }
+
+  /**
+   * @brief Free blocks or inodes of all groups
+   */
+  inline uint64_t total(FreeSpaceKind kind) const {
+    return summary_[kind].total_;
+  }
+
+ private:
+  struct Summary {
+    // free count by group
+    std::vector<uint32_t> free_;
+    // sum of free_
+    uint64_t total_ = 0;
+    // groups with a free count above 0
+    std::set<uint32_t> available_;
+    // (free count, -group) of the available groups, most free last
+    std::set<std::pair<uint32_t, int64_t>> by_free_;
+  };
+
+  Summary summary_[NUM_FREE_SPACE_KINDS];
+};
+
+}  // namespace naivefs
+#endif
@@ -0,0 +1,61 @@
+#ifndef NAIVEFS_INCLUDE_IOCTL_H_
+#define NAIVEFS_INCLUDE_IOCTL_H_
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ * @brief Argument of NAIVEFS_IOC_DEFRAG, issued on an open regular file. The
+ * file is measured by the runs of adjacent data blocks (extents) its block
+ * map has; unless NAIVEFS_DEFRAG_QUERY is set, a file of more than one extent
+ * is copied into a single run and its block map swapped while it stays open.
+ * Files with compressed clusters are only measured.
+ */
+struct naivefs_defrag {
+  uint32_t flags;           // NAIVEFS_DEFRAG_* (in)
+  uint32_t blocks;          // data blocks of the file (out)
+  uint32_t extents_before;  // extents before defragmentation (out)
+  uint32_t extents_after;   // and after it (out)
+};
+
+// only measure the fragmentation of the file
+#define NAIVEFS_DEFRAG_QUERY 0x1
+
+#define NAIVEFS_IOC_DEFRAG _IOWR('N', 1, struct naivefs_defrag)
+
+/**
+ * @brief Argument of NAIVEFS_IOC_TRIM, the struct fstrim_range of FITRIM
+ * (<linux/fs.h> defines a BLOCK_SIZE of its own, so both are mirrored here).
+ * The range is in bytes of the block index space: every free run of at least
+ * minlen bytes in it is discarded on the device, and len returns the number
+ * of bytes discarded. It is issued on any file or directory, by root.
+ */
+struct naivefs_trim_range {
+  uint64_t start;   // (in)
+  uint64_t len;     // (in/out)
+  uint64_t minlen;  // (in)
+};
+
+// the command of FITRIM, so that fstrim(8) works on a mount point
+#define NAIVEFS_IOC_TRIM _IOWR('X', 121, struct naivefs_trim_range)
+
+/**
+ * The commands of FS_IOC_GETFLAGS and FS_IOC_SETFLAGS, so that lsattr(1) and
+ * chattr(1) work on files and directories: the argument is an int of
+ * NAIVEFS_*_FL flags, the FS_*_FL values. NAIVEFS_COMPR_FL (chattr +c) and
+ * NAIVEFS_DEDUP_FL are the ones that can be changed, by the owner or root:
+ * the clusters of 64 KiB a file gets after the first is set are written back
+ * compressed, the full blocks it gets after the second is set share the
+ * blocks of identical data (file systems made with mkfs -d), and the files
+ * and directories created in a directory that has them inherit them.
+ */
+#define NAIVEFS_COMPR_FL 0x00000004        // compress the file
+#define NAIVEFS_COMPRBLK_FL 0x00000200     // has compressed clusters (read-only)
+#define NAIVEFS_DEDUP_FL 0x01000000        // share blocks of identical data
+#define NAIVEFS_DEDUPBLK_FL 0x04000000     // has shareable blocks (read-only)
+#define NAIVEFS_INLINE_DATA_FL 0x10000000  // data in the inode (read-only)
+
+#define NAIVEFS_IOC_GETFLAGS _IOR('f', 1, long)
+#define NAIVEFS_IOC_SETFLAGS _IOW('f', 2, long)
+
+#endif
@@ -10,13 +10,21 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
+#include <unordered_set>
+#include <vector>
 
+#include "compress.h"
 #include "ext2/inode.h"
 #include "filesystem.h"
+#include "ioctl.h"
+#include "utils/hash.h"
 #include "utils/logging.h"
 #include "utils/option.h"
+#include "utils/stats.h"
 
 namespace naivefs {
 
@@ -42,7 +50,7 @@ constexpr uint32_t IBLOCK_13 = (BLOCK_SIZE / 4) * (BLOCK_SIZE / 4) + IBLOCK_12;
 constexpr uint32_t IBLOCK_14 = (BLOCK_SIZE / 4) * (BLOCK_SIZE / 4) * (BLOCK_SIZE / 4) + IBLOCK_13;  // 1074791436
 
 template <typename T>
-class FSListPtr {
+class FSListPtr : public SlabObject {
  public:
   T value_;
   FSListPtr<T> *prev_;
@@ -85,8 +93,94 @@ class FSList {
   }
 };
 
+/**
+ * @brief File blocks written past the blocks mapped by an inode, which get
+ * data blocks only at writeback (delayed allocation). Their space is
+ * reserved and their data kept in memory until they are allocated together,
+ * as one run: a file grown by small appends is laid out contiguously, and a
+ * file deleted before writeback never touches the bitmaps. The blocks are
+ * the last ones of the file.
+ */
+class DelayedBlocks {
+ public:
+  DelayedBlocks() : i_size_(0), first_(0) {}
+  DelayedBlocks(DelayedBlocks &&) = default;
+  DelayedBlocks &operator=(DelayedBlocks &&) = default;
+  ~DelayedBlocks() {
+    for (auto buf : buffers_) BufferPool::block_pool()->free(buf);
+  }
+
+  bool empty() const { return buffers_.empty(); }
+  uint32_t size() const { return buffers_.size(); }
+  // first file block, the blocks before it are mapped
+  uint32_t first() const { return first_; }
+
+  /**
+   * @brief Data of file block, nullptr if it is not delayed
+   */
+  uint8_t *get(uint32_t block) {
+    return block >= first_ && block - first_ < buffers_.size() ? buffers_[block - first_] : nullptr;
+  }
+
+  /**
+   * @brief Delay the zeroed file blocks up to end, reserving their space
+   *
+   * @param mapped number of blocks mapped by the inode
+   * @return false if the disk has no room for them
+   */
+  bool extend(uint32_t mapped, uint32_t end);
+
+  /**
+   * @brief Allocate the blocks for the inode and move their data into the
+   * block cache. The complete clusters of a file with EXT2_COMPR_FL are
+   * stored compressed, the blocks after them as they are. The full blocks of
+   * a regular file with EXT2_DEDUP_FL share the data blocks of identical
+   * data. It works under the writer lock of the inode.
+   *
+   * @return int 0, or -EIO or -ENOSPC if some blocks are still delayed
+   */
+  int writeback(ext2_inode *inode, uint32_t inode_id);
+
+  /**
+   * @brief Forget the blocks, their inode is gone
+   */
+  void drop();
+
+  // size of the file while no inode cache holds the blocks
+  uint32_t i_size_;
+
+ private:
+  /**
+   * @brief Store the clusters the delayed blocks complete, together with the
+   * mapped blocks of the first one
+   *
+   * @return int 0, -EIO or -ENOSPC
+   */
+  int writeback_clusters(ext2_inode *inode, uint32_t inode_id);
+
+  /**
+   * @brief Share the data blocks holding the data of the full blocks, and
+   * store the others
+   *
+   * @return int 0, -EIO or -ENOSPC
+   */
+  int writeback_dedup(ext2_inode *inode, uint32_t inode_id);
+
+  /**
+   * @brief Store the first count blocks in new data blocks
+   *
+   * @param hashes of the blocks, which become shareable, nullptr if they do
+   * not
+   * @return int 0, or -EIO or -ENOSPC if some of them are still delayed
+   */
+  int store(ext2_inode *inode, uint32_t inode_id, uint32_t count, const uint64_t *hashes);
+
+  uint32_t first_;
+  std::vector<uint8_t *> buffers_;
+};
+
 class FileStatus;
-class InodeCache {
+class InodeCache : public SlabObject {
  public:
   uint32_t inode_id_;               // this inode
   uint32_t cnts_;
@@ -95,7 +189,9 @@ class InodeCache {
                                     // use this to ensure atomicity.
   FSList<FileStatus*> vec;                       // when inode cache is changed in a critical section, other process
                                     // must update their cache.
-  explicit InodeCache(uint32_t inode_id) : inode_id_(inode_id) { cnts_ = 0; }
+  DelayedBlocks delayed_;           // blocks written but not allocated yet
+  std::atomic<uint64_t> version_;   // bumped whenever data or block map change
+  explicit InodeCache(uint32_t inode_id) : inode_id_(inode_id), version_(0) { cnts_ = 0; }
   ~InodeCache() {}
   void lock_shared() { inode_rwlock_.lock_shared(); }
   void unlock_shared() { inode_rwlock_.unlock_shared(); }
@@ -116,11 +212,38 @@ class InodeCache {
     INFO("inode cache commit %d", inode_id_);
     if (!fs->get_inode(inode_id_, &inode)) return -EIO;
     memcpy(inode, cache_, sizeof(ext2_inode));
+    // the inode table only covers the allocated blocks
+    if (!delayed_.empty())
+      inode->i_size = std::min((uint64_t)inode->i_size, (uint64_t)delayed_.first() * BLOCK_SIZE);
     return 0;
   }
+
+  /**
+   * @brief Delay the file blocks up to end, writing back the delayed blocks
+   * whenever DELALLOC_MAX_BLOCKS are buffered. It works under the writer lock.
+   *
+   * @return int 0, or -ENOSPC
+   */
+  int delay(uint32_t end);
+
+  /**
+   * @brief Allocate the delayed blocks. It works under the writer lock.
+   */
+  int writeback();
+
+  /**
+   * @brief Defragment the file (NAIVEFS_IOC_DEFRAG): its blocks are copied
+   * under the reader lock, so that it can still be read meanwhile, and the
+   * new block map replaces the old one under the writer lock unless the file
+   * was written in between, else the copy is tried again.
+   *
+   * @return int 0, -ENOSPC if there is no free run as long as the file, or
+   * -EBUSY if writes kept racing with the copy
+   */
+  int defrag(naivefs_defrag *arg);
 };
 
-class FileStatus {
+class FileStatus : public SlabObject {
  public:
   class IndirectBlockPtr {
    public:
@@ -210,6 +333,15 @@ class FileStatus {
    */
   int copy_to_buf(char *buf, size_t offset, size_t size);
 
+  /**
+   * @brief copy between buf and the file blocks, mapped or delayed: into the
+   * blocks if dirty, else out of them. It works under rwlock and a lock of
+   * inode_rwlock.
+   *
+   * @return int the number of bytes, or a negative integer
+   */
+  int copy_blocks(char *buf, size_t offset, size_t size, bool dirty);
+
   /**
    * @brief write buf to the file. the function works under rwlock because it
    * changes file pointers, and we also lock inode_rwlock, because it changes
@@ -230,6 +362,15 @@ class FileStatus {
   int write(const char *buf, size_t offset, size_t size, bool append_flag = false);
 
   int append(const char *buf, size_t offset, size_t size) { return write(buf, offset, size, true); }
+
+  /**
+   * @brief write to a file stored inline in i_block. It works under the writer
+   * lock of inode_rwlock.
+   *
+   * @return int the number of bytes written, or 0 if the data does not fit and
+   * has been moved to a data block (the caller goes on with block writes)
+   */
+  int write_inline(const char *buf, size_t offset, size_t size, bool append_flag);
 };
 
 class OpManager {
@@ -240,7 +381,7 @@ class OpManager {
    * @param inode_id
    * @return InodeCache*
    */
-  OpManager() {}
+  OpManager() : parked_blocks_(0) {}
   ~OpManager() {
     for (auto &[_, ptr] : st_) delete ptr;
   }
@@ -254,6 +395,13 @@ class OpManager {
         delete ic;
         return nullptr;
       }
+      auto parked = parked_.find(inode_id);
+      if (parked != parked_.end()) {
+        ic->cache_->i_size = parked->second.i_size_;
+        parked_blocks_ -= parked->second.size();
+        ic->delayed_ = std::move(parked->second);
+        parked_.erase(parked);
+      }
       st_[inode_id] = ic;
     }
     auto ret = st_[inode_id];
@@ -274,33 +422,97 @@ class OpManager {
     fd->fslist_ptr_ = it->second->vec.ins(fd);
   }
   /**
-   * @brief try to release an InodeCache object
-   * 
-   * @param inode_id 
-   * @return int 
+   * @brief write every cached inode back to the inode table, allocating the
+   * delayed blocks first
+   */
+  void commit_all() {
+    std::unique_lock<std::shared_mutex> lck(m_);
+    for (auto &[_, ic] : st_) {
+      ic->lock();
+      ic->writeback();
+      ic->commit();
+      ic->unlock();
+    }
+    for (auto it = parked_.begin(); it != parked_.end();) {
+      ext2_inode *inode;
+      DelayedBlocks &delayed = it->second;
+      parked_blocks_ -= delayed.size();
+      if (fs->get_inode(it->first, &inode)) {
+        delayed.writeback(inode, it->first);
+        inode->i_size = delayed.empty() ? delayed.i_size_ : std::min(delayed.i_size_, delayed.first() * BLOCK_SIZE);
+      }
+      // the file is closed
+      fs->discard_window(it->first);
+      if (delayed.empty()) {
+        it = parked_.erase(it);
+      } else {
+        parked_blocks_ += delayed.size();
+        ++it;
+      }
+    }
+  }
+  /**
+   * @brief try to release an InodeCache object. Its delayed blocks are kept
+   * until the next commit_all() while DELALLOC_PARKED_BLOCKS are not reached,
+   * else they are written back now. The preallocation window of the inode is
+   * discarded.
+   *
+   * @param inode_id
+   * @return int
    */
   int rel_cache(uint32_t inode_id) {
     std::unique_lock<std::shared_mutex> lck(m_);
     auto it = st_.find(inode_id);
     int ret = 0;
     if (it == st_.end()) return 0;
-    it->second->lock();
-    if(!--it->second->cnts_) {
+    auto ic = it->second;
+    ic->lock();
+    if(!--ic->cnts_) {
       INFO("rel cache success");
-      ret = it->second->commit();
-      it->second->unlock();
-      delete it->second;
+      if (parked_blocks_ + ic->delayed_.size() > DELALLOC_PARKED_BLOCKS) ic->writeback();
+      fs->discard_window(inode_id);
+      ret = ic->commit();
+      if (!ic->delayed_.empty()) {
+        parked_blocks_ += ic->delayed_.size();
+        ic->delayed_.i_size_ = ic->cache_->i_size;
+        parked_[inode_id] = std::move(ic->delayed_);
+      }
+      ic->unlock();
+      delete ic;
       st_.erase(it);
     } else {
-      INFO("rel cache: cache cnts %d", it->second->cnts_);
-      it->second->unlock();
+      INFO("rel cache: cache cnts %d", ic->cnts_);
+      ic->unlock();
     }
     INFO("rel cache returns %d", ret);
     return ret;
   }
+  /**
+   * @brief drop the delayed blocks of a deleted inode
+   *
+   * @param inode_id
+   */
+  void drop_delayed(uint32_t inode_id) {
+    std::unique_lock<std::shared_mutex> lck(m_);
+    auto parked = parked_.find(inode_id);
+    if (parked != parked_.end()) {
+      parked_blocks_ -= parked->second.size();
+      parked->second.drop();
+      parked_.erase(parked);
+    }
+    auto it = st_.find(inode_id);
+    if (it != st_.end()) {
+      it->second->lock();
+      it->second->delayed_.drop();
+      it->second->unlock();
+    }
+  }
 
  private:
-  std::map<uint32_t, InodeCache *> st_;
+  std::map<uint32_t, InodeCache *, std::less<uint32_t>, SlabAllocator<std::pair<const uint32_t, InodeCache *>>> st_;
+  // delayed blocks of the released inodes
+  std::map<uint32_t, DelayedBlocks> parked_;
+  uint64_t parked_blocks_;
   std::shared_mutex m_;
 };
 
@@ -308,6 +520,64 @@ extern OpManager *opm;
 FileStatus *_fuse_trans_info(struct fuse_file_info *fi);
 bool _check_permission(mode_t mode, int read, int write, int exec, gid_t gid, uid_t uid);
 bool _check_user(uid_t mode, uid_t uid, int read, int write, int exec);
+
+/**
+ * @brief File handle of a file opened inside a snapshot
+ */
+struct SnapshotFile {
+  std::string snapshot_;
+  ext2_inode inode_;
+};
+
+/**
+ * Snapshots are exposed read-only under the hidden directory "/.snapshots"
+ * (not listed by readdir of the root). mkdir "/.snapshots/<name>" takes a new
+ * snapshot and rmdir removes it. Every other modification returns EROFS.
+ */
+bool _is_snapshot_path(const char *path);
+int _snapshot_getattr(const char *, struct stat *);
+int _snapshot_readdir(const char *, void *, fuse_fill_dir_t);
+int _snapshot_mkdir(const char *);
+int _snapshot_rmdir(const char *);
+int _snapshot_open(const char *, struct fuse_file_info *);
+int _snapshot_read(const char *, char *, size_t, off_t, struct fuse_file_info *);
+int _snapshot_release(const char *, struct fuse_file_info *);
+int _snapshot_readlink(const char *, char *, size_t);
+
+// hidden directory under the root exposing run-time statistics
+#define STATS_DIR ".naivefs"
+#define STATS_DIR_LEN (sizeof(STATS_DIR) - 1)
+#define STATS_FILE "stats"
+
+/**
+ * @brief File handle of the stats file, the report is taken at open
+ */
+struct StatsFile {
+  std::string report_;
+};
+
+/**
+ * "/.naivefs/stats" is a read-only virtual file with counters and latency
+ * histograms of the mounted file system, e.g. for monitoring to scrape.
+ */
+bool _is_stats_path(const char *path);
+int _stats_getattr(const char *, struct stat *);
+int _stats_readdir(const char *, void *, fuse_fill_dir_t);
+int _stats_open(const char *, struct fuse_file_info *);
+int _stats_read(const char *, char *, size_t, off_t, struct fuse_file_info *);
+int _stats_release(const char *, struct fuse_file_info *);
+
+/**
+ * @brief Paths served by virtual files and directories instead of the disk
+ */
+inline bool _is_virtual_path(const char *path) { return _is_snapshot_path(path) || _is_stats_path(path); }
+
+/**
+ * @brief Replace the operations in ops with wrappers appending every call to
+ * the trace opened by trace_open() (see utils/trace.h)
+ */
+void trace_install(struct fuse_operations *ops);
+
 /**
  * The file system operations:
  *
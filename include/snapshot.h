@@ -0,0 +1,377 @@
+#ifndef NAIVEFS_INCLUDE_SNAPSHOT_H_
+#define NAIVEFS_INCLUDE_SNAPSHOT_H_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "block.h"
+#include "common.h"
+#include "utils/path.h"
+
+namespace naivefs {
+
+// hidden directory under the root exposing all snapshots
+#define SNAPSHOT_DIR ".snapshots"
+#define SNAPSHOT_DIR_LEN (sizeof(SNAPSHOT_DIR) - 1)
+#define SNAPSHOT_MAGIC 0x736e6170  // "snap"
+
+/**
+ * @brief Header of a preserved block in a snapshot store. BLOCK_SIZE bytes of
+ * old block data follow the header.
+ */
+struct SnapshotRecord {
+  uint64_t offset;      // disk offset of the preserved block
+  uint32_t generation;  // generation of the snapshot owning the copy
+  uint32_t magic;
+  uint32_t checksum;  // CRC32C of the block data, catches torn records
+  uint32_t reserved;
+};
+
+// blocks settled into the store between two syncs of it
+#define SNAPSHOT_SETTLE_BATCH 256
+
+/**
+ * @brief Blocks whose data in memory, not yet written back, belongs to a
+ * snapshot being taken, by disk offset
+ */
+typedef std::unordered_map<off_t, std::unique_ptr<uint8_t[]>> FrozenBlocks;
+
+/**
+ * @brief A frozen point-in-time image of the disk.
+ *
+ * Snapshots are copy-on-write: taking one only bumps the generation. Before a
+ * block is overwritten for the first time after the newest snapshot, its old
+ * contents are copied into the store of that snapshot. A block that is not in
+ * the store of a snapshot is read from the next newer snapshot, and finally
+ * from the live disk. The blocks that were dirty in memory when the snapshot
+ * was taken are kept in memory until settle() writes them to the store.
+ */
+class Snapshot {
+ public:
+  Snapshot(uint32_t generation, const std::string& name,
+           const std::string& store);
+
+  ~Snapshot();
+
+  /**
+   * @brief Open the store file and rebuild the block table from its records.
+   * Invalid records, left by failed or torn writes, are skipped and their
+   * slots reused.
+   */
+  bool open(bool create);
+
+  enum Holding { NOT_HELD, HELD, ON_DISK };
+
+  /**
+   * @brief Whether the snapshot has its own copy of the block at offset, in
+   * the store or frozen in memory, or has it as it is on the disk until the
+   * next snapshot settles it (see lazy_)
+   */
+  Holding holds(off_t offset);
+
+  inline bool contains(off_t offset) { return holds(offset) == HELD; }
+
+  /**
+   * @brief Whether the block at offset is in the store already
+   */
+  bool copied(off_t offset);
+
+  /**
+   * @brief contains(), once a copy out of the block in progress is done
+   */
+  bool preserved(off_t offset);
+
+  /**
+   * @brief Take the blocks frozen when the snapshot is taken, those it does
+   * not reference are dropped. Until they are settled, older reads them as
+   * they are on the disk.
+   *
+   * @param older the snapshot taken before, nullptr if there is none
+   */
+  void freeze(FrozenBlocks* frozen, Snapshot* older);
+
+  /**
+   * @brief Forget the blocks held on the disk for a newer snapshot that was
+   * dropped before it settled them
+   */
+  void drop_lazy();
+
+  /**
+   * @brief Write the frozen blocks that differ from the disk to the store,
+   * SNAPSHOT_SETTLE_BATCH at a time, then the map
+   */
+  bool settle();
+
+  bool preserve(off_t offset, const uint8_t* data);
+
+  /**
+   * @brief Preserve the block at offset with its data on the disk, unless it
+   * already is. The lock of the store is only held to update its block table,
+   * a writer of a block another writer is copying out waits for that copy.
+   * The record is durable when it returns, before the block is overwritten.
+   *
+   * @param data aligned BLOCK_SIZE buffer to read the block into
+   * @return 0, -EIO if the block could not be preserved
+   */
+  int copy_out(off_t offset, uint8_t* data);
+
+  bool load(off_t offset, uint8_t* data);
+
+  /**
+   * @brief Copy the blocks of this snapshot that are missing in target
+   */
+  bool merge_into(Snapshot* target);
+
+  /**
+   * @brief Keep the data blocks allocated when the snapshot is taken, the
+   * others need no copy out. Those of older, whose blocks may still be read
+   * through this snapshot, are kept as well. settle() writes the map next to
+   * the store.
+   *
+   * @param super the geometry of the groups
+   * @param bitmaps the block bitmap of every group of super
+   * @param older the snapshot taken before, nullptr if there is none
+   */
+  void set_map(const ext2_super_block* super, std::vector<uint8_t>* bitmaps,
+               Snapshot* older);
+
+  /**
+   * @brief Read the map written by set_map(), once the snapshot is the newest
+   */
+  void load_map();
+
+  /**
+   * @brief Whether the snapshot may need the block at offset: the super block
+   * and the group metadata, or a data block allocated when it was taken. All
+   * blocks are without a map.
+   */
+  bool referenced(off_t offset);
+
+  void sync();
+
+  void unlink();
+
+  inline uint32_t generation() const { return generation_; }
+
+  inline const std::string& name() const { return name_; }
+
+ private:
+  /**
+   * @brief Write the record of the block at offset to the store at record
+   */
+  bool write_record(off_t offset, off_t record, const uint8_t* data);
+
+  /**
+   * @brief Take a free record slot, a hole first. lock_ must be held.
+   */
+  off_t claim_record();
+
+  /**
+   * @brief Give back the slot of a record that failed to be written
+   */
+  void release_record(off_t record);
+
+  bool save_map();
+
+  /**
+   * @brief Before the frozen block at offset leaves memory, give older_ the
+   * disk data of the block if it holds it on the disk
+   *
+   * @param disk aligned BLOCK_SIZE buffer to read the block into
+   */
+  bool hand_down(off_t offset, const uint8_t* frozen, uint8_t* disk);
+
+  /**
+   * @brief Stop holding the block at offset on the disk, preserving data
+   * first unless it is nullptr (the disk data is the same as the frozen one)
+   */
+  bool settle_lazy(off_t offset, const uint8_t* data);
+
+  uint32_t generation_;
+  std::string name_;
+  std::string store_;
+  std::string map_;
+  int fd_;
+  off_t end_;
+  // disk offset mapped to record offset in the store
+  std::unordered_map<off_t, off_t> table_;
+  // disk offsets being copied out by copy_out()
+  std::unordered_set<off_t> pending_;
+  // slots before end_ without a valid record
+  std::vector<off_t> holes_;
+  // blocks frozen in memory until settle(), and not copied out since
+  FrozenBlocks frozen_;
+  // the snapshot taken before, while frozen_ is not empty
+  Snapshot* older_;
+  // blocks the next snapshot froze: this one has them as they are on the
+  // disk, and gets their disk data before they are overwritten
+  std::unordered_set<off_t> lazy_;
+  // guards end_, table_, pending_, holes_, frozen_ and lazy_
+  std::mutex lock_;
+  std::condition_variable copied_;
+  // the map of allocated blocks, only loaded for the newest snapshot
+  bool has_map_;
+  ext2_super_block super_;
+  uint32_t groups_;
+  std::vector<uint8_t> allocated_;
+};
+
+class SnapshotManager {
+ public:
+  SnapshotManager(const char* disk_name);
+
+  ~SnapshotManager();
+
+  /**
+   * @brief Held across the steps of taking a snapshot, and by remove()
+   */
+  inline std::mutex& changes() { return changes_; }
+
+  /**
+   * @brief First step of taking a snapshot: check the name and create its
+   * store. The caller holds changes().
+   */
+  RetCode prepare(const char* name, size_t name_len, Snapshot** snapshot);
+
+  /**
+   * @brief Give up a snapshot prepare() returned
+   */
+  void abandon(Snapshot* snapshot);
+
+  /**
+   * @brief Freeze the disk image with the blocks not written back yet: the
+   * snapshot is the newest from now on. The caller keeps the file system
+   * from changing.
+   *
+   * @param super the geometry of the groups
+   * @param bitmaps the block bitmap of every group, see Snapshot::set_map()
+   * @param frozen the blocks in memory that differ from the disk
+   */
+  void freeze(Snapshot* snapshot, const ext2_super_block* super,
+              std::vector<uint8_t>* bitmaps, FrozenBlocks* frozen);
+
+  /**
+   * @brief Last step of taking a snapshot, while the file system is in use:
+   * make it durable (see Snapshot::settle()) and list it in the manifest. It
+   * is dropped if that fails.
+   */
+  RetCode settle(Snapshot* snapshot);
+
+  /**
+   * @brief Drop a snapshot, its copies older snapshots read through it are
+   * merged into the previous one. The caller holds changes().
+   */
+  RetCode remove(const char* name, size_t name_len);
+
+  bool exists(const char* name, size_t name_len);
+
+  void list(const std::function<void(const std::string&)>& visitor);
+
+  /**
+   * @brief Read a block as it was when the snapshot was taken
+   */
+  bool read_block(const char* name, size_t name_len, off_t offset,
+                  uint8_t* data);
+
+  /**
+   * @brief Disk write hook: preserve blocks of [where, where + size) which
+   * have not been copied out since the newest snapshot.
+   *
+   * @return 0, -EIO if a block could not be preserved, the write then fails
+   * instead of corrupting the snapshot
+   */
+  int before_write(off_t where, size_t size);
+
+  /**
+   * @brief Visit the runs of [where, where + size) which the newest snapshot
+   * does not need copied out first: those free when it was taken or copied
+   * out since. All of the range without snapshots.
+   */
+  void visit_discardable(off_t where, size_t size,
+                         const std::function<void(off_t, size_t)>& visitor);
+
+  void sync();
+
+ private:
+  int find(const char* name, size_t name_len);
+
+  bool save_manifest();
+
+  /**
+   * @brief Take a snapshot out of snapshots_ and delete it. The caller holds
+   * changes_.
+   */
+  RetCode drop(Snapshot* snapshot);
+
+  std::string disk_name_;
+  std::string manifest_;
+  uint32_t generation_;
+  // ordered by generation, the newest is at the back
+  std::vector<Snapshot*> snapshots_;
+  // exclusive to change snapshots_, shared by the readers and before_write()
+  std::shared_mutex m_;
+  // serializes taking and removing snapshots
+  std::mutex changes_;
+};
+
+/**
+ * @brief Read-only view of the file system tree frozen in a snapshot
+ */
+class SnapshotView {
+ public:
+  SnapshotView(SnapshotManager* manager, const char* name, size_t name_len);
+
+  inline bool valid() const { return valid_; }
+
+  /**
+   * @brief Lookup an inode by path, skipping the first `skip` names of path
+   */
+  RetCode lookup(const Path& path, size_t skip, ext2_inode* inode,
+                 uint32_t* inode_index = nullptr);
+
+  int read(const ext2_inode& inode, char* buf, size_t size, off_t offset);
+
+  void readdir(const ext2_inode& inode,
+               const std::function<void(const char*, size_t)>& visitor);
+
+ private:
+  bool read_block(off_t offset, uint8_t* data);
+
+  bool get_inode(uint32_t index, ext2_inode* inode);
+
+  bool get_block_offset(uint32_t index, off_t* offset);
+
+  /**
+   * @brief Map the n-th block of the inode to its block index
+   */
+  bool map_block(const ext2_inode& inode, uint32_t n, uint32_t* index);
+
+  /**
+   * @brief Decompress a cluster of the inode into data if it is compressed
+   *
+   * @return 1 if it is, 0 if it is not, -1 on errors
+   */
+  int read_cluster(const ext2_inode& inode, uint32_t cluster,
+                   std::unique_ptr<uint8_t[]>* data);
+
+  bool visit_dentries(
+      const ext2_inode& inode,
+      const std::function<bool(ext2_dir_entry_2*)>& visitor);
+
+  SnapshotManager* manager_;
+  std::string name_;
+  bool valid_;
+  ext2_super_block super_;
+  std::vector<ext2_group_desc> desc_table_;
+};
+
+}  // namespace naivefs
+
+#endif
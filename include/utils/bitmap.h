@@ -26,10 +26,10 @@ class Bitmap {
   /**
    * @brief find the first unset bit in the bitmap
    *
-   * @param size find the bit in range [0, size)
+   * @param size find the bit in range [start, size)
    * @return int -1 if out of range or no unset bit
    */
-  int64_t find(int size);
+  int64_t find(int size, int start = 0);
 
  private:
   uint32_t* data_;
@@ -0,0 +1,30 @@
+#ifndef NAIVEFS_INCLUDE_CRC32C_H_
+#define NAIVEFS_INCLUDE_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace naivefs {
+
+/**
+ * @brief CRC32C (Castagnoli polynomial, as in ext4 and iSCSI) of size bytes,
+ * continuing from crc, 0 for the first chunk. It runs on the SSE4.2 or ARMv8
+ * CRC32 instructions when the CPU has them, on slice-by-8 tables otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void* buf, size_t size);
+
+/**
+ * @brief crc32c() on the slice-by-8 tables whatever the CPU, to check the
+ * instructions against
+ */
+uint32_t crc32c_portable(uint32_t crc, const void* buf, size_t size);
+
+/**
+ * @brief Implementation picked for this CPU: "sse4.2", "armv8" or
+ * "slice-by-8"
+ */
+const char* crc32c_impl();
+
+}  // namespace naivefs
+
+#endif
@@ -7,14 +7,256 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <functional>
+#include <string>
+#include <vector>
+
 #include "common.h"
 #include "utils/logging.h"
 
 namespace naivefs {
 
 void* alloc_aligned(size_t size);
-int disk_open();
+
+/**
+ * Hook invoked before every disk write with the range about to be
+ * overwritten. Snapshots use it to copy out the old contents. A negative
+ * errno fails the write, which then leaves the range untouched.
+ */
+typedef std::function<int(off_t, size_t)> DiskWriteHook;
+
+/**
+ * @brief Backing store of the file system. read() and write() account the
+ * I/O in the statistics and run the write hook, implementations only move
+ * the bytes. Offsets and sizes are multiples of DISK_ALIGN and buffers come
+ * from alloc_aligned() or the block pool.
+ */
+class BlockDevice {
+ public:
+  explicit BlockDevice(const char* name) : name_(name) {}
+  virtual ~BlockDevice() {}
+
+  virtual int open() = 0;
+  virtual int close() = 0;
+  /**
+   * @brief Make completed writes durable
+   */
+  virtual int sync() { return 0; }
+  // size in bytes, 0 if unknown
+  virtual uint64_t size() = 0;
+  /**
+   * @brief Learn the size of a block group (of a flex group with FLEX_BG),
+   * known once the super block has been read. Devices may use it to place
+   * data by group.
+   */
+  virtual void set_group_size(__attribute__((unused)) uint64_t size) {}
+
+  int read(off_t where, size_t size, void* buf);
+  int write(off_t where, size_t size, const void* buf);
+  /**
+   * @brief Give the range back to the storage below, e.g. the file system
+   * above or an SSD. It reads back as zeros or as garbage; the write hook
+   * runs first as for a write.
+   */
+  int discard(off_t where, size_t size);
+
+  const char* name() { return name_.c_str(); }
+
+  void set_write_hook(const DiskWriteHook& hook) { write_hook_ = hook; }
+
+ protected:
+  virtual int do_read(off_t where, size_t size, void* buf) = 0;
+  virtual int do_write(off_t where, size_t size, const void* buf) = 0;
+  // devices that cannot discard ignore it
+  virtual int do_discard(__attribute__((unused)) off_t where,
+                         __attribute__((unused)) size_t size) {
+    return 0;
+  }
+
+  std::string name_;
+  DiskWriteHook write_hook_;
+
+  // members are driven below the accounting of the striped device
+  friend class StripedDevice;
+};
+
+/**
+ * @brief Regular file holding the disk image. The direct engine bypasses the
+ * page cache with O_DIRECT; the buffered engine goes through it and asks the
+ * kernel to read ahead readahead bytes after every read. Discarded ranges are
+ * punched out of the file, unless its file system cannot.
+ */
+class FileDevice : public BlockDevice {
+ public:
+  FileDevice(const char* path, bool direct = true, size_t readahead = 0)
+      : BlockDevice(path),
+        fd_(-1),
+        direct_(direct),
+        readahead_(direct ? 0 : readahead),
+        can_discard_(true) {}
+  ~FileDevice() override {
+    if (fd_ >= 0) close();
+  }
+
+  int open() override;
+  int close() override;
+  int sync() override;
+  uint64_t size() override;
+
+ protected:
+  int do_read(off_t where, size_t size, void* buf) override;
+  int do_write(off_t where, size_t size, const void* buf) override;
+  int do_discard(off_t where, size_t size) override;
+
+  virtual int open_flags();
+
+  int fd_;
+  bool direct_;
+  size_t readahead_;
+  bool can_discard_;
+};
+
+/**
+ * @brief Raw block device, always opened with O_DIRECT and O_EXCL so it is
+ * not mounted or opened by another NaiveFS at the same time. Discards are
+ * passed to the drive (BLKDISCARD).
+ */
+class RawDevice : public FileDevice {
+ public:
+  explicit RawDevice(const char* path) : FileDevice(path, true, 0) {}
+
+  int sync() override;
+  uint64_t size() override;
+
+ protected:
+  int do_discard(off_t where, size_t size) override;
+  int open_flags() override;
+};
+
+/**
+ * @brief Disk kept in anonymous memory, lost on close. Pages are only backed
+ * once written, untouched ranges read as zeros (an uninitialized disk), and
+ * discarded pages are given back.
+ */
+class RamDevice : public BlockDevice {
+ public:
+  RamDevice(const char* name, uint64_t size)
+      : BlockDevice(name), data_(nullptr), size_(size) {}
+  ~RamDevice() override {
+    if (data_ != nullptr) close();
+  }
+
+  int open() override;
+  int close() override;
+  uint64_t size() override { return size_; }
+
+ protected:
+  int do_read(off_t where, size_t size, void* buf) override;
+  int do_write(off_t where, size_t size, const void* buf) override;
+  int do_discard(off_t where, size_t size) override;
+
+  uint8_t* data_;
+  uint64_t size_;
+};
+
+/**
+ * @brief RAID-0 over several member devices, owned by the striped device.
+ * The super block (the first BLOCK_SIZE bytes) lives on the first member.
+ * Past it, the address space is cut into units that are dealt round-robin
+ * over the members: fixed-size chunks, or whole block groups so that the
+ * bitmaps, inode table and data of a group share one device. A request
+ * spanning several members is split and handed to one I/O thread per
+ * member, so the pieces proceed in parallel. The device is named after its
+ * first member, which also keeps the snapshot stores.
+ */
+class StripedDevice : public BlockDevice {
+ public:
+  /**
+   * @param chunk bytes per unit, a multiple of DISK_ALIGN, or 0 to stripe
+   * block groups once set_group_size() is called
+   */
+  StripedDevice(const std::vector<BlockDevice*>& members, uint64_t chunk);
+  ~StripedDevice() override;
+
+  int open() override;
+  int close() override;
+  int sync() override;
+  uint64_t size() override;
+  void set_group_size(uint64_t size) override;
+
+ protected:
+  int do_read(off_t where, size_t size, void* buf) override;
+  int do_write(off_t where, size_t size, const void* buf) override;
+  int do_discard(off_t where, size_t size) override;
+
+ private:
+  struct Queue;
+
+  // a piece of a request that falls on one member
+  struct Extent {
+    uint32_t member;
+    off_t where;
+    size_t size;
+    uint8_t* buf;
+  };
+
+  /**
+   * @brief Cut a request into the pieces falling on each member
+   *
+   * @param spans set if the pieces are on more than one member
+   */
+  int split(off_t where, size_t size, uint8_t* buf,
+            std::vector<Extent>* extents, bool* spans);
+
+  int do_io(bool write, off_t where, size_t size, uint8_t* buf);
+
+  int submit(bool write, const std::vector<Extent>& extents);
+
+  // bytes at the start of the device kept on the first member (the super
+  // block), fixed here as <linux/fs.h> has a BLOCK_SIZE of its own
+  static const uint64_t head_size_ = BLOCK_SIZE;
+
+  std::vector<BlockDevice*> members_;
+  std::vector<Queue*> queues_;
+  bool by_group_;
+  uint64_t unit_;
+};
+
+#define RAM_DEVICE_PREFIX "ram:"
+#define STRIPE_DEVICE_PREFIX "stripe:"
+#define STRIPE_BY_GROUP "group"
+#define STRIPE_MEMBER_SEPARATOR '+'
+
+/**
+ * @brief "64m", "1g", ... in bytes (k/m/g suffixes), 0 if malformed
+ */
+uint64_t parse_size(const char* str);
+
+/**
+ * @brief Open the device described by spec and attach it. "ram:<size>"
+ * (k/m/g suffixes) is a RAM disk, a block device path a RawDevice and
+ * anything else a disk image opened as a FileDevice with the given engine.
+ * "stripe:<chunk>:<spec>+<spec>..." stripes the member specs in chunks of
+ * the given size, or by block group if chunk is "group".
+ */
+int disk_open(const char* spec = DISK_NAME, bool direct = true,
+              size_t readahead = 0);
+/**
+ * @brief Use a device set up by the embedder, which keeps owning it. The
+ * device must be open.
+ */
+void disk_attach(BlockDevice* device);
+/**
+ * @brief Detach the device, closing and freeing it if disk_open created it
+ */
 int disk_close();
+int disk_sync();
+int disk_discard(off_t where, size_t size);
+const char* disk_name();
+BlockDevice* disk();
+
+void disk_set_write_hook(const DiskWriteHook& hook);
+void disk_set_group_size(uint64_t size);
 
 #define disk_read(__where, __s, __p) \
   __disk_read(__where, __s, __p, __func__, __LINE__)
@@ -32,4 +274,4 @@ int __disk_read(off_t where, size_t size, void* buf, const char* func,
 int __disk_write(off_t where, size_t size, void* buf, const char* func,
                  int line);
 }  // namespace naivefs
-#endif
\ No newline at end of file
+#endif
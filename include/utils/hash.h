@@ -0,0 +1,26 @@
+#ifndef NAIVEFS_INCLUDE_HASH_H_
+#define NAIVEFS_INCLUDE_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace naivefs {
+
+/**
+ * @brief 64-bit hash of size bytes, a multiple of 64, to find identical
+ * blocks: 8 lanes accumulate 32x32-bit products of the data mixed with a key
+ * that changes every 64 bytes, as XXH3 does, then are folded together. It
+ * runs on SSE2 when the CPU has it, with the same result as the portable
+ * code. It is not collision resistant, blocks of the same hash are compared.
+ */
+uint64_t block_hash(const void* data, size_t size);
+
+/**
+ * @brief block_hash() on the portable code whatever the CPU, to check SSE2
+ * against
+ */
+uint64_t block_hash_portable(const void* data, size_t size);
+
+}  // namespace naivefs
+
+#endif
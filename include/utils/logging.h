@@ -2,6 +2,12 @@
 #define LOGGING_H
 
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <type_traits>
 
 #define LOG_EMERG   0
 #define LOG_ALERT   1
@@ -12,32 +18,175 @@
 #define LOG_INFO    6
 #define LOG_DEBUG   7
 
-#define EMERG(...)              __LOG(LOG_EMERG, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-#define ALERT(...)              __LOG(LOG_ALERT, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-#define CRIT(...)               __LOG(LOG_CRIT, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-#define ERR(...)                __LOG(LOG_ERR, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-#define WARNING(...)            __LOG(LOG_WARNING, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-#define NOTICE(...)             __LOG(LOG_NOTICE, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-#define INFO(...)               __LOG(LOG_INFO, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-#define DEBUG(...)              __LOG(LOG_DEBUG, __FUNCTION__, __LINE__, ##__VA_ARGS__);
-
 #define DEFAULT_LOG_FILE        NULL
 
 #ifndef NDEBUG
 #define DEFAULT_LOG_LEVEL LOG_DEBUG
+#else
+#define DEFAULT_LOG_LEVEL LOG_ERR
+#endif
+
+/*
+ * Messages above this level are compiled out: their arguments are not even
+ * evaluated. Override with -DLOG_COMPILE_LEVEL=<level>.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL DEFAULT_LOG_LEVEL
+#endif
+
+#define __LOG_AT(level, ...)                                        \
+  do {                                                              \
+    if ((level) <= LOG_COMPILE_LEVEL)                               \
+      __LOG(level, __FUNCTION__, __LINE__, ##__VA_ARGS__);          \
+  } while (0)
+
+#define EMERG(...)              __LOG_AT(LOG_EMERG, ##__VA_ARGS__);
+#define ALERT(...)              __LOG_AT(LOG_ALERT, ##__VA_ARGS__);
+#define CRIT(...)               __LOG_AT(LOG_CRIT, ##__VA_ARGS__);
+#define ERR(...)                __LOG_AT(LOG_ERR, ##__VA_ARGS__);
+#define WARNING(...)            __LOG_AT(LOG_WARNING, ##__VA_ARGS__);
+#define NOTICE(...)             __LOG_AT(LOG_NOTICE, ##__VA_ARGS__);
+#define INFO(...)               __LOG_AT(LOG_INFO, ##__VA_ARGS__);
+#define DEBUG(...)              __LOG_AT(LOG_DEBUG, ##__VA_ARGS__);
+
+#ifndef NDEBUG
 #define ASSERT(assertion) ({                            \
     if (!(assertion)) {                                 \
         WARNING("ASSERT FAIL: " #assertion);            \
+        logging_flush();                                \
         assert(assertion);                              \
     }                                                   \
 })
 #else
-#define DEFAULT_LOG_LEVEL LOG_ERR
 #define ASSERT(assertion)       do { } while(0)
 #endif
 
-void __LOG(int level, const char *func, int line, const char *format, ...);
+/*
+ * Log records are captured in binary form into a lock-free ring of the
+ * calling thread, and formatted and written by a background thread. Records
+ * keep pointers to the format string and the function name, so both must be
+ * string literals; string arguments are copied. Records of different threads
+ * are not ordered against each other.
+ */
+#define LOG_RING_SIZE           1024  // records per thread
+#define LOG_RECORD_SIZE         256
+#define LOG_PAYLOAD_SIZE        (LOG_RECORD_SIZE - 32)
+
+struct __log_record {
+  const char *func;
+  const char *format;
+  int32_t line;
+  int16_t level;
+  uint16_t size;  // used bytes of payload
+  uint32_t reserved;
+  uint8_t payload[LOG_PAYLOAD_SIZE];
+};
+
+// argument tags in the payload
+enum __log_arg_type : uint8_t {
+  LOG_ARG_INT,     // followed by the size of the type and 8 bytes
+  LOG_ARG_DOUBLE,  // 8 bytes
+  LOG_ARG_PTR,     // 8 bytes
+  LOG_ARG_STR,     // 2 bytes length and the characters
+};
+
+extern std::atomic<int> __log_level;
+
+/**
+ * @brief Reserve a record in the ring of this thread, nullptr if the ring
+ * is full (messages below LOG_WARNING are dropped then) or logging is off
+ */
+__log_record *__log_begin(int level);
+
+void __log_commit(__log_record *record);
+
+class __log_writer {
+ public:
+  explicit __log_writer(__log_record *record) : record_(record) {}
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type put(T value) {
+    uint64_t raw;
+    if (std::is_signed<T>::value)
+      raw = (uint64_t)(int64_t)value;
+    else
+      raw = (uint64_t)value;
+    uint8_t size = sizeof(T);
+    if (!reserve(2 + sizeof(raw))) return;
+    push(LOG_ARG_INT);
+    push(size);
+    append(&raw, sizeof(raw));
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type put(T value) {
+    double d = value;
+    if (!reserve(1 + sizeof(d))) return;
+    push(LOG_ARG_DOUBLE);
+    append(&d, sizeof(d));
+  }
+
+  void put(const char *str) {
+    if (str == nullptr) str = "(null)";
+    size_t len = strlen(str);
+    if (!reserve(3)) return;
+    // strings are truncated to the space left
+    len = std::min(len, (size_t)(LOG_PAYLOAD_SIZE - record_->size - 3));
+    uint16_t len16 = len;
+    push(LOG_ARG_STR);
+    append(&len16, sizeof(len16));
+    append(str, len);
+  }
+
+  void put(char *str) { put((const char *)str); }
+
+  void put(const void *ptr) {
+    uint64_t raw = (uint64_t)(uintptr_t)ptr;
+    if (!reserve(1 + sizeof(raw))) return;
+    push(LOG_ARG_PTR);
+    append(&raw, sizeof(raw));
+  }
+
+ private:
+  bool reserve(size_t n) { return record_->size + n <= LOG_PAYLOAD_SIZE; }
+
+  void push(uint8_t byte) { record_->payload[record_->size++] = byte; }
+
+  void append(const void *data, size_t n) {
+    memcpy(record_->payload + record_->size, data, n);
+    record_->size += n;
+  }
+
+  __log_record *record_;
+};
+
+template <typename... Args>
+inline void __LOG(int level, const char *func, int line, const char *format, Args... args) {
+  if (level < 0 || level > __log_level.load(std::memory_order_relaxed)) return;
+  __log_record *record = __log_begin(level);
+  if (record == nullptr) return;
+  record->func = func;
+  record->format = format;
+  record->line = line;
+  record->level = level;
+  record->size = 0;
+  __log_writer writer(record);
+  (writer.put(args), ...);
+  __log_commit(record);
+}
+
 void logging_setlevel(int new_level);
 int logging_open(const char *path);
+/**
+ * @brief Start the writer thread again in a process forked after
+ * logging_open() (e.g. when the daemon detaches). Until then, warnings and
+ * errors that fill a ring are written by their own thread.
+ */
+void logging_start();
+/**
+ * @brief Wait until every record captured so far has been written
+ */
+void logging_flush();
+void logging_close();
 
 #endif
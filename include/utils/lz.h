@@ -0,0 +1,31 @@
+#ifndef NAIVEFS_INCLUDE_LZ_H_
+#define NAIVEFS_INCLUDE_LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace naivefs {
+
+/**
+ * @brief Compress size bytes of src into dst, in the LZ4 block format:
+ * sequences of literals followed by a match of at least 4 bytes up to 64 KiB
+ * back, found through a hash table of the last positions of 4-byte strings.
+ * It favours speed over ratio, like LZ4 itself.
+ *
+ * @return the size of the compressed data, 0 if it does not fit in capacity
+ */
+size_t lz_compress(const void* src, size_t size, void* dst, size_t capacity);
+
+/**
+ * @brief Decompress size bytes of src, compressed by lz_compress(), into
+ * dst. Malformed input is detected, nothing is written past capacity.
+ *
+ * @return the size of the decompressed data, -1 if src is malformed or does
+ * not fit in capacity
+ */
+int64_t lz_decompress(const void* src, size_t size, void* dst,
+                      size_t capacity);
+
+}  // namespace naivefs
+
+#endif
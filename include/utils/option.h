@@ -1,6 +1,8 @@
 #ifndef NAIVEFS_INCLUDE_OPTION_H_
 #define NAIVEFS_INCLUDE_OPTION_H_
 
+#include <string.h>
+
 #include <string>
 
 namespace naivefs {
@@ -8,8 +10,23 @@ struct options {
   // const char *filename;
   // const char *contents;
   int show_help;
+  char *device;           // disk image or block device
+  unsigned cache_blocks;  // blocks kept in the block cache
+  unsigned dentry_cache;  // entries kept in the dentry cache
+  char *io_engine;        // "direct" (O_DIRECT) or "buffered"
+  unsigned readahead_kb;  // kernel readahead of the buffered engine
+  char *trace;            // record every operation into this file
+  int noreservation;      // no preallocation windows (EXT2_MOUNT_RESERVATION)
+  int discard;            // discard freed blocks on the device
 };
 extern options global_options;
+
+#define IO_ENGINE_DIRECT "direct"
+#define IO_ENGINE_BUFFERED "buffered"
+
+inline bool io_engine_direct(const options &opts) {
+  return opts.io_engine == nullptr || strcmp(opts.io_engine, IO_ENGINE_BUFFERED) != 0;
+}
 }  // namespace naivefs
 
-#endif
\ No newline at end of file
+#endif
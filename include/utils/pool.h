@@ -0,0 +1,130 @@
+#ifndef NAIVEFS_INCLUDE_POOL_H_
+#define NAIVEFS_INCLUDE_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "utils/logging.h"
+
+namespace naivefs {
+
+// buffers are carved out of chunks of this size, one huge page on x86-64
+#define POOL_CHUNK_SIZE (2 << 20)
+// back the block buffer pool with explicit huge pages (MAP_HUGETLB)
+#ifndef BLOCK_POOL_HUGE_PAGE
+#define BLOCK_POOL_HUGE_PAGE 0
+#endif
+// block buffers reserved at mount for blocks kept outside the block cache
+#define BLOCK_POOL_RESERVE_SLACK 64
+
+// slabs are aligned to their size, so an object finds its slab by masking
+#define SLAB_SIZE (64 << 10)
+#define SLAB_MAX_OBJECT_SIZE 1024
+
+/**
+ * @brief Map an anonymous arena of size bytes. With huge_page, explicit huge
+ * pages are tried first (huge_page is cleared if none are available);
+ * otherwise the arena is advised for transparent huge pages.
+ */
+void* arena_map(size_t size, bool* huge_page);
+
+void arena_unmap(void* arena, size_t size);
+
+/**
+ * @brief Pool of fixed-size buffers carved out of large page-aligned chunks.
+ * Freed buffers are kept in a free list and chunks are only unmapped when the
+ * pool is destroyed, so a warmed-up pool never calls into the allocator.
+ */
+class BufferPool {
+ public:
+  BufferPool(size_t buffer_size, size_t chunk_size, bool huge_page);
+
+  ~BufferPool();
+
+  /**
+   * @brief Make sure at least n buffers can be handed out without growing
+   */
+  bool reserve(size_t n);
+
+  void* alloc();
+
+  void free(void* buf);
+
+  inline size_t capacity() const { return capacity_; }
+
+  /**
+   * @brief The pool shared by all Block objects
+   */
+  static BufferPool* block_pool();
+
+ private:
+  struct FreeBuffer {
+    FreeBuffer* next_;
+  };
+
+  bool grow();
+
+  size_t buffer_size_;
+  size_t chunk_size_;
+  bool huge_page_;
+  FreeBuffer* free_list_;
+  size_t capacity_;
+  std::vector<std::pair<void*, size_t>> chunks_;
+  std::mutex m_;
+};
+
+/**
+ * @brief Size-class slab allocator for small objects (cache nodes, dentry
+ * nodes, file handles). Objects larger than SLAB_MAX_OBJECT_SIZE get a slab
+ * of their own, so slab_free works for every pointer from slab_alloc.
+ */
+void* slab_alloc(size_t size);
+
+void slab_free(void* ptr);
+
+/**
+ * @brief Inherit to allocate objects of a class (and its derived classes)
+ * from the slab allocator
+ */
+struct SlabObject {
+  static void* operator new(size_t size) { return slab_alloc(size); }
+
+  static void operator delete(void* ptr) { slab_free(ptr); }
+};
+
+/**
+ * @brief STL allocator on top of the slab allocator, used for node-based
+ * containers on hot paths
+ */
+template <typename T>
+struct SlabAllocator {
+  typedef T value_type;
+
+  SlabAllocator() noexcept {}
+
+  template <typename U>
+  SlabAllocator(const SlabAllocator<U>&) noexcept {}
+
+  T* allocate(size_t n) { return (T*)slab_alloc(n * sizeof(T)); }
+
+  void deallocate(T* ptr, size_t) noexcept { slab_free(ptr); }
+
+  template <typename U>
+  bool operator==(const SlabAllocator<U>&) const noexcept {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const SlabAllocator<U>&) const noexcept {
+    return false;
+  }
+};
+
+}  // namespace naivefs
+
+#endif
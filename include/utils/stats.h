@@ -0,0 +1,146 @@
+#ifndef NAIVEFS_INCLUDE_STATS_H_
+#define NAIVEFS_INCLUDE_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+
+namespace naivefs {
+
+// latencies (in ns) recorded into log-linear histograms
+enum StatHistogram {
+  STAT_OP_GETATTR = 0,
+  STAT_OP_READDIR,
+  STAT_OP_OPEN,
+  STAT_OP_READ,
+  STAT_OP_WRITE,
+  STAT_OP_CREATE,
+  STAT_OP_MKDIR,
+  STAT_OP_RMDIR,
+  STAT_OP_UNLINK,
+  STAT_OP_RENAME,
+  STAT_OP_LINK,
+  STAT_OP_SYMLINK,
+  STAT_OP_READLINK,
+  STAT_OP_TRUNCATE,
+  STAT_OP_CHMOD,
+  STAT_OP_CHOWN,
+  STAT_OP_UTIMENS,
+  STAT_OP_ACCESS,
+  STAT_OP_RELEASE,
+  STAT_OP_FSYNC,
+  STAT_OP_IOCTL,
+  STAT_DISK_READ,
+  STAT_DISK_WRITE,
+  STAT_BIG_LOCK_WAIT,
+  STAT_BLOCK_LOCK_WAIT,
+  STAT_GROUP_LOCK_WAIT,
+  NUM_STAT_HISTOGRAMS
+};
+
+enum StatCounter {
+  STAT_CACHE_HIT = 0,
+  STAT_CACHE_MISS,
+  STAT_CACHE_EVICT,
+  STAT_CACHE_WRITEBACK,
+  STAT_DISK_READ_BYTES,
+  STAT_DISK_WRITE_BYTES,
+  STAT_DISK_DISCARD_BYTES,
+  STAT_DELALLOC_BLOCKS,
+  STAT_DELALLOC_DROPPED,
+  STAT_DEFRAG_BLOCKS,
+  STAT_CSUM_ERRORS,
+  STAT_COMPRESS_CLUSTERS,
+  STAT_COMPRESS_SAVED_BLOCKS,
+  STAT_DECOMPRESS_CLUSTERS,
+  STAT_DEDUP_BLOCKS,
+  STAT_DEDUP_COW,
+  NUM_STAT_COUNTERS
+};
+
+// a power of two is split into 2^STAT_SUB_BITS linear buckets (~12% error)
+#define STAT_SUB_BITS 3
+#define STAT_NUM_BUCKETS (64 << STAT_SUB_BITS)
+
+/**
+ * @brief Statistics are kept per thread and only written by their thread, so
+ * recording is a plain add without atomic read-modify-write. A report sums up
+ * the live threads and the threads that have exited.
+ */
+void stat_add(StatCounter counter, uint64_t value = 1);
+
+void stat_record(StatHistogram histogram, uint64_t ns);
+
+/**
+ * @brief Text report of all counters and histograms, one metric per line
+ */
+std::string stat_report();
+
+inline uint64_t stat_now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Record the lifetime of the timer
+ */
+class StatTimer {
+ public:
+  explicit StatTimer(StatHistogram histogram)
+      : histogram_(histogram), start_(stat_now()) {}
+
+  ~StatTimer() { stat_record(histogram_, stat_now() - start_); }
+
+ private:
+  StatHistogram histogram_;
+  uint64_t start_;
+};
+
+#define STAT_TIMER(__h) StatTimer __stat_timer(__h)
+
+/**
+ * @brief Shared mutex recording how long lockers wait. Uncontended locks
+ * take the try_lock path and record a zero wait without reading the clock.
+ */
+class TimedSharedMutex {
+ public:
+  explicit TimedSharedMutex(StatHistogram histogram) : histogram_(histogram) {}
+
+  void lock() {
+    if (m_.try_lock()) {
+      stat_record(histogram_, 0);
+      return;
+    }
+    uint64_t start = stat_now();
+    m_.lock();
+    stat_record(histogram_, stat_now() - start);
+  }
+
+  bool try_lock() { return m_.try_lock(); }
+
+  void unlock() { m_.unlock(); }
+
+  void lock_shared() {
+    if (m_.try_lock_shared()) {
+      stat_record(histogram_, 0);
+      return;
+    }
+    uint64_t start = stat_now();
+    m_.lock_shared();
+    stat_record(histogram_, stat_now() - start);
+  }
+
+  void unlock_shared() { m_.unlock_shared(); }
+
+ private:
+  StatHistogram histogram_;
+  std::shared_mutex m_;
+};
+
+}  // namespace naivefs
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef NAIVEFS_INCLUDE_TRACE_H_
+#define NAIVEFS_INCLUDE_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+namespace naivefs {
+
+/*
+ * Binary operation trace: a TraceHeader followed by records. Every record is
+ * a TraceRecord followed by path_len bytes of path and path2_len bytes of
+ * path2 (no terminators). Data of reads and writes is not recorded. Records
+ * are appended in completion order, sort them by start to get issue order.
+ */
+#define TRACE_MAGIC 0x45434152545346ULL  // "FSTRACE"
+#define TRACE_VERSION 1
+
+struct TraceHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;  // sizeof(TraceRecord)
+  uint64_t realtime;     // ns since the epoch when the trace began
+};
+
+enum TraceOp : uint8_t {
+  TRACE_GETATTR = 0,
+  TRACE_READDIR,
+  TRACE_OPEN,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_CREATE,
+  TRACE_MKDIR,
+  TRACE_RMDIR,
+  TRACE_UNLINK,
+  TRACE_RENAME,
+  TRACE_LINK,
+  TRACE_SYMLINK,
+  TRACE_READLINK,
+  TRACE_TRUNCATE,
+  TRACE_CHMOD,
+  TRACE_CHOWN,
+  TRACE_UTIMENS,
+  TRACE_ACCESS,
+  TRACE_RELEASE,
+  TRACE_FSYNC,
+  TRACE_FLUSH,
+  NUM_TRACE_OPS
+};
+
+/**
+ * @brief One operation. The meaning of offset and arg depends on the op:
+ *   read/write  offset, size
+ *   readdir     offset, -
+ *   open        -, open flags
+ *   create      mode, open flags
+ *   mkdir/chmod -, mode
+ *   truncate    -, new size
+ *   chown       -, uid << 32 | gid
+ *   utimens     atime, mtime as sec << 32 | nsec, ~0 for a NULL tv
+ *   access      -, mask
+ *   readlink    -, buffer size
+ *   rename      -, flags
+ *   fsync       -, datasync
+ * path2 is the second path of rename, link (the new names) and symlink (the
+ * link, path being the target).
+ */
+struct TraceRecord {
+  uint64_t start;   // ns since the trace began
+  uint64_t fh;      // trace handle used or returned, 0 if none
+  uint64_t offset;
+  uint64_t arg;
+  int32_t ret;
+  uint32_t duration;  // ns, saturated
+  uint16_t thread;    // index of the calling thread in the trace
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t path_len;
+  uint16_t path2_len;
+};
+
+static_assert(sizeof(TraceRecord) == 48, "trace record layout changed");
+
+const char *trace_op_name(uint8_t op);
+
+/**
+ * @brief Start recording into path. Returns 0 or -errno.
+ */
+int trace_open(const char *path);
+void trace_close();
+bool trace_enabled();
+
+/**
+ * @brief ns since the trace began
+ */
+uint64_t trace_now();
+
+/**
+ * @brief Fill in thread and duration (from record->start) and append the
+ * record. Safe to call from any thread.
+ */
+void trace_record(TraceRecord *record, const char *path,
+                  const char *path2 = nullptr);
+
+/**
+ * @brief File handles are recycled, so records carry a trace handle that is
+ * unique for every open instead. trace_handle_open() assigns one to the fh
+ * returned by open or create, trace_handle() looks it up and
+ * trace_handle_release() drops it, before the fh may be reused.
+ */
+uint64_t trace_handle_open(uint64_t fh);
+uint64_t trace_handle(uint64_t fh);
+uint64_t trace_handle_release(uint64_t fh);
+
+/**
+ * @brief Read the next record of a trace, false at the end or on a torn
+ * record
+ */
+bool trace_read(FILE *file, TraceRecord *record, std::string *path,
+                std::string *path2);
+
+/**
+ * @brief Read and check the header, false if it is not a trace
+ */
+bool trace_read_header(FILE *file, TraceHeader *header);
+
+}  // namespace naivefs
+
+#endif
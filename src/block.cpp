@@ -1,5 +1,8 @@
 #include "block.h"
 
+#include <atomic>
+#include <thread>
+
 namespace naivefs {
 
 void SuperBlock::init_super_block() {
@@ -10,25 +13,31 @@ void SuperBlock::init_super_block() {
       super_->s_log_block_size = LOG_BLOCK_SIZE;
       super_->s_blocks_per_group = TOTAL_BLOCKS_PER_GROUP;
       super_->s_inodes_per_group = INODES_PER_GROUP;
+      super_->s_log_groups_per_flex = LOG_GROUPS_PER_FLEX;
+      if (flex_layout(super_))
+        super_->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_FLEX_BG;
       // 1 inode bitmap, 1 block bitmap, 1 inode table block, no data blocks
       super_->s_blocks_count = 3;
       super_->s_inodes_count = 1;  // 1 root inode
       super_->s_first_ino = ROOT_INODE;
       super_->s_inode_size = sizeof(ext2_inode);
+      super_->s_prealloc_blocks = PREALLOC_BLOCKS;
+      super_->s_prealloc_dir_blocks = PREALLOC_DIR_BLOCKS;
+      super_->s_groups_count = 1;
+      size_group_descs();
       // set state to normal
       super_->s_state = FSState::NORMAL;
 
       // init first block group
-      ext2_group_desc* desc =
-          (ext2_group_desc*)(data_ + sizeof(ext2_super_block));
-      desc->bg_inode_bitmap = BLOCK_SIZE;
-      desc->bg_block_bitmap = desc->bg_inode_bitmap + BLOCK_SIZE;
-      desc->bg_inode_table = desc->bg_block_bitmap + BLOCK_SIZE;
-      desc->bg_free_blocks_count = BLOCKS_PER_GROUP;
-      // root inode has been allocated
-      desc->bg_free_inodes_count = INODES_PER_GROUP - 1;
+      super_->s_first_meta_bg = MAX_BLOCK_GROUPS;
+      ext2_group_desc* desc = new_group_desc();
+      set_group_offsets(super_, 0, desc);
+      desc->bg_free_blocks_count =
+          BLOCKS_PER_GROUP - reserved_data_blocks(super_, 0);
+      // the file system allocates the root inode from this group
+      desc->bg_free_inodes_count = INODES_PER_GROUP;
       desc->bg_used_dirs_count = 0;
-      desc_table_.push_back(desc);
+      formatted_ = true;
 
       // Why flush needed?
       flush();
@@ -41,11 +50,14 @@ void SuperBlock::init_super_block() {
       INFO("N BlOCK GROUPS: %i", num_block_groups());
       INFO("INODE SIZE: %i", inode_size());
       INFO("INODES PER GROUP: %i", inodes_per_group());
-
-      ext2_group_desc* ptr =
-          (ext2_group_desc*)(data_ + sizeof(ext2_super_block));
-      for (uint32_t i = 0; i < num_block_groups(); ++i) {
-        desc_table_.push_back(ptr++);
+      if (has_checksums(super_)) {
+        checksums_ = new ChecksumTable(super_);
+        set_checksums(checksums_);
+        if (super_->s_checksum != 0 &&
+            super_->s_checksum != super_block_checksum(data_)) {
+          ERR("Checksum mismatch of the super block");
+          stat_add(STAT_CSUM_ERRORS);
+        }
       }
       break;
     }
@@ -54,10 +66,134 @@ void SuperBlock::init_super_block() {
       abort();
     }
   }
+  // a device striping block groups needs their size before any group I/O,
+  // a flex group is kept whole
+  disk_set_group_size(block_group_size() << super_->s_log_groups_per_flex);
+  error_ = load_group_descs();
+  if (error_ < 0) ERR("Cannot read the group descriptors: %d", error_);
+}
+
+void SuperBlock::size_group_descs() {
+  uint32_t first = first_meta_bg(super_);
+  uint32_t n_groups = std::max(max_block_groups(super_), num_block_groups());
+  desc_table_.assign(n_groups, nullptr);
+  uint32_t n_blocks =
+      n_groups > first
+          ? (n_groups - first + DESCS_PER_BLOCK - 1) / DESCS_PER_BLOCK
+          : 0;
+  meta_blocks_.assign(n_blocks, nullptr);
+  meta_loaded_.reset(new std::atomic<bool>[n_blocks]());
+}
+
+int SuperBlock::load_group_descs() {
+  uint32_t first = first_meta_bg(super_);
+  uint32_t n_groups = num_block_groups();
+  if (desc_table_.empty()) size_group_descs();
+  // the descriptor blocks of meta groups are spread over the disk, one per
+  // DESCS_PER_BLOCK groups, they are read in parallel
+  if (n_groups > first && meta_blocks_[0] == nullptr) {
+    uint32_t n_blocks = (n_groups - first + DESCS_PER_BLOCK - 1) /
+                        DESCS_PER_BLOCK;
+    for (uint32_t i = 0; i < n_blocks; ++i) {
+      meta_blocks_[i] = new Block(
+          meta_desc_block_offset(super_, first + i * DESCS_PER_BLOCK), true);
+    }
+    std::atomic<uint32_t> next{0};
+    std::atomic<int> error{0};
+    std::vector<std::thread> threads;
+    unsigned n = std::min(std::max(1u, std::thread::hardware_concurrency()),
+                          std::min(n_blocks, (uint32_t)MOUNT_READ_THREADS));
+    for (unsigned t = 0; t < n; ++t) {
+      threads.emplace_back([&]() {
+        for (uint32_t i; (i = next.fetch_add(1)) < n_blocks;) {
+          Block* block = meta_blocks_[i];
+          int ret = disk_read(block->offset(), BLOCK_SIZE, block->get());
+          if (ret < 0) {
+            error.store(ret);
+            continue;
+          }
+          if (checksums_ != nullptr)
+            checksums_->verify(block->offset(), block->get());
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    if (error.load() < 0) return error.load();
+  }
+  for (uint32_t i = n_descs_.load(); i < n_groups; ++i) {
+    desc_table_[i] = map_group_desc(i, false);
+  }
+  if (n_groups > n_descs_.load())
+    n_descs_.store(n_groups, std::memory_order_release);
+  return 0;
+}
+
+int SuperBlock::flush() {
+  int ret;
+  if (has_checksums(super_)) {
+    // of a copy, the counters change while the file system is in use
+    uint8_t* copy = (uint8_t*)BufferPool::block_pool()->alloc();
+    memcpy(copy, data_, BLOCK_SIZE);
+    ((ext2_super_block*)copy)->s_checksum = super_block_checksum(copy);
+    ret = disk_write(0, BLOCK_SIZE, copy);
+    BufferPool::block_pool()->free(copy);
+  } else {
+    ret = Block::flush();
+  }
+  for (size_t i = 0; i < meta_blocks_.size() && ret >= 0; ++i) {
+    if (meta_blocks_[i] != nullptr && meta_loaded_[i])
+      ret = meta_blocks_[i]->flush();
+  }
+  return ret;
+}
+
+void SuperBlock::get_metadata(std::vector<Block*>* blocks) {
+  if (has_checksums(super_)) super_->s_checksum = super_block_checksum(data_);
+  blocks->push_back(this);
+  for (size_t i = 0; i < meta_blocks_.size(); ++i) {
+    if (meta_blocks_[i] != nullptr && meta_loaded_[i])
+      blocks->push_back(meta_blocks_[i]);
+  }
 }
 
-int64_t BitmapBlock::alloc_new() {
-  int64_t i = bitmap_.find(BLOCK_SIZE * 8);
+ext2_group_desc* SuperBlock::new_group_desc() {
+  uint32_t index = n_descs_.load();
+  ASSERT(index < desc_table_.size());
+  ext2_group_desc* desc = map_group_desc(index, true);
+  memset((void*)desc, 0, sizeof(ext2_group_desc));
+  desc_table_[index] = desc;
+  // readers take no lock, the slot is filled before it is counted
+  n_descs_.store(index + 1, std::memory_order_release);
+  track_group_desc(index);
+  // only set once used, so that small images stay readable by older versions
+  if (index >= first_meta_bg(super_)) {
+    super_->s_first_meta_bg = first_meta_bg(super_);
+    super_->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_META_BG;
+  }
+  if ((uint64_t)naivefs::block_group_offset(super_, index + 1) > UINT32_MAX)
+    super_->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_64BIT;
+  return desc;
+}
+
+ext2_group_desc* SuperBlock::map_group_desc(uint32_t index, bool alloc) {
+  uint32_t first = first_meta_bg(super_);
+  if (index < first) {
+    ASSERT(index < MAX_BLOCK_GROUPS);
+    return (ext2_group_desc*)(data_ + sizeof(ext2_super_block)) + index;
+  }
+  // groups are mapped in order, the first of a meta group reads (or
+  // creates) the descriptor block
+  uint32_t n = (index - first) / DESCS_PER_BLOCK;
+  ASSERT(n < meta_blocks_.size());
+  if (meta_blocks_[n] == nullptr)
+    meta_blocks_[n] = new Block(meta_desc_block_offset(super_, index), alloc);
+  return (ext2_group_desc*)meta_blocks_[n]->get() +
+         (index - first) % DESCS_PER_BLOCK;
+}
+
+int64_t BitmapBlock::alloc_new(int64_t goal) {
+  int64_t i = find_free(BLOCK_SIZE * 8, goal);
+  if (i < 0 && goal > 0) i = find_free(BLOCK_SIZE * 8, 0);
   if (i < 0) {
     WARNING("Failed to alloc new item");
     return i;
@@ -66,17 +202,92 @@ int64_t BitmapBlock::alloc_new() {
   return i;
 }
 
-BlockGroup::BlockGroup(ext2_group_desc* desc, bool alloc) : desc_(desc) {
+int64_t BitmapBlock::alloc_run(int64_t goal, uint32_t count, uint32_t min,
+                               uint32_t* len) {
+  const int size = BLOCK_SIZE * 8;
+  int64_t first = -1;
+  *len = 0;
+  // from goal to the end, then from the start up to goal
+  for (int pass = 0; pass < 2 && *len < count; ++pass) {
+    int end = pass == 0 ? size : goal;
+    int64_t i = find_free(end, pass == 0 ? goal : 0);
+    while (i >= 0) {
+      uint32_t n = 1;
+      while (n < count && i + n < size && !bitmap_.test(i + n) && !held(i + n))
+        ++n;
+      if ((first < 0 && n >= min) || n == count) {
+        first = i;
+        *len = n;
+      }
+      if (n == count || i + n >= end) break;
+      i = find_free(end, i + n);
+    }
+  }
+  if (first < 0) return first;
+  for (uint32_t i = 0; i < *len; ++i) bitmap_.set(first + i);
+  return first;
+}
+
+void BitmapBlock::hold(uint32_t first, uint32_t len) {
+  held_[first] = first + len;
+}
+
+void BitmapBlock::unhold(uint32_t first, uint32_t len) {
+  auto iter = held_.find(first);
+  if (iter == held_.end()) return;
+  uint32_t end = iter->second;
+  held_.erase(iter);
+  // a window is used up from its start
+  if (first + len < end) held_[first + len] = end;
+}
+
+bool BitmapBlock::held(int64_t i) {
+  auto iter = held_.upper_bound(i);
+  return iter != held_.begin() && (--iter)->second > i;
+}
+
+int64_t BitmapBlock::find_free(int end, int64_t start) {
+  int64_t i = bitmap_.find(end, start);
+  while (i >= 0 && !held_.empty()) {
+    auto iter = held_.upper_bound(i);
+    if (iter == held_.begin() || (--iter)->second <= i) break;
+    // past the held run
+    i = iter->second < (uint32_t)end ? bitmap_.find(end, iter->second) : -1;
+  }
+  return i;
+}
+
+BlockGroup::BlockGroup(ext2_group_desc* desc, const ext2_super_block* super,
+                       uint32_t index, bool alloc)
+    : desc_(desc),
+      super_(super),
+      index_(index),
+      lock_(STAT_GROUP_LOCK_WAIT),
+      trimmed_min_(0),
+      corrupt_(false) {
   ASSERT(desc != nullptr);
 
-  INFO("BLOCK BITMAP OFFSET: 0x%x", desc->bg_block_bitmap);
-  INFO("INODE BITMAP OFFSET: 0x%x", desc->bg_inode_bitmap);
-  INFO("INODE TABLE OFFSET: 0x%x", desc->bg_inode_table);
+  INFO("BLOCK BITMAP OFFSET: 0x%lx", block_bitmap_offset(desc));
+  INFO("INODE BITMAP OFFSET: 0x%lx", inode_bitmap_offset(desc));
+  INFO("INODE TABLE OFFSET: 0x%lx", inode_table_offset(desc));
   INFO("FREE BLOCKS COUNT: %i", desc->bg_free_blocks_count);
   INFO("FREE INODES COUNT: %i", desc->bg_free_inodes_count);
 
-  block_bitmap_ = new BitmapBlock(desc->bg_block_bitmap, alloc);
-  inode_bitmap_ = new BitmapBlock(desc->bg_inode_bitmap, alloc);
+  block_bitmap_ = new BitmapBlock(block_bitmap_offset(desc), alloc);
+  inode_bitmap_ = new BitmapBlock(inode_bitmap_offset(desc), alloc);
+  if (alloc) {
+    for (uint32_t i = 0; i < reserved_data_blocks(super, index); ++i)
+      block_bitmap_->set(i);
+    for (uint32_t i = data_blocks_per_group(super); i < BLOCK_SIZE * 8; ++i)
+      block_bitmap_->set(i);
+    for (uint32_t i = super->s_inodes_per_group; i < BLOCK_SIZE * 8; ++i)
+      inode_bitmap_->set(i);
+  } else if (block_bitmap_->corrupt() || inode_bitmap_->corrupt()) {
+    // allocating from a bitmap that cannot be trusted would cross-link files
+    ERR("Bitmaps of block group %u are corrupt, nothing is allocated from it",
+        index);
+    corrupt_ = true;
+  }
 }
 
 BlockGroup::~BlockGroup() {
@@ -98,6 +309,17 @@ void BlockGroup::flush() {
   }
 }
 
+void BlockGroup::get_metadata(std::vector<Block*>* blocks) {
+  blocks->push_back(block_bitmap_);
+  blocks->push_back(inode_bitmap_);
+  for (auto item : inode_table_) blocks->push_back(item.second);
+}
+
+void BlockGroup::copy_block_bitmap(uint8_t* data) {
+  std::shared_lock<TimedSharedMutex> lck(lock_);
+  memcpy(data, block_bitmap_->get(), BLOCK_SIZE);
+}
+
 bool BlockGroup::get_inode(uint32_t index, ext2_inode** inode) {
   // invalid inode
   // INFO("inner get inode: %d", index);
@@ -110,40 +332,58 @@ bool BlockGroup::get_inode(uint32_t index, ext2_inode** inode) {
 
   // lazy read
   if (inode_table_.find(block_index) == inode_table_.end()) {
-    inode_table_[block_index] =
-        new InodeTableBlock(inode_block_offset(block_index));
+    auto block = new InodeTableBlock(inode_block_offset(block_index));
+    if (block->corrupt()) {
+      delete block;
+      return false;
+    }
+    inode_table_[block_index] = block;
   }
   *inode = inode_table_[block_index]->get(block_inner_index);
   return true;
 }
 
-bool BlockGroup::get_block(uint32_t index, Block** block) {
+bool BlockGroup::get_block(uint32_t index, Block** block, bool file_data,
+                           uint8_t* data) {
   // invalid block
   if (!block_bitmap_->test(index)) {
     WARNING("Block has not been allocated in the bitmap!");
     return false;
   }
-  *block = new Block(data_block_offset(index));
+  if (data != nullptr)
+    *block = new Block(data_block_offset(index), data, file_data);
+  else
+    *block = new Block(data_block_offset(index), false, file_data);
+  if ((*block)->corrupt()) {
+    delete *block;
+    return false;
+  }
   return true;
 }
 
 bool BlockGroup::alloc_inode(ext2_inode** inode, uint32_t* index, mode_t mode) {
+  if (corrupt_) return false;
   int ret = inode_bitmap_->alloc_new();
   if (ret == -1) return false;
+  if (!get_inode(ret, inode)) {
+    // its inode table block is corrupt
+    inode_bitmap_->clear(ret);
+    return false;
+  }
 
   // update block group descriptor
   desc_->bg_free_inodes_count--;
   if (S_ISDIR(mode)) desc_->bg_used_dirs_count++;
 
   if (index != nullptr) *index = ret;
-  ret = get_inode(ret, inode);
   memset((void*)(*inode), 0, sizeof(ext2_inode));
   (*inode)->i_mode = mode;
-  return ret;
+  return true;
 }
 
-bool BlockGroup::alloc_block(Block** block, uint32_t* index) {
-  int ret = block_bitmap_->alloc_new();
+bool BlockGroup::alloc_block(Block** block, uint32_t* index, uint32_t goal) {
+  if (corrupt_) return false;
+  int ret = block_bitmap_->alloc_new(goal);
   if (ret == -1) return false;
 
   // update block group descriptor
@@ -154,6 +394,20 @@ bool BlockGroup::alloc_block(Block** block, uint32_t* index) {
   return true;
 }
 
+uint32_t BlockGroup::alloc_blocks(uint32_t goal, uint32_t count,
+                                  uint32_t min, uint32_t* index) {
+  if (corrupt_) return 0;
+  uint32_t len;
+  int64_t ret = block_bitmap_->alloc_run(goal, count, min, &len);
+  if (ret == -1) return 0;
+
+  // update block group descriptor
+  desc_->bg_free_blocks_count -= len;
+
+  *index = ret;
+  return len;
+}
+
 bool BlockGroup::free_inode(uint32_t index) {
   ext2_inode* inode;
   if (!get_inode(index, &inode)) return false;
@@ -164,20 +418,53 @@ bool BlockGroup::free_inode(uint32_t index) {
   return true;
 }
 
+void BlockGroup::hold_blocks(uint32_t first, uint32_t len) {
+  for (uint32_t i = 0; i < len; ++i) block_bitmap_->clear(first + i);
+  block_bitmap_->hold(first, len);
+  desc_->bg_free_blocks_count += len;
+}
+
+void BlockGroup::take_held(uint32_t first, uint32_t len) {
+  block_bitmap_->unhold(first, len);
+  for (uint32_t i = 0; i < len; ++i) block_bitmap_->set(first + i);
+  desc_->bg_free_blocks_count -= len;
+}
+
+void BlockGroup::drop_held(uint32_t first, uint32_t len) {
+  block_bitmap_->unhold(first, len);
+}
+
 bool BlockGroup::free_block(uint32_t index) {
   if (!block_bitmap_->test(index)) return false;
   block_bitmap_->clear(index);
   // update block group descriptor
   desc_->bg_free_blocks_count++;
+  trimmed_min_ = 0;
   return true;
 }
 
+void BlockGroup::visit_free_runs(
+    uint32_t first, uint32_t end, uint32_t min,
+    const std::function<void(uint32_t, uint32_t)>& visitor) {
+  int64_t i = block_bitmap_->find(end, first);
+  while (i >= 0) {
+    uint32_t n = 1;
+    while (i + n < end && !block_bitmap_->test(i + n)) ++n;
+    if (n >= min) visitor(i, n);
+    i = block_bitmap_->find(end, i + n);
+  }
+}
+
 off_t BlockGroup::inode_block_offset(uint32_t inode_block_index) {
-  return block_bitmap_->offset() + (inode_block_index + 1) * BLOCK_SIZE;
+  return inode_block_offset(desc_, inode_block_index);
 }
 
 off_t BlockGroup::data_block_offset(uint32_t data_block_index) {
-  return block_bitmap_->offset() + NUM_INODE_TABLE_BLOCKS * BLOCK_SIZE +
-         data_block_index * BLOCK_SIZE;
+  return naivefs::data_block_offset(super_, index_, data_block_index);
+}
+
+off_t BlockGroup::inode_block_offset(const ext2_group_desc* desc,
+                                     uint32_t inode_block_index) {
+  return inode_table_offset(desc) + (off_t)inode_block_index * BLOCK_SIZE;
 }
 }  // namespace naivefs
\ No newline at end of file
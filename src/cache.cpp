@@ -1,10 +1,25 @@
 #include "cache.h"
 
 namespace naivefs {
-BlockCache::BlockCache(size_t size) : entries_(new Node[size]), head_(new Node), tail_(new Node), size_(size) {
+BlockCache::BlockCache(size_t size)
+    : entries_(new Node[size]),
+      head_(new Node),
+      tail_(new Node),
+      size_(size),
+      arena_size_((size * BLOCK_SIZE + POOL_CHUNK_SIZE - 1) / POOL_CHUNK_SIZE * POOL_CHUNK_SIZE),
+      huge_page_(BLOCK_CACHE_HUGE_PAGE) {
+  arena_ = (uint8_t*)arena_map(arena_size_, &huge_page_);
+  if (arena_ == nullptr) {
+    ERR("Failed to map block cache arena");
+    abort();
+  }
+  INFO("Block cache arena: %zu blocks, huge page %d", size_, huge_page_);
   for (size_t i = 0; i < size; ++i) {
     free_entries_.push_back(entries_ + i);
   }
+  // the map never rehashes once the cache is full
+  map_.reserve(size);
+  BufferPool::block_pool()->reserve(BLOCK_POOL_RESERVE_SLACK);
   head_->prev_ = nullptr;
   head_->next_ = tail_;
   tail_->prev_ = head_;
@@ -15,13 +30,15 @@ BlockCache::~BlockCache() {
   delete head_;
   delete tail_;
   delete[] entries_;
+  arena_unmap(arena_, arena_size_);
 }
 
 void BlockCache::flush() {
   for (auto& node : map_) {
     if (node.second->dirty_) {
-      DEBUG("[BlockCache] Flush block %u", node.second->index_);
+      DEBUG("[BlockCache] Flush block %lu", node.second->index_);
       node.second->block_->flush();
+      stat_add(STAT_CACHE_WRITEBACK);
       node.second->dirty_ = false;
     }
   }
@@ -31,30 +48,28 @@ void BlockCache::flush(uint32_t inode_index) {
   for (auto& node : map_)
     if (node.second->index_ == inode_index) {
       if (node.second->dirty_) {
-        DEBUG("[BlockCache] Flush block %u", node.second->index_);
+        DEBUG("[BlockCache] Flush block %lu", node.second->index_);
         node.second->block_->flush();
+        stat_add(STAT_CACHE_WRITEBACK);
         node.second->dirty_ = false;
       }
     }
 }
 
-void BlockCache::insert(uint32_t index, Block* block, bool dirty) {
-  DEBUG("[BlockCache] Inserting block %u", index);
+void BlockCache::visit_dirty(
+    const std::function<void(uint64_t, Block*)>& visitor) {
+  for (auto& node : map_) {
+    if (node.second->dirty_) visitor(node.second->index_, node.second->block_);
+  }
+}
+
+void BlockCache::insert(uint64_t index, Block* block, bool dirty) {
+  DEBUG("[BlockCache] Inserting block %lu", index);
   Node* node = nullptr;
   auto iter = map_.find(index);
   if (iter == map_.end()) {
     INFO("block cache insert: iter doesn't exist");
-    if (free_entries_.empty()) {
-      INFO("block cache insert: iter doesn't exist, free entries empty");
-      node = tail_->prev_;
-      ASSERT(node != nullptr);
-      INFO("block cache insert: iter doesn't exist, free entries empty, detach");
-      detach(node);
-      INFO("block cache insert: iter doesn't exist, free entries empty, release");
-      release(node);
-      INFO("block cache insert: iter doesn't exist, free entries empty, map->erase");
-      map_.erase(node->index_);
-    }
+    make_room();
     // to get the node released in free_entries_
     {
       INFO("block cache insert: iter doesn't exist, free entries not empty");
@@ -62,6 +77,8 @@ void BlockCache::insert(uint32_t index, Block* block, bool dirty) {
       free_entries_.pop_back();
     }
     ASSERT(node != nullptr);
+    // move the block data into the slot of the node
+    block->rebind(slot(node));
     node->index_ = index;
     node->block_ = block;
     node->dirty_ = dirty;
@@ -81,8 +98,13 @@ void BlockCache::insert(uint32_t index, Block* block, bool dirty) {
   }
 }
 
-Block* BlockCache::get(uint32_t index, bool dirty) {
-  DEBUG("[BlockCache] Getting block %u", index);
+uint8_t* BlockCache::reserve() {
+  make_room();
+  return slot(free_entries_.back());
+}
+
+Block* BlockCache::get(uint64_t index, bool dirty) {
+  DEBUG("[BlockCache] Getting block %lu", index);
   auto iter = map_.find(index);
   if (iter == map_.end()) {
     DEBUG("blockcache: nullptr");
@@ -100,8 +122,8 @@ Block* BlockCache::get(uint32_t index, bool dirty) {
   }
 }
 
-void BlockCache::remove(uint32_t index) {
-  DEBUG("[BlockCache] Removing block %u", index);
+void BlockCache::remove(uint64_t index) {
+  DEBUG("[BlockCache] Removing block %lu", index);
   auto iter = map_.find(index);
   if (iter == map_.end()) {
     return;
@@ -114,9 +136,9 @@ void BlockCache::remove(uint32_t index) {
   }
 }
 
-void BlockCache::modify(uint32_t index) {
+void BlockCache::modify(uint64_t index) {
   if (map_.find(index) == map_.end()) return;
-  DEBUG("[BlockCache] Modify block %u", index);
+  DEBUG("[BlockCache] Modify block %lu", index);
   map_[index]->dirty_ = true;
 }
 
@@ -127,7 +149,7 @@ DentryCache::DentryCache(size_t size) : size_(1), max_size_(size) {
 
 DentryCache::~DentryCache() {
   release_node(root_);
-  free(root_);
+  slab_free(root_);
 }
 
 DentryCache::Node* DentryCache::insert(Node* parent, const char* name, size_t name_len, uint32_t inode) {
@@ -138,6 +160,7 @@ DentryCache::Node* DentryCache::insert(Node* parent, const char* name, size_t na
   Node* new_node;
   alloc_new_node(&new_node, name, name_len);
   new_node->inode_ = inode;
+  size_++;
 
   if (parent->childs_ == nullptr) {
     new_node->next_ = new_node;
@@ -191,7 +214,8 @@ void DentryCache::remove(Node* parent, const char* name, size_t name_len) {
       parent->childs_ = (ptr == ptr->next_) ? nullptr : ptr->next_;
       prev->next_ = ptr->next_;
       release_node(ptr);
-      free(ptr);
+      slab_free(ptr);
+      size_--;
       return;
     }
     prev = ptr;
@@ -207,13 +231,22 @@ void DentryCache::release_node(Node* parent) {
   do {
     Node* next = ptr->next_;
     release_node(ptr);
-    free(ptr);
+    slab_free(ptr);
+    size_--;
     ptr = next;
   } while (ptr != parent->childs_);
 }
 
+void DentryCache::clear() {
+  DEBUG("[DentryCache] Clearing %zu entries", size_);
+  release_node(root_);
+  root_->childs_ = nullptr;
+  ASSERT(size_ == 1);
+}
+
 void DentryCache::alloc_new_node(Node** node, const char* name, size_t name_len) {
-  Node* new_node = (Node*)calloc(1, sizeof(Node) + name_len);
+  Node* new_node = (Node*)slab_alloc(sizeof(Node) + name_len);
+  memset(new_node, 0, sizeof(Node) + name_len);
   new_node->childs_ = new_node->next_ = nullptr;
   ASSERT(name_len + 1 <= EXT2_NAME_LEN);
   new_node->name_len_ = name_len;
@@ -0,0 +1,217 @@
+#include "checksum.h"
+
+#include <algorithm>
+
+#include "block.h"
+#include "utils/crc32c.h"
+
+namespace naivefs {
+
+static ChecksumTable* checksum_table = nullptr;
+
+ChecksumTable* checksums() { return checksum_table; }
+
+void set_checksums(ChecksumTable* table) { checksum_table = table; }
+
+ChecksumTable::ChecksumTable(const ext2_super_block* super)
+    : super_(super),
+      data_(super->s_feature_ro_compat & NAIVEFS_FEATURE_RO_COMPAT_DATA_CSUM),
+      table_blocks_(csum_table_blocks(super)),
+      tick_(0),
+      zeroing_(0) {
+  zero_ = (uint8_t*)alloc_aligned(BLOCKS2BYTES(table_blocks_));
+  memset(zero_, 0, BLOCKS2BYTES(table_blocks_));
+  INFO("Checksums: crc32c (%s), %s", crc32c_impl(),
+       data_ ? "metadata and data" : "metadata");
+}
+
+ChecksumTable::~ChecksumTable() {
+  for (auto& item : tables_) free(item.second.slots_);
+  free(zero_);
+}
+
+ChecksumTable::Table* ChecksumTable::table(uint32_t group, bool load) {
+  auto iter = tables_.find(group);
+  if (iter != tables_.end()) {
+    iter->second.used_ = ++tick_;
+    return &iter->second;
+  }
+  if (load && group >= num_block_groups(super_)) return nullptr;
+  if (tables_.size() >= CSUM_TABLE_CACHE) evict();
+  Table table;
+  table.slots_ = (uint32_t*)alloc_aligned(BLOCKS2BYTES(table_blocks_));
+  table.dirty_.assign(table_blocks_, !load);
+  table.zeroed_.assign(table_blocks_, false);
+  table.zeroing_.assign(table_blocks_, false);
+  table.used_ = ++tick_;
+  if (!load) {
+    memset(table.slots_, 0, BLOCKS2BYTES(table_blocks_));
+  } else if (disk_read(csum_table_offset(super_, group),
+                       BLOCKS2BYTES(table_blocks_), table.slots_) != 0) {
+    ERR("Failed to read the checksum table of group %u", group);
+    free(table.slots_);
+    return nullptr;
+  }
+  return &(tables_[group] = table);
+}
+
+void ChecksumTable::evict() {
+  // a zeroed or zeroing block is dirty too
+  auto victim = tables_.end();
+  for (auto iter = tables_.begin(); iter != tables_.end(); ++iter) {
+    const std::vector<bool>& dirty = iter->second.dirty_;
+    if (std::find(dirty.begin(), dirty.end(), true) != dirty.end()) continue;
+    if (victim == tables_.end() || iter->second.used_ < victim->second.used_)
+      victim = iter;
+  }
+  if (victim == tables_.end()) return;
+  free(victim->second.slots_);
+  tables_.erase(victim);
+}
+
+bool ChecksumTable::stale(Table* table, uint32_t block, uint32_t crc) {
+  if (table->zeroed_[block] || table->zeroing_[block]) return false;
+  // the disk copy holds no checksum of the block
+  if (!table->dirty_[block] && crc == 0) return false;
+  table->zeroing_[block] = true;
+  table->dirty_[block] = true;
+  ++zeroing_;
+  return true;
+}
+
+void ChecksumTable::zero(std::unique_lock<std::mutex>& lck,
+                         std::vector<std::pair<uint32_t, uint32_t>>* blocks) {
+  std::sort(blocks->begin(), blocks->end());
+  // the marked blocks are dirty, their tables stay while mutex_ is released
+  lck.unlock();
+  std::vector<bool> done(blocks->size(), false);
+  for (size_t i = 0, n; i < blocks->size(); i += n) {
+    uint32_t group = (*blocks)[i].first;
+    uint32_t first = (*blocks)[i].second;
+    n = 1;
+    while (i + n < blocks->size() && (*blocks)[i + n].first == group &&
+           (*blocks)[i + n].second == first + n)
+      ++n;
+    if (disk_write(csum_table_offset(super_, group) + BLOCKS2BYTES(first),
+                   BLOCKS2BYTES(n), zero_) != 0) {
+      ERR("Failed to zero blocks %u-%u of the checksum table of group %u",
+          first, first + (uint32_t)n - 1, group);
+      continue;
+    }
+    std::fill(done.begin() + i, done.begin() + i + n, true);
+  }
+  lck.lock();
+  for (size_t i = 0; i < blocks->size(); ++i) {
+    Table& table = tables_[(*blocks)[i].first];
+    table.zeroing_[(*blocks)[i].second] = false;
+    if (done[i]) table.zeroed_[(*blocks)[i].second] = true;
+  }
+  zeroing_ -= blocks->size();
+  zeroed_.notify_all();
+}
+
+uint32_t* ChecksumTable::slot(off_t offset, uint32_t* group,
+                              uint32_t* index) {
+  if (!csum_slot(super_, offset, group, index)) return nullptr;
+  Table* table = this->table(*group, true);
+  if (table == nullptr) return nullptr;
+  return table->slots_ + *index;
+}
+
+bool ChecksumTable::verify(off_t offset, const uint8_t* data) {
+  uint32_t crc = crc32c(0, data, BLOCK_SIZE);
+  uint32_t group, index;
+  std::lock_guard<std::mutex> lck(mutex_);
+  uint32_t* slot = this->slot(offset, &group, &index);
+  if (slot == nullptr || *slot == 0 || *slot == crc) return true;
+  ERR("Checksum mismatch of the block at 0x%jx (group %u, slot %u): "
+      "%08x on disk, %08x recorded",
+      (intmax_t)offset, group, index, crc, *slot);
+  stat_add(STAT_CSUM_ERRORS);
+  return false;
+}
+
+void ChecksumTable::update(off_t offset, const uint8_t* data) {
+  uint32_t crc = crc32c(0, data, BLOCK_SIZE);
+  uint32_t group, index;
+  std::unique_lock<std::mutex> lck(mutex_);
+  uint32_t* slot;
+  Table* table;
+  uint32_t block;
+  // looked up again after waiting, the table may have been flushed and
+  // dropped meanwhile
+  for (;;) {
+    slot = this->slot(offset, &group, &index);
+    if (slot == nullptr || *slot == crc) return;
+    table = &tables_[group];
+    block = index * sizeof(uint32_t) / BLOCK_SIZE;
+    if (!table->zeroing_[block]) break;
+    zeroed_.wait(lck);
+  }
+  // the block is written before the table: if the disk copy of the table may
+  // hold a checksum of the block, zero it first so a crash leaves no stale
+  // one. A writeback has prepare() zero them all at once.
+  if (stale(table, block, *slot)) {
+    std::vector<std::pair<uint32_t, uint32_t>> blocks{{group, block}};
+    zero(lck, &blocks);
+  }
+  *slot = crc;
+  table->dirty_[block] = true;
+}
+
+void ChecksumTable::prepare(const std::vector<off_t>& offsets) {
+  std::vector<std::pair<uint32_t, uint32_t>> stale_blocks;
+  std::unique_lock<std::mutex> lck(mutex_);
+  for (off_t offset : offsets) {
+    uint32_t group, index;
+    uint32_t* slot = this->slot(offset, &group, &index);
+    if (slot == nullptr) continue;
+    uint32_t table_block = index * sizeof(uint32_t) / BLOCK_SIZE;
+    if (stale(&tables_[group], table_block, *slot))
+      stale_blocks.emplace_back(group, table_block);
+  }
+  if (!stale_blocks.empty()) zero(lck, &stale_blocks);
+}
+
+void ChecksumTable::clear(off_t offset) {
+  uint32_t group, index;
+  std::lock_guard<std::mutex> lck(mutex_);
+  uint32_t* slot = this->slot(offset, &group, &index);
+  if (slot == nullptr || *slot == 0) return;
+  *slot = 0;
+  tables_[group].dirty_[index * sizeof(uint32_t) / BLOCK_SIZE] = true;
+}
+
+void ChecksumTable::init_group(uint32_t index) {
+  std::lock_guard<std::mutex> lck(mutex_);
+  auto iter = tables_.find(index);
+  if (iter != tables_.end()) {
+    free(iter->second.slots_);
+    tables_.erase(iter);
+  }
+  table(index, false);
+}
+
+int ChecksumTable::flush() {
+  std::unique_lock<std::mutex> lck(mutex_);
+  // a zero landing after the table would lose its checksums
+  zeroed_.wait(lck, [this] { return zeroing_ == 0; });
+  for (auto& item : tables_) {
+    Table& table = item.second;
+    off_t offset = csum_table_offset(super_, item.first);
+    // each run of changed blocks at once
+    for (uint32_t i = 0, n; i < table_blocks_; i += n) {
+      n = 1;
+      if (!table.dirty_[i]) continue;
+      while (i + n < table_blocks_ && table.dirty_[i + n]) ++n;
+      int ret = disk_write(offset + BLOCKS2BYTES(i), BLOCKS2BYTES(n),
+                           (uint8_t*)table.slots_ + BLOCKS2BYTES(i));
+      if (ret < 0) return ret;
+      for (uint32_t j = i; j < i + n; ++j)
+        table.dirty_[j] = table.zeroed_[j] = false;
+    }
+  }
+  return 0;
+}
+
+}  // namespace naivefs
@@ -0,0 +1,38 @@
+#include "compress.h"
+
+#include <string.h>
+
+#include "utils/crc32c.h"
+#include "utils/lz.h"
+
+namespace naivefs {
+
+uint32_t compress_cluster(const uint8_t* data, uint8_t* packed) {
+  cluster_header* header = reinterpret_cast<cluster_header*>(packed);
+  // at least one block smaller
+  size_t capacity = CLUSTER_BYTES - BLOCK_SIZE - sizeof(cluster_header);
+  size_t size = lz_compress(data, CLUSTER_BYTES, header + 1, capacity);
+  if (size == 0) return 0;
+  header->ch_magic = CLUSTER_MAGIC;
+  header->ch_size = size;
+  header->ch_checksum = crc32c(0, header + 1, size);
+  header->ch_reserved = 0;
+  size += sizeof(cluster_header);
+  // the tail of the last block is written too
+  uint32_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  memset(packed + size, 0, (size_t)blocks * BLOCK_SIZE - size);
+  return blocks;
+}
+
+bool decompress_cluster(const uint8_t* packed, uint32_t blocks, uint8_t* data) {
+  const cluster_header* header = reinterpret_cast<const cluster_header*>(packed);
+  if (header->ch_magic != CLUSTER_MAGIC ||
+      header->ch_size > (size_t)blocks * BLOCK_SIZE - sizeof(cluster_header))
+    return false;
+  if (crc32c(0, header + 1, header->ch_size) != header->ch_checksum)
+    return false;
+  return lz_decompress(header + 1, header->ch_size, data, CLUSTER_BYTES) ==
+         CLUSTER_BYTES;
+}
+
+}  // namespace naivefs
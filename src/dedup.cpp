@@ -0,0 +1,128 @@
+#include "dedup.h"
+
+#include "filesystem.h"
+
+namespace naivefs {
+
+#define DEDUP_SET_SIZE (DEDUP_WAYS * sizeof(dedup_entry))
+#define DEDUP_MAX_REFS UINT16_MAX
+
+DedupIndex::DedupIndex(FileSystem* fs, const ext2_super_block* super)
+    : fs_(fs),
+      super_(super),
+      sets_per_block_(BLOCK_SIZE / DEDUP_SET_SIZE),
+      sets_((uint64_t)super->s_dedup_groups * dedup_index_blocks(super) *
+            sets_per_block_),
+      victim_(0),
+      buf_((uint8_t*)alloc_aligned(BLOCK_SIZE)) {
+  INFO("Dedup: %lu index entries in %u groups", sets_ * DEDUP_WAYS,
+       super->s_dedup_groups);
+}
+
+DedupIndex::~DedupIndex() { free(buf_); }
+
+bool DedupIndex::locate(uint64_t hash, uint32_t* block, uint32_t* offset) {
+  if (sets_ == 0) return false;
+  uint64_t set = hash % sets_;
+  uint64_t sets_per_group =
+      (uint64_t)dedup_index_blocks(super_) * sets_per_block_;
+  uint32_t group = set / sets_per_group;
+  uint32_t inner = set % sets_per_group;
+  *block = group * super_->s_blocks_per_group +
+           dedup_table_start(super_, group) + dedup_ref_blocks(super_) +
+           inner / sets_per_block_;
+  *offset = inner % sets_per_block_ * DEDUP_SET_SIZE;
+  return true;
+}
+
+bool DedupIndex::locate_refs(uint32_t index, uint32_t* block,
+                             uint32_t* offset) {
+  uint32_t group = index / super_->s_blocks_per_group;
+  uint32_t inner = index % super_->s_blocks_per_group;
+  if (inner >= data_blocks_per_group(super_)) return false;
+  *block = group * super_->s_blocks_per_group +
+           dedup_table_start(super_, group) +
+           inner * sizeof(uint16_t) / BLOCK_SIZE;
+  *offset = inner * sizeof(uint16_t) % BLOCK_SIZE;
+  return true;
+}
+
+bool DedupIndex::get_refs(uint32_t index, uint16_t* refs) {
+  uint32_t block, offset;
+  Block* blk;
+  return locate_refs(index, &block, &offset) &&
+         fs_->get_block(block, &blk, false, offset, (char*)refs,
+                        sizeof(uint16_t));
+}
+
+bool DedupIndex::set_refs(uint32_t index, uint16_t refs) {
+  uint32_t block, offset;
+  Block* blk;
+  return locate_refs(index, &block, &offset) &&
+         fs_->get_block(block, &blk, true, offset, (const char*)&refs,
+                        sizeof(uint16_t));
+}
+
+bool DedupIndex::share(uint64_t hash, const uint8_t* data, uint32_t* index) {
+  dedup_entry set[DEDUP_WAYS] = {};
+  uint32_t block, offset;
+  Block* blk;
+  hash = hash ? hash : 1;
+  if (!locate(hash, &block, &offset) ||
+      !fs_->get_block(block, &blk, false, offset, (char*)set, sizeof(set)))
+    return false;
+  for (const auto& entry : set) {
+    uint16_t refs = 0;
+    if (entry.de_hash != hash || !get_refs(entry.de_block, &refs) ||
+        refs == 0 || refs == DEDUP_MAX_REFS)
+      continue;
+    // the same hash may still be other data
+    if (!fs_->get_block(entry.de_block, &blk, false, 0, (char*)buf_,
+                        BLOCK_SIZE, true) ||
+        memcmp(buf_, data, BLOCK_SIZE) != 0)
+      continue;
+    if (!set_refs(entry.de_block, refs + 1)) return false;
+    *index = entry.de_block;
+    return true;
+  }
+  return false;
+}
+
+void DedupIndex::insert(uint64_t hash, uint32_t index) {
+  dedup_entry set[DEDUP_WAYS] = {};
+  uint32_t block, offset;
+  Block* blk;
+  hash = hash ? hash : 1;
+  if (!locate(hash, &block, &offset) ||
+      !fs_->get_block(block, &blk, false, offset, (char*)set, sizeof(set)) ||
+      !set_refs(index, 1))
+    return;
+  // an entry of the hash is replaced, then a free one, then in turns
+  uint32_t way = 0;
+  while (way < DEDUP_WAYS && set[way].de_hash != hash) ++way;
+  if (way == DEDUP_WAYS) {
+    way = 0;
+    while (way < DEDUP_WAYS && set[way].de_hash != 0) ++way;
+  }
+  if (way == DEDUP_WAYS) way = victim_++ % DEDUP_WAYS;
+  dedup_entry entry = {hash, index, 0};
+  fs_->get_block(block, &blk, true, offset + way * sizeof(dedup_entry),
+                 (const char*)&entry, sizeof(entry));
+}
+
+bool DedupIndex::release(uint32_t index) {
+  uint16_t refs = 0;
+  if (!get_refs(index, &refs) || refs == 0) return false;
+  set_refs(index, refs - 1);
+  return refs > 1;
+}
+
+bool DedupIndex::exclusive(uint32_t index) {
+  uint16_t refs = 0;
+  if (!get_refs(index, &refs) || refs == 0) return true;
+  if (refs > 1) return false;
+  set_refs(index, 0);
+  return true;
+}
+
+}  // namespace naivefs
@@ -0,0 +1,60 @@
+#include "discard.h"
+
+#include <chrono>
+
+#include "common.h"
+
+namespace naivefs {
+
+DiscardQueue::DiscardQueue(const Discarder& discarder)
+    : discarder_(discarder), pending_(0), stop_(false) {
+  thread_ = std::thread([this]() { run(); });
+}
+
+DiscardQueue::~DiscardQueue() {
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+}
+
+void DiscardQueue::add(uint32_t index) {
+  std::lock_guard<std::mutex> lck(mutex_);
+  auto next = runs_.lower_bound(index);
+  if (next != runs_.end() && next->first == index) return;
+  auto prev = next == runs_.begin() ? runs_.end() : std::prev(next);
+  // already pending
+  if (prev != runs_.end() && prev->first + prev->second > index) return;
+  bool joins_prev = prev != runs_.end() && prev->first + prev->second == index;
+  bool joins_next = next != runs_.end() && next->first == index + 1;
+  uint32_t len = 1 + (joins_next ? next->second : 0);
+  if (joins_prev)
+    prev->second += len;
+  else
+    runs_[index] = len;
+  if (joins_next) runs_.erase(next);
+  if (++pending_ == 1 || pending_ == DISCARD_BATCH_BLOCKS) wake_.notify_one();
+}
+
+void DiscardQueue::run() {
+  std::unique_lock<std::mutex> lck(mutex_);
+  while (true) {
+    wake_.wait(lck, [this]() { return stop_ || pending_ > 0; });
+    if (!stop_)
+      wake_.wait_for(lck, std::chrono::milliseconds(DISCARD_INTERVAL_MS),
+                     [this]() {
+                       return stop_ || pending_ >= DISCARD_BATCH_BLOCKS;
+                     });
+    std::map<uint32_t, uint32_t> runs;
+    runs.swap(runs_);
+    pending_ = 0;
+    lck.unlock();
+    for (auto& run : runs) discarder_(run.first, run.second);
+    lck.lock();
+    if (stop_ && runs_.empty()) return;
+  }
+}
+
+}  // namespace naivefs
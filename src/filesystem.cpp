@@ -1,7 +1,20 @@
 #include "filesystem.h"
 
+#include <sched.h>
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include "compress.h"
+
 namespace naivefs {
 
+// longest run of group metadata written back at once
+#define FLUSH_RUN_BLOCKS 256
+// groups past the goal group searched for a whole run of blocks
+#define RUN_SCAN_GROUPS 16
+
 /**
  * @brief Initialize a new inode
  *
@@ -47,14 +60,28 @@ static void inode_display(ext2_inode* inode) {
   }
 }
 
-FileSystem::FileSystem()
-    : super_block_(new SuperBlock()),
-      block_cache_(new BlockCache(BLOCK_CACHE_SIZE)),
-      dentry_cache_(new DentryCache(BLOCK_CACHE_SIZE)) {
+FileSystem::FileSystem(const options& opts)
+    : snapshots_(new SnapshotManager(disk_name())),
+      super_block_(new SuperBlock()),
+      block_cache_(new BlockCache(opts.cache_blocks ? opts.cache_blocks
+                                                    : BLOCK_CACHE_SIZE)),
+      cache_lock_(STAT_BLOCK_LOCK_WAIT),
+      dentry_cache_(new DentryCache(opts.dentry_cache ? opts.dentry_cache
+                                                      : DENTRY_CACHE_SIZE)) {
   DEBUG("Initialize file system");
+  reserved_blocks_ = 0;
+  folded_free_blocks_ = 0;
+  mount_opts_ = opts.noreservation ? 0 : EXT2_MOUNT_RESERVATION;
+  discards_ = nullptr;
+  dedup_ = nullptr;
+  n_contexts_ = std::max(1u, std::thread::hardware_concurrency());
+  contexts_ = new AllocContext[n_contexts_];
+  if (error() < 0) return;
 
   // init first block group
-  block_groups_[0] = new BlockGroup(super_block_->get_group_desc(0));
+  block_groups_[0] = new BlockGroup(super_block_->get_group_desc(0),
+                                    super_block_->get_super(), 0,
+                                    super_block_->formatted());
 
   // init root inode
   if (!block_groups_[0]->get_inode(ROOT_INODE, &root_inode_)) {
@@ -73,42 +100,146 @@ FileSystem::FileSystem()
   }
 
   block_groups_[0]->flush();
+
+  // the summary of free space, groups are then loaded when allocated from
+  for (uint32_t i = 0; i < super_block_->num_block_groups(); ++i)
+    update_free_space(i);
+  // the blocks taken by the root directory are in its descriptor now
+  fold_alloc_contexts();
+  if (opts.discard) {
+    discards_ = new DiscardQueue([this](uint32_t first, uint32_t count) {
+      discard_blocks(first, count);
+    });
+  }
+  if (has_dedup(super_block_->get_super()))
+    dedup_ = new DedupIndex(this, super_block_->get_super());
   DEBUG("File system has been initialized");
 }
 
 FileSystem::~FileSystem() {
-  super_block_->flush();
-  delete super_block_;
-
-  for (auto bg : block_groups_) {
-    bg.second->flush();
-    delete bg.second;
+  if (error() < 0) {
+    // nothing was loaded, nothing is written back
+    delete[] contexts_;
+    delete super_block_;
+    delete block_cache_;
+    delete dentry_cache_;
+    delete snapshots_;
+    return;
   }
+  while (!windows_.empty()) discard_window(windows_.begin()->first);
+  // the blocks freed last are discarded before the groups go away
+  delete discards_;
+  delete dedup_;
+  prepare_checksums();
+  flush_super_block();
+  delete[] contexts_;
+
+  flush_block_groups();
+  for (auto bg : block_groups_) delete bg.second;
 
   block_cache_->flush();
+  // the checksums of everything written above
+  super_block_->flush_checksums();
+  delete super_block_;
   delete block_cache_;
   delete dentry_cache_;
+  delete snapshots_;
 }
 
 void FileSystem::flush() {
-  super_block_->flush();
-
-  for (auto bg : block_groups_) {
-    bg.second->flush();
-  }
+  prepare_checksums();
+  flush_super_block();
+  flush_block_groups();
 
+  cache_lock_.lock();
   block_cache_->flush();
+  cache_lock_.unlock();
+  super_block_->flush_checksums();
+  disk_sync();
+  snapshots_->sync();
 }
 
 
 void FileSystem::flush(uint32_t inode_index) {
-  super_block_->flush();
+  prepare_checksums();
+  flush_super_block();
+  flush_block_groups();
 
-  for (auto bg : block_groups_) {
-    bg.second->flush();
+  cache_lock_.lock();
+  block_cache_->flush(inode_index);
+  cache_lock_.unlock();
+  super_block_->flush_checksums();
+}
+
+RetCode FileSystem::snapshot_prepare(const char* name, size_t name_len,
+                                     Snapshot** snapshot,
+                                     std::vector<uint8_t>* bitmaps) {
+  flush();
+  RetCode ret = snapshots_->prepare(name, name_len, snapshot);
+  if (ret) return ret;
+  if (!copy_block_bitmaps(bitmaps, false)) {
+    snapshots_->abandon(*snapshot);
+    return FS_ALLOC_ERR;
   }
+  return FS_SUCCESS;
+}
 
-  block_cache_->flush(inode_index);
+void FileSystem::snapshot_freeze(Snapshot* snapshot,
+                                 std::vector<uint8_t>* bitmaps) {
+  // everything written before this point belongs to the snapshot
+  fold_alloc_contexts();
+  copy_block_bitmaps(bitmaps, true);
+  std::vector<Block*> blocks;
+  super_block_->get_metadata(&blocks);
+  {
+    std::shared_lock<std::shared_mutex> lck(groups_lock_);
+    for (auto bg : block_groups_) bg.second->get_metadata(&blocks);
+  }
+  {
+    std::shared_lock<TimedSharedMutex> lck(cache_lock_);
+    // the decompressed blocks of clusters are not on the disk
+    block_cache_->visit_dirty([&blocks](uint64_t index, Block* block) {
+      if (index <= UINT32_MAX) blocks.push_back(block);
+    });
+  }
+  FrozenBlocks frozen;
+  for (auto block : blocks) {
+    std::unique_ptr<uint8_t[]>& data = frozen[block->offset()];
+    data.reset(new uint8_t[BLOCK_SIZE]);
+    memcpy(data.get(), block->get(), BLOCK_SIZE);
+  }
+  snapshots_->freeze(snapshot, super(), bitmaps, &frozen);
+}
+
+bool FileSystem::copy_block_bitmaps(std::vector<uint8_t>* bitmaps,
+                                    bool loaded) {
+  uint32_t n = super_block_->num_block_groups();
+  // groups are only added, and loaded to be changed
+  bitmaps->resize((size_t)n * BLOCK_SIZE);
+  uint8_t* buf = nullptr;
+  std::shared_lock<std::shared_mutex> lck(groups_lock_);
+  for (uint32_t i = 0; i < n; ++i) {
+    uint8_t* data = bitmaps->data() + (size_t)i * BLOCK_SIZE;
+    auto iter = block_groups_.find(i);
+    if (loaded) {
+      if (iter != block_groups_.end()) iter->second->copy_block_bitmap(data);
+      continue;
+    }
+    if (iter != block_groups_.end()) continue;
+    if (buf == nullptr) buf = (uint8_t*)alloc_aligned(BLOCK_SIZE);
+    if (disk_read(block_bitmap_offset(super_block_->get_group_desc(i)),
+                  BLOCK_SIZE, buf) < 0) {
+      free(buf);
+      return false;
+    }
+    memcpy(data, buf, BLOCK_SIZE);
+  }
+  free(buf);
+  return true;
+}
+
+RetCode FileSystem::snapshot_delete(const char* name, size_t name_len) {
+  return snapshots_->remove(name, name_len);
 }
 
 RetCode FileSystem::inode_create(const Path& path, ext2_inode** inode,
@@ -118,8 +249,10 @@ RetCode FileSystem::inode_create(const Path& path, ext2_inode** inode,
   if (path.empty()) return FS_DUP_ERR;
 
   ext2_inode* parent;
+  uint32_t parent_index;
   if (!inode_index_result) return FS_NULL_ERR;
-  RetCode lookup_ret = inode_lookup(Path(path, path.size() - 1), &parent);
+  RetCode lookup_ret =
+      inode_lookup(Path(path, path.size() - 1), &parent, &parent_index);
   if (lookup_ret) return lookup_ret;
   if (!S_ISDIR(parent->i_mode)) return FS_NDIR_ERR;
 
@@ -141,11 +274,17 @@ RetCode FileSystem::inode_create(const Path& path, ext2_inode** inode,
   }
 
   // allocate new inode
-  if (!alloc_inode(inode, &inode_index, mode)) return FS_ALLOC_ERR;
+  if (!alloc_inode(inode, &inode_index, mode, parent_index))
+    return FS_ALLOC_ERR;
+  // small files and directories start inline and move to blocks as they
+  // grow, and are compressed or deduplicated in a directory that is
+  if (S_ISREG(mode) || S_ISDIR(mode))
+    (*inode)->i_flags |= EXT2_INLINE_DATA_FL |
+                         (parent->i_flags & (EXT2_COMPR_FL | EXT2_DEDUP_FL));
 
   RetCode dentry_ret =
-      dentry_create(last_block, last_block_index, parent, last_item.first,
-                    last_item.second, inode_index, mode);
+      dentry_create(last_block, last_block_index, parent, parent_index,
+                    last_item.first, last_item.second, inode_index, mode);
   if (dentry_ret) return dentry_ret;
 
   DEBUG("Create inode: %i,%s", inode_index,
@@ -155,11 +294,23 @@ RetCode FileSystem::inode_create(const Path& path, ext2_inode** inode,
 }
 
 RetCode FileSystem::dentry_create(Block* last_block, uint32_t last_block_index,
-                                  ext2_inode* parent, const char* name,
-                                  size_t name_len, uint32_t inode_index,
-                                  mode_t mode) {
+                                  ext2_inode* parent, uint32_t parent_index,
+                                  const char* name, size_t name_len,
+                                  uint32_t inode_index, mode_t mode) {
+  if (INODE_IS_INLINE(parent)) {
+    InlineBlock inline_block(parent);
+    DentryBlock inline_dentries(&inline_block);
+    if (inline_dentries.size() + sizeof(ext2_dir_entry_2) + name_len <=
+        INLINE_DATA_SIZE) {
+      inline_dentries.alloc_dentry(name, name_len, inode_index, mode);
+      return FS_SUCCESS;
+    }
+    // the directory outgrows i_block
+    if (!inline_to_block(parent, parent_index, &last_block, &last_block_index))
+      return FS_ALLOC_ERR;
+  }
   if (last_block == nullptr) {
-    if (!alloc_block(&last_block, &last_block_index, parent)) {
+    if (!alloc_block(&last_block, &last_block_index, parent, parent_index)) {
       return FS_ALLOC_ERR;
     }
   }
@@ -167,7 +318,7 @@ RetCode FileSystem::dentry_create(Block* last_block, uint32_t last_block_index,
 
   // update dentry block
   if (dentry_block->size() + sizeof(ext2_dir_entry_2) + name_len > BLOCK_SIZE) {
-    if (!alloc_block(&last_block, &last_block_index, parent))
+    if (!alloc_block(&last_block, &last_block_index, parent, parent_index))
       return FS_ALLOC_ERR;
     delete dentry_block;
     dentry_block = new DentryBlock(last_block);
@@ -191,6 +342,8 @@ RetCode FileSystem::inode_lookup(const Path& path, ext2_inode** inode,
     if (cache_ptr != nullptr) *cache_ptr = nullptr;
     return FS_SUCCESS;
   }
+  // no cache node is held across lookups, so a full cache can start over
+  if (dentry_cache_->full()) dentry_cache_->clear();
   DentryCache::Node* link = nullptr;
   DentryCache::Node* node = nullptr;
   DentryCache::Node* parent = nullptr;
@@ -272,7 +425,9 @@ RetCode FileSystem::inode_lookup(ext2_inode* parent, const char* name,
       if (inode_index != nullptr) *inode_index = dentry->inode;
     }
 
-    if (last_block != nullptr) *last_block = block;
+    // inline dentries are not a block that can be appended to
+    if (last_block != nullptr)
+      *last_block = index == INLINE_BLOCK_INDEX ? nullptr : block;
     if (last_block_index != nullptr) *last_block_index = index;
     return false;
   };
@@ -298,15 +453,13 @@ RetCode FileSystem::inode_delete(uint32_t index) {
           }
           return false;
         });
-  } else {
-    visit_inode_blocks(
-        inode, [this](uint32_t index, __attribute__((unused)) Block* block) {
-          free_block(index);
-          return false;
-        });
   }
+  // the indirect blocks along with the data blocks
+  if (!INODE_IS_INLINE(inode)) free_block_map(inode);
 
+  discard_window(index);
   free_inode(index);
+  if (delete_hook_) delete_hook_(index);
   return FS_SUCCESS;
 }
 
@@ -383,7 +536,8 @@ RetCode FileSystem::inode_link(const Path& src, const Path& dst) {
   if (S_ISDIR(src_inode->i_mode)) return FS_DIR_ERR;
 
   ext2_inode* parent;
-  lookup_ret = inode_lookup(Path(dst, dst.size() - 1), &parent);
+  uint32_t parent_index;
+  lookup_ret = inode_lookup(Path(dst, dst.size() - 1), &parent, &parent_index);
   if (lookup_ret) return lookup_ret;
   if (!S_ISDIR(parent->i_mode)) return FS_NDIR_ERR;
 
@@ -404,8 +558,9 @@ RetCode FileSystem::inode_link(const Path& src, const Path& dst) {
   // Inode index will bot be changed after looking up source inode if name to
   // create is not in duplicate with existing dentries.
   RetCode dentry_ret =
-      dentry_create(last_block, last_block_index, parent, last_item.first,
-                    last_item.second, inode_index, src_inode->i_mode);
+      dentry_create(last_block, last_block_index, parent, parent_index,
+                    last_item.first, last_item.second, inode_index,
+                    src_inode->i_mode);
   if (dentry_ret) return dentry_ret;
 
   // update source inode
@@ -438,6 +593,11 @@ void FileSystem::visit_inode_blocks(ext2_inode* inode,
                                     const BlockVisitor& visitor) {
   ASSERT(inode != nullptr &&
          (S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode)));
+  if (INODE_IS_INLINE(inode)) {
+    InlineBlock inline_block(inode);
+    visitor(INLINE_BLOCK_INDEX, &inline_block);
+    return;
+  }
   uint32_t num_blocks = super_block_->num_aligned_blocks(inode->i_blocks);
   if (num_blocks == 0) return;
   Block* block = nullptr;
@@ -501,6 +661,367 @@ error_occured:
   return;
 }
 
+bool FileSystem::visit_block_map(ext2_inode* inode,
+                                 const MapVisitor& visitor) {
+  ASSERT(inode != nullptr &&
+         (S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode)));
+  if (INODE_IS_INLINE(inode)) return true;
+  uint32_t left = num_blocks(inode);
+  for (int i = 0; i < EXT2_N_BLOCKS && left > 0; ++i) {
+    int level = i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_IND_BLOCK + 1;
+    if (!visit_map_level(inode->i_block[i], level, &left, visitor))
+      return false;
+  }
+  return true;
+}
+
+bool FileSystem::visit_map_level(uint32_t index, int level, uint32_t* left,
+                                 const MapVisitor& visitor) {
+  if (level == 0) {
+    --*left;
+    return index == EXT2_COMPRESSED_BLKADDR || !visitor(index, level);
+  }
+  // a copy, the indirect block may leave the cache while its blocks are
+  // visited
+  uint32_t entries[NUM_INDIRECT_BLOCKS] = {};
+  Block* block;
+  if (!get_block(index, &block, false, 0, reinterpret_cast<char*>(entries),
+                 BLOCK_SIZE))
+    return false;
+  for (uint32_t i = 0; i < NUM_INDIRECT_BLOCKS && *left > 0; ++i) {
+    if (!visit_map_level(entries[i], level - 1, left, visitor)) return false;
+  }
+  return !visitor(index, level);
+}
+
+uint32_t FileSystem::count_extents(ext2_inode* inode) {
+  uint32_t extents = 0;
+  int64_t last = -1;
+  visit_block_map(inode, [&extents, &last](uint32_t index, int level) {
+    if (level > 0) return false;
+    if (index != last + 1) ++extents;
+    last = index;
+    return false;
+  });
+  return extents;
+}
+
+RetCode FileSystem::defrag_copy(ext2_inode* inode, uint32_t inode_index,
+                                ext2_inode* donor) {
+  uint32_t count = num_blocks(inode);
+  // room for the indirect blocks too, the reserved blocks of delayed
+  // allocation are not touched
+  uint32_t needed = count + count / NUM_INDIRECT_BLOCKS + EXT2_N_BLOCKS;
+  if (!reserve_blocks(needed)) return FS_ALLOC_ERR;
+  // in the group of the inode, else in the group with the most free blocks
+  uint32_t first;
+  uint32_t len = alloc_run(inode_index / super_block_->inodes_per_group() *
+                               super_block_->blocks_per_group(),
+                           count, &first);
+  if (len < count) {
+    for (uint32_t i = 0; i < len; ++i) free_block(first + i);
+    int64_t group;
+    {
+      std::lock_guard<std::mutex> lck(free_space_lock_);
+      group = free_space_.most_free(FREE_BLOCKS);
+    }
+    len = group < 0 ? 0
+                    : alloc_run(group * super_block_->blocks_per_group(),
+                                count, &first);
+  }
+  if (len < count) {
+    for (uint32_t i = 0; i < len; ++i) free_block(first + i);
+    release_blocks(needed);
+    return FS_ALLOC_ERR;
+  }
+
+  memcpy(donor, inode, sizeof(ext2_inode));
+  memset(donor->i_block, 0, sizeof(donor->i_block));
+  donor->i_blocks = 0;
+  cache_new_blocks(first, count);
+  uint8_t* buf = (uint8_t*)BufferPool::block_pool()->alloc();
+  uint32_t copied = 0;
+  bool done = visit_block_map(inode, [&](uint32_t index, int level) {
+    if (level > 0) return false;
+    Block* block;
+    char* data = reinterpret_cast<char*>(buf);
+    if (!get_block(index, &block, false, 0, data, BLOCK_SIZE, true) ||
+        !get_block(first + copied, &block, true, 0, data, BLOCK_SIZE, true) ||
+        !append_block(donor, first + copied))
+      return true;
+    ++copied;
+    return false;
+  });
+  BufferPool::block_pool()->free(buf);
+  release_blocks(needed);
+  if (!done) {
+    WARNING("Failed to copy the blocks of inode %u", inode_index);
+    free_block_map(donor);
+    while (copied < count) free_block(first + copied++);
+    return FS_ALLOC_ERR;
+  }
+  return FS_SUCCESS;
+}
+
+void FileSystem::free_block_map(ext2_inode* inode) {
+  visit_block_map(inode, [this](uint32_t index, __attribute__((unused)) int) {
+    free_block(index);
+    return false;
+  });
+}
+
+bool FileSystem::map_entry(ext2_inode* inode, uint32_t file_block,
+                           uint32_t* holder, uint32_t* slot) {
+  if (file_block < MAX_DIR_BLOCKS) {
+    *holder = 0;
+    *slot = file_block;
+    return true;
+  }
+  // walk down the indirect blocks, one level per iteration
+  uint32_t level, span;
+  file_block -= MAX_DIR_BLOCKS;
+  if (file_block < MAX_IND_BLOCKS) {
+    level = EXT2_IND_BLOCK, span = 1;
+  } else if ((file_block -= MAX_IND_BLOCKS) < MAX_DIND_BLOCKS) {
+    level = EXT2_DIND_BLOCK, span = MAX_IND_BLOCKS;
+  } else {
+    file_block -= MAX_DIND_BLOCKS;
+    level = EXT2_TIND_BLOCK, span = MAX_DIND_BLOCKS;
+  }
+  uint32_t curr = inode->i_block[level];
+  for (; span > 1; span /= NUM_INDIRECT_BLOCKS) {
+    Block* block;
+    if (!get_block(curr, &block, false, file_block / span * sizeof(uint32_t),
+                   reinterpret_cast<char*>(&curr), sizeof(uint32_t)))
+      return false;
+    file_block %= span;
+  }
+  *holder = curr;
+  *slot = file_block;
+  return true;
+}
+
+bool FileSystem::lookup_block(ext2_inode* inode, uint32_t file_block,
+                              uint32_t* index) {
+  uint32_t holder, slot;
+  if (!map_entry(inode, file_block, &holder, &slot)) return false;
+  if (holder == 0) {
+    *index = inode->i_block[slot];
+    return true;
+  }
+  Block* block;
+  return get_block(holder, &block, false, slot * sizeof(uint32_t),
+                   reinterpret_cast<char*>(index), sizeof(uint32_t));
+}
+
+bool FileSystem::remap_block(ext2_inode* inode, uint32_t file_block,
+                             uint32_t index) {
+  uint32_t holder, slot;
+  if (!map_entry(inode, file_block, &holder, &slot)) return false;
+  if (holder == 0) {
+    inode->i_block[slot] = index;
+    return true;
+  }
+  Block* block;
+  return get_block(holder, &block, true, slot * sizeof(uint32_t),
+                   reinterpret_cast<char*>(&index), sizeof(uint32_t));
+}
+
+bool FileSystem::compressed_cluster(ext2_inode* inode, uint32_t cluster,
+                                    uint32_t* head) {
+  if (!(inode->i_flags & EXT2_COMPRBLK_FL)) return false;
+  uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+  uint32_t last;
+  if (first + COMPRESS_CLUSTER_BLOCKS > num_blocks(inode) ||
+      !lookup_block(inode, first + COMPRESS_CLUSTER_BLOCKS - 1, &last) ||
+      last != EXT2_COMPRESSED_BLKADDR)
+    return false;
+  return lookup_block(inode, first, head);
+}
+
+bool FileSystem::store_cluster(ext2_inode* inode, uint32_t inode_index,
+                               uint32_t cluster, const uint8_t* data) {
+  uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+  ASSERT(num_blocks(inode) >= first);
+  uint32_t mapped = std::min(num_blocks(inode) - first,
+                             (uint32_t)COMPRESS_CLUSTER_BLOCKS);
+  uint32_t old[COMPRESS_CLUSTER_BLOCKS];
+  for (uint32_t i = 0; i < mapped; ++i) {
+    if (!lookup_block(inode, first + i, &old[i])) return false;
+  }
+  std::unique_ptr<uint8_t[]> packed(new uint8_t[CLUSTER_BYTES]);
+  uint32_t n = compress_cluster(data, packed.get());
+  const uint8_t* src = n ? packed.get() : data;
+  if (n == 0) n = COMPRESS_CLUSTER_BLOCKS;
+
+  // new blocks, the old ones are still read until the map is switched
+  uint32_t entries[COMPRESS_CLUSTER_BLOCKS];
+  uint32_t got = 0;
+  uint32_t goal = block_goal(inode, inode_index);
+  while (got < n) {
+    uint32_t index;
+    uint32_t len = alloc_run(goal, n - got, &index);
+    if (len > 0) {
+      cache_new_blocks(index, len);
+    } else {
+      Block* block;
+      if (!alloc_block(&block, &index, goal)) break;
+      len = 1;
+    }
+    for (uint32_t i = 0; i < len; ++i) entries[got++] = index + i;
+    goal = index + len;
+  }
+  if (got < n) {
+    for (uint32_t i = 0; i < got; ++i) free_block(entries[i]);
+    return false;
+  }
+  for (uint32_t i = 0; i < n; ++i) {
+    // the new blocks are in the block cache
+    Block* block;
+    if (!get_block(entries[i], &block, true, 0,
+                   reinterpret_cast<const char*>(src) + BLOCKS2BYTES(i),
+                   BLOCK_SIZE, true)) {
+      WARNING("Failed to write cluster %u of inode %u", cluster, inode_index);
+      for (uint32_t j = 0; j < n; ++j) free_block(entries[j]);
+      return false;
+    }
+  }
+  for (uint32_t i = n; i < COMPRESS_CLUSTER_BLOCKS; ++i)
+    entries[i] = EXT2_COMPRESSED_BLKADDR;
+
+  for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+    bool done = i < mapped ? remap_block(inode, first + i, entries[i])
+                           : append_block(inode, entries[i]);
+    if (!done) {
+      WARNING("Failed to map cluster %u of inode %u", cluster, inode_index);
+      return false;
+    }
+  }
+  uint32_t holes = 0;
+  for (uint32_t i = 0; i < mapped; ++i) {
+    if (old[i] == EXT2_COMPRESSED_BLKADDR)
+      ++holes;
+    else
+      free_block(old[i]);
+  }
+  inode->i_compr_saved += COMPRESS_CLUSTER_BLOCKS - n - holes;
+  if (n < COMPRESS_CLUSTER_BLOCKS) {
+    inode->i_flags |= EXT2_COMPRBLK_FL;
+    stat_add(STAT_COMPRESS_CLUSTERS);
+    stat_add(STAT_COMPRESS_SAVED_BLOCKS, COMPRESS_CLUSTER_BLOCKS - n);
+  }
+  return true;
+}
+
+bool FileSystem::read_cluster(ext2_inode* inode, uint32_t cluster,
+                              uint8_t* data) {
+  std::unique_ptr<uint8_t[]> packed(new uint8_t[CLUSTER_BYTES]);
+  uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+  uint32_t n = 0;
+  for (; n < COMPRESS_CLUSTER_BLOCKS; ++n) {
+    uint32_t index;
+    if (!lookup_block(inode, first + n, &index)) return false;
+    if (index == EXT2_COMPRESSED_BLKADDR) break;
+    Block* block;
+    if (!get_block(index, &block, false, 0,
+                   reinterpret_cast<char*>(packed.get()) + BLOCKS2BYTES(n),
+                   BLOCK_SIZE, true))
+      return false;
+  }
+  if (!decompress_cluster(packed.get(), n, data)) {
+    WARNING("Cluster %u of the inode is corrupt", cluster);
+    return false;
+  }
+  stat_add(STAT_DECOMPRESS_CLUSTERS);
+  return true;
+}
+
+bool FileSystem::copy_cluster(ext2_inode* inode, uint32_t inode_index,
+                              uint32_t cluster, uint32_t head, off_t offset,
+                              char* buf, size_t size, bool dirty) {
+  if (dirty) {
+    std::unique_ptr<uint8_t[]> data(new uint8_t[CLUSTER_BYTES]);
+    if (!read_cluster(inode, cluster, data.get())) return false;
+    memcpy(data.get() + offset, buf, size);
+    return store_cluster(inode, inode_index, cluster, data.get());
+  }
+  std::unique_ptr<uint8_t[]> data;
+  while (size) {
+    uint32_t k = offset / BLOCK_SIZE;
+    size_t csz = std::min(size, BLOCK_SIZE - (size_t)offset % BLOCK_SIZE);
+    if (data == nullptr) {
+      {
+        std::shared_lock<TimedSharedMutex> lck(cache_lock_);
+        Block* block = block_cache_->get(cluster_key(head, k));
+        if (block != nullptr) {
+          stat_add(STAT_CACHE_HIT);
+          memcpy(buf, block->get() + offset % BLOCK_SIZE, csz);
+          buf += csz, size -= csz, offset += csz;
+          continue;
+        }
+      }
+      // the decompressed blocks of the cluster are cached together
+      stat_add(STAT_CACHE_MISS);
+      data.reset(new uint8_t[CLUSTER_BYTES]);
+      if (!read_cluster(inode, cluster, data.get())) return false;
+      std::lock_guard<TimedSharedMutex> lck(cache_lock_);
+      for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+        uint64_t key = cluster_key(head, i);
+        if (block_cache_->get(key) != nullptr) continue;
+        Block* block = new Block(0, true);
+        memcpy(block->get(), data.get() + BLOCKS2BYTES(i), BLOCK_SIZE);
+        block_cache_->insert(key, block);
+      }
+    }
+    memcpy(buf, data.get() + offset, csz);
+    buf += csz, size -= csz, offset += csz;
+  }
+  return true;
+}
+
+bool FileSystem::dedup_share(uint64_t hash, const uint8_t* data,
+                             uint32_t* index) {
+  std::lock_guard<std::mutex> lck(dedup_->mutex());
+  if (!dedup_->share(hash, data, index)) return false;
+  stat_add(STAT_DEDUP_BLOCKS);
+  return true;
+}
+
+void FileSystem::dedup_insert(uint64_t hash, uint32_t index) {
+  std::lock_guard<std::mutex> lck(dedup_->mutex());
+  dedup_->insert(hash, index);
+}
+
+bool FileSystem::write_data_block(ext2_inode* inode, uint32_t file_block,
+                                  uint32_t index, off_t offset,
+                                  const char* buf, size_t size, bool* moved) {
+  Block* block;
+  *moved = false;
+  std::unique_lock<std::mutex> lck(dedup_->mutex());
+  if (dedup_->exclusive(index)) {
+    lck.unlock();
+    return get_block(index, &block, true, offset, buf, size, true);
+  }
+  // the other files keep the shared block
+  std::unique_ptr<char[]> data(new char[BLOCK_SIZE]);
+  if (!get_block(index, &block, false, 0, data.get(), BLOCK_SIZE, true))
+    return false;
+  memcpy(data.get() + offset, buf, size);
+  uint32_t copy;
+  if (!alloc_block(&block, &copy, index)) return false;
+  get_block(copy, &block, true, 0, data.get(), BLOCK_SIZE, true);
+  if (!remap_block(inode, file_block, copy)) {
+    lck.unlock();
+    free_block(copy);
+    return false;
+  }
+  dedup_->release(index);
+  lck.unlock();
+  *moved = true;
+  stat_add(STAT_DEDUP_COW);
+  return true;
+}
+
 bool FileSystem::get_inode(uint32_t index, ext2_inode** inode) {
   // INFO("get inode: %d", index);
   if (index == -1) {
@@ -518,16 +1039,11 @@ bool FileSystem::get_inode(uint32_t index, ext2_inode** inode) {
 
   // lazy read
   uint32_t block_group_index = index / super_block_->inodes_per_group();
-  auto iter = block_groups_.find(block_group_index);
-  if (iter == block_groups_.end()) {
-    iter = block_groups_
-               .insert({block_group_index,
-                        new BlockGroup(
-                            super_block_->get_group_desc(block_group_index))})
-               .first;
-  }
+  BlockGroup* bg = block_group(block_group_index);
+  if (bg == nullptr) return false;
   uint32_t inner_index = index % super_block_->inodes_per_group();
-  if (!iter->second->get_inode(inner_index, inode)) {
+  std::unique_lock<TimedSharedMutex> lck(bg->mutex());
+  if (!bg->get_inode(inner_index, inode)) {
     WARNING("Inode has not been allocated in the target block group");
     return false;
   }
@@ -535,35 +1051,35 @@ bool FileSystem::get_inode(uint32_t index, ext2_inode** inode) {
   return true;
 }
 
-bool FileSystem::get_block(uint32_t index, Block** block, bool dirty, off_t offset, const char* buf, size_t copy_size) {
-  static std::shared_mutex m_;
+bool FileSystem::get_block(uint32_t index, Block** block, bool dirty, off_t offset, const char* buf, size_t copy_size, bool file_data) {
   /*
   if (index >= super_block_->get_super()->s_blocks_count) {
     WARNING("Block index exceeds blocks count");
     return false;
   }*/
-  m_.lock_shared();
+  cache_lock_.lock_shared();
   // find in block cache
   *block = block_cache_->get(index, dirty);
   if (*block == nullptr) {
-    m_.unlock_shared();
+    cache_lock_.unlock_shared();
+    stat_add(STAT_CACHE_MISS);
     // lasy read
     uint32_t block_group_index = index / super_block_->blocks_per_group();
-    m_.lock();
+    cache_lock_.lock();
     *block = block_cache_->get(index);
     if(*block == nullptr) {
-      auto iter = block_groups_.find(block_group_index);
-      if (iter == block_groups_.end()) {
-        iter = block_groups_
-                  .insert({block_group_index,
-                            new BlockGroup(
-                                super_block_->get_group_desc(block_group_index))})
-                  .first;
-      }
+      BlockGroup* bg = block_group(block_group_index);
       uint32_t inner_index = index % super_block_->blocks_per_group();
-      if (!iter->second->get_block(inner_index, block)) {
+      bool found = false;
+      if (bg != nullptr) {
+        // read straight into the cache slot the block is inserted into
+        uint8_t* slot = block_cache_->reserve();
+        std::lock_guard<TimedSharedMutex> lck(bg->mutex());
+        found = bg->get_block(inner_index, block, file_data, slot);
+      }
+      if (!found) {
         WARNING("Block has not been allocated in the target block group");
-        m_.unlock();
+        cache_lock_.unlock();
         return false;
       }  
       block_cache_->insert(index, *block, dirty);
@@ -571,35 +1087,41 @@ bool FileSystem::get_block(uint32_t index, Block** block, bool dirty, off_t offs
     // Update block cache
     // if dirty is true, copy blk from buf, otherwise copy blk to buf
     !dirty ? memcpy(const_cast<char*>(buf), (*block)->get() + offset, copy_size) : memcpy((*block)->get() + offset, buf, copy_size);
-    m_.unlock();
+    cache_lock_.unlock();
     INFO("get_block ret");
     return true;
-  } else !dirty ? memcpy(const_cast<char*>(buf), (*block)->get() + offset, copy_size) : memcpy((*block)->get() + offset, buf, copy_size);
-  m_.unlock_shared();
+  } else {
+    stat_add(STAT_CACHE_HIT);
+    !dirty ? memcpy(const_cast<char*>(buf), (*block)->get() + offset, copy_size) : memcpy((*block)->get() + offset, buf, copy_size);
+  }
+  cache_lock_.unlock_shared();
   INFO("get_block ret");
   return true;
 }
 
-bool FileSystem::alloc_inode(ext2_inode** inode, uint32_t* index, mode_t mode) {
-  // update super block
-  super_block_->get_super()->s_free_inodes_count--;
-  super_block_->get_super()->s_inodes_count++;
-
-  uint32_t block_group_index;
-  // allocated by block group
-  for (auto bg : block_groups_) {
-    if (bg.second->get_desc()->bg_free_inodes_count) {
-      if (bg.second->alloc_inode(inode, index, mode)) {
-        inode_init(*inode);
-        block_group_index = bg.first;
-        goto alloc_finished;
-      }
-    }
+bool FileSystem::alloc_inode(ext2_inode** inode, uint32_t* index, mode_t mode,
+                             uint32_t parent) {
+  AllocContext* context = alloc_context();
+  uint32_t goal = parent / super_block_->inodes_per_group();
+  int64_t i;
+  {
+    std::lock_guard<std::mutex> lck(free_space_lock_);
+    i = S_ISDIR(mode) ? find_dir_group(parent)
+                      : free_space_.find(FREE_INODES, goal);
+    if (i < 0) i = free_space_.find(FREE_INODES);
+  }
+  // allocated by block group, groups without free inodes are not loaded
+  while (i >= 0) {
+    if (group_alloc_inode(i, inode, index, mode)) goto alloc_finished;
+    std::lock_guard<std::mutex> lck(free_space_lock_);
+    i = free_space_.find(FREE_INODES, i + 1);
+    if (i < 0) i = free_space_.find(FREE_INODES);
   }
 
   // create a new block group
-  alloc_block_group(&block_group_index);
-  if (block_groups_[block_group_index]->alloc_inode(inode, index, mode))
+  uint32_t block_group_index;
+  if (alloc_block_group(&block_group_index) &&
+      group_alloc_inode(block_group_index, inode, index, mode))
     goto alloc_finished;
 
   WARNING("Allocate inode in the new block group(%u) failed",
@@ -607,67 +1129,378 @@ bool FileSystem::alloc_inode(ext2_inode** inode, uint32_t* index, mode_t mode) {
   return false;
 
 alloc_finished:
-  // must be converted to the index of the whole file system
-  *index = block_group_index * super_block_->inodes_per_group() + *index;
-  DEBUG("Allocate new inode %u in block group %u", *index, block_group_index);
+  context->inodes_.fetch_add(1, std::memory_order_relaxed);
+  DEBUG("Allocate new inode %u", *index);
   return true;
 }
 
-bool FileSystem::alloc_block(Block** block, uint32_t* index) {
+bool FileSystem::alloc_block(Block** block, uint32_t* index, uint32_t goal) {
   ASSERT(block != nullptr && index != nullptr);
-  // update super block
-  super_block_->get_super()->s_free_blocks_count--;
-  super_block_->get_super()->s_blocks_count++;
+  AllocContext* context = alloc_context();
+  uint32_t n_groups = super_block_->num_block_groups();
+  uint32_t goal_group = goal / super_block_->blocks_per_group();
+  uint32_t goal_inner = goal % super_block_->blocks_per_group();
+  if (goal_inner >= super_block_->data_blocks_per_group()) {
+    goal_group++;
+    goal_inner = 0;
+  }
+  // the goal group, unless another CPU is allocating from it: the CPU then
+  // keeps to its own group, so parallel writers do not wait for each other
+  if (goal_group < n_groups &&
+      group_alloc_block(goal_group, goal_inner, false, block, index))
+    goto alloc_finished;
+  int64_t i;
+  i = context->group_.load(std::memory_order_relaxed);
+  if (i >= 0 && group_alloc_block(i, 0, true, block, index))
+    goto alloc_finished;
 
-  uint32_t block_group_index;
-  // allocated by block group
-  char __a[BLOCK_SIZE] = {0};
-  for (auto bg : block_groups_) {
-    if (bg.second->get_desc()->bg_free_blocks_count) {
-      if (bg.second->alloc_block(block, index)) {
-        block_group_index = bg.first;
-        goto alloc_finished;
-      }
+  {
+    // reserve another group, searching from the share of the groups that
+    // falls to the CPU
+    std::lock_guard<std::mutex> lck(free_space_lock_);
+    i = free_space_.find(FREE_BLOCKS, (uint64_t)n_groups *
+                                          (context - contexts_) /
+                                          n_contexts_);
+    if (i < 0) i = free_space_.find(FREE_BLOCKS);
+  }
+  // allocated by block group, groups without free blocks are not loaded
+  while (i >= 0) {
+    if (group_alloc_block(i, 0, true, block, index)) {
+      context->group_.store(i, std::memory_order_relaxed);
+      goto alloc_finished;
     }
+    std::lock_guard<std::mutex> lck(free_space_lock_);
+    i = free_space_.find(FREE_BLOCKS, i + 1);
+    if (i < 0) i = free_space_.find(FREE_BLOCKS);
   }
 
-  ASSERT(memcmp(*block, __a, BLOCK_SIZE) == 0);
-
   // create a new block group
-  alloc_block_group(&block_group_index);
-  if (block_groups_[block_group_index]->alloc_block(block, index))
+  uint32_t block_group_index;
+  if (alloc_block_group(&block_group_index) &&
+      group_alloc_block(block_group_index, 0, true, block, index)) {
+    context->group_.store(block_group_index, std::memory_order_relaxed);
     goto alloc_finished;
+  }
 
   WARNING("Failed to allocate block in the new block group %u",
           block_group_index);
   return false;
 
 alloc_finished:
-  // must be converted to the index of the whole file system
-  *index = block_group_index * super_block_->blocks_per_group() + *index;
+  context->blocks_.fetch_add(1, std::memory_order_relaxed);
   // add to block cache
+  cache_lock_.lock();
   block_cache_->insert(*index, *block);
-  DEBUG("Allocate new block %u in block group %u", *index, block_group_index);
+  cache_lock_.unlock();
+  DEBUG("Allocate new block %u", *index);
+  return true;
+}
+
+bool FileSystem::group_alloc_inode(uint32_t group, ext2_inode** inode,
+                                   uint32_t* index, mode_t mode) {
+  BlockGroup* bg = block_group(group);
+  if (bg == nullptr) return false;
+  std::unique_lock<TimedSharedMutex> lck(bg->mutex());
+  if (!bg->alloc_inode(inode, index, mode)) {
+    lck.unlock();
+    WARNING("Block group %u has no free inode in its bitmap", group);
+    std::lock_guard<std::mutex> free_lck(free_space_lock_);
+    free_space_.update(FREE_INODES, group, 0);
+    return false;
+  }
+  inode_init(*inode);
+  bool full = bg->get_desc()->bg_free_inodes_count == 0;
+  lck.unlock();
+  // other counts reach the summary when the contexts are folded
+  if (full) update_free_space(group);
+  // must be converted to the index of the whole file system
+  *index = group * super_block_->inodes_per_group() + *index;
   return true;
 }
 
+bool FileSystem::group_alloc_block(uint32_t group, uint32_t goal, bool wait,
+                                   Block** block, uint32_t* index) {
+  BlockGroup* bg = block_group(group);
+  if (bg == nullptr) return false;
+  std::unique_lock<TimedSharedMutex> lck(bg->mutex(), std::defer_lock);
+  if (wait) {
+    lck.lock();
+  } else if (!lck.try_lock()) {
+    return false;
+  }
+  if (!bg->alloc_block(block, index, goal)) {
+    lck.unlock();
+    std::lock_guard<std::mutex> free_lck(free_space_lock_);
+    if (free_space_.free(FREE_BLOCKS, group) > 0) {
+      WARNING("Block group %u has no free block in its bitmap", group);
+      free_space_.update(FREE_BLOCKS, group, 0);
+    }
+    return false;
+  }
+  bool full = bg->get_desc()->bg_free_blocks_count == 0;
+  lck.unlock();
+  // other counts reach the summary when the contexts are folded
+  if (full) update_free_space(group);
+  // must be converted to the index of the whole file system
+  *index = group * super_block_->blocks_per_group() + *index;
+  return true;
+}
+
+uint32_t FileSystem::group_alloc_blocks(uint32_t group, uint32_t goal,
+                                        uint32_t count, uint32_t min,
+                                        uint32_t* index) {
+  BlockGroup* bg = block_group(group);
+  if (bg == nullptr) return 0;
+  std::unique_lock<TimedSharedMutex> lck(bg->mutex());
+  uint32_t len = bg->alloc_blocks(goal, count, min, index);
+  bool full = bg->get_desc()->bg_free_blocks_count == 0;
+  lck.unlock();
+  if (len == 0) return 0;
+  // other counts reach the summary when the contexts are folded
+  if (full) update_free_space(group);
+  // must be converted to the index of the whole file system
+  *index = group * super_block_->blocks_per_group() + *index;
+  return len;
+}
+
 bool FileSystem::alloc_block(Block** block, uint32_t* index,
-                             ext2_inode* inode) {
-  
-  static std::shared_mutex m_;
-  std::unique_lock<std::shared_mutex> lck(m_);
+                             ext2_inode* inode, uint32_t inode_index) {
+  // with a preallocation window, the block comes from the window
+  if (prealloc_blocks(inode) == 0)
+    return alloc_next_block(block, index, inode, inode_index);
+  return alloc_blocks(inode, inode_index, 1, index) == 1 &&
+         get_block(*index, block);
+}
+
+bool FileSystem::alloc_next_block(Block** block, uint32_t* index,
+                                  ext2_inode* inode, uint32_t inode_index) {
+  ASSERT(inode != nullptr &&
+         (S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode)));
+  if (!alloc_block(block, index, block_goal(inode, inode_index)) ||
+      !append_block(inode, *index)) {
+    WARNING("Error occured while allocating inode blocks!");
+    return false;
+  }
+  return true;
+}
+
+uint32_t FileSystem::alloc_blocks(ext2_inode* inode, uint32_t inode_index,
+                                  uint32_t count, uint32_t* indexes) {
   ASSERT(inode != nullptr &&
          (S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode)));
-  uint32_t block_index, indirect_block_index;
+  uint32_t n = 0;
+  bool discarded = false;
+  while (n < count) {
+    uint32_t goal = block_goal(inode, inode_index);
+    uint32_t size = prealloc_blocks(inode);
+    uint32_t first;
+    uint32_t len = take_window(inode_index, count - n, &first, &goal, &size);
+    if (len > 0) {
+      update_window(first, len, WINDOW_TAKE);
+    } else {
+      // a run with the next window after the blocks
+      uint32_t got = alloc_run(goal, count - n + size, &first);
+      if (got == 0) {
+        // no room near goal, the next block decides where the file goes on
+        Block* block;
+        if (alloc_next_block(&block, &indexes[n], inode, inode_index)) {
+          ++n;
+          continue;
+        }
+        // the free blocks left may all be in windows
+        if (discarded || !discard_windows()) break;
+        discarded = true;
+        continue;
+      }
+      len = std::min(got, count - n);
+      if (size > 0) {
+        update_window(first + len, got - len, WINDOW_HOLD);
+        std::lock_guard<std::mutex> lck(windows_lock_);
+        windows_[inode_index] = {first + len, got - len, size};
+      }
+    }
+    // the indirect blocks mapping the new blocks follow them
+    cache_new_blocks(first, len);
+    for (uint32_t i = 0; i < len; ++i) {
+      if (!append_block(inode, first + i)) {
+        WARNING("Error occured while allocating inode blocks!");
+        while (i < len) free_block(first + i++);
+        return n;
+      }
+      indexes[n++] = first + i;
+    }
+  }
+  return n;
+}
+
+uint32_t FileSystem::alloc_run(uint32_t goal, uint32_t count,
+                               uint32_t* index) {
+  uint32_t group = goal / super_block_->blocks_per_group();
+  uint32_t inner = goal % super_block_->blocks_per_group();
+  if (inner >= super_block_->data_blocks_per_group()) {
+    group++;
+    inner = 0;
+  }
+  bool exists = group < super_block_->num_block_groups();
+  // the whole run from goal
+  uint32_t len = exists ? group_alloc_blocks(group, inner, count, count, index)
+                        : 0;
+  // or in one of the next groups with room for it
+  int64_t i = group;
+  for (int tries = 0; len == 0 && tries < RUN_SCAN_GROUPS; ++tries) {
+    uint32_t free;
+    {
+      std::lock_guard<std::mutex> lck(free_space_lock_);
+      i = free_space_.find(FREE_BLOCKS, i + 1);
+      if (i < 0) break;
+      free = free_space_.free(FREE_BLOCKS, i);
+    }
+    if (free >= count) len = group_alloc_blocks(i, 0, count, count, index);
+  }
+  // else the first free blocks from goal
+  if (len == 0 && exists)
+    len = group_alloc_blocks(group, inner, count, 1, index);
+  alloc_context()->blocks_.fetch_add(len, std::memory_order_relaxed);
+  return len;
+}
+
+void FileSystem::cache_new_blocks(uint32_t first, uint32_t count) {
+  ext2_super_block* super = super_block_->get_super();
+  std::lock_guard<TimedSharedMutex> lck(cache_lock_);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t index = first + i;
+    block_cache_->insert(
+        index, new Block(data_block_offset(
+                             super, index / super_block_->blocks_per_group(),
+                             index % super_block_->blocks_per_group()),
+                         true, true));
+  }
+}
+
+uint32_t FileSystem::prealloc_blocks(ext2_inode* inode) {
+  if (!(mount_opts_ & EXT2_MOUNT_RESERVATION)) return 0;
+  ext2_super_block* super = super_block_->get_super();
+  return S_ISDIR(inode->i_mode) ? super->s_prealloc_dir_blocks
+                                : super->s_prealloc_blocks;
+}
+
+uint32_t FileSystem::take_window(uint32_t inode_index, uint32_t count,
+                                 uint32_t* first, uint32_t* goal,
+                                 uint32_t* size) {
+  std::lock_guard<std::mutex> lck(windows_lock_);
+  auto iter = windows_.find(inode_index);
+  if (iter == windows_.end()) return 0;
+  PreallocWindow& window = iter->second;
+  if (window.len_ == 0) {
+    // the file goes on after its last window, with a larger one
+    *goal = window.start_;
+    *size = window.size_;
+    return 0;
+  }
+  uint32_t n = std::min(count, window.len_);
+  *first = window.start_;
+  window.start_ += n;
+  window.len_ -= n;
+  if (window.len_ == 0)
+    window.size_ = std::min(window.size_ * 2, (uint32_t)PREALLOC_MAX_BLOCKS);
+  return n;
+}
+
+void FileSystem::discard_window(uint32_t inode_index) {
+  PreallocWindow window;
+  {
+    std::lock_guard<std::mutex> lck(windows_lock_);
+    auto iter = windows_.find(inode_index);
+    if (iter == windows_.end()) return;
+    window = iter->second;
+    windows_.erase(iter);
+  }
+  update_window(window.start_, window.len_, WINDOW_DROP);
+}
+
+bool FileSystem::discard_windows() {
+  std::vector<uint32_t> inodes;
+  {
+    std::lock_guard<std::mutex> lck(windows_lock_);
+    for (auto& item : windows_) {
+      if (item.second.len_ > 0) inodes.push_back(item.first);
+    }
+  }
+  for (uint32_t inode_index : inodes) discard_window(inode_index);
+  return !inodes.empty();
+}
+
+void FileSystem::update_window(uint32_t first, uint32_t len, WindowOp op) {
+  if (len == 0) return;
+  uint32_t group = first / super_block_->blocks_per_group();
+  uint32_t inner = first % super_block_->blocks_per_group();
+  BlockGroup* bg = block_group(group);
+  if (bg == nullptr) return;
+  std::unique_lock<TimedSharedMutex> lck(bg->mutex());
+  if (op == WINDOW_HOLD) {
+    bg->hold_blocks(inner, len);
+  } else if (op == WINDOW_TAKE) {
+    bg->take_held(inner, len);
+  } else {
+    bg->drop_held(inner, len);
+  }
+  bool full = bg->get_desc()->bg_free_blocks_count == 0;
+  lck.unlock();
+  // the blocks of a window are free until taken
+  if (op == WINDOW_HOLD) {
+    alloc_context()->blocks_.fetch_sub(len, std::memory_order_relaxed);
+  } else if (op == WINDOW_TAKE) {
+    alloc_context()->blocks_.fetch_add(len, std::memory_order_relaxed);
+  }
+  // a group whose free blocks were all in windows may have been marked full
+  if ((op == WINDOW_TAKE && full) || op == WINDOW_DROP)
+    update_free_space(group);
+}
+
+bool FileSystem::reserve_blocks(uint32_t n) {
+  ext2_super_block* super = super_block_->get_super();
+  std::lock_guard<std::mutex> lck(free_space_lock_);
+  // groups not created yet count as free. The summary is not used: groups
+  // that fill up refresh it with blocks the contexts still count.
+  int64_t free = folded_free_blocks_ +
+                 (uint64_t)(max_block_groups(super) -
+                            super_block_->num_block_groups()) *
+                     super_block_->data_blocks_per_group();
+  for (uint32_t i = 0; i < n_contexts_; ++i)
+    free -= contexts_[i].blocks_.load(std::memory_order_relaxed);
+  if (free < 0 || reserved_blocks_ + n > (uint64_t)free) return false;
+  reserved_blocks_ += n;
+  return true;
+}
+
+void FileSystem::release_blocks(uint32_t n) {
+  std::lock_guard<std::mutex> lck(free_space_lock_);
+  ASSERT(reserved_blocks_ >= n);
+  reserved_blocks_ -= n;
+}
+
+uint32_t FileSystem::block_goal(ext2_inode* inode, uint32_t inode_index) {
+  // the first block goes to the group of the inode, the next ones follow the
+  // block last added to i_block (data or the indirect block leading to it)
+  for (int i = EXT2_N_BLOCKS - 1; num_blocks(inode) > 0 && i >= 0; --i) {
+    if (inode->i_block[i] && inode->i_block[i] != EXT2_COMPRESSED_BLKADDR)
+      return inode->i_block[i] + 1;
+  }
+  return inode_index / super_block_->inodes_per_group() *
+         super_block_->blocks_per_group();
+}
+
+bool FileSystem::append_block(ext2_inode* inode, uint32_t block_index) {
+  uint32_t indirect_block_index;
   uint32_t num_blocks = super_block_->num_aligned_blocks(inode->i_blocks);
   Block* indirect_block = nullptr;
-  if (!alloc_block(block, &block_index)) goto error_occured;
 
   if (num_blocks < MAX_DIR_BLOCKS) {
     inode->i_block[num_blocks] = block_index;
   } else if (num_blocks < MAX_DIR_BLOCKS + MAX_IND_BLOCKS) {
     if (num_blocks == MAX_DIR_BLOCKS) {
-      if (!alloc_block(&indirect_block, &indirect_block_index))
+      if (!alloc_block(&indirect_block, &indirect_block_index,
+                       block_index + 1))
         goto error_occured;
       inode->i_block[EXT2_IND_BLOCK] = indirect_block_index;
     } else if (!get_block(inode->i_block[EXT2_IND_BLOCK], &indirect_block))
@@ -679,7 +1512,8 @@ bool FileSystem::alloc_block(Block** block, uint32_t* index,
     block_cache_->modify(inode->i_block[EXT2_IND_BLOCK]);
   } else if (num_blocks < MAX_DIR_BLOCKS + MAX_IND_BLOCKS + MAX_DIND_BLOCKS) {
     if (num_blocks == MAX_DIR_BLOCKS + MAX_IND_BLOCKS) {
-      if (!alloc_block(&indirect_block, &indirect_block_index))
+      if (!alloc_block(&indirect_block, &indirect_block_index,
+                       block_index + 1))
         goto error_occured;
       inode->i_block[EXT2_DIND_BLOCK] = indirect_block_index;
     } else if (!get_block(inode->i_block[EXT2_DIND_BLOCK], &indirect_block))
@@ -695,7 +1529,8 @@ bool FileSystem::alloc_block(Block** block, uint32_t* index,
 
     if (inner_index == 0) {  // double indirect blocks has been full
       // allocate new double indirect block
-      if (!alloc_block(&double_indirect_block, &double_indirect_index))
+      if (!alloc_block(&double_indirect_block, &double_indirect_index,
+                       block_index + 1))
         goto error_occured;
 
       // update indirect block
@@ -720,7 +1555,8 @@ bool FileSystem::alloc_block(Block** block, uint32_t* index,
     }
   } else {
     if (num_blocks == MAX_DIR_BLOCKS + MAX_IND_BLOCKS + MAX_DIND_BLOCKS) {
-      if (!alloc_block(&indirect_block, &indirect_block_index))
+      if (!alloc_block(&indirect_block, &indirect_block_index,
+                       block_index + 1))
         goto error_occured;
       inode->i_block[EXT2_TIND_BLOCK] = indirect_block_index;
     } else if (!get_block(inode->i_block[EXT2_TIND_BLOCK], &indirect_block))
@@ -738,10 +1574,12 @@ bool FileSystem::alloc_block(Block** block, uint32_t* index,
 
     if (inner_index == 0) {  // double indirect blocks has been full
       // allocate new double indirect block
-      if (!alloc_block(&double_indirect_block, &double_indirect_index))
+      if (!alloc_block(&double_indirect_block, &double_indirect_index,
+                       block_index + 1))
         goto error_occured;
       // allocate new triple indirect block
-      if (!alloc_block(&triple_indirect_block, &triple_indirect_index))
+      if (!alloc_block(&triple_indirect_block, &triple_indirect_index,
+                       block_index + 1))
         goto error_occured;
 
       // update indirect block
@@ -769,7 +1607,8 @@ bool FileSystem::alloc_block(Block** block, uint32_t* index,
       uint32_t double_inner_index = inner_index % MAX_IND_BLOCKS;
       if (double_inner_index == 0) {  // triple indirect blocks has been full
         // allocate new triple indirect block
-        if (!alloc_block(&triple_indirect_block, &triple_indirect_index))
+        if (!alloc_block(&triple_indirect_block, &triple_indirect_index,
+                         block_index + 1))
           goto error_occured;
 
         // update double indirect block
@@ -795,79 +1634,359 @@ bool FileSystem::alloc_block(Block** block, uint32_t* index,
   }
   // update inode
   inode->i_blocks += 2 << super_block_->get_super()->s_log_block_size;
-  *index = block_index;
   return true;
 
 error_occured:
-  WARNING("Error occured while allocating inode blocks!");
   return false;
 }
 
+bool FileSystem::inline_to_block(ext2_inode* inode, uint32_t inode_index,
+                                 Block** block, uint32_t* index) {
+  ASSERT(INODE_IS_INLINE(inode));
+  uint8_t data[INLINE_DATA_SIZE];
+  memcpy(data, inode->i_block, INLINE_DATA_SIZE);
+  memset(inode->i_block, 0, INLINE_DATA_SIZE);
+  inode->i_flags &= ~EXT2_INLINE_DATA_FL;
+  *block = nullptr;
+  if (S_ISREG(inode->i_mode) && inode->i_size == 0) return true;
+
+  if (!alloc_block(block, index, inode, inode_index)) return false;
+  memcpy((*block)->get(), data, INLINE_DATA_SIZE);
+  block_cache_->modify(*index);
+  DEBUG("Move inline data to block %u", *index);
+  return true;
+}
+
+BlockGroup* FileSystem::block_group(uint32_t index) {
+  {
+    std::shared_lock<std::shared_mutex> lck(groups_lock_);
+    auto iter = block_groups_.find(index);
+    if (iter != block_groups_.end()) return iter->second;
+  }
+  std::unique_lock<std::shared_mutex> lck(groups_lock_);
+  auto iter = block_groups_.find(index);
+  if (iter != block_groups_.end()) return iter->second;
+  ext2_group_desc* desc = super_block_->get_group_desc(index);
+  if (desc == nullptr) {
+    WARNING("Block group %u does not exist", index);
+    return nullptr;
+  }
+  BlockGroup* bg = new BlockGroup(desc, super_block_->get_super(), index);
+  block_groups_[index] = bg;
+  super_block_->track_group_desc(index);
+  return bg;
+}
+
+int64_t FileSystem::find_dir_group(uint32_t parent) {
+  uint32_t n_groups = super_block_->num_block_groups();
+  uint32_t parent_group = parent / super_block_->inodes_per_group();
+  uint64_t free_inodes = 0, free_blocks = 0, dirs = 0;
+  for (uint32_t i = 0; i < n_groups; ++i) {
+    ext2_group_desc* desc = super_block_->get_group_desc(i);
+    free_inodes += desc->bg_free_inodes_count;
+    free_blocks += desc->bg_free_blocks_count;
+    dirs += desc->bg_used_dirs_count;
+  }
+  uint64_t avg_free_inodes = free_inodes / n_groups;
+  uint64_t avg_free_blocks = free_blocks / n_groups;
+
+  if (parent == ROOT_INODE) {
+    // spread top level directories, each starts a tree of its own
+    int64_t best = -1;
+    uint32_t best_dirs = UINT32_MAX;
+    for (uint32_t i = 0; i < n_groups; ++i) {
+      ext2_group_desc* desc = super_block_->get_group_desc(i);
+      if (desc->bg_free_inodes_count == 0 ||
+          desc->bg_free_inodes_count < avg_free_inodes ||
+          desc->bg_free_blocks_count < avg_free_blocks ||
+          desc->bg_used_dirs_count >= best_dirs)
+        continue;
+      best = i;
+      best_dirs = desc->bg_used_dirs_count;
+    }
+    if (best >= 0) return best;
+  } else {
+    // stay near the parent while its groups are not crowded with directories
+    // or short of room
+    uint32_t slack_inodes = super_block_->inodes_per_group() / 4;
+    uint32_t slack_blocks = super_block_->data_blocks_per_group() / 4;
+    uint64_t max_dirs = dirs / n_groups + super_block_->inodes_per_group() / 16;
+    uint64_t min_inodes =
+        avg_free_inodes > slack_inodes ? avg_free_inodes - slack_inodes : 0;
+    uint64_t min_blocks =
+        avg_free_blocks > slack_blocks ? avg_free_blocks - slack_blocks : 0;
+    for (uint32_t n = 0; n < n_groups; ++n) {
+      uint32_t i = (parent_group + n) % n_groups;
+      ext2_group_desc* desc = super_block_->get_group_desc(i);
+      if (desc->bg_free_inodes_count > 0 &&
+          desc->bg_used_dirs_count < max_dirs &&
+          desc->bg_free_inodes_count >= min_inodes &&
+          desc->bg_free_blocks_count >= min_blocks)
+        return i;
+    }
+  }
+  return free_space_.most_free(FREE_INODES);
+}
+
+void FileSystem::update_free_space(uint32_t index) {
+  ext2_group_desc* desc = super_block_->get_group_desc(index);
+  std::lock_guard<std::mutex> lck(free_space_lock_);
+  free_space_.update(FREE_BLOCKS, index, desc->bg_free_blocks_count);
+  free_space_.update(FREE_INODES, index, desc->bg_free_inodes_count);
+}
+
+void FileSystem::flush_block_groups() {
+  // with FLEX_BG, the bitmaps and inode tables of the groups of a flex group
+  // follow each other
+  std::vector<Block*> blocks;
+  std::shared_lock<std::shared_mutex> lck(groups_lock_);
+  for (auto bg : block_groups_) bg.second->get_metadata(&blocks);
+  std::sort(blocks.begin(), blocks.end(),
+            [](Block* a, Block* b) { return a->offset() < b->offset(); });
+  uint8_t* buf = nullptr;
+  size_t n;
+  for (size_t i = 0; i < blocks.size(); i += n) {
+    n = 1;
+    while (i + n < blocks.size() && n < FLUSH_RUN_BLOCKS &&
+           blocks[i + n]->offset() ==
+               blocks[i]->offset() + (off_t)BLOCKS2BYTES(n))
+      ++n;
+    if (n == 1) {
+      blocks[i]->flush();
+      continue;
+    }
+    if (buf == nullptr)
+      buf = (uint8_t*)alloc_aligned(BLOCKS2BYTES(FLUSH_RUN_BLOCKS));
+    for (size_t j = 0; j < n; ++j) {
+      memcpy(buf + BLOCKS2BYTES(j), blocks[i + j]->get(), BLOCK_SIZE);
+      // of the copy, inodes change while the groups are flushed
+      if (checksums() != nullptr)
+        checksums()->update(blocks[i + j]->offset(), buf + BLOCKS2BYTES(j));
+    }
+    disk_write(blocks[i]->offset(), BLOCKS2BYTES(n), buf);
+  }
+  free(buf);
+}
+
 bool FileSystem::alloc_block_group(uint32_t* index) {
+  ext2_super_block* super = super_block_->get_super();
+  std::unique_lock<std::shared_mutex> lck(groups_lock_);
   *index = super_block_->num_block_groups();
-  // We assume disk space will not drain out
-  ASSERT(sizeof(ext2_super_block) + *index * sizeof(ext2_group_desc) <=
-         BLOCK_SIZE);
-  ext2_group_desc* desc =
-      (ext2_group_desc*)(super_block_->get() + sizeof(ext2_super_block) +
-                         *index * sizeof(ext2_group_desc));
-  desc->bg_inode_bitmap = *index * MAX_BLOCK_GROUP_SIZE + BLOCK_SIZE;
-  desc->bg_block_bitmap = desc->bg_inode_bitmap + BLOCK_SIZE;
-  desc->bg_inode_table = desc->bg_block_bitmap + BLOCK_SIZE;
-  desc->bg_free_blocks_count = BLOCKS_PER_GROUP;
-  desc->bg_free_inodes_count = INODES_PER_GROUP;
+  if (*index >= max_block_groups(super)) {
+    WARNING("Block group %u cannot be addressed", *index);
+    return false;
+  }
+  ext2_group_desc* desc = super_block_->new_group_desc();
+  set_group_offsets(super, *index, desc);
+  uint32_t free_blocks = super_block_->data_blocks_per_group() -
+                         reserved_data_blocks(super, *index);
+  desc->bg_free_blocks_count = free_blocks;
+  desc->bg_free_inodes_count = super_block_->inodes_per_group();
   desc->bg_used_dirs_count = 0;
-  super_block_->put_group_desc(desc);
-  block_groups_[*index] = new BlockGroup(desc, true);
+  super->s_groups_count = *index + 1;
+  block_groups_[*index] = new BlockGroup(desc, super, *index, true);
+  if (checksums() != nullptr) checksums()->init_group(*index);
+  lck.unlock();
+  // no block of the group is shared yet, nor in the index
+  if (dedup_ != nullptr) {
+    uint32_t start = dedup_table_start(super, *index);
+    std::lock_guard<TimedSharedMutex> cache_lck(cache_lock_);
+    for (uint32_t i = 0; i < dedup_table_blocks(super); ++i) {
+      block_cache_->insert(
+          *index * super_block_->blocks_per_group() + start + i,
+          new Block(data_block_offset(super, *index, start + i), true), true);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> free_lck(free_space_lock_);
+    // unless a fold since the group was created has counted it
+    if (*index >= free_space_.groups(FREE_BLOCKS))
+      folded_free_blocks_ += free_blocks;
+    free_space_.update(FREE_BLOCKS, *index, desc->bg_free_blocks_count);
+    free_space_.update(FREE_INODES, *index, desc->bg_free_inodes_count);
+  }
   DEBUG("Allocate new block group: %u", *index);
   return true;
 }
 
 bool FileSystem::free_inode(uint32_t index) {
-  // update super block
-  super_block_->get_super()->s_free_inodes_count++;
-  super_block_->get_super()->s_inodes_count--;
-
   uint32_t block_group_index = index / super_block_->inodes_per_group();
   uint32_t inner_index = index % super_block_->inodes_per_group();
-  auto iter = block_groups_.find(block_group_index);
-  if (iter == block_groups_.end()) {
-    iter = block_groups_
-               .insert({block_group_index,
-                        new BlockGroup(
-                            super_block_->get_group_desc(block_group_index))})
-               .first;
-  }
+  BlockGroup* bg = block_group(block_group_index);
   DEBUG("Free END");
-  if (!iter->second->free_inode(inner_index)) {
+  if (bg == nullptr) {
+    WARNING("Attempting to free nonexistent inode!");
+    return false;
+  }
+  std::unique_lock<TimedSharedMutex> lck(bg->mutex());
+  if (!bg->free_inode(inner_index)) {
     WARNING("Attempting to free nonexistent inode!");
     return false;
   }
+  bool was_full = bg->get_desc()->bg_free_inodes_count == 1;
+  lck.unlock();
+  alloc_context()->inodes_.fetch_sub(1, std::memory_order_relaxed);
+  if (was_full) update_free_space(block_group_index);
   return true;
 }
 
 bool FileSystem::free_block(uint32_t index) {
-  // update super block
-  super_block_->get_super()->s_free_blocks_count++;
-  super_block_->get_super()->s_blocks_count--;
-
   uint32_t block_group_index = index / super_block_->blocks_per_group();
   uint32_t inner_index = index % super_block_->blocks_per_group();
-  auto iter = block_groups_.find(block_group_index);
-  if (iter == block_groups_.end()) {
-    iter = block_groups_
-               .insert({block_group_index,
-                        new BlockGroup(
-                            super_block_->get_group_desc(block_group_index))})
-               .first;
-  }
-  if (!iter->second->free_block(inner_index)) {
+  BlockGroup* bg = block_group(block_group_index);
+  if (bg == nullptr) {
+    WARNING("Attempting to free nonexistent block!");
+    return false;
+  }
+  // held until the block is free, so that it is not shared meanwhile
+  std::unique_lock<std::mutex> dedup_lck;
+  if (dedup_ != nullptr) {
+    dedup_lck = std::unique_lock<std::mutex>(dedup_->mutex());
+    // other files still map it
+    if (dedup_->release(index)) return true;
+  }
+  std::unique_lock<TimedSharedMutex> lck(bg->mutex());
+  if (!bg->free_block(inner_index)) {
     WARNING("Attempting to free nonexistent block!");
     return false;
   }
-  // free block in block cache
+  // before the block can be allocated again
+  if (checksums() != nullptr) {
+    checksums()->clear(data_block_offset(super_block_->get_super(),
+                                         block_group_index, inner_index));
+  }
+  bool was_full = bg->get_desc()->bg_free_blocks_count == 1;
+  lck.unlock();
+  alloc_context()->blocks_.fetch_sub(1, std::memory_order_relaxed);
+  // a group that was full is allocated from again
+  if (was_full) update_free_space(block_group_index);
+  if (discards_ != nullptr) discards_->add(index);
+  // free block in block cache, with the cluster it may start
+  cache_lock_.lock();
   block_cache_->remove(index);
+  for (uint32_t k = 0; k < COMPRESS_CLUSTER_BLOCKS; ++k)
+    block_cache_->remove(cluster_key(index, k));
+  cache_lock_.unlock();
   return true;
 }
 
+uint64_t FileSystem::discard_blocks(uint32_t first, uint32_t count) {
+  uint32_t bpg = super_block_->blocks_per_group();
+  uint64_t discarded = 0;
+  while (count) {
+    uint32_t group = first / bpg;
+    uint32_t inner = first % bpg;
+    uint32_t n = std::min(count, bpg - inner);
+    BlockGroup* bg = block_group(group);
+    if (bg == nullptr) break;
+    {
+      // the blocks may have been allocated again since they were freed, the
+      // lock keeps them free until the device has let them go
+      std::lock_guard<TimedSharedMutex> lck(bg->mutex());
+      bg->visit_free_runs(inner, inner + n, 1,
+                          [&](uint32_t run, uint32_t len) {
+                            discarded += discard_run(group, run, len);
+                          });
+    }
+    first += n;
+    count -= n;
+  }
+  return discarded;
+}
+
+uint64_t FileSystem::trim(uint64_t first, uint64_t end, uint32_t min) {
+  uint32_t bpg = super_block_->blocks_per_group();
+  uint32_t dpg = data_blocks_per_group(super_block_->get_super());
+  uint32_t n_groups = super_block_->num_block_groups();
+  end = std::min(end, (uint64_t)n_groups * bpg);
+  if (min == 0) min = 1;
+  uint64_t trimmed = 0;
+  for (uint64_t g = first / bpg; g * bpg < end; ++g) {
+    // a group without enough free blocks is not even loaded
+    if (super_block_->get_group_desc(g)->bg_free_blocks_count < min) continue;
+    BlockGroup* bg = block_group(g);
+    if (bg == nullptr) break;
+    uint32_t begin = g == first / bpg ? first % bpg : 0;
+    uint32_t last = std::min<uint64_t>(dpg, end - g * bpg);
+    bool whole = begin == 0 && last == dpg;
+    std::lock_guard<TimedSharedMutex> lck(bg->mutex());
+    if (whole && bg->trimmed(min)) continue;
+    // blocks a snapshot still refers to are left for a later trim
+    bool complete = true;
+    bg->visit_free_runs(begin, last, min, [&](uint32_t run, uint32_t len) {
+      uint32_t n = discard_run(g, run, len);
+      trimmed += n;
+      if (n < len) complete = false;
+    });
+    if (whole && complete) bg->set_trimmed(min);
+  }
+  return trimmed;
+}
+
+uint32_t FileSystem::discard_run(uint32_t group, uint32_t first,
+                                 uint32_t len) {
+  uint32_t discarded = 0;
+  // discarding a block the newest snapshot refers to would copy it out first
+  snapshots_->visit_discardable(
+      data_block_offset(super_block_->get_super(), group, first),
+      BLOCKS2BYTES((uint64_t)len), [&](off_t where, size_t size) {
+        if (disk_discard(where, size) == 0) discarded += size / BLOCK_SIZE;
+      });
+  return discarded;
+}
+
+AllocContext* FileSystem::alloc_context() {
+  int cpu = sched_getcpu();
+  return &contexts_[cpu < 0 ? 0 : cpu % n_contexts_];
+}
+
+void FileSystem::fold_alloc_contexts() {
+  ext2_super_block* super = super_block_->get_super();
+  std::lock_guard<std::mutex> lck(free_space_lock_);
+  for (uint32_t i = 0; i < n_contexts_; ++i) {
+    int64_t blocks = contexts_[i].blocks_.exchange(0);
+    int64_t inodes = contexts_[i].inodes_.exchange(0);
+    super->s_free_blocks_count -= blocks;
+    super->s_blocks_count += blocks;
+    super->s_free_inodes_count -= inodes;
+    super->s_inodes_count += inodes;
+  }
+  // allocations only report groups that filled up or stopped being full
+  std::shared_lock<std::shared_mutex> groups_lck(groups_lock_);
+  for (auto bg : block_groups_) {
+    ext2_group_desc* desc = super_block_->get_group_desc(bg.first);
+    free_space_.update(FREE_BLOCKS, bg.first, desc->bg_free_blocks_count);
+    free_space_.update(FREE_INODES, bg.first, desc->bg_free_inodes_count);
+  }
+  folded_free_blocks_ = free_space_.total(FREE_BLOCKS);
+}
+
+void FileSystem::prepare_checksums() {
+  if (checksums() == nullptr) return;
+  std::vector<Block*> blocks;
+  super_block_->get_metadata(&blocks);
+  {
+    std::shared_lock<std::shared_mutex> lck(groups_lock_);
+    for (auto bg : block_groups_) bg.second->get_metadata(&blocks);
+  }
+  // groups and metadata blocks stay, cached blocks may go once unlocked
+  std::vector<off_t> offsets;
+  for (auto block : blocks) offsets.push_back(block->offset());
+  {
+    std::shared_lock<TimedSharedMutex> lck(cache_lock_);
+    block_cache_->visit_dirty([&offsets](uint64_t index, Block* block) {
+      if (index <= UINT32_MAX && checksums()->covers(block->file_data()))
+        offsets.push_back(block->offset());
+    });
+  }
+  checksums()->prepare(offsets);
+}
+
+void FileSystem::flush_super_block() {
+  fold_alloc_contexts();
+  // meta groups may get new descriptor blocks
+  std::shared_lock<std::shared_mutex> lck(groups_lock_);
+  super_block_->flush();
+}
+
 }  // namespace naivefs
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include "freespace.h"
+
+namespace naivefs {
+
+void FreeSpaceIndex::update(FreeSpaceKind kind, uint32_t group,
+                            uint32_t free) {
+  Summary& summary = summary_[kind];
+  if (group >= summary.free_.size()) summary.free_.resize(group + 1, 0);
+  uint32_t old = summary.free_[group];
+  if (old == free) return;
+  if (old > 0) {
+    summary.available_.erase(group);
+    summary.by_free_.erase(std::make_pair(old, -(int64_t)group));
+  }
+  summary.free_[group] = free;
+  summary.total_ += (int64_t)free - old;
+  if (free > 0) {
+    summary.available_.insert(group);
+    summary.by_free_.insert(std::make_pair(free, -(int64_t)group));
+  }
+}
+
+int64_t FreeSpaceIndex::find(FreeSpaceKind kind, uint32_t goal) const {
+  const Summary& summary = summary_[kind];
+  auto iter = summary.available_.lower_bound(goal);
+  if (iter == summary.available_.end()) return -1;
+  return *iter;
+}
+
+int64_t FreeSpaceIndex::most_free(FreeSpaceKind kind) const {
+  const Summary& summary = summary_[kind];
+  if (summary.by_free_.empty()) return -1;
+  return -summary.by_free_.rbegin()->second;
+}
+
+}  // namespace naivefs
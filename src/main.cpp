@@ -8,24 +8,53 @@
 #include "utils/disk.h"
 #include "utils/option.h"
 #include "utils/path.h"
+#include "utils/trace.h"
 
 #define OPTION(t, p) \
   { t, offsetof(naivefs::options, p), 1 }
+#define VALUE_OPTION(t, p) \
+  { t, offsetof(naivefs::options, p), 0 }
 static const struct fuse_opt option_spec[] = {
-    OPTION("-h", show_help), OPTION("--help", show_help), FUSE_OPT_END};
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    VALUE_OPTION("device=%s", device),
+    VALUE_OPTION("cache_blocks=%u", cache_blocks),
+    VALUE_OPTION("dentry_cache=%u", dentry_cache),
+    VALUE_OPTION("io_engine=%s", io_engine),
+    VALUE_OPTION("readahead_kb=%u", readahead_kb),
+    VALUE_OPTION("trace=%s", trace),
+    OPTION("noreservation", noreservation),
+    OPTION("discard", discard),
+    FUSE_OPT_END};
 static struct fuse_operations ops;
 static void show_help(const char *progname) {
   printf("usage: %s [options] <mountpoint>\n\n", progname);
   printf(
       "File-system specific options:\n"
-      "    --name=<s>          Name of the \"hello\" file\n"
-      "                        (default: \"hello\")\n"
-      "    --contents=<s>      Contents \"hello\" file\n"
-      "                        (default \"Hello, World!\\n\")\n"
-      "\n");
+      "    -o device=<s>          Disk image, block device or ram:<size>\n"
+      "                           (default: \"" DISK_NAME "\")\n"
+      "    -o cache_blocks=<n>    Blocks kept in the block cache\n"
+      "                           (default: %d)\n"
+      "    -o dentry_cache=<n>    Entries kept in the dentry cache\n"
+      "                           (default: %d)\n"
+      "    -o io_engine=<s>       \"" IO_ENGINE_DIRECT "\" or \"" IO_ENGINE_BUFFERED "\"\n"
+      "                           (default: \"" IO_ENGINE_DIRECT "\")\n"
+      "    -o readahead_kb=<n>    Readahead of the buffered engine\n"
+      "                           (default: 0)\n"
+      "    -o trace=<path>        Record every operation into a trace\n"
+      "                           for naivefs_replay\n"
+      "    -o noreservation       Don't preallocate blocks ahead of growing\n"
+      "                           files\n"
+      "    -o discard             Discard freed blocks on the device, in\n"
+      "                           batches in the background\n"
+      "\n"
+      "The block size (%d) is part of the on-disk format and fixed at build\n"
+      "time.\n"
+      "\n",
+      BLOCK_CACHE_SIZE, DENTRY_CACHE_SIZE, BLOCK_SIZE);
 }
 
-naivefs::options global_options = {.show_help = 0};
+using naivefs::global_options;
 
 void test_disk() {
   uint8_t *buf = (uint8_t *)naivefs::alloc_aligned(4096);
@@ -77,7 +106,7 @@ void test_dentry_cache() {
 using namespace std;
 void test_filesystem() {
   naivefs::disk_open();
-  naivefs::FileSystem *fs = new naivefs::FileSystem();
+  naivefs::FileSystem *fs = new naivefs::FileSystem(global_options);
   ext2_inode *home_inode;
   INFO("%d", fs->inode_create("/home", &home_inode, S_IFDIR));
   ext2_inode *test_inode;
@@ -121,7 +150,21 @@ int main(int argc, char *argv[]) {
 
   int ret;
   fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  // fuse_opt_parse frees the old value of string options
+  global_options.device = strdup(DISK_NAME);
+  global_options.cache_blocks = BLOCK_CACHE_SIZE;
+  global_options.dentry_cache = DENTRY_CACHE_SIZE;
+  global_options.io_engine = strdup(IO_ENGINE_DIRECT);
+  global_options.readahead_kb = 0;
   if (fuse_opt_parse(&args, &global_options, option_spec, NULL) == -1) return 1;
+  if (strcmp(global_options.io_engine, IO_ENGINE_DIRECT) && strcmp(global_options.io_engine, IO_ENGINE_BUFFERED)) {
+    fprintf(stderr, "Unknown io_engine: %s\n", global_options.io_engine);
+    return 1;
+  }
+  if (global_options.cache_blocks == 0 || global_options.dentry_cache == 0) {
+    fprintf(stderr, "Cache sizes must be positive\n");
+    return 1;
+  }
   if (global_options.show_help) {
     show_help(argv[0]);
     assert(fuse_opt_add_arg(&args, "--help") == 0);
@@ -150,7 +193,16 @@ int main(int argc, char *argv[]) {
   ops.utimens = naivefs::fuse_utimens;
   ops.flush = naivefs::fuse_flush;
   ops.chown = naivefs::fuse_chown;
+  ops.ioctl = naivefs::fuse_ioctl;
+  if (global_options.trace && !global_options.show_help) {
+    if (naivefs::trace_open(global_options.trace) < 0) {
+      fprintf(stderr, "Failed to open trace %s\n", global_options.trace);
+      return 1;
+    }
+    naivefs::trace_install(&ops);
+  }
   ret = fuse_main(args.argc, args.argv, &ops, NULL);
+  naivefs::trace_close();
   fuse_opt_free_args(&args);
   return ret;
 }
\ No newline at end of file
@@ -2,10 +2,13 @@
 
 namespace naivefs {
 
-extern std::shared_mutex _big_lock;
+extern TimedSharedMutex _big_lock;
 
 int fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_GETATTR);
+  if (_is_snapshot_path(path)) return _snapshot_getattr(path, stbuf);
+  if (_is_stats_path(path)) return _stats_getattr(path, stbuf);
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   (void)fi;
   INFO("GETATTR: %s", path);
   if (!stbuf) return -EINVAL;
@@ -33,7 +36,9 @@ int fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi
   stbuf->st_rdev = 0;                      // ID of device (special file)
   stbuf->st_size = inode->i_size;          // size in bytes
   stbuf->st_blksize = BLOCK_SIZE;
-  stbuf->st_blocks = inode->i_blocks;  // number of 512 bytes
+  // number of 512 bytes, with the delayed blocks and without those saved by
+  // compression
+  stbuf->st_blocks = inode->i_blocks + ((int64_t)ic->delayed_.size() - inode->i_compr_saved) * (BLOCK_SIZE / 512);
   stbuf->st_atime = inode->i_atime;    // access time
   stbuf->st_mtime = inode->i_mtime;    // modify time
   stbuf->st_ctime = inode->i_ctime;    // change time
@@ -45,7 +50,9 @@ int fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi
 }
 
 int fuse_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_CHMOD);
+  if (_is_virtual_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   (void)fi;
   INFO("CHMOD: %s", path);
   ext2_inode *inode;
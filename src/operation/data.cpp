@@ -2,13 +2,16 @@
 
 namespace naivefs {
 
-extern std::shared_mutex _big_lock;
+extern TimedSharedMutex _big_lock;
 // options global_options;
 // it returns the number of bytes it read if success.
 int fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  STAT_TIMER(STAT_OP_READ);
+  if (_is_snapshot_path(path)) return _snapshot_read(path, buf, size, offset, fi);
+  if (_is_stats_path(path)) return _stats_read(path, buf, size, offset, fi);
   INFO("READ %s", path);
   // TODO: locking, poll events
-  std::shared_lock<std::shared_mutex> __lck(_big_lock);
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
   if (fs == nullptr || fi == nullptr) return -EINVAL;
   auto fd = _fuse_trans_info(fi);
 
@@ -20,9 +23,11 @@ int fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fus
 }
 
 int fuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  STAT_TIMER(STAT_OP_WRITE);
+  if (_is_virtual_path(path)) return -EROFS;
   INFO("WRITE %s", path);
   // if returns 0, OS will consider this as EIO.
-  std::shared_lock<std::shared_mutex> __lck(_big_lock);
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
 
   if (fs == nullptr || fi == nullptr) return -EINVAL;
   auto fd = _fuse_trans_info(fi);
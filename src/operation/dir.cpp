@@ -4,9 +4,12 @@ namespace naivefs {
 // options global_options;
 
 
-extern std::shared_mutex _big_lock;
+extern TimedSharedMutex _big_lock;
 int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_READDIR);
+  if (_is_snapshot_path(path)) return _snapshot_readdir(path, buf, filler);
+  if (_is_stats_path(path)) return _stats_readdir(path, buf, filler);
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   // TODO: readdir can be thread-safe
   (void)offset;
   (void)fi;
@@ -35,7 +38,10 @@ int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
 }
 
 int fuse_mkdir(const char *path, mode_t mode) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_MKDIR);
+  if (_is_snapshot_path(path)) return _snapshot_mkdir(path);
+  if (_is_stats_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("MKDIR: %s", path);
   mode |= S_IFDIR;
 
@@ -58,7 +64,7 @@ int fuse_mkdir(const char *path, mode_t mode) {
   inode->i_atime = nw_time;
   inode->i_ctime = nw_time;
   inode->i_mtime = nw_time;
-  inode->i_flags = 0;  // now we don't care this
+  inode->i_flags &= EXT2_INLINE_DATA_FL | EXT2_COMPR_FL | EXT2_DEDUP_FL;  // only the storage flags are used
   inode->i_gid = current_user->gid;
   inode->i_uid = current_user->uid;
   ic->commit();
@@ -71,7 +77,10 @@ int fuse_mkdir(const char *path, mode_t mode) {
 }
 
 int fuse_rmdir(const char *path) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_RMDIR);
+  if (_is_snapshot_path(path)) return _snapshot_rmdir(path);
+  if (_is_stats_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   DEBUG("RMDIR %s", path);
   ext2_inode *parent;
   uint32_t inode_id;
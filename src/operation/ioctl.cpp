@@ -0,0 +1,96 @@
+#include "operation.h"
+
+namespace naivefs {
+
+extern TimedSharedMutex _big_lock;
+
+static int defrag(struct fuse_file_info *fi, unsigned int flags, naivefs_defrag *defrag) {
+  if (flags & FUSE_IOCTL_DIR) return -EISDIR;
+  // reads and writes go on while the file is copied
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+  if (fs == nullptr || fi == nullptr || defrag == nullptr) return -EINVAL;
+  auto fd = _fuse_trans_info(fi);
+  if (!fd) return -EBADF;
+
+  auto ic = fd->inode_cache_;
+  if (!(defrag->flags & NAIVEFS_DEFRAG_QUERY)) {
+    // moving the blocks of a file takes the right to write it
+    ic->lock_shared();
+    bool allowed = _check_permission(ic->cache_->i_mode, 0, 1, 0, ic->cache_->i_gid, ic->cache_->i_uid);
+    ic->unlock_shared();
+    if (!allowed) return -EACCES;
+  }
+  return ic->defrag(defrag);
+}
+
+static int trim(naivefs_trim_range *range) {
+  if (fuse_get_context()->uid != 0) return -EPERM;
+  // only free blocks are touched, under the locks of their groups
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+  if (fs == nullptr || range == nullptr) return -EINVAL;
+  uint64_t first = range->start / BLOCK_SIZE;
+  uint64_t end = range->len > UINT64_MAX - range->start ? UINT64_MAX / BLOCK_SIZE
+                                                        : (range->start + range->len) / BLOCK_SIZE;
+  uint64_t min = (range->minlen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint64_t trimmed = fs->trim(first, end, std::min<uint64_t>(min, UINT32_MAX));
+  range->len = BLOCKS2BYTES(trimmed);
+  return 0;
+}
+
+// the flags of i_flags lsattr(1) shows, the read-only ones are ignored when
+// they are set
+#define VISIBLE_FLAGS \
+  (EXT2_COMPR_FL | EXT2_COMPRBLK_FL | EXT2_DEDUP_FL | EXT2_DEDUPBLK_FL | EXT2_INLINE_DATA_FL)
+
+static int file_flags(const char *path, unsigned int cmd, uint32_t *flags) {
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
+  if (fs == nullptr || flags == nullptr) return -EINVAL;
+  ext2_inode *inode;
+  uint32_t inode_id;
+  auto ret = fs->inode_lookup(path, &inode, &inode_id);
+  if (ret) return Code2Errno(ret);
+  auto ic = opm->get_cache(inode_id);
+  if (!ic) return -EIO;
+
+  int err = 0;
+  ic->lock();
+  inode = ic->cache_;
+  if (cmd == NAIVEFS_IOC_GETFLAGS) {
+    *flags = inode->i_flags & VISIBLE_FLAGS;
+  } else if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode)) {
+    err = -ENOTTY;
+  } else if ((*flags & ~VISIBLE_FLAGS) || ((*flags & EXT2_DEDUP_FL) && !fs->dedup())) {
+    err = -EOPNOTSUPP;
+  } else if (fuse_get_context()->uid != 0 && fuse_get_context()->uid != inode->i_uid) {
+    err = -EPERM;
+  } else {
+    // clusters compressed and blocks shared so far stay so when they are
+    // cleared
+    const uint32_t settable = EXT2_COMPR_FL | EXT2_DEDUP_FL;
+    inode->i_flags = (inode->i_flags & ~settable) | (*flags & settable);
+    err = ic->commit();
+  }
+  ic->unlock();
+  opm->rel_cache(inode_id);
+  return err;
+}
+
+int fuse_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+  STAT_TIMER(STAT_OP_IOCTL);
+  (void)arg;
+  if (_is_virtual_path(path)) return -ENOTTY;
+  INFO("IOCTL %s, cmd %x", path, cmd);
+  switch ((unsigned int)cmd) {
+    case NAIVEFS_IOC_DEFRAG:
+      return defrag(fi, flags, reinterpret_cast<naivefs_defrag *>(data));
+    case NAIVEFS_IOC_TRIM:
+      return trim(reinterpret_cast<naivefs_trim_range *>(data));
+    case NAIVEFS_IOC_GETFLAGS:
+    case NAIVEFS_IOC_SETFLAGS:
+      return file_flags(path, cmd, reinterpret_cast<uint32_t *>(data));
+    default:
+      return -ENOTTY;
+  }
+}
+
+}  // namespace naivefs
@@ -6,9 +6,11 @@
 #define RENAME_WHITEOUT (1 << 2)  /* Whiteout source */
 
 namespace naivefs {
-extern std::shared_mutex _big_lock;
+extern TimedSharedMutex _big_lock;
 int fuse_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_CREATE);
+  if (_is_virtual_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("CREATE %s, mode %d", path, mode);
   // if O_CREAT is specified without mode specified, mode will be something in
   // the stack.
@@ -37,7 +39,7 @@ int fuse_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
   inode->i_atime = nw_time;
   inode->i_ctime = nw_time;
   inode->i_mtime = nw_time;
-  inode->i_flags = 0;  // now we don't care this
+  inode->i_flags &= EXT2_INLINE_DATA_FL | EXT2_COMPR_FL | EXT2_DEDUP_FL;  // only the storage flags are used
   inode->i_gid = current_user->gid;
   inode->i_uid = current_user->uid;
   ic->commit();
@@ -48,7 +50,10 @@ int fuse_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
   return 0;
 }
 int fuse_open(const char* path, struct fuse_file_info* fi) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_OPEN);
+  if (_is_snapshot_path(path)) return _snapshot_open(path, fi);
+  if (_is_stats_path(path)) return _stats_open(path, fi);
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("OPEN %s", path);
 
   ext2_inode* inode;
@@ -79,7 +84,9 @@ int fuse_open(const char* path, struct fuse_file_info* fi) {
 }
 
 int fuse_rename(const char* oldname, const char* newname, unsigned int flags) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_RENAME);
+  if (_is_virtual_path(oldname) || _is_virtual_path(newname)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("RENAME %s, %s", oldname, newname);
 
   ext2_inode *_old, *_new;
@@ -133,7 +140,9 @@ int fuse_rename(const char* oldname, const char* newname, unsigned int flags) {
 }
 
 int fuse_truncate(const char* path, off_t offset, struct fuse_file_info* fi) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_TRUNCATE);
+  if (_is_virtual_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("TRUNATE %s", path);
   // char buf[1];
   // fuse_write(path, buf, 0, offset, fi);
@@ -141,7 +150,9 @@ int fuse_truncate(const char* path, off_t offset, struct fuse_file_info* fi) {
 }
 
 int fuse_link(const char* src, const char* dst) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_LINK);
+  if (_is_virtual_path(src) || _is_virtual_path(dst)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("LINK %s,%s", src, dst);
 
   RetCode ret = fs->inode_link(src, dst);
@@ -151,7 +162,9 @@ int fuse_link(const char* src, const char* dst) {
 }
 
 int fuse_unlink(const char* path) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_UNLINK);
+  if (_is_virtual_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("UNLINK %s", path);
 
   ext2_inode* inode;
@@ -175,7 +188,9 @@ int fuse_unlink(const char* path) {
 }
 
 int fuse_access(const char* path, int mode) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_ACCESS);
+  if (_is_virtual_path(path)) return (mode & W_OK) ? -EROFS : 0;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("ACCESS %s", path);
   ext2_inode* inode;
   uint32_t inode_id;
@@ -187,7 +202,9 @@ int fuse_access(const char* path, int mode) {
 }
 
 int fuse_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_UTIMENS);
+  if (_is_virtual_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("UTIMENS %s", path);
 
   // see i_atime and i_atime_extra in https://ext4.wiki.kernel.org/index.php/Ext4_Disk_Layout
@@ -252,8 +269,11 @@ int fuse_utimens(const char* path, const struct timespec tv[2], struct fuse_file
 }
 
 int fuse_release(const char* path, struct fuse_file_info* fi) {
+  STAT_TIMER(STAT_OP_RELEASE);
+  if (_is_snapshot_path(path)) return _snapshot_release(path, fi);
+  if (_is_stats_path(path)) return _stats_release(path, fi);
   INFO("RELEASE %s", path);
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   if (fs == nullptr || fi == nullptr) return -EINVAL;
   auto fd = _fuse_trans_info(fi);
 
@@ -267,21 +287,23 @@ int fuse_release(const char* path, struct fuse_file_info* fi) {
 }
 
 int fuse_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+  STAT_TIMER(STAT_OP_FSYNC);
+  if (_is_virtual_path(path)) return 0;
   DEBUG("FSYNC %s", path);
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   if (fs == nullptr || fi == nullptr || !path) return -EINVAL;
   auto fd = _fuse_trans_info(fi);
   if (!fd) return -EBADF;
 
-  if (datasync) {
-    fs->flush(fd->inode_cache_->inode_id_);
-  } else {
-    fd->inode_cache_->lock_shared();
-    fd->inode_cache_->commit();
-    fd->inode_cache_->unlock_shared();
-    fs->flush(fd->inode_cache_->inode_id_);
-  }
-  return 0;
+  // the delayed blocks are allocated first, which changes the inode
+  auto ic = fd->inode_cache_;
+  ic->lock();
+  bool allocated = !ic->delayed_.empty();
+  int ret = ic->writeback();
+  if (!datasync || allocated) ic->commit();
+  ic->unlock();
+  fs->flush(ic->inode_id_);
+  return ret;
 }
 
 int fuse_statfs(const char* path, struct statvfs* stf) {
@@ -297,7 +319,9 @@ int fuse_flush(const char* path, struct fuse_file_info*) {
 }
 
 int fuse_chown(const char* path, uid_t user, gid_t group, struct fuse_file_info* fi) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_CHOWN);
+  if (_is_virtual_path(path)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("CHOWN %s", path);
   ext2_inode* inode;
   uint32_t inode_id;
@@ -132,40 +132,92 @@ int FileStatus::copy_to_buf(char* buf, size_t offset, size_t size) {
   std::shared_lock<std::shared_mutex> lck_inode(inode_cache_->inode_rwlock_);
   size_t isize = file_size();
   if (offset >= isize) return 0;
+  if (INODE_IS_INLINE(inode_cache_->cache_)) {
+    size_t csz = std::min(size, isize - offset);
+    memcpy(buf, reinterpret_cast<uint8_t*>(inode_cache_->cache_->i_block) + offset, csz);
+    return csz;
+  }
   int _err_ret = _upd_cache();
   if (_err_ret) return _err_ret;
 
-  _err_ret = seek(offset / BLOCK_SIZE);
-  if (_err_ret) return _err_ret;
-  Block* blk;
+  return copy_blocks(buf, offset, std::min(size, isize - offset), false);
+}
+
+int FileStatus::copy_blocks(char* buf, size_t offset, size_t size, bool dirty) {
+  DelayedBlocks& delayed = inode_cache_->delayed_;
+  ext2_inode* inode = inode_cache_->cache_;
+  bool seeked = false;
   size_t ret = 0;
-  size_t csz = std::min(size, BLOCK_SIZE - (size_t)offset % BLOCK_SIZE);
-  if (!fs->get_block(block_id_, &blk, false, offset % BLOCK_SIZE, buf, csz)) return -EINVAL;
-  // memcpy(buf, blk->get());
-  ret += csz, size -= csz, offset += csz, buf += csz;
-  INFO("copy_to_buf: ret: %llu, size: %llu, offset: %llu", ret, size, offset);
   while (size) {
-    if (offset >= isize) return ret;
-    _err_ret = next_block();
-    csz = std::min(size, std::min((size_t)isize - (size_t)offset, (size_t)BLOCK_SIZE));
-    if (_err_ret) return _err_ret;
-    if (!fs->get_block(block_id_, &blk, false, 0, buf, csz)) return -EINVAL;
-    // memcpy(buf, blk->get(), csz);
-    ret += csz, size -= csz, offset += csz, buf += csz;
+    uint32_t block = offset / BLOCK_SIZE;
+    uint32_t cluster = block / COMPRESS_CLUSTER_BLOCKS;
+    size_t csz = std::min(size, BLOCK_SIZE - (size_t)offset % BLOCK_SIZE);
+    uint8_t* data = delayed.get(block);
+    uint32_t head;
+    if (data != nullptr) {
+      data += offset % BLOCK_SIZE;
+      dirty ? memcpy(data, buf + ret, csz) : memcpy(buf + ret, data, csz);
+    } else if ((!seeked || block % COMPRESS_CLUSTER_BLOCKS == 0) && fs->compressed_cluster(inode, cluster, &head)) {
+      // the part of the cluster at once, a write stores it again
+      csz = std::min(size, (size_t)(cluster + 1) * CLUSTER_BYTES - offset);
+      if (!fs->copy_cluster(inode, inode_cache_->inode_id_, cluster, head, offset % CLUSTER_BYTES, buf + ret, csz, dirty))
+        return dirty ? -ENOSPC : -EIO;
+      if (dirty) inode_cache_->upd_all();
+      seeked = false;
+    } else {
+      int _err_ret = seeked ? next_block() : seek(block);
+      if (_err_ret) return _err_ret;
+      seeked = true;
+      Block* blk;
+      bool moved;
+      if (dirty && (inode->i_flags & EXT2_DEDUPBLK_FL)) {
+        // a shared block is copied first
+        if (!fs->write_data_block(inode, block, block_id_, offset % BLOCK_SIZE, buf + ret, csz, &moved)) return -ENOSPC;
+        if (moved) {
+          inode_cache_->upd_all();
+          seeked = false;
+        }
+      } else if (!fs->get_block(block_id_, &blk, dirty, offset % BLOCK_SIZE, buf + ret, csz, true)) {
+        return -EIO;
+      }
+    }
+    ret += csz, size -= csz, offset += csz;
   }
+  INFO("copy_blocks: ret: %llu, offset: %llu", ret, offset);
   return ret;
 }
 
+int FileStatus::write_inline(const char* buf, size_t offset, size_t size, bool append_flag) {
+  ext2_inode* inode = inode_cache_->cache_;
+  // another writer may have moved the data out
+  if (!INODE_IS_INLINE(inode)) return 0;
+  if (append_flag) offset = inode->i_size;
+  if (offset + size <= INLINE_DATA_SIZE) {
+    memcpy(reinterpret_cast<uint8_t*>(inode->i_block) + offset, buf, size);
+    inode->i_size = std::max((size_t)inode->i_size, offset + size);
+    return size;
+  }
+  Block* blk;
+  uint32_t index;
+  if (!fs->inline_to_block(inode, inode_cache_->inode_id_, &blk, &index)) return -EIO;
+  INFO("write: inline data moved to block %u", index);
+  inode_cache_->upd_all();
+  return 0;
+}
+
 int FileStatus::write(const char* buf, size_t offset, size_t size, bool append_flag) {
   std::unique_lock<std::shared_mutex> lck(rwlock);
   inode_cache_->lock_shared();
-  size_t isize = file_size();
-  /*
-  INFO("Begin to write, %d, %d", isize, offset);
-  if (offset > isize) {
+  if (INODE_IS_INLINE(inode_cache_->cache_)) {
     inode_cache_->unlock_shared();
-    return 0;
-  }*/
+    {
+      std::unique_lock<std::shared_mutex> inode_lck(inode_cache_->inode_rwlock_);
+      int ret = write_inline(buf, offset, size, append_flag);
+      if (ret) return ret;
+    }
+    inode_cache_->lock_shared();
+  }
+  size_t isize = file_size();
   // It seems that offset can > isize
   int _err_ret = _upd_cache();
   if (_err_ret) {
@@ -175,116 +227,249 @@ int FileStatus::write(const char* buf, size_t offset, size_t size, bool append_f
   }
   if (append_flag) offset = isize;
   INFO("Begin to write, now block: %u(%u), write offset: %llu\n", block_id_, block_id_in_file_, offset);
-  if (offset + size > isize) {
+  // writes to compressed clusters and shared blocks change the block map too
+  if (offset + size > isize || (inode_cache_->cache_->i_flags & (EXT2_COMPRBLK_FL | EXT2_DEDUPBLK_FL))) {
     // Now we need to modify the inode.
     inode_cache_->unlock_shared();
     std::unique_lock<std::shared_mutex> inode_lck(inode_cache_->inode_rwlock_);
     isize = file_size();
     if (append_flag) offset = isize;
 
-    Block* blk;
-    while (inode_cache_->cache_->i_size + BLOCK_SIZE - inode_cache_->cache_->i_size % BLOCK_SIZE < offset) {
-      uint32_t index;
-      if (!fs->alloc_block(&blk, &index, inode_cache_->cache_)) return 0;
-      inode_cache_->cache_->i_size += BLOCK_SIZE - inode_cache_->cache_->i_size % BLOCK_SIZE;
-    }
-    if (inode_cache_->cache_->i_size % BLOCK_SIZE == 0) {
-      uint32_t index;
-      if (!fs->alloc_block(&blk, &index, inode_cache_->cache_)) return 0;
-    }
-    _err_ret = seek(offset / BLOCK_SIZE);
+    // the blocks past the mapped ones get data blocks at writeback
+    _err_ret = inode_cache_->delay((offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE);
     if (_err_ret) return _err_ret;
-    INFO("write: seek success");
-
-    // write is dirty
-    // since get_block...memcpy(blk->get()) is not atomic (but we can assume this when the number of threads is small, and cache is big although),
-    size_t ret = 0;
-    size_t csz = std::min(size, BLOCK_SIZE - (size_t)offset % BLOCK_SIZE);
-    if (!fs->get_block(block_id_, &blk, true, offset % BLOCK_SIZE, buf + ret, csz)) return -EINVAL;
-    INFO("write read first block");
-    ret += csz, size -= csz, offset += csz, inode_cache_->cache_->i_size = std::max((size_t)inode_cache_->cache_->i_size, (size_t)offset);
-
-    while (size) {
-      csz = std::min(size, (size_t)BLOCK_SIZE);
-      if (offset >= inode_cache_->cache_->i_size) {
-        INFO("write: need allocation");
-        uint32_t _;
-        if (!fs->alloc_block(&blk, &_, inode_cache_->cache_)) return ret;
-        if (next_block()) {
-          WARNING("write: EIO");
-          return -EIO;
-        }
-        if (!fs->get_block(block_id_, &blk, true, 0, buf + ret, csz)) {
-          WARNING("write: EIO");
-          return -EIO;
-        }
-      } else {
-        INFO("write: don't need allocation");
-        if (next_block()) {
-          WARNING("write: EIO");
-          return -EIO;
-        }
-        if (!fs->get_block(block_id_, &blk, true, 0, buf + ret, csz)) {
-          WARNING("write: EIO");
-          return -EIO;
-        }
-      }
-      // memcpy(blk->get(), buf + ret, csz);
-      INFO("write read blocks");
-      ret += csz, size -= csz, offset += csz, inode_cache_->cache_->i_size = std::max((size_t)inode_cache_->cache_->i_size, (size_t)offset);
+    int ret = copy_blocks(const_cast<char*>(buf), offset, size, true);
+    if (ret < 0) {
+      WARNING("write: EIO");
+      return ret;
     }
-
-    INFO("write: upd_All");
-    inode_cache_->upd_all();
+    inode_cache_->cache_->i_size = std::max((size_t)inode_cache_->cache_->i_size, offset + ret);
+    inode_cache_->version_++;
+    if (inode_cache_->delayed_.size() >= DELALLOC_MAX_BLOCKS) inode_cache_->writeback();
     INFO("write: end");
 
     return ret;
 
   } else {
     INFO("write: overlap");
-    _err_ret = seek(offset / BLOCK_SIZE);
-    if (_err_ret) {
-      inode_cache_->unlock_shared();
-      return _err_ret;
+    int ret = copy_blocks(const_cast<char*>(buf), offset, size, true);
+    // after the copy, a defragmentation copying meanwhile sees it
+    inode_cache_->version_++;
+    inode_cache_->unlock_shared();
+    return ret;
+  }
+  return 0;
+}
+
+bool DelayedBlocks::extend(uint32_t mapped, uint32_t end) {
+  if (buffers_.empty()) first_ = mapped;
+  if (end <= first_ + buffers_.size()) return true;
+  uint32_t n = end - first_ - buffers_.size();
+  if (!fs->reserve_blocks(n)) return false;
+  for (uint32_t i = 0; i < n; ++i) {
+    auto buf = (uint8_t*)BufferPool::block_pool()->alloc();
+    memset(buf, 0, BLOCK_SIZE);
+    buffers_.push_back(buf);
+  }
+  return true;
+}
+
+int DelayedBlocks::writeback(ext2_inode* inode, uint32_t inode_id) {
+  if (buffers_.empty()) return 0;
+  ASSERT(fs->num_blocks(inode) >= first_);
+  // the blocks a failed writeback mapped are filled first
+  if (fs->num_blocks(inode) > first_) {
+    int ret = store(inode, inode_id, std::min(fs->num_blocks(inode) - first_, size()), nullptr);
+    if (ret || buffers_.empty()) return ret;
+  }
+  if (inode->i_flags & EXT2_COMPR_FL) {
+    int ret = writeback_clusters(inode, inode_id);
+    if (ret || buffers_.empty()) return ret;
+  } else if ((inode->i_flags & EXT2_DEDUP_FL) && S_ISREG(inode->i_mode) && fs->dedup()) {
+    int ret = writeback_dedup(inode, inode_id);
+    if (ret || buffers_.empty()) return ret;
+  }
+  return store(inode, inode_id, buffers_.size(), nullptr);
+}
+
+int DelayedBlocks::writeback_dedup(ext2_inode* inode, uint32_t inode_id) {
+  // the last block may still grow
+  uint32_t full = inode->i_size / BLOCK_SIZE;
+  full = full > first_ ? std::min(full - first_, size()) : 0;
+  // the blocks shared with none, stored together
+  std::vector<uint64_t> hashes;
+  std::unordered_set<uint64_t> run;
+  for (uint32_t i = 0; i < full; ++i) {
+    uint64_t hash = block_hash(buffers_[hashes.size()], BLOCK_SIZE);
+    // one like a block of the run shares it once it is stored
+    if (run.count(hash) != 0) {
+      int ret = store(inode, inode_id, hashes.size(), hashes.data());
+      if (ret) return ret;
+      hashes.clear();
+      run.clear();
+    }
+    uint32_t index;
+    if (!fs->dedup_share(hash, buffers_[hashes.size()], &index)) {
+      hashes.push_back(hash);
+      run.insert(hash);
+      continue;
+    }
+    int ret = store(inode, inode_id, hashes.size(), hashes.data());
+    if (ret || !fs->append_block(inode, index)) {
+      // drops the reference taken
+      fs->free_block(index);
+      return ret ? ret : -ENOSPC;
     }
+    hashes.clear();
+    run.clear();
+    inode->i_flags |= EXT2_DEDUPBLK_FL;
+    BufferPool::block_pool()->free(buffers_[0]);
+    fs->release_blocks(1);
+    buffers_.erase(buffers_.begin());
+    first_++;
+  }
+  return store(inode, inode_id, hashes.size(), hashes.data());
+}
+
+int DelayedBlocks::store(ext2_inode* inode, uint32_t inode_id, uint32_t count, const uint64_t* hashes) {
+  if (count == 0) return 0;
+  std::vector<uint32_t> indexes(count);
+  // mapped by a writeback that could not fill them
+  uint32_t n = 0;
+  for (uint32_t mapped = fs->num_blocks(inode); n < count && first_ + n < mapped; ++n) {
+    if (!fs->lookup_block(inode, first_ + n, &indexes[n])) return -EIO;
+  }
+  n += fs->alloc_blocks(inode, inode_id, count - n, indexes.data() + n);
+  INFO("writeback: %u of %u delayed blocks of inode %u", n, size(), inode_id);
+  // written in place through FileSystem::write_data_block() from now on
+  if (hashes != nullptr && n > 0) inode->i_flags |= EXT2_DEDUPBLK_FL;
+  uint32_t stored = 0;
+  for (; stored < n; ++stored) {
+    // the new blocks are in the block cache
     Block* blk;
-    size_t ret = 0;
-    size_t csz = std::min(size, BLOCK_SIZE - (size_t)offset % BLOCK_SIZE);
-    if (!fs->get_block(block_id_, &blk, true, offset % BLOCK_SIZE, buf + ret, csz)) {
-      inode_cache_->unlock_shared();
-      return -EINVAL;
+    if (!fs->get_block(indexes[stored], &blk, true, 0, reinterpret_cast<char*>(buffers_[stored]), BLOCK_SIZE,
+                       true)) {
+      // the rest stays delayed, the next writeback fills their blocks
+      ERR("writeback: block %u of inode %u cannot be written", indexes[stored], inode_id);
+      break;
     }
-    // memcpy(blk->get() + offset % BLOCK_SIZE, buf + ret, csz);
-    ret += csz, size -= csz, offset += csz;
-    while (size) {
-      csz = std::min(size, (size_t)BLOCK_SIZE);
-      if (offset >= isize) {
-        inode_cache_->unlock_shared();
-        return ret;
-      }
-      _err_ret = next_block();
-      if (_err_ret) {
-        inode_cache_->unlock_shared();
-        return _err_ret;
-      }
-      if (!fs->get_block(block_id_, &blk, true, 0, buf + ret, csz)) {
-        inode_cache_->unlock_shared();
-        return -EINVAL;
-      }
-      // memcpy(blk->get());
-      ret += csz, size -= csz, offset += csz;
+    if (hashes != nullptr) fs->dedup_insert(hashes[stored], indexes[stored]);
+    BufferPool::block_pool()->free(buffers_[stored]);
+  }
+  fs->release_blocks(stored);
+  stat_add(STAT_DELALLOC_BLOCKS, stored);
+  buffers_.erase(buffers_.begin(), buffers_.begin() + stored);
+  first_ += stored;
+  if (stored < n) return -EIO;
+  return n == count ? 0 : -ENOSPC;
+}
+
+int DelayedBlocks::writeback_clusters(ext2_inode* inode, uint32_t inode_id) {
+  std::unique_ptr<uint8_t[]> data(new uint8_t[CLUSTER_BYTES]);
+  while (true) {
+    uint32_t cluster = first_ / COMPRESS_CLUSTER_BLOCKS;
+    // a tail left as it is by the last writeback is stored again with them
+    uint32_t start = cluster * COMPRESS_CLUSTER_BLOCKS;
+    uint32_t n = start + COMPRESS_CLUSTER_BLOCKS - first_;
+    if (n > buffers_.size()) return 0;
+    for (uint32_t i = start; i < first_; ++i) {
+      uint32_t index;
+      Block* blk;
+      char* dst = reinterpret_cast<char*>(data.get()) + BLOCKS2BYTES(i - start);
+      if (!fs->lookup_block(inode, i, &index) || !fs->get_block(index, &blk, false, 0, dst, BLOCK_SIZE, true))
+        return -EIO;
     }
-    inode_cache_->unlock_shared();
-    return ret;
+    for (uint32_t i = 0; i < n; ++i) memcpy(data.get() + BLOCKS2BYTES(first_ - start + i), buffers_[i], BLOCK_SIZE);
+    if (!fs->store_cluster(inode, inode_id, cluster, data.get())) return -ENOSPC;
+    INFO("writeback: cluster %u of inode %u", cluster, inode_id);
+    for (uint32_t i = 0; i < n; ++i) BufferPool::block_pool()->free(buffers_[i]);
+    fs->release_blocks(n);
+    stat_add(STAT_DELALLOC_BLOCKS, n);
+    buffers_.erase(buffers_.begin(), buffers_.begin() + n);
+    first_ += n;
+  }
+}
+
+void DelayedBlocks::drop() {
+  if (buffers_.empty()) return;
+  fs->release_blocks(buffers_.size());
+  stat_add(STAT_DELALLOC_DROPPED, buffers_.size());
+  for (auto buf : buffers_) BufferPool::block_pool()->free(buf);
+  buffers_.clear();
+}
+
+int InodeCache::delay(uint32_t end) {
+  while (true) {
+    if (delayed_.size() >= DELALLOC_MAX_BLOCKS) {
+      int ret = writeback();
+      if (ret) return ret;
+    }
+    uint32_t mapped = fs->num_blocks(cache_);
+    uint32_t next = delayed_.empty() ? mapped : delayed_.first() + delayed_.size();
+    if (next >= end) return 0;
+    if (!delayed_.extend(mapped, std::min(end, next + DELALLOC_MAX_BLOCKS - delayed_.size()))) return -ENOSPC;
   }
-  return 0;
 }
+
+int InodeCache::writeback() {
+  if (delayed_.empty()) return 0;
+  int ret = delayed_.writeback(cache_, inode_id_);
+  upd_all();
+  return ret;
+}
+
 void InodeCache::upd_all() {
+  version_++;
   vec.iter([](FileStatus*& ptr) { ptr->cache_update_flag_ = true; });
   // in critical section
   // for (const auto& a : vec) a->cache_update_flag_ = true;
 }
 
+int InodeCache::defrag(naivefs_defrag* arg) {
+  // the delayed blocks get theirs first
+  lock();
+  int ret = writeback();
+  unlock();
+  if (ret) return ret;
+  for (int tries = 0; tries < DEFRAG_RETRIES; ++tries) {
+    ext2_inode donor;
+    uint64_t version;
+    {
+      std::shared_lock<std::shared_mutex> lck(inode_rwlock_);
+      arg->blocks = fs->num_blocks(cache_);
+      arg->extents_before = arg->extents_after = fs->count_extents(cache_);
+      // compressed clusters and shared blocks stay where they are
+      if ((arg->flags & NAIVEFS_DEFRAG_QUERY) || arg->extents_before <= 1 ||
+          (cache_->i_flags & (EXT2_COMPRBLK_FL | EXT2_DEDUPBLK_FL)))
+        return 0;
+      version = version_;
+      RetCode code = fs->defrag_copy(cache_, inode_id_, &donor);
+      if (code) return Code2Errno(code);
+    }
+    std::unique_lock<std::shared_mutex> lck(inode_rwlock_);
+    if (version_ != version) {
+      // written during the copy
+      INFO("defrag: inode %u changed, copying again", inode_id_);
+      fs->free_block_map(&donor);
+      continue;
+    }
+    ext2_inode old;
+    memcpy(&old, cache_, sizeof(ext2_inode));
+    memcpy(cache_->i_block, donor.i_block, sizeof(donor.i_block));
+    cache_->i_blocks = donor.i_blocks;
+    commit();
+    // open handles seek in the new block map
+    upd_all();
+    fs->free_block_map(&old);
+    // the window followed the old blocks
+    fs->discard_window(inode_id_);
+    arg->extents_after = fs->count_extents(cache_);
+    stat_add(STAT_DEFRAG_BLOCKS, arg->blocks);
+    return 0;
+  }
+  return -EBUSY;
+}
+
 FileStatus* _fuse_trans_info(struct fuse_file_info* fi) { return reinterpret_cast<FileStatus*>(fi->fh); }
 
 bool _check_permission(mode_t mode, int read, int write, int exec, gid_t gid, uid_t uid) {
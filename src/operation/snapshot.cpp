@@ -0,0 +1,182 @@
+#include "operation.h"
+
+namespace naivefs {
+
+extern TimedSharedMutex _big_lock;
+
+static void snapshot_stat(const ext2_inode *inode, uint32_t inode_id, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = inode_id;
+  // snapshots are never writable
+  stbuf->st_mode = inode->i_mode & ~(S_IWUSR | S_IWGRP | S_IWOTH);
+  stbuf->st_nlink = inode->i_links_count;
+  stbuf->st_uid = inode->i_uid;
+  stbuf->st_gid = inode->i_gid;
+  stbuf->st_size = inode->i_size;
+  stbuf->st_blksize = BLOCK_SIZE;
+  stbuf->st_blocks = inode->i_blocks - inode->i_compr_saved * (BLOCK_SIZE / 512);
+  stbuf->st_atime = inode->i_atime;
+  stbuf->st_mtime = inode->i_mtime;
+  stbuf->st_ctime = inode->i_ctime;
+}
+
+bool _is_snapshot_path(const char *path) {
+  if (path == nullptr || path[0] != '/') return false;
+  if (strncmp(path + 1, SNAPSHOT_DIR, SNAPSHOT_DIR_LEN)) return false;
+  char next = path[SNAPSHOT_DIR_LEN + 1];
+  return next == '\0' || next == '/';
+}
+
+int _snapshot_getattr(const char *path, struct stat *stbuf) {
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+  INFO("SNAPSHOT GETATTR: %s", path);
+  if (!stbuf) return -EINVAL;
+  Path snapshot_path(path);
+  if (snapshot_path.size() == 1) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    stbuf->st_nlink = 2;
+    stbuf->st_blksize = BLOCK_SIZE;
+    return 0;
+  }
+  auto name = snapshot_path.get(1);
+  SnapshotView view(fs->snapshots(), name.first, name.second);
+  ext2_inode inode;
+  uint32_t inode_id;
+  RetCode ret = view.lookup(snapshot_path, 2, &inode, &inode_id);
+  if (ret) return Code2Errno(ret);
+  snapshot_stat(&inode, inode_id, stbuf);
+  return 0;
+}
+
+int _snapshot_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+  INFO("SNAPSHOT READDIR: %s", path);
+  Path snapshot_path(path);
+  filler(buf, ".", NULL, 0, FUSE_FILL_DIR_PLUS);
+  filler(buf, "..", NULL, 0, FUSE_FILL_DIR_PLUS);
+  if (snapshot_path.size() == 1) {
+    fs->snapshots()->list([&buf, &filler](const std::string &name) { filler(buf, name.c_str(), NULL, 0, FUSE_FILL_DIR_PLUS); });
+    return 0;
+  }
+  auto name = snapshot_path.get(1);
+  SnapshotView view(fs->snapshots(), name.first, name.second);
+  ext2_inode inode;
+  RetCode ret = view.lookup(snapshot_path, 2, &inode);
+  if (ret) return Code2Errno(ret);
+  if (!S_ISDIR(inode.i_mode)) return -ENOTDIR;
+  view.readdir(inode, [&buf, &filler](const char *name, size_t name_len) {
+    filler(buf, std::string(name, name_len).c_str(), NULL, 0, FUSE_FILL_DIR_PLUS);
+  });
+  return 0;
+}
+
+int _snapshot_mkdir(const char *path) {
+  std::lock_guard<std::mutex> __changes(fs->snapshots()->changes());
+  INFO("SNAPSHOT CREATE: %s", path);
+  Path snapshot_path(path);
+  if (snapshot_path.size() != 2) return -EROFS;
+  if (fuse_get_context()->uid != 0) return -EPERM;
+
+  auto name = snapshot_path.get(1);
+  Snapshot *snapshot;
+  std::vector<uint8_t> bitmaps;
+  {
+    // the bulk of the dirty blocks is written back while the others go on
+    std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+    // open files keep their inodes in the inode cache
+    opm->commit_all();
+    RetCode ret = fs->snapshot_prepare(name.first, name.second, &snapshot, &bitmaps);
+    if (ret) return Code2Errno(ret);
+  }
+  {
+    // what changed since is frozen in memory
+    std::unique_lock<TimedSharedMutex> __lck(_big_lock);
+    opm->commit_all();
+    fs->snapshot_freeze(snapshot, &bitmaps);
+  }
+  RetCode ret = fs->snapshots()->settle(snapshot);
+  if (ret) return Code2Errno(ret);
+  return 0;
+}
+
+int _snapshot_rmdir(const char *path) {
+  // the file system goes on while the blocks are merged into the older one
+  std::lock_guard<std::mutex> __changes(fs->snapshots()->changes());
+  INFO("SNAPSHOT DELETE: %s", path);
+  Path snapshot_path(path);
+  if (snapshot_path.size() != 2) return -EROFS;
+  if (fuse_get_context()->uid != 0) return -EPERM;
+
+  auto name = snapshot_path.get(1);
+  RetCode ret = fs->snapshot_delete(name.first, name.second);
+  if (ret) return Code2Errno(ret);
+  return 0;
+}
+
+int _snapshot_open(const char *path, struct fuse_file_info *fi) {
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+  INFO("SNAPSHOT OPEN: %s", path);
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+  Path snapshot_path(path);
+  if (snapshot_path.size() < 2) return -EISDIR;
+
+  auto name = snapshot_path.get(1);
+  SnapshotView view(fs->snapshots(), name.first, name.second);
+  auto fd = new SnapshotFile;
+  fd->snapshot_ = std::string(name.first, name.second);
+  RetCode ret = view.lookup(snapshot_path, 2, &fd->inode_);
+  if (ret) {
+    delete fd;
+    return Code2Errno(ret);
+  }
+  if (!_check_permission(fd->inode_.i_mode, 1, 0, 0, fd->inode_.i_gid, fd->inode_.i_uid)) {
+    delete fd;
+    return -EACCES;
+  }
+  fi->fh = reinterpret_cast<decltype(fi->fh)>(fd);
+  return 0;
+}
+
+int _snapshot_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+  INFO("SNAPSHOT READ: %s", path);
+  auto fd = reinterpret_cast<SnapshotFile *>(fi->fh);
+  if (!fd) return -EBADF;
+  SnapshotView view(fs->snapshots(), fd->snapshot_.data(), fd->snapshot_.size());
+  if (!view.valid()) return -ENOENT;
+  return view.read(fd->inode_, buf, size, offset);
+}
+
+int _snapshot_release(const char *path, struct fuse_file_info *fi) {
+  INFO("SNAPSHOT RELEASE: %s", path);
+  delete reinterpret_cast<SnapshotFile *>(fi->fh);
+  return 0;
+}
+
+int _snapshot_readlink(const char *path, char *buf, size_t size) {
+  std::shared_lock<TimedSharedMutex> __lck(_big_lock);
+  INFO("SNAPSHOT READLINK: %s", path);
+  Path snapshot_path(path);
+  if (snapshot_path.size() < 2) return -EINVAL;
+
+  auto name = snapshot_path.get(1);
+  SnapshotView view(fs->snapshots(), name.first, name.second);
+  ext2_inode inode;
+  RetCode ret = view.lookup(snapshot_path, 2, &inode);
+  if (ret) return Code2Errno(ret);
+  if (!S_ISLNK(inode.i_mode)) return -EINVAL;
+
+  memset(buf, 0, size);
+  if (inode.i_blocks == 0) {
+    memcpy(buf, inode.i_block, std::min(size - 1, sizeof(inode.i_block)));
+  } else {
+    // the target is stored in the first data block
+    inode.i_size = BLOCK_SIZE;
+    int len = view.read(inode, buf, size - 1, 0);
+    if (len < 0) return len;
+  }
+  return 0;
+}
+
+}  // namespace naivefs
@@ -4,18 +4,35 @@
 
 namespace naivefs {
 
+options global_options = {};
 FileSystem* fs;
 OpManager* opm;
-std::shared_mutex _big_lock;
+TimedSharedMutex _big_lock(STAT_BIG_LOCK_WAIT);
 
 void* fuse_init(struct fuse_conn_info* info, fuse_config* config) {
+  // fuse_main() may have forked the daemon since logging_open()
+  logging_start();
   INFO("INIT");
   INFO("Using FUSE protocol %d.%d", info->proto_major, info->proto_minor);
   (void)config;
 
-  disk_open();
-  fs = new FileSystem();
+  // an embedder may have attached its own device
+  if (disk() == nullptr) {
+    disk_open(global_options.device ? global_options.device : DISK_NAME,
+              io_engine_direct(global_options),
+              (size_t)global_options.readahead_kb << 10);
+  }
+  fs = new FileSystem(global_options);
+  if (fs->error() < 0) {
+    ERR("Cannot mount the file system: %d", fs->error());
+    delete fs;
+    fs = nullptr;
+    fuse_exit(fuse_get_context()->fuse);
+    return NULL;
+  }
   opm = new OpManager();
+  // blocks of deleted files that were never written back are forgotten
+  fs->set_delete_hook([](uint32_t inode_id) { opm->drop_delayed(inode_id); });
 
   // enable writeback cache
   // info->want |= FUSE_CAP_WRITEBACK_CACHE;
@@ -25,7 +42,14 @@ void* fuse_init(struct fuse_conn_info* info, fuse_config* config) {
 
 void fuse_destroy(void* private_data) {
   INFO("DESTROY")
-
+  // the mount failed
+  if (fs == nullptr) {
+    disk_close();
+    return;
+  }
+
+  // allocates the delayed blocks
+  opm->commit_all();
   delete fs;
   delete opm;
   disk_close();
@@ -0,0 +1,72 @@
+#include "operation.h"
+
+namespace naivefs {
+
+bool _is_stats_path(const char *path) {
+  if (path == nullptr || path[0] != '/') return false;
+  if (strncmp(path + 1, STATS_DIR, STATS_DIR_LEN)) return false;
+  char next = path[STATS_DIR_LEN + 1];
+  return next == '\0' || next == '/';
+}
+
+int _stats_getattr(const char *path, struct stat *stbuf) {
+  INFO("STATS GETATTR: %s", path);
+  if (!stbuf) return -EINVAL;
+  Path stats_path(path);
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_blksize = BLOCK_SIZE;
+  if (stats_path.size() == 1) {
+    stbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+  auto name = stats_path.get(1);
+  if (stats_path.size() != 2 || std::string(name.first, name.second) != STATS_FILE) return -ENOENT;
+  // the size is unknown until the report is taken, reads bypass it (direct_io)
+  stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+  stbuf->st_nlink = 1;
+  return 0;
+}
+
+int _stats_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+  INFO("STATS READDIR: %s", path);
+  Path stats_path(path);
+  if (stats_path.size() != 1) return -ENOTDIR;
+  filler(buf, ".", NULL, 0, FUSE_FILL_DIR_PLUS);
+  filler(buf, "..", NULL, 0, FUSE_FILL_DIR_PLUS);
+  filler(buf, STATS_FILE, NULL, 0, FUSE_FILL_DIR_PLUS);
+  return 0;
+}
+
+int _stats_open(const char *path, struct fuse_file_info *fi) {
+  INFO("STATS OPEN: %s", path);
+  struct stat st;
+  int ret = _stats_getattr(path, &st);
+  if (ret) return ret;
+  if (S_ISDIR(st.st_mode)) return -EISDIR;
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+  auto fd = new StatsFile;
+  fd->report_ = stat_report();
+  fi->fh = reinterpret_cast<decltype(fi->fh)>(fd);
+  fi->direct_io = 1;
+  return 0;
+}
+
+int _stats_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  INFO("STATS READ: %s", path);
+  auto fd = reinterpret_cast<StatsFile *>(fi->fh);
+  if (!fd) return -EBADF;
+  if ((size_t)offset >= fd->report_.size()) return 0;
+  size = std::min(size, fd->report_.size() - offset);
+  memcpy(buf, fd->report_.data() + offset, size);
+  return size;
+}
+
+int _stats_release(const char *path, struct fuse_file_info *fi) {
+  INFO("STATS RELEASE: %s", path);
+  delete reinterpret_cast<StatsFile *>(fi->fh);
+  return 0;
+}
+
+}  // namespace naivefs
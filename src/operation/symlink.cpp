@@ -2,9 +2,11 @@
 
 namespace naivefs {
 
-extern std::shared_mutex _big_lock;
+extern TimedSharedMutex _big_lock;
 int fuse_symlink(const char *src, const char *dst) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_SYMLINK);
+  if (_is_virtual_path(dst)) return -EROFS;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("SYMLINK %s, %s", src, dst);
 
   ext2_inode *inode;
@@ -22,7 +24,7 @@ int fuse_symlink(const char *src, const char *dst) {
   } else {
     Block *block;
     uint32_t block_id;
-    if (!fs->alloc_block(&block, &block_id, inode))
+    if (!fs->alloc_block(&block, &block_id, inode, inode_id))
       return Code2Errno(FS_ALLOC_ERR);
     fs->write_block(block, block_id, src, src_len);
   }
@@ -31,7 +33,10 @@ int fuse_symlink(const char *src, const char *dst) {
 }
 
 int fuse_readlink(const char *path, char *buf, size_t size) {
-  std::unique_lock<std::shared_mutex> __lck(_big_lock);
+  STAT_TIMER(STAT_OP_READLINK);
+  if (_is_snapshot_path(path)) return _snapshot_readlink(path, buf, size);
+  if (_is_stats_path(path)) return -EINVAL;
+  std::unique_lock<TimedSharedMutex> __lck(_big_lock);
   INFO("READLINK %s", path);
 
   ext2_inode *inode;
@@ -0,0 +1,215 @@
+#include "operation.h"
+#include "utils/trace.h"
+
+namespace naivefs {
+
+namespace {
+
+inline TraceRecord trace_begin(TraceOp op, struct fuse_file_info *fi = nullptr) {
+  TraceRecord record;
+  memset(&record, 0, sizeof(record));
+  record.op = op;
+  record.start = trace_now();
+  record.fh = fi ? trace_handle(fi->fh) : 0;
+  return record;
+}
+
+inline uint64_t trace_time(const struct timespec &ts) { return ((uint64_t)ts.tv_sec << 32) | (uint32_t)ts.tv_nsec; }
+
+int traced_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_GETATTR, fi);
+  record.ret = fuse_getattr(path, stbuf, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+                   enum fuse_readdir_flags flags) {
+  TraceRecord record = trace_begin(TRACE_READDIR, fi);
+  record.offset = offset;
+  record.ret = fuse_readdir(path, buf, filler, offset, fi, flags);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_open(const char *path, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_OPEN);
+  record.arg = fi->flags;
+  record.ret = fuse_open(path, fi);
+  if (record.ret == 0) record.fh = trace_handle_open(fi->fh);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_READ, fi);
+  record.offset = offset;
+  record.arg = size;
+  record.ret = fuse_read(path, buf, size, offset, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_WRITE, fi);
+  record.offset = offset;
+  record.arg = size;
+  record.ret = fuse_write(path, buf, size, offset, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_CREATE);
+  record.offset = mode;
+  record.arg = fi->flags;
+  record.ret = fuse_create(path, mode, fi);
+  if (record.ret == 0) record.fh = trace_handle_open(fi->fh);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_mkdir(const char *path, mode_t mode) {
+  TraceRecord record = trace_begin(TRACE_MKDIR);
+  record.arg = mode;
+  record.ret = fuse_mkdir(path, mode);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_rmdir(const char *path) {
+  TraceRecord record = trace_begin(TRACE_RMDIR);
+  record.ret = fuse_rmdir(path);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_unlink(const char *path) {
+  TraceRecord record = trace_begin(TRACE_UNLINK);
+  record.ret = fuse_unlink(path);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_rename(const char *oldpath, const char *newpath, unsigned int flags) {
+  TraceRecord record = trace_begin(TRACE_RENAME);
+  record.arg = flags;
+  record.ret = fuse_rename(oldpath, newpath, flags);
+  trace_record(&record, oldpath, newpath);
+  return record.ret;
+}
+
+int traced_link(const char *oldpath, const char *newpath) {
+  TraceRecord record = trace_begin(TRACE_LINK);
+  record.ret = fuse_link(oldpath, newpath);
+  trace_record(&record, oldpath, newpath);
+  return record.ret;
+}
+
+int traced_symlink(const char *target, const char *linkpath) {
+  TraceRecord record = trace_begin(TRACE_SYMLINK);
+  record.ret = fuse_symlink(target, linkpath);
+  trace_record(&record, target, linkpath);
+  return record.ret;
+}
+
+int traced_readlink(const char *path, char *buf, size_t size) {
+  TraceRecord record = trace_begin(TRACE_READLINK);
+  record.arg = size;
+  record.ret = fuse_readlink(path, buf, size);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_TRUNCATE, fi);
+  record.arg = size;
+  record.ret = fuse_truncate(path, size, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_CHMOD, fi);
+  record.arg = mode;
+  record.ret = fuse_chmod(path, mode, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_CHOWN, fi);
+  record.arg = ((uint64_t)uid << 32) | (uint32_t)gid;
+  record.ret = fuse_chown(path, uid, gid, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_UTIMENS, fi);
+  record.offset = tv ? trace_time(tv[0]) : ~0ULL;
+  record.arg = tv ? trace_time(tv[1]) : ~0ULL;
+  record.ret = fuse_utimens(path, tv, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_access(const char *path, int mask) {
+  TraceRecord record = trace_begin(TRACE_ACCESS);
+  record.arg = mask;
+  record.ret = fuse_access(path, mask);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_release(const char *path, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_RELEASE);
+  // the fh may be handed out again as soon as it is released
+  record.fh = trace_handle_release(fi->fh);
+  record.ret = fuse_release(path, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_FSYNC, fi);
+  record.arg = datasync;
+  record.ret = fuse_fsync(path, datasync, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+int traced_flush(const char *path, struct fuse_file_info *fi) {
+  TraceRecord record = trace_begin(TRACE_FLUSH, fi);
+  record.ret = fuse_flush(path, fi);
+  trace_record(&record, path);
+  return record.ret;
+}
+
+}  // namespace
+
+void trace_install(struct fuse_operations *ops) {
+  ops->getattr = traced_getattr;
+  ops->readdir = traced_readdir;
+  ops->open = traced_open;
+  ops->read = traced_read;
+  ops->write = traced_write;
+  ops->create = traced_create;
+  ops->mkdir = traced_mkdir;
+  ops->rmdir = traced_rmdir;
+  ops->unlink = traced_unlink;
+  ops->rename = traced_rename;
+  ops->link = traced_link;
+  ops->symlink = traced_symlink;
+  ops->readlink = traced_readlink;
+  ops->truncate = traced_truncate;
+  ops->chmod = traced_chmod;
+  ops->chown = traced_chown;
+  ops->utimens = traced_utimens;
+  ops->access = traced_access;
+  ops->release = traced_release;
+  ops->fsync = traced_fsync;
+  ops->flush = traced_flush;
+}
+
+}  // namespace naivefs
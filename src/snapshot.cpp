@@ -0,0 +1,806 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include "compress.h"
+
+namespace naivefs {
+
+#define SNAPSHOT_RECORD_SIZE (sizeof(SnapshotRecord) + BLOCK_SIZE)
+
+Snapshot::Snapshot(uint32_t generation, const std::string& name,
+                   const std::string& store)
+    : generation_(generation),
+      name_(name),
+      store_(store),
+      map_(store + ".map"),
+      fd_(-1),
+      end_(0),
+      older_(nullptr),
+      has_map_(false),
+      groups_(0) {}
+
+Snapshot::~Snapshot() {
+  if (fd_ >= 0) close(fd_);
+}
+
+bool Snapshot::open(bool create) {
+  int flags = O_RDWR | (create ? O_CREAT | O_TRUNC : 0);
+  fd_ = ::open(store_.c_str(), flags, 0644);
+  if (fd_ < 0) {
+    ERR("Failed to open snapshot store %s: %s", store_.c_str(),
+        strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) < 0) {
+    ERR("Failed to stat snapshot store %s: %s", store_.c_str(),
+        strerror(errno));
+    return false;
+  }
+  // rebuild the block table from every slot, records are written
+  // concurrently, so a failed or torn one may sit before valid ones
+  uint8_t* buf = (uint8_t*)alloc_aligned(SNAPSHOT_RECORD_SIZE);
+  SnapshotRecord* record = (SnapshotRecord*)buf;
+  end_ = 0;
+  while (end_ < st.st_size) {
+    if (pread(fd_, buf, SNAPSHOT_RECORD_SIZE, end_) !=
+            (ssize_t)SNAPSHOT_RECORD_SIZE ||
+        record->magic != SNAPSHOT_MAGIC ||
+        record->generation != generation_ ||
+        crc32c(0, record + 1, BLOCK_SIZE) != record->checksum) {
+      holes_.push_back(end_);
+    } else {
+      table_[record->offset] = end_;
+    }
+    end_ += SNAPSHOT_RECORD_SIZE;
+  }
+  free(buf);
+  INFO("Snapshot %s (generation %u): %zu blocks preserved, %zu holes",
+       name_.c_str(), generation_, table_.size(), holes_.size());
+  return true;
+}
+
+Snapshot::Holding Snapshot::holds(off_t offset) {
+  std::lock_guard<std::mutex> lck(lock_);
+  if (table_.find(offset) != table_.end() ||
+      frozen_.find(offset) != frozen_.end())
+    return HELD;
+  return lazy_.count(offset) ? ON_DISK : NOT_HELD;
+}
+
+bool Snapshot::copied(off_t offset) {
+  std::lock_guard<std::mutex> lck(lock_);
+  return table_.find(offset) != table_.end();
+}
+
+bool Snapshot::preserved(off_t offset) {
+  std::unique_lock<std::mutex> lck(lock_);
+  copied_.wait(lck, [this, offset] { return pending_.count(offset) == 0; });
+  return table_.find(offset) != table_.end() ||
+         frozen_.find(offset) != frozen_.end();
+}
+
+void Snapshot::freeze(FrozenBlocks* frozen, Snapshot* older) {
+  std::lock_guard<std::mutex> lck(lock_);
+  older_ = older;
+  for (auto& item : *frozen) {
+    if (!referenced(item.first)) continue;
+    if (older != nullptr && older->referenced(item.first)) {
+      std::lock_guard<std::mutex> older_lck(older->lock_);
+      if (older->table_.find(item.first) == older->table_.end())
+        older->lazy_.insert(item.first);
+    }
+    frozen_[item.first] = std::move(item.second);
+  }
+  frozen->clear();
+}
+
+void Snapshot::drop_lazy() {
+  std::lock_guard<std::mutex> lck(lock_);
+  lazy_.clear();
+}
+
+bool Snapshot::hand_down(off_t offset, const uint8_t* frozen, uint8_t* disk) {
+  if (older_ == nullptr || older_->holds(offset) != ON_DISK) return true;
+  if (disk_read(offset, BLOCK_SIZE, disk) < 0) return false;
+  bool same = memcmp(disk, frozen, BLOCK_SIZE) == 0;
+  return older_->settle_lazy(offset, same ? nullptr : disk);
+}
+
+bool Snapshot::settle_lazy(off_t offset, const uint8_t* data) {
+  // durable before the newer snapshot lets the block be overwritten
+  if (data != nullptr && (!preserve(offset, data) || fdatasync(fd_) < 0))
+    return false;
+  std::lock_guard<std::mutex> lck(lock_);
+  lazy_.erase(offset);
+  return true;
+}
+
+bool Snapshot::settle() {
+  struct Settled {
+    off_t offset;
+    const uint8_t* data;
+    off_t record;  // -1 if the disk holds the same data
+  };
+  std::vector<Settled> batch;
+  uint8_t* disk = (uint8_t*)alloc_aligned(BLOCK_SIZE);
+  bool ok = true;
+  std::unique_lock<std::mutex> lck(lock_);
+  while (ok && !frozen_.empty()) {
+    // the blocks a writer copies out meanwhile are written by copy_out()
+    batch.clear();
+    for (auto& item : frozen_) {
+      if (batch.size() == SNAPSHOT_SETTLE_BATCH) break;
+      if (pending_.count(item.first)) continue;
+      batch.push_back({item.first, item.second.get(), -1});
+    }
+    if (batch.empty()) {
+      copied_.wait(lck);
+      continue;
+    }
+    for (auto& item : batch) pending_.insert(item.offset);
+    lck.unlock();
+
+    for (auto& item : batch) {
+      if (disk_read(item.offset, BLOCK_SIZE, disk) < 0) {
+        ok = false;
+        break;
+      }
+      bool same = memcmp(disk, item.data, BLOCK_SIZE) == 0;
+      if (older_ != nullptr && older_->holds(item.offset) == ON_DISK &&
+          !older_->settle_lazy(item.offset, same ? nullptr : disk)) {
+        ok = false;
+        break;
+      }
+      if (same) continue;
+      lck.lock();
+      item.record = claim_record();
+      lck.unlock();
+      if (!write_record(item.offset, item.record, item.data)) {
+        release_record(item.record);
+        item.record = -1;
+        ok = false;
+        break;
+      }
+    }
+    if (ok && fdatasync(fd_) < 0) ok = false;
+
+    lck.lock();
+    for (auto& item : batch) {
+      pending_.erase(item.offset);
+      if (!ok) continue;
+      if (item.record >= 0) table_[item.offset] = item.record;
+      frozen_.erase(item.offset);
+    }
+    copied_.notify_all();
+  }
+  if (ok) older_ = nullptr;
+  lck.unlock();
+  free(disk);
+  return ok && save_map();
+}
+
+bool Snapshot::write_record(off_t offset, off_t record, const uint8_t* data) {
+  SnapshotRecord header;
+  header.offset = offset;
+  header.generation = generation_;
+  header.magic = SNAPSHOT_MAGIC;
+  header.checksum = crc32c(0, data, BLOCK_SIZE);
+  header.reserved = 0;
+  struct iovec iov[2] = {{&header, sizeof(header)},
+                         {const_cast<uint8_t*>(data), BLOCK_SIZE}};
+  if (pwritev(fd_, iov, 2, record) != (ssize_t)SNAPSHOT_RECORD_SIZE) {
+    ERR("Failed to preserve block 0x%jx in snapshot %s", offset,
+        name_.c_str());
+    return false;
+  }
+  return true;
+}
+
+off_t Snapshot::claim_record() {
+  if (!holes_.empty()) {
+    off_t record = holes_.back();
+    holes_.pop_back();
+    return record;
+  }
+  off_t record = end_;
+  end_ += SNAPSHOT_RECORD_SIZE;
+  return record;
+}
+
+void Snapshot::release_record(off_t record) {
+  // best effort, a record left whole would be valid but not in table_
+  SnapshotRecord header;
+  memset(&header, 0, sizeof(header));
+  pwrite(fd_, &header, sizeof(header), record);
+  std::lock_guard<std::mutex> lck(lock_);
+  holes_.push_back(record);
+}
+
+bool Snapshot::preserve(off_t offset, const uint8_t* data) {
+  off_t record;
+  {
+    std::lock_guard<std::mutex> lck(lock_);
+    record = claim_record();
+  }
+  if (!write_record(offset, record, data)) {
+    release_record(record);
+    return false;
+  }
+  std::lock_guard<std::mutex> lck(lock_);
+  table_[offset] = record;
+  return true;
+}
+
+int Snapshot::copy_out(off_t offset, uint8_t* data) {
+  std::unique_lock<std::mutex> lck(lock_);
+  // the old data must be in the store before the block is overwritten
+  copied_.wait(lck, [this, offset] { return pending_.count(offset) == 0; });
+  if (table_.find(offset) != table_.end()) return 0;
+  pending_.insert(offset);
+  off_t record = claim_record();
+  // a frozen block is only erased by the owner of its pending_ entry
+  auto iter = frozen_.find(offset);
+  const uint8_t* frozen = iter != frozen_.end() ? iter->second.get() : nullptr;
+  lck.unlock();
+
+  // and on stable storage, or a crash could keep the write but not the copy
+  bool ok = frozen != nullptr
+                ? hand_down(offset, frozen, data) &&
+                      write_record(offset, record, frozen)
+                : disk_read(offset, BLOCK_SIZE, data) == 0 &&
+                      write_record(offset, record, data);
+  ok = ok && fdatasync(fd_) == 0;
+  if (!ok) release_record(record);
+
+  lck.lock();
+  if (ok) {
+    table_[offset] = record;
+    frozen_.erase(offset);
+  }
+  pending_.erase(offset);
+  lck.unlock();
+  copied_.notify_all();
+  return ok ? 0 : -EIO;
+}
+
+bool Snapshot::load(off_t offset, uint8_t* data) {
+  off_t record;
+  {
+    std::lock_guard<std::mutex> lck(lock_);
+    auto iter = table_.find(offset);
+    if (iter == table_.end()) {
+      auto frozen = frozen_.find(offset);
+      if (frozen == frozen_.end()) return false;
+      memcpy(data, frozen->second.get(), BLOCK_SIZE);
+      return true;
+    }
+    record = iter->second;
+  }
+  return pread(fd_, data, BLOCK_SIZE, record + sizeof(SnapshotRecord)) ==
+         BLOCK_SIZE;
+}
+
+bool Snapshot::merge_into(Snapshot* target) {
+  // the newest snapshot keeps copying out meanwhile
+  std::vector<off_t> offsets;
+  {
+    std::lock_guard<std::mutex> lck(lock_);
+    offsets.reserve(table_.size());
+    for (auto& item : table_) offsets.push_back(item.first);
+  }
+  uint8_t data[BLOCK_SIZE];
+  for (off_t offset : offsets) {
+    if (target->contains(offset)) continue;
+    if (!load(offset, data)) return false;
+    if (!target->preserve(offset, data)) return false;
+  }
+  return true;
+}
+
+void Snapshot::set_map(const ext2_super_block* super,
+                       std::vector<uint8_t>* bitmaps, Snapshot* older) {
+  // without the map of the older snapshot, any block may be needed
+  if (older != nullptr && !older->has_map_) return;
+  if (older != nullptr) {
+    size_t n = std::min(bitmaps->size(), older->allocated_.size());
+    for (size_t i = 0; i < n; ++i) (*bitmaps)[i] |= older->allocated_[i];
+  }
+  super_ = *super;
+  groups_ = bitmaps->size() / BLOCK_SIZE;
+  allocated_.swap(*bitmaps);
+  has_map_ = true;
+}
+
+bool Snapshot::save_map() {
+  if (!has_map_) return true;
+  FILE* file = fopen(map_.c_str(), "w");
+  if (file == nullptr) {
+    ERR("Failed to write %s: %s", map_.c_str(), strerror(errno));
+    return false;
+  }
+  bool ok = fwrite(&super_, sizeof(ext2_super_block), 1, file) == 1 &&
+            fwrite(allocated_.data(), 1, allocated_.size(), file) ==
+                allocated_.size() &&
+            fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+  fclose(file);
+  if (!ok) ERR("Failed to write %s", map_.c_str());
+  return ok;
+}
+
+void Snapshot::load_map() {
+  if (has_map_) return;
+  std::ifstream file(map_, std::ios::binary);
+  if (!file.read((char*)&super_, sizeof(ext2_super_block))) return;
+  allocated_.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+  groups_ = allocated_.size() / BLOCK_SIZE;
+  // a map cut short leaves every block referenced
+  has_map_ = groups_ == num_block_groups(&super_);
+  if (!has_map_) allocated_.clear();
+}
+
+bool Snapshot::referenced(off_t offset) {
+  uint32_t group, index;
+  if (!has_map_ || !data_block_index(&super_, offset, &group, &index))
+    return true;
+  if (group >= groups_) return false;
+  if (index < reserved_data_blocks(&super_, group)) return true;
+  Bitmap bitmap(allocated_.data() + (size_t)group * BLOCK_SIZE);
+  return bitmap.test(index);
+}
+
+void Snapshot::sync() {
+  if (fd_ >= 0) fdatasync(fd_);
+}
+
+void Snapshot::unlink() {
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+  ::unlink(store_.c_str());
+  ::unlink(map_.c_str());
+}
+
+SnapshotManager::SnapshotManager(const char* disk_name)
+    : disk_name_(disk_name),
+      manifest_(std::string(disk_name) + ".snapshots"),
+      generation_(0) {
+  // manifest: one "<generation> <name>" line per snapshot, oldest first
+  std::ifstream manifest(manifest_);
+  uint32_t generation;
+  std::string name;
+  while (manifest >> generation >> name) {
+    Snapshot* snapshot =
+        new Snapshot(generation, name, disk_name_ + ".snap." + name);
+    if (!snapshot->open(false)) {
+      delete snapshot;
+      continue;
+    }
+    snapshots_.push_back(snapshot);
+    generation_ = std::max(generation_, generation);
+  }
+  // only the newest snapshot takes copies
+  if (!snapshots_.empty()) snapshots_.back()->load_map();
+  disk_set_write_hook(
+      [this](off_t where, size_t size) { return before_write(where, size); });
+}
+
+SnapshotManager::~SnapshotManager() {
+  disk_set_write_hook(nullptr);
+  for (auto snapshot : snapshots_) {
+    snapshot->sync();
+    delete snapshot;
+  }
+}
+
+RetCode SnapshotManager::prepare(const char* name, size_t name_len,
+                                 Snapshot** snapshot) {
+  if (name_len == 0 || name_len > EXT2_NAME_LEN) return FS_INVALID;
+  if (exists(name, name_len)) return FS_DUP_ERR;
+
+  // generation_ only changes with changes_ held
+  std::string snapshot_name(name, name_len);
+  *snapshot = new Snapshot(generation_ + 1, snapshot_name,
+                           disk_name_ + ".snap." + snapshot_name);
+  if (!(*snapshot)->open(true)) {
+    abandon(*snapshot);
+    return FS_ALLOC_ERR;
+  }
+  return FS_SUCCESS;
+}
+
+void SnapshotManager::abandon(Snapshot* snapshot) {
+  snapshot->unlink();
+  delete snapshot;
+}
+
+void SnapshotManager::freeze(Snapshot* snapshot, const ext2_super_block* super,
+                             std::vector<uint8_t>* bitmaps,
+                             FrozenBlocks* frozen) {
+  std::unique_lock<std::shared_mutex> lck(m_);
+  snapshot->set_map(super, bitmaps,
+                    snapshots_.empty() ? nullptr : snapshots_.back());
+  snapshot->freeze(frozen, snapshots_.empty() ? nullptr : snapshots_.back());
+  generation_++;
+  snapshots_.push_back(snapshot);
+  DEBUG("Create snapshot %s, generation %u", snapshot->name().c_str(),
+        generation_);
+}
+
+RetCode SnapshotManager::settle(Snapshot* snapshot) {
+  if (snapshot->settle()) {
+    std::shared_lock<std::shared_mutex> lck(m_);
+    if (save_manifest()) return FS_SUCCESS;
+  }
+  // taken back, with what was copied out to it since it was frozen
+  ERR("Failed to take snapshot %s", snapshot->name().c_str());
+  uint32_t generation = snapshot->generation();
+  drop(snapshot);
+  if (generation_ == generation) generation_--;
+  return FS_ALLOC_ERR;
+}
+
+RetCode SnapshotManager::remove(const char* name, size_t name_len) {
+  Snapshot* snapshot;
+  {
+    std::shared_lock<std::shared_mutex> lck(m_);
+    int index = find(name, name_len);
+    if (index < 0) return FS_NOT_FOUND;
+    snapshot = snapshots_[index];
+  }
+  return drop(snapshot);
+}
+
+RetCode SnapshotManager::drop(Snapshot* snapshot) {
+  // snapshots_ only changes with changes_ held
+  auto iter = std::find(snapshots_.begin(), snapshots_.end(), snapshot);
+  Snapshot* older = iter == snapshots_.begin() ? nullptr : *(iter - 1);
+  bool newest = snapshot == snapshots_.back();
+  // the older snapshot falls through to this one for unpreserved blocks,
+  // the bulk of them is merged while the file system is in use
+  if (older != nullptr) {
+    if (!snapshot->merge_into(older)) return FS_ALLOC_ERR;
+    if (newest) older->load_map();
+  }
+  {
+    std::unique_lock<std::shared_mutex> lck(m_);
+    // then what the newest snapshot copied out since
+    if (newest && older != nullptr && !snapshot->merge_into(older))
+      return FS_ALLOC_ERR;
+    snapshots_.erase(std::find(snapshots_.begin(), snapshots_.end(), snapshot));
+    // the blocks it froze and did not settle are on the disk again
+    if (older != nullptr) older->drop_lazy();
+  }
+  if (older != nullptr) older->sync();
+  bool ok;
+  {
+    std::shared_lock<std::shared_mutex> lck(m_);
+    ok = save_manifest();
+  }
+  // listed again on the next mount otherwise, with its blocks merged
+  if (!ok) return FS_ALLOC_ERR;
+  snapshot->unlink();
+  delete snapshot;
+  return FS_SUCCESS;
+}
+
+bool SnapshotManager::exists(const char* name, size_t name_len) {
+  std::shared_lock<std::shared_mutex> lck(m_);
+  return find(name, name_len) >= 0;
+}
+
+void SnapshotManager::list(
+    const std::function<void(const std::string&)>& visitor) {
+  std::shared_lock<std::shared_mutex> lck(m_);
+  for (auto snapshot : snapshots_) visitor(snapshot->name());
+}
+
+bool SnapshotManager::read_block(const char* name, size_t name_len,
+                                 off_t offset, uint8_t* data) {
+  std::shared_lock<std::shared_mutex> lck(m_);
+  int index = find(name, name_len);
+  if (index < 0) return false;
+  for (size_t i = index; i < snapshots_.size(); ++i) {
+    Snapshot* snapshot = snapshots_[i];
+    Snapshot::Holding holding = snapshot->holds(offset);
+    if (holding == Snapshot::HELD) return snapshot->load(offset, data);
+    if (holding == Snapshot::NOT_HELD) continue;
+    // the disk data is handed down before the block is overwritten
+    if (disk_read(offset, BLOCK_SIZE, data) < 0) return false;
+    return snapshot->copied(offset) ? snapshot->load(offset, data) : true;
+  }
+  // never overwritten since the snapshot was taken, unless a writer copied
+  // the block out to the newest one and overwrote it since it was checked
+  if (disk_read(offset, BLOCK_SIZE, data) < 0) return false;
+  Snapshot* newest = snapshots_.back();
+  if (newest->preserved(offset)) return newest->load(offset, data);
+  return true;
+}
+
+int SnapshotManager::before_write(off_t where, size_t size) {
+  // the snapshots only change under an exclusive lock, the blocks are copied
+  // out under the lock of the store of the newest one
+  std::shared_lock<std::shared_mutex> lck(m_);
+  if (snapshots_.empty()) return 0;
+  Snapshot* newest = snapshots_.back();
+  uint8_t* data = nullptr;
+  int ret = 0;
+  for (off_t offset = where - where % BLOCK_SIZE; offset < (off_t)(where + size);
+       offset += BLOCK_SIZE) {
+    if (!newest->referenced(offset) || newest->copied(offset)) continue;
+    if (data == nullptr) data = (uint8_t*)alloc_aligned(BLOCK_SIZE);
+    ret = newest->copy_out(offset, data);
+    if (ret < 0) {
+      ERR("Failed to copy out the block at 0x%jx to snapshot %s, the write "
+          "fails", (intmax_t)offset, newest->name().c_str());
+      break;
+    }
+  }
+  free(data);
+  return ret;
+}
+
+void SnapshotManager::visit_discardable(
+    off_t where, size_t size,
+    const std::function<void(off_t, size_t)>& visitor) {
+  std::vector<std::pair<off_t, size_t>> runs;
+  {
+    std::shared_lock<std::shared_mutex> lck(m_);
+    if (snapshots_.empty()) {
+      runs.emplace_back(where, size);
+    } else {
+      Snapshot* newest = snapshots_.back();
+      off_t run = where;
+      off_t end = where + size;
+      for (off_t offset = where; offset < end; offset += BLOCK_SIZE) {
+        if (!newest->referenced(offset) || newest->copied(offset)) continue;
+        if (offset > run) runs.emplace_back(run, offset - run);
+        run = offset + BLOCK_SIZE;
+      }
+      if (end > run) runs.emplace_back(run, end - run);
+    }
+  }
+  // the discard runs before_write(), which takes m_ again; a snapshot taken
+  // meanwhile is still preserved by it
+  for (auto& run : runs) visitor(run.first, run.second);
+}
+
+void SnapshotManager::sync() {
+  std::shared_lock<std::shared_mutex> lck(m_);
+  for (auto snapshot : snapshots_) snapshot->sync();
+}
+
+int SnapshotManager::find(const char* name, size_t name_len) {
+  for (size_t i = 0; i < snapshots_.size(); ++i) {
+    const std::string& snapshot_name = snapshots_[i]->name();
+    if (snapshot_name.size() == name_len &&
+        memcmp(snapshot_name.data(), name, name_len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+bool SnapshotManager::save_manifest() {
+  std::string tmp = manifest_ + ".tmp";
+  FILE* file = fopen(tmp.c_str(), "w");
+  if (file == nullptr) {
+    ERR("Failed to write %s: %s", tmp.c_str(), strerror(errno));
+    return false;
+  }
+  for (auto snapshot : snapshots_)
+    fprintf(file, "%u %s\n", snapshot->generation(), snapshot->name().c_str());
+  fflush(file);
+  fdatasync(fileno(file));
+  fclose(file);
+  return rename(tmp.c_str(), manifest_.c_str()) == 0;
+}
+
+SnapshotView::SnapshotView(SnapshotManager* manager, const char* name,
+                           size_t name_len)
+    : manager_(manager), name_(name, name_len), valid_(false) {
+  Block block(0, true);
+  if (!read_block(0, block.get())) return;
+  memcpy(&super_, block.get(), sizeof(ext2_super_block));
+  if (super_.s_state != FSState::NORMAL) return;
+
+  uint32_t n = num_block_groups(&super_);
+  uint32_t first = std::min(first_meta_bg(&super_), n);
+  if (first > MAX_BLOCK_GROUPS) return;
+  ext2_group_desc* ptr =
+      (ext2_group_desc*)(block.get() + sizeof(ext2_super_block));
+  desc_table_.assign(ptr, ptr + first);
+  // then the descriptor blocks of the meta groups
+  for (uint32_t i = first; i < n; i += DESCS_PER_BLOCK) {
+    if (!read_block(meta_desc_block_offset(&super_, i), block.get())) return;
+    ptr = (ext2_group_desc*)block.get();
+    desc_table_.insert(desc_table_.end(), ptr,
+                       ptr + std::min((size_t)(n - i), DESCS_PER_BLOCK));
+  }
+  valid_ = true;
+}
+
+RetCode SnapshotView::lookup(const Path& path, size_t skip, ext2_inode* inode,
+                             uint32_t* inode_index) {
+  if (!valid_) return FS_NOT_FOUND;
+  uint32_t index = ROOT_INODE;
+  if (!get_inode(index, inode)) return FS_NOT_FOUND;
+  for (size_t i = skip; i < path.size(); ++i) {
+    if (!S_ISDIR(inode->i_mode)) return FS_NDIR_ERR;
+    auto elem = path.get(i);
+    bool found = false;
+    visit_dentries(*inode, [&elem, &index, &found](ext2_dir_entry_2* dentry) {
+      if (dentry->name_len != elem.second) return false;
+      if (memcmp(elem.first, dentry->name, dentry->name_len)) return false;
+      index = dentry->inode;
+      found = true;
+      return true;
+    });
+    if (!found || !get_inode(index, inode)) return FS_NOT_FOUND;
+  }
+  if (inode_index != nullptr) *inode_index = index;
+  return FS_SUCCESS;
+}
+
+int SnapshotView::read(const ext2_inode& inode, char* buf, size_t size,
+                       off_t offset) {
+  if ((size_t)offset >= inode.i_size) return 0;
+  size = std::min(size, (size_t)(inode.i_size - offset));
+  if (INODE_IS_INLINE(&inode)) {
+    memcpy(buf, (uint8_t*)inode.i_block + offset, size);
+    return size;
+  }
+  Block block(0, true);
+  std::unique_ptr<uint8_t[]> cluster_data;
+  bool compressed = false;
+  size_t ret = 0;
+  while (ret < size) {
+    uint32_t index;
+    off_t block_offset;
+    // whether a cluster is compressed is looked up once, at its start
+    if ((inode.i_flags & EXT2_COMPRBLK_FL) &&
+        (ret == 0 || offset % CLUSTER_BYTES == 0)) {
+      int r = read_cluster(inode, offset / CLUSTER_BYTES, &cluster_data);
+      if (r < 0) return -EIO;
+      compressed = r;
+    }
+    if (compressed) {
+      size_t csz =
+          std::min(size - ret, CLUSTER_BYTES - (size_t)offset % CLUSTER_BYTES);
+      memcpy(buf + ret, cluster_data.get() + offset % CLUSTER_BYTES, csz);
+      ret += csz, offset += csz;
+      continue;
+    }
+    if (!map_block(inode, offset / BLOCK_SIZE, &index) ||
+        !get_block_offset(index, &block_offset) ||
+        !read_block(block_offset, block.get()))
+      return -EIO;
+    size_t csz = std::min(size - ret, BLOCK_SIZE - (size_t)offset % BLOCK_SIZE);
+    memcpy(buf + ret, block.get() + offset % BLOCK_SIZE, csz);
+    ret += csz, offset += csz;
+  }
+  return ret;
+}
+
+int SnapshotView::read_cluster(const ext2_inode& inode, uint32_t cluster,
+                               std::unique_ptr<uint8_t[]>* data) {
+  uint32_t start = cluster * COMPRESS_CLUSTER_BLOCKS;
+  uint32_t num_blocks = inode.i_blocks / (2 << super_.s_log_block_size);
+  uint32_t index;
+  if (start + COMPRESS_CLUSTER_BLOCKS > num_blocks) return 0;
+  if (!map_block(inode, start + COMPRESS_CLUSTER_BLOCKS - 1, &index)) return -1;
+  if (index != EXT2_COMPRESSED_BLKADDR) return 0;
+  std::unique_ptr<uint8_t[]> packed(new uint8_t[CLUSTER_BYTES]);
+  uint32_t n = 0;
+  for (; n < COMPRESS_CLUSTER_BLOCKS; ++n) {
+    off_t offset;
+    if (!map_block(inode, start + n, &index)) return -1;
+    if (index == EXT2_COMPRESSED_BLKADDR) break;
+    if (!get_block_offset(index, &offset) ||
+        !read_block(offset, packed.get() + (size_t)n * BLOCK_SIZE))
+      return -1;
+  }
+  if (*data == nullptr) data->reset(new uint8_t[CLUSTER_BYTES]);
+  return decompress_cluster(packed.get(), n, data->get()) ? 1 : -1;
+}
+
+void SnapshotView::readdir(
+    const ext2_inode& inode,
+    const std::function<void(const char*, size_t)>& visitor) {
+  visit_dentries(inode, [&visitor](ext2_dir_entry_2* dentry) {
+    if (dentry->name_len) visitor(dentry->name, dentry->name_len);
+    return false;
+  });
+}
+
+bool SnapshotView::read_block(off_t offset, uint8_t* data) {
+  return manager_->read_block(name_.data(), name_.size(), offset, data);
+}
+
+bool SnapshotView::get_inode(uint32_t index, ext2_inode* inode) {
+  uint32_t n_group = index / super_.s_inodes_per_group;
+  uint32_t inner_index = index % super_.s_inodes_per_group;
+  if (n_group >= desc_table_.size()) return false;
+  off_t offset = BlockGroup::inode_block_offset(
+      &desc_table_[n_group], inner_index / INODES_PER_BLOCK);
+  Block block(offset, true);
+  if (!read_block(offset, block.get())) return false;
+  memcpy(inode, (ext2_inode*)block.get() + inner_index % INODES_PER_BLOCK,
+         sizeof(ext2_inode));
+  return true;
+}
+
+bool SnapshotView::get_block_offset(uint32_t index, off_t* offset) {
+  uint32_t n_group = index / super_.s_blocks_per_group;
+  if (n_group >= desc_table_.size()) return false;
+  *offset = data_block_offset(&super_, n_group,
+                              index % super_.s_blocks_per_group);
+  return true;
+}
+
+bool SnapshotView::map_block(const ext2_inode& inode, uint32_t n,
+                             uint32_t* index) {
+  if (n < MAX_DIR_BLOCKS) {
+    *index = inode.i_block[n];
+    return true;
+  }
+  // walk down the indirect blocks, one level per iteration
+  uint32_t level, span;
+  n -= MAX_DIR_BLOCKS;
+  if (n < MAX_IND_BLOCKS) {
+    level = EXT2_IND_BLOCK, span = 1;
+  } else if ((n -= MAX_IND_BLOCKS) < MAX_DIND_BLOCKS) {
+    level = EXT2_DIND_BLOCK, span = MAX_IND_BLOCKS;
+  } else if ((n -= MAX_DIND_BLOCKS) < MAX_TIND_BLOCKS) {
+    level = EXT2_TIND_BLOCK, span = MAX_DIND_BLOCKS;
+  } else {
+    return false;
+  }
+  uint32_t curr = inode.i_block[level];
+  Block block(0, true);
+  while (true) {
+    off_t offset;
+    if (!get_block_offset(curr, &offset) || !read_block(offset, block.get()))
+      return false;
+    curr = ((uint32_t*)block.get())[n / span];
+    if (span == 1) break;
+    n %= span;
+    span /= NUM_INDIRECT_BLOCKS;
+  }
+  *index = curr;
+  return true;
+}
+
+bool SnapshotView::visit_dentries(
+    const ext2_inode& inode,
+    const std::function<bool(ext2_dir_entry_2*)>& visitor) {
+  if (INODE_IS_INLINE(&inode)) {
+    ext2_inode copy = inode;
+    InlineBlock inline_block(&copy);
+    DentryBlock dentry_block(&inline_block);
+    for (auto dentry : *dentry_block.get()) {
+      if (visitor(dentry)) return true;
+    }
+    return false;
+  }
+  uint32_t num_blocks = inode.i_blocks / (2 << super_.s_log_block_size);
+  Block block(0, true);
+  for (uint32_t n = 0; n < num_blocks; ++n) {
+    uint32_t index;
+    off_t offset;
+    if (!map_block(inode, n, &index) || !get_block_offset(index, &offset) ||
+        !read_block(offset, block.get()))
+      return false;
+    DentryBlock dentry_block(&block);
+    for (auto dentry : *dentry_block.get()) {
+      if (visitor(dentry)) return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace naivefs
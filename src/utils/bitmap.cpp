@@ -8,11 +8,15 @@ bool Bitmap::test(int i) { return data_[i >> BIT_SHIFT] & BIT_GET(i); }
 
 void Bitmap::clear(int i) { data_[i >> BIT_SHIFT] &= ~BIT_GET(i); }
 
-int64_t Bitmap::find(int size) {
+int64_t Bitmap::find(int size, int start) {
+  if (start >= size) return -1;
   int max_index = (size >> BIT_SHIFT) + ((size & BIT_MASK) != 0);
-  for (int i = 0; i < max_index; ++i) {
-    if (data_[i] != BIT_MAX) {
-      int cur_bits = data_[i];
+  for (int i = start >> BIT_SHIFT; i < max_index; ++i) {
+    // bits below start count as set in the first word
+    uint32_t word = data_[i];
+    if (i == start >> BIT_SHIFT) word |= (1u << (start & BIT_MASK)) - 1;
+    if (word != BIT_MAX) {
+      int cur_bits = word;
       int k = 0;
       while (cur_bits & 1) {
         cur_bits >>= 1;
@@ -0,0 +1,132 @@
+#include "utils/crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+namespace naivefs {
+
+namespace {
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+/**
+ * @brief Tables of slice-by-8: table_[k][b] is the CRC of byte b followed by
+ * k zero bytes, so that 8 bytes are folded in with 8 lookups
+ */
+struct Crc32cTables {
+  uint32_t table_[8][256];
+
+  constexpr Crc32cTables() : table_() {
+    for (uint32_t b = 0; b < 256; ++b) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; ++i) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+      table_[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b)
+      for (int k = 1; k < 8; ++k)
+        table_[k][b] = (table_[k - 1][b] >> 8) ^ table_[0][table_[k - 1][b] & 0xff];
+  }
+};
+
+constexpr Crc32cTables tables;
+
+uint32_t crc32c_slice8(uint32_t crc, const uint8_t* p, size_t size) {
+  const auto& t = tables.table_;
+  while (size && ((uintptr_t)p & 7)) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    size--;
+  }
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+          t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+          t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+          t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+  }
+  while (size--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc,
+                                                      const uint8_t* p,
+                                                      size_t size) {
+  while (size && ((uintptr_t)p & 7)) {
+    crc = _mm_crc32_u8(crc, *p++);
+    size--;
+  }
+  uint64_t crc64 = crc;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  while (size--) crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+bool has_crc32c_hw() { return __builtin_cpu_supports("sse4.2"); }
+
+#define CRC32C_HW_NAME "sse4.2"
+#elif defined(__aarch64__)
+__attribute__((target("+crc"))) uint32_t crc32c_hw(uint32_t crc,
+                                                   const uint8_t* p,
+                                                   size_t size) {
+  while (size && ((uintptr_t)p & 7)) {
+    crc = __crc32cb(crc, *p++);
+    size--;
+  }
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc = __crc32cd(crc, word);
+  }
+  while (size--) crc = __crc32cb(crc, *p++);
+  return crc;
+}
+
+bool has_crc32c_hw() { return getauxval(AT_HWCAP) & HWCAP_CRC32; }
+
+#define CRC32C_HW_NAME "armv8"
+#else
+uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t size) {
+  return crc32c_slice8(crc, p, size);
+}
+
+bool has_crc32c_hw() { return false; }
+
+#define CRC32C_HW_NAME "slice-by-8"
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t, const uint8_t*, size_t);
+
+// picked once, before main()
+const bool hw = has_crc32c_hw();
+const Crc32cFn crc32c_fn = hw ? crc32c_hw : crc32c_slice8;
+
+}  // namespace
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t size) {
+  return ~crc32c_fn(~crc, (const uint8_t*)buf, size);
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void* buf, size_t size) {
+  return ~crc32c_slice8(~crc, (const uint8_t*)buf, size);
+}
+
+const char* crc32c_impl() { return hw ? CRC32C_HW_NAME : "slice-by-8"; }
+
+}  // namespace naivefs
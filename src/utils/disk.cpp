@@ -1,10 +1,24 @@
 #include "utils/disk.h"
 
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "utils/stats.h"
+
 namespace naivefs {
 
-static int disk_fd = -1;
+static BlockDevice* disk_device = nullptr;
+// the device was created by disk_open
+static bool disk_owned = false;
 
 void* alloc_aligned(size_t size) {
   void* buf = nullptr;
@@ -18,53 +32,536 @@ void* alloc_aligned(size_t size) {
   return buf;
 }
 
-int disk_open() {
-  disk_fd = open(DISK_NAME, O_DIRECT | O_NOATIME | O_RDWR);
-  if (disk_fd < 0) {
-    ERR("Failed to open %s: %s", DISK_NAME, strerror(errno));
+int BlockDevice::read(off_t where, size_t size, void* buf) {
+  STAT_TIMER(STAT_DISK_READ);
+  stat_add(STAT_DISK_READ_BYTES, size);
+  return do_read(where, size, buf);
+}
+
+int BlockDevice::write(off_t where, size_t size, const void* buf) {
+  STAT_TIMER(STAT_DISK_WRITE);
+  stat_add(STAT_DISK_WRITE_BYTES, size);
+  if (write_hook_) {
+    int ret = write_hook_(where, size);
+    if (ret < 0) return ret;
+  }
+  return do_write(where, size, buf);
+}
+
+int BlockDevice::discard(off_t where, size_t size) {
+  stat_add(STAT_DISK_DISCARD_BYTES, size);
+  if (write_hook_) {
+    int ret = write_hook_(where, size);
+    if (ret < 0) return ret;
+  }
+  return do_discard(where, size);
+}
+
+int FileDevice::open_flags() {
+  int flags = O_NOATIME | O_RDWR;
+  if (direct_) flags |= O_DIRECT;
+  return flags;
+}
+
+int FileDevice::open() {
+  fd_ = ::open(name(), open_flags());
+  if (fd_ < 0) {
+    ERR("Failed to open %s: %s", name(), strerror(errno));
     return -errno;
   }
+  INFO("Disk %s opened, %s I/O, readahead %zu", name(),
+       direct_ ? "direct" : "buffered", readahead_);
   return 0;
 }
 
-int disk_close() {
-  int ret = close(disk_fd);
+int FileDevice::close() {
+  int ret = ::close(fd_);
+  fd_ = -1;
   if (ret < 0) {
-    ERR("Failed to close %s: %s", DISK_NAME, strerror(errno));
+    ERR("Failed to close %s: %s", name(), strerror(errno));
     return -errno;
   }
   return 0;
 }
 
-// TODO: multi-thread
-int __disk_write(off_t where, size_t size, void* buf, const char* func,
-                 int line) {
-  DEBUG("Disk Write: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
-  // Fist seek to the disk (seek path in real disk)
-  int ret = lseek(disk_fd, where, SEEK_SET);
+int FileDevice::sync() {
+  // direct writes do not linger in the page cache
+  if (direct_) return 0;
+  int ret = fdatasync(fd_);
   if (ret < 0) {
-    ERR("Failed to seek to 0x%jx: %s", where, strerror(errno));
+    ERR("Failed to sync %s: %s", name(), strerror(errno));
     return -errno;
   }
-  ret = write(disk_fd, buf, size);
+  return 0;
+}
+
+uint64_t FileDevice::size() {
+  struct stat st;
+  if (fstat(fd_, &st) < 0) return 0;
+  return st.st_size;
+}
+
+int FileDevice::do_write(off_t where, size_t size, const void* buf) {
+  int ret = pwrite(fd_, buf, size, where);
   if (ret < 0) {
-    ERR("Failed to write %s: %s", DISK_NAME, strerror(errno));
+    ERR("Failed to write %s: %s", name(), strerror(errno));
     return -errno;
   }
   return 0;
 }
 
-// TODO: multi-thread
-int __disk_read(off_t where, size_t size, void* buf, const char* func,
-                int line) {
-  DEBUG("Disk Read: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
-  int ret = pread(disk_fd, buf, size, where);
+int FileDevice::do_read(off_t where, size_t size, void* buf) {
+  int ret = pread(fd_, buf, size, where);
   if (ret < 0) {
-    ERR("Failed to read %s: %s", DISK_NAME, strerror(errno));
+    ERR("Failed to read %s: %s", name(), strerror(errno));
     return -errno;
   }
   ASSERT((size_t)ret == size);
+  if (readahead_) {
+    posix_fadvise(fd_, where + size, readahead_, POSIX_FADV_WILLNEED);
+  }
+  return 0;
+}
+
+int FileDevice::do_discard(off_t where, size_t size) {
+  if (!can_discard_) return 0;
+  int ret = fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, where,
+                      size);
+  if (ret < 0 && errno == EOPNOTSUPP) {
+    WARNING("%s cannot punch holes, discards are ignored", name());
+    can_discard_ = false;
+    return 0;
+  }
+  if (ret < 0) {
+    ERR("Failed to discard %s: %s", name(), strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+int RawDevice::open_flags() { return FileDevice::open_flags() | O_EXCL; }
+
+int RawDevice::do_discard(off_t where, size_t size) {
+  if (!can_discard_) return 0;
+  uint64_t range[2] = {(uint64_t)where, size};
+  int ret = ioctl(fd_, BLKDISCARD, range);
+  if (ret < 0 && errno == EOPNOTSUPP) {
+    WARNING("%s does not support discard, discards are ignored", name());
+    can_discard_ = false;
+    return 0;
+  }
+  if (ret < 0) {
+    ERR("Failed to discard %s: %s", name(), strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+int RawDevice::sync() {
+  // flush the volatile write cache of the drive
+  int ret = fsync(fd_);
+  if (ret < 0) {
+    ERR("Failed to sync %s: %s", name(), strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+uint64_t RawDevice::size() {
+  uint64_t size = 0;
+  if (ioctl(fd_, BLKGETSIZE64, &size) < 0) return 0;
+  return size;
+}
+
+int RamDevice::open() {
+  void* data = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (data == MAP_FAILED) {
+    ERR("Failed to map RAM disk of %lu bytes: %s", size_, strerror(errno));
+    return -errno;
+  }
+  data_ = (uint8_t*)data;
+  INFO("RAM disk %s opened, %lu bytes", name(), size_);
+  return 0;
+}
+
+int RamDevice::close() {
+  munmap(data_, size_);
+  data_ = nullptr;
+  return 0;
+}
+
+int RamDevice::do_read(off_t where, size_t size, void* buf) {
+  if ((uint64_t)where + size > size_) {
+    ERR("Read 0x%jx +0x%zx beyond the RAM disk", where, size);
+    return -EIO;
+  }
+  memcpy(buf, data_ + where, size);
+  return 0;
+}
+
+int RamDevice::do_write(off_t where, size_t size, const void* buf) {
+  if ((uint64_t)where + size > size_) {
+    ERR("Write 0x%jx +0x%zx beyond the RAM disk", where, size);
+    return -ENOSPC;
+  }
+  memcpy(data_ + where, buf, size);
+  return 0;
+}
+
+int RamDevice::do_discard(off_t where, size_t size) {
+  if ((uint64_t)where + size > size_) return -EINVAL;
+  // whole pages are unmapped, the partial ones at the edges zeroed
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t begin = ((uint64_t)where + page - 1) / page * page;
+  uint64_t end = ((uint64_t)where + size) / page * page;
+  if (begin >= end) {
+    memset(data_ + where, 0, size);
+    return 0;
+  }
+  memset(data_ + where, 0, begin - where);
+  memset(data_ + end, 0, where + size - end);
+  madvise(data_ + begin, end - begin, MADV_DONTNEED);
+  return 0;
+}
+
+/**
+ * @brief I/O thread of a member. Jobs are the pieces of requests that span
+ * several members.
+ */
+struct StripedDevice::Queue {
+  std::mutex m_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> jobs_;
+  bool stop_ = false;
+  std::thread thread_;
+
+  Queue() : thread_([this]() { run(); }) {}
+
+  ~Queue() {
+    {
+      std::lock_guard<std::mutex> lck(m_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  void push(std::function<void()>&& job) {
+    {
+      std::lock_guard<std::mutex> lck(m_);
+      jobs_.push_back(std::move(job));
+    }
+    cv_.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lck(m_);
+    while (true) {
+      cv_.wait(lck, [this]() { return stop_ || !jobs_.empty(); });
+      if (jobs_.empty()) return;
+      auto job = std::move(jobs_.front());
+      jobs_.pop_front();
+      lck.unlock();
+      job();
+      lck.lock();
+    }
+  }
+};
+
+StripedDevice::StripedDevice(const std::vector<BlockDevice*>& members,
+                             uint64_t chunk)
+    : BlockDevice(members[0]->name()),
+      members_(members),
+      by_group_(chunk == 0),
+      unit_(chunk) {}
+
+StripedDevice::~StripedDevice() {
+  if (!queues_.empty()) close();
+  for (auto member : members_) delete member;
+}
+
+int StripedDevice::open() {
+  for (size_t i = 0; i < members_.size(); ++i) {
+    int ret = members_[i]->open();
+    if (ret < 0) {
+      while (i--) members_[i]->close();
+      return ret;
+    }
+    queues_.push_back(new Queue());
+  }
+  INFO("Striped disk opened, %zu members, %s", members_.size(),
+       by_group_ ? "one block group per unit" : "fixed-size units");
+  return 0;
+}
+
+int StripedDevice::close() {
+  int ret = 0;
+  for (auto queue : queues_) delete queue;
+  queues_.clear();
+  for (auto member : members_) {
+    int member_ret = member->close();
+    if (ret == 0) ret = member_ret;
+  }
+  return ret;
+}
+
+int StripedDevice::sync() {
+  int ret = 0;
+  for (auto member : members_) {
+    int member_ret = member->sync();
+    if (ret == 0) ret = member_ret;
+  }
+  return ret;
+}
+
+uint64_t StripedDevice::size() {
+  uint64_t size = UINT64_MAX;
+  for (auto member : members_) size = std::min(size, member->size());
+  if (unit_ == 0 || size <= head_size_) return size;
+  // whole units of the smallest member
+  return head_size_ + (size - head_size_) / unit_ * unit_ * members_.size();
+}
+
+void StripedDevice::set_group_size(uint64_t size) {
+  if (!by_group_) return;
+  ASSERT(size % DISK_ALIGN == 0);
+  unit_ = size;
+}
+
+int StripedDevice::do_read(off_t where, size_t size, void* buf) {
+  return do_io(false, where, size, (uint8_t*)buf);
+}
+
+int StripedDevice::do_write(off_t where, size_t size, const void* buf) {
+  return do_io(true, where, size, (uint8_t*)buf);
+}
+
+int StripedDevice::do_discard(off_t where, size_t size) {
+  std::vector<Extent> extents;
+  bool spans;
+  int ret = split(where, size, nullptr, &extents, &spans);
+  for (size_t i = 0; ret == 0 && i < extents.size(); ++i) {
+    ret = members_[extents[i].member]->do_discard(extents[i].where,
+                                                 extents[i].size);
+  }
+  return ret;
+}
+
+int StripedDevice::split(off_t where, size_t size, uint8_t* buf,
+                         std::vector<Extent>* extents, bool* spans) {
+  *spans = false;
+  while (size) {
+    Extent extent;
+    size_t run;
+    if ((uint64_t)where < head_size_) {
+      extent.member = 0;
+      extent.where = where;
+      run = head_size_ - where;
+    } else if (unit_ == 0) {
+      ERR("Striped I/O at 0x%jx before the block group size is known", where);
+      return -EIO;
+    } else {
+      uint64_t offset = where - head_size_;
+      uint64_t unit = offset / unit_;
+      extent.member = unit % members_.size();
+      extent.where =
+          head_size_ + unit / members_.size() * unit_ + offset % unit_;
+      run = unit_ - offset % unit_;
+    }
+    extent.size = std::min(size, run);
+    extent.buf = buf;
+    *spans |= !extents->empty() && extent.member != (*extents)[0].member;
+    extents->push_back(extent);
+    where += extent.size;
+    if (buf != nullptr) buf += extent.size;
+    size -= extent.size;
+  }
+  return 0;
+}
+
+int StripedDevice::do_io(bool write, off_t where, size_t size, uint8_t* buf) {
+  std::vector<Extent> extents;
+  bool spans;
+  int ret = split(where, size, buf, &extents, &spans);
+  if (ret < 0) return ret;
+  if (spans) return submit(write, extents);
+
+  // the common case stays on the calling thread
+  for (auto& extent : extents) {
+    BlockDevice* member = members_[extent.member];
+    int ret = write ? member->do_write(extent.where, extent.size, extent.buf)
+                    : member->do_read(extent.where, extent.size, extent.buf);
+    if (ret < 0) return ret;
+  }
+  return 0;
+}
+
+int StripedDevice::submit(bool write, const std::vector<Extent>& extents) {
+  std::mutex m;
+  std::condition_variable cv;
+  size_t pending = extents.size();
+  int result = 0;
+  for (auto& extent : extents) {
+    BlockDevice* member = members_[extent.member];
+    queues_[extent.member]->push([&, member, extent]() {
+      int ret = write ? member->do_write(extent.where, extent.size, extent.buf)
+                      : member->do_read(extent.where, extent.size, extent.buf);
+      std::lock_guard<std::mutex> lck(m);
+      if (ret < 0 && result == 0) result = ret;
+      if (--pending == 0) cv.notify_one();
+    });
+  }
+  std::unique_lock<std::mutex> lck(m);
+  cv.wait(lck, [&]() { return pending == 0; });
+  return result;
+}
+
+uint64_t parse_size(const char* str) {
+  char* end;
+  uint64_t size = strtoull(str, &end, 0);
+  switch (*end) {
+    case 'g':
+    case 'G':
+      size <<= 10;
+      // fallthrough
+    case 'm':
+    case 'M':
+      size <<= 10;
+      // fallthrough
+    case 'k':
+    case 'K':
+      size <<= 10;
+      ++end;
+      break;
+  }
+  return *end ? 0 : size;
+}
+
+static BlockDevice* disk_create(const char* spec, bool direct,
+                                size_t readahead);
+
+/**
+ * @brief "<chunk>:<spec>+<spec>...", the part of a spec after "stripe:"
+ */
+static BlockDevice* stripe_create(const char* spec, bool direct,
+                                  size_t readahead) {
+  const char* members = strchr(spec, ':');
+  if (members == nullptr) {
+    ERR("Invalid striped disk: %s", spec);
+    return nullptr;
+  }
+  std::string chunk_spec(spec, members - spec);
+  uint64_t chunk = 0;
+  if (chunk_spec != STRIPE_BY_GROUP) {
+    chunk = parse_size(chunk_spec.c_str());
+    if (chunk == 0 || chunk % DISK_ALIGN) {
+      ERR("Invalid stripe chunk %s, a multiple of %d or " STRIPE_BY_GROUP,
+          chunk_spec.c_str(), DISK_ALIGN);
+      return nullptr;
+    }
+  }
+
+  std::vector<BlockDevice*> devices;
+  const char* begin = members + 1;
+  while (true) {
+    const char* end = strchr(begin, STRIPE_MEMBER_SEPARATOR);
+    std::string member = end ? std::string(begin, end - begin) : begin;
+    BlockDevice* device = disk_create(member.c_str(), direct, readahead);
+    if (device == nullptr) {
+      for (auto device : devices) delete device;
+      return nullptr;
+    }
+    devices.push_back(device);
+    if (end == nullptr) break;
+    begin = end + 1;
+  }
+  return new StripedDevice(devices, chunk);
+}
+
+static BlockDevice* disk_create(const char* spec, bool direct,
+                                size_t readahead) {
+  struct stat st;
+  if (strncmp(spec, STRIPE_DEVICE_PREFIX, strlen(STRIPE_DEVICE_PREFIX)) == 0) {
+    return stripe_create(spec + strlen(STRIPE_DEVICE_PREFIX), direct,
+                         readahead);
+  } else if (strncmp(spec, RAM_DEVICE_PREFIX, strlen(RAM_DEVICE_PREFIX)) == 0) {
+    uint64_t size = parse_size(spec + strlen(RAM_DEVICE_PREFIX));
+    if (size == 0) {
+      ERR("Invalid RAM disk size: %s", spec);
+      return nullptr;
+    }
+    return new RamDevice(spec, size);
+  } else if (stat(spec, &st) == 0 && S_ISBLK(st.st_mode)) {
+    if (!direct || readahead) {
+      WARNING("Block devices always use direct I/O");
+    }
+    return new RawDevice(spec);
+  }
+  if (direct && readahead) {
+    WARNING("Readahead is ignored by the direct I/O engine");
+  }
+  return new FileDevice(spec, direct, readahead);
+}
+
+int disk_open(const char* spec, bool direct, size_t readahead) {
+  BlockDevice* device = disk_create(spec, direct, readahead);
+  if (device == nullptr) return -EINVAL;
+  int ret = device->open();
+  if (ret < 0) {
+    delete device;
+    return ret;
+  }
+  disk_attach(device);
+  disk_owned = true;
   return 0;
 }
 
-}  // namespace naivefs
\ No newline at end of file
+void disk_attach(BlockDevice* device) {
+  ASSERT(disk_device == nullptr);
+  disk_device = device;
+  disk_owned = false;
+}
+
+int disk_close() {
+  if (disk_device == nullptr) return 0;
+  int ret = 0;
+  if (disk_owned) {
+    ret = disk_device->close();
+    delete disk_device;
+  }
+  disk_device = nullptr;
+  disk_owned = false;
+  return ret;
+}
+
+int disk_sync() { return disk_device->sync(); }
+
+int disk_discard(off_t where, size_t size) {
+  DEBUG("Disk Discard: 0x%jx +0x%zx", where, size);
+  return disk_device->discard(where, size);
+}
+
+const char* disk_name() { return disk_device->name(); }
+
+BlockDevice* disk() { return disk_device; }
+
+void disk_set_write_hook(const DiskWriteHook& hook) {
+  disk_device->set_write_hook(hook);
+}
+
+void disk_set_group_size(uint64_t size) { disk_device->set_group_size(size); }
+
+int __disk_write(off_t where, size_t size, void* buf, const char* func,
+                 int line) {
+  DEBUG("Disk Write: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
+  return disk_device->write(where, size, buf);
+}
+
+int __disk_read(off_t where, size_t size, void* buf, const char* func,
+                int line) {
+  DEBUG("Disk Read: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
+  return disk_device->read(where, size, buf);
+}
+
+}  // namespace naivefs
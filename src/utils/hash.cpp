@@ -0,0 +1,121 @@
+#include "utils/hash.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace naivefs {
+
+namespace {
+
+#define HASH_LANES 8
+#define HASH_STRIPE (HASH_LANES * sizeof(uint64_t))
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+
+/**
+ * @brief Key of each lane for the first stripe, every stripe adds
+ * PRIME64_3 to them, so that equal stripes at different places differ
+ */
+struct HashKeys {
+  uint64_t keys_[HASH_LANES];
+
+  constexpr HashKeys() : keys_() {
+    uint64_t key = PRIME64_2;
+    for (int l = 0; l < HASH_LANES; ++l) {
+      key = (key ^ (key >> 31)) * PRIME64_1;
+      keys_[l] = key;
+    }
+  }
+};
+
+constexpr HashKeys keys;
+
+inline uint64_t read64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  return h ^ (h >> 32);
+}
+
+/**
+ * @brief The stripes into the lanes: lane l adds the product of the halves of
+ * its data mixed with its key, and the data of lane l ^ 1
+ */
+void accumulate_portable(uint64_t* acc, const uint8_t* p, size_t stripes) {
+  for (size_t s = 0; s < stripes; ++s, p += HASH_STRIPE) {
+    uint64_t v[HASH_LANES];
+    for (int l = 0; l < HASH_LANES; ++l)
+      v[l] = read64(p + l * sizeof(uint64_t));
+    for (int l = 0; l < HASH_LANES; ++l) {
+      uint64_t k = v[l] ^ (keys.keys_[l] + s * PRIME64_3);
+      acc[l] += (k & 0xffffffff) * (k >> 32) + v[l ^ 1];
+    }
+  }
+}
+
+#if !defined(__SSE2__)
+inline void accumulate(uint64_t* acc, const uint8_t* p, size_t stripes) {
+  accumulate_portable(acc, p, stripes);
+}
+#else
+void accumulate(uint64_t* acc, const uint8_t* p, size_t stripes) {
+  __m128i a[HASH_LANES / 2], k[HASH_LANES / 2];
+  const __m128i step = _mm_set1_epi64x((long long)PRIME64_3);
+  for (int i = 0; i < HASH_LANES / 2; ++i) {
+    a[i] = _mm_loadu_si128((const __m128i*)acc + i);
+    k[i] = _mm_loadu_si128((const __m128i*)keys.keys_ + i);
+  }
+  for (size_t s = 0; s < stripes; ++s, p += HASH_STRIPE) {
+    for (int i = 0; i < HASH_LANES / 2; ++i) {
+      __m128i v = _mm_loadu_si128((const __m128i*)p + i);
+      __m128i mixed = _mm_xor_si128(v, k[i]);
+      // the high half of each lane next to its low half
+      __m128i high = _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1));
+      __m128i product = _mm_mul_epu32(mixed, high);
+      __m128i swapped = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+      a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, swapped));
+      k[i] = _mm_add_epi64(k[i], step);
+    }
+  }
+  for (int i = 0; i < HASH_LANES / 2; ++i)
+    _mm_storeu_si128((__m128i*)acc + i, a[i]);
+}
+#endif
+
+typedef void (*AccumulateFn)(uint64_t*, const uint8_t*, size_t);
+
+inline uint64_t hash(AccumulateFn fn, const void* data, size_t size) {
+  uint64_t acc[HASH_LANES] = {PRIME64_3, PRIME64_1, PRIME64_2, PRIME64_1,
+                              PRIME64_3, PRIME64_2, PRIME64_1, PRIME64_3};
+  fn(acc, (const uint8_t*)data, size / HASH_STRIPE);
+  uint64_t h = size * PRIME64_1;
+  for (int l = 0; l < HASH_LANES; ++l)
+    h = rotl64(h ^ avalanche(acc[l] + l), 27) * PRIME64_1 + PRIME64_2;
+  return avalanche(h);
+}
+
+}  // namespace
+
+uint64_t block_hash(const void* data, size_t size) {
+  return hash(accumulate, data, size);
+}
+
+uint64_t block_hash_portable(const void* data, size_t size) {
+  return hash(accumulate_portable, data, size);
+}
+
+}  // namespace naivefs
@@ -10,46 +10,415 @@
 #include "utils/logging.h"
 
 #include <pthread.h>
-#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-static int loglevel = DEFAULT_LOG_LEVEL;
-static FILE *logfile = NULL;
-static const char *loglevel_str[] = {
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+std::atomic<int> __log_level(DEFAULT_LOG_LEVEL);
+
+namespace {
+
+const char *loglevel_str[] = {
     [LOG_EMERG] = "[emerg]",   [LOG_ALERT] = "[alert]",
     [LOG_CRIT] = "[crit] ",    [LOG_ERR] = "[err]  ",
     [LOG_WARNING] = "[warn] ", [LOG_NOTICE] = "[notic]",
     [LOG_INFO] = "[info] ",    [LOG_DEBUG] = "[debug]",
 };
 
-void __LOG(int level, const char *func, int line, const char *format, ...) {
-  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-  va_list ap;
+// the writer thread wakes up at least this often
+#define LOG_WRITER_INTERVAL_MS 10
+
+/*
+ * Single-producer single-consumer ring: the owning thread advances head_, the
+ * writer advances tail_.
+ */
+struct LogRing {
+  __log_record records_[LOG_RING_SIZE];
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+  // the thread has exited, free the ring once it is drained
+  std::atomic<bool> retired_{false};
+};
+
+struct Logger {
+  FILE *file_ = nullptr;
+  std::atomic<bool> enabled_{false};
+  std::atomic<uint64_t> dropped_{0};
+  std::mutex rings_m_;
+  std::vector<LogRing *> rings_;
+  // serializes formatting between the writer thread and logging_flush
+  std::mutex drain_m_;
+  // nullptr when no writer runs, e.g. in the child of a fork()
+  std::thread *writer_ = nullptr;
+  std::atomic<bool> writer_alive_{false};
+  std::mutex wake_m_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+};
+
+Logger *logger() {
+  // never destroyed, threads may log during static destruction
+  static Logger *logger = new Logger();
+  return logger;
+}
+
+class RingHolder {
+ public:
+  ~RingHolder() {
+    if (ring_ != nullptr) ring_->retired_.store(true, std::memory_order_release);
+  }
+
+  LogRing *get() {
+    if (ring_ == nullptr) {
+      ring_ = new LogRing();
+      Logger *l = logger();
+      std::lock_guard<std::mutex> lck(l->rings_m_);
+      l->rings_.push_back(ring_);
+    }
+    return ring_;
+  }
+
+ private:
+  LogRing *ring_ = nullptr;
+};
+
+thread_local RingHolder ring_holder;
+
+struct LogArg {
+  uint8_t type;
+  uint8_t size;
+  uint64_t value;
+  double real;
+  const char *str;
+  uint16_t len;
+};
+
+class LogArgReader {
+ public:
+  explicit LogArgReader(const __log_record *record) : record_(record), pos_(0) {}
+
+  bool next(LogArg *arg) {
+    if (pos_ >= record_->size) return false;
+    const uint8_t *p = record_->payload;
+    arg->type = p[pos_++];
+    switch (arg->type) {
+      case LOG_ARG_INT:
+        arg->size = p[pos_++];
+        memcpy(&arg->value, p + pos_, sizeof(uint64_t));
+        pos_ += sizeof(uint64_t);
+        break;
+      case LOG_ARG_DOUBLE:
+        memcpy(&arg->real, p + pos_, sizeof(double));
+        pos_ += sizeof(double);
+        break;
+      case LOG_ARG_PTR:
+        memcpy(&arg->value, p + pos_, sizeof(uint64_t));
+        pos_ += sizeof(uint64_t);
+        break;
+      case LOG_ARG_STR:
+        memcpy(&arg->len, p + pos_, sizeof(uint16_t));
+        pos_ += sizeof(uint16_t);
+        arg->str = (const char *)p + pos_;
+        pos_ += arg->len;
+        break;
+      default:
+        return false;
+    }
+    return true;
+  }
+
+  int next_int() {
+    LogArg arg{};
+    if (!next(&arg) || arg.type != LOG_ARG_INT) return 0;
+    return (int)arg.value;
+  }
+
+ private:
+  const __log_record *record_;
+  size_t pos_;
+};
+
+inline bool is_flag(char c) { return c && strchr("-+ #0'", c); }
 
-  if (!logfile) return;
-  if (level < 0) return;
-  if (level > loglevel) return;
+inline bool is_length(char c) { return c && strchr("hljztLq", c); }
 
-  /* We have a lock here so different threads don interleave the log output */
-  pthread_mutex_lock(&lock);
-  va_start(ap, format);
-  fprintf(logfile, "%s[%s:%d] ", loglevel_str[level], func, line);
-  vfprintf(logfile, format, ap);
-  fprintf(logfile, "\n");
-  va_end(ap);
-  pthread_mutex_unlock(&lock);
-  fflush(logfile);
+/**
+ * @brief printf the format of the record with its captured arguments. Every
+ * conversion is re-issued on its own with the argument widened to the type
+ * it was captured as.
+ */
+void format_record(const __log_record *record, std::string *out) {
+  LogArgReader reader(record);
+  char buf[512];
+  const char *p = record->format;
+  while (*p) {
+    if (*p != '%') {
+      out->push_back(*p++);
+      continue;
+    }
+    if (p[1] == '%') {
+      out->push_back('%');
+      p += 2;
+      continue;
+    }
+    std::string spec = "%";
+    ++p;
+    while (is_flag(*p)) spec.push_back(*p++);
+    if (*p == '*') {
+      spec += std::to_string(reader.next_int());
+      ++p;
+    }
+    while (*p >= '0' && *p <= '9') spec.push_back(*p++);
+    if (*p == '.') {
+      spec.push_back(*p++);
+      if (*p == '*') {
+        spec += std::to_string(reader.next_int());
+        ++p;
+      }
+      while (*p >= '0' && *p <= '9') spec.push_back(*p++);
+    }
+    while (is_length(*p)) ++p;
+    char conv = *p;
+    if (conv == '\0') break;
+    ++p;
+
+    LogArg arg{};
+    if (!reader.next(&arg)) {
+      *out += "<missing>";
+      continue;
+    }
+    if (arg.type == LOG_ARG_DOUBLE) arg.value = (uint64_t)(int64_t)arg.real;
+    if (arg.type == LOG_ARG_STR && conv != 's') conv = 's';
+
+    switch (conv) {
+      case 'd':
+      case 'i':
+        spec += "lld";
+        snprintf(buf, sizeof(buf), spec.c_str(), (long long)arg.value);
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X': {
+        uint64_t value = arg.value;
+        // keep the width of the original type, e.g. %x of (int)-1
+        if (arg.type == LOG_ARG_INT && arg.size < sizeof(uint64_t))
+          value &= (((uint64_t)1) << (arg.size * 8)) - 1;
+        spec += "ll";
+        spec.push_back(conv);
+        snprintf(buf, sizeof(buf), spec.c_str(), (unsigned long long)value);
+        break;
+      }
+      case 'c':
+        spec.push_back('c');
+        snprintf(buf, sizeof(buf), spec.c_str(), (int)arg.value);
+        break;
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+        spec.push_back(conv);
+        snprintf(buf, sizeof(buf), spec.c_str(),
+                 arg.type == LOG_ARG_DOUBLE ? arg.real : (double)(int64_t)arg.value);
+        break;
+      case 's':
+        spec.push_back('s');
+        if (arg.type == LOG_ARG_STR) {
+          snprintf(buf, sizeof(buf), spec.c_str(), std::string(arg.str, arg.len).c_str());
+        } else {
+          snprintf(buf, sizeof(buf), "%lld", (long long)arg.value);
+        }
+        break;
+      case 'p':
+        spec.push_back('p');
+        snprintf(buf, sizeof(buf), spec.c_str(), (void *)(uintptr_t)arg.value);
+        break;
+      default:
+        snprintf(buf, sizeof(buf), "<%%%c?>", conv);
+        break;
+    }
+    *out += buf;
+  }
 }
 
-void logging_setlevel(int new_level) { loglevel = new_level; }
+void drain() {
+  Logger *l = logger();
+  std::lock_guard<std::mutex> drain_lck(l->drain_m_);
+  if (l->file_ == nullptr) return;
+
+  std::vector<LogRing *> rings;
+  {
+    std::lock_guard<std::mutex> lck(l->rings_m_);
+    rings = l->rings_;
+  }
+  std::string line;
+  for (auto ring : rings) {
+    bool retired = ring->retired_.load(std::memory_order_acquire);
+    uint64_t head = ring->head_.load(std::memory_order_acquire);
+    uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+    for (; tail != head; ++tail) {
+      const __log_record *record = &ring->records_[tail % LOG_RING_SIZE];
+      line.clear();
+      line += loglevel_str[record->level];
+      line += "[";
+      line += record->func;
+      line += ":";
+      line += std::to_string(record->line);
+      line += "] ";
+      format_record(record, &line);
+      line += "\n";
+      fwrite(line.data(), 1, line.size(), l->file_);
+    }
+    ring->tail_.store(tail, std::memory_order_release);
+    if (retired) {
+      std::lock_guard<std::mutex> lck(l->rings_m_);
+      l->rings_.erase(std::find(l->rings_.begin(), l->rings_.end(), ring));
+      delete ring;
+    }
+  }
+  uint64_t dropped = l->dropped_.exchange(0);
+  if (dropped) fprintf(l->file_, "%s[logging] %lu messages dropped\n", loglevel_str[LOG_WARNING], dropped);
+  fflush(l->file_);
+}
+
+void writer_main() {
+  Logger *l = logger();
+  while (true) {
+    bool stop;
+    {
+      std::unique_lock<std::mutex> lck(l->wake_m_);
+      l->wake_.wait_for(lck, std::chrono::milliseconds(LOG_WRITER_INTERVAL_MS), [l] { return l->stop_; });
+      stop = l->stop_;
+    }
+    drain();
+    if (stop) break;
+  }
+}
+
+void start_writer() {
+  Logger *l = logger();
+  if (l->writer_ != nullptr) return;
+  l->stop_ = false;
+  l->writer_ = new std::thread(writer_main);
+  l->writer_alive_.store(true);
+}
+
+/*
+ * fork() keeps only the calling thread: the locks are taken around it so
+ * that the child gets them unlocked, and the child has no writer until
+ * logging_start().
+ */
+void before_fork() {
+  Logger *l = logger();
+  l->drain_m_.lock();
+  l->rings_m_.lock();
+  l->wake_m_.lock();
+}
+
+void after_fork_parent() {
+  Logger *l = logger();
+  l->wake_m_.unlock();
+  l->rings_m_.unlock();
+  l->drain_m_.unlock();
+}
+
+void after_fork_child() {
+  after_fork_parent();
+  Logger *l = logger();
+  // the thread is gone, its object cannot be joined nor destroyed, and the
+  // condition may still count it as a waiter
+  l->writer_ = nullptr;
+  new (&l->wake_) std::condition_variable();
+  l->writer_alive_.store(false);
+}
+
+}  // namespace
+
+__log_record *__log_begin(int level) {
+  Logger *l = logger();
+  if (!l->enabled_.load(std::memory_order_relaxed)) return nullptr;
+  LogRing *ring = ring_holder.get();
+  uint64_t head = ring->head_.load(std::memory_order_relaxed);
+  while (head - ring->tail_.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+    if (level > LOG_WARNING) {
+      // never stall the file system for chatty levels
+      l->dropped_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    if (!l->enabled_.load(std::memory_order_relaxed)) return nullptr;
+    if (!l->writer_alive_.load(std::memory_order_acquire)) {
+      // nobody else drains the ring
+      drain();
+      continue;
+    }
+    l->wake_.notify_one();
+    std::this_thread::yield();
+  }
+  return &ring->records_[head % LOG_RING_SIZE];
+}
+
+void __log_commit(__log_record *record) {
+  (void)record;
+  LogRing *ring = ring_holder.get();
+  ring->head_.store(ring->head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void logging_setlevel(int new_level) { __log_level.store(new_level); }
 
 int logging_open(const char *path) {
   if (path == NULL) return 0;
 
-  if ((logfile = fopen(path, "w")) == NULL) {
+  Logger *l = logger();
+  if (l->file_ != nullptr) logging_close();
+  if ((l->file_ = fopen(path, "w")) == NULL) {
     perror("open");
     return -1;
   }
 
+  static std::once_flag registered;
+  std::call_once(registered, [] {
+    atexit(logging_close);
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+  });
+  start_writer();
+  l->enabled_.store(true);
   return 0;
 }
+
+void logging_start() {
+  if (logger()->file_ != nullptr) start_writer();
+}
+
+void logging_flush() { drain(); }
+
+void logging_close() {
+  Logger *l = logger();
+  if (l->file_ == nullptr) return;
+  l->enabled_.store(false);
+  {
+    std::lock_guard<std::mutex> lck(l->wake_m_);
+    l->stop_ = true;
+  }
+  l->wake_.notify_one();
+  if (l->writer_ != nullptr) {
+    l->writer_->join();
+    delete l->writer_;
+    l->writer_ = nullptr;
+    l->writer_alive_.store(false);
+  }
+  drain();
+  std::lock_guard<std::mutex> lck(l->drain_m_);
+  fclose(l->file_);
+  l->file_ = nullptr;
+}
@@ -0,0 +1,174 @@
+#include "utils/lz.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace naivefs {
+
+namespace {
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_LOG 13
+// the last 5 bytes are literals and the last match starts 12 bytes before
+// the end at the latest, as LZ4 requires
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+// the scan speeds up by a byte every 2^LZ_SKIP_TRIGGER bytes without match
+#define LZ_SKIP_TRIGGER 6
+
+inline uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t read64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/**
+ * @brief Bytes of a length past the 15 of its token: 255 each, then the rest
+ */
+inline size_t length_bytes(size_t len) {
+  return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+inline uint8_t* put_length(uint8_t* op, size_t len) {
+  for (len -= 15; len >= 255; len -= 255) *op++ = 255;
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/**
+ * @brief Read the bytes of a length past the 15 of its token
+ *
+ * @return false if the input ends first
+ */
+inline bool get_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+  uint8_t b;
+  do {
+    if (*ip >= iend) return false;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+/**
+ * @brief Length of the match of a and b, up to limit
+ */
+inline size_t match_length(const uint8_t* a, const uint8_t* b,
+                           const uint8_t* limit) {
+  const uint8_t* start = a;
+  while (a + sizeof(uint64_t) <= limit) {
+    uint64_t diff = read64(a) ^ read64(b);
+    if (diff) return a - start + __builtin_ctzll(diff) / 8;
+    a += sizeof(uint64_t), b += sizeof(uint64_t);
+  }
+  while (a < limit && *a == *b) ++a, ++b;
+  return a - start;
+}
+
+}  // namespace
+
+size_t lz_compress(const void* src, size_t size, void* dst, size_t capacity) {
+  const uint8_t* base = (const uint8_t*)src;
+  const uint8_t* ip = base;
+  const uint8_t* anchor = base;
+  const uint8_t* iend = base + size;
+  uint8_t* op = (uint8_t*)dst;
+  uint8_t* oend = op + capacity;
+  if (size > LZ_MF_LIMIT) {
+    const uint8_t* mf_limit = iend - LZ_MF_LIMIT;
+    const uint8_t* match_limit = iend - LZ_LAST_LITERALS;
+    // positions in src, a stale or empty one fails the comparison
+    uint32_t table[1 << LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+    ++ip;
+    while (ip < mf_limit) {
+      uint32_t seq = read32(ip);
+      uint32_t h = hash(seq);
+      const uint8_t* ref = base + table[h];
+      table[h] = ip - base;
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+        ip += 1 + ((ip - anchor) >> LZ_SKIP_TRIGGER);
+        continue;
+      }
+      while (ip > anchor && ref > base && ip[-1] == ref[-1]) --ip, --ref;
+      size_t literals = ip - anchor;
+      size_t len = LZ_MIN_MATCH + match_length(ip + LZ_MIN_MATCH,
+                                               ref + LZ_MIN_MATCH, match_limit);
+      size_t need = 1 + length_bytes(literals) + literals + 2 +
+                    length_bytes(len - LZ_MIN_MATCH);
+      if (need > (size_t)(oend - op)) return 0;
+      uint8_t* token = op++;
+      *token = (uint8_t)(std::min<size_t>(literals, 15) << 4);
+      if (literals >= 15) op = put_length(op, literals);
+      memcpy(op, anchor, literals);
+      op += literals;
+      uint16_t offset = ip - ref;
+      *op++ = offset & 0xff;
+      *op++ = offset >> 8;
+      *token |= (uint8_t)std::min<size_t>(len - LZ_MIN_MATCH, 15);
+      if (len - LZ_MIN_MATCH >= 15) op = put_length(op, len - LZ_MIN_MATCH);
+      ip += len;
+      anchor = ip;
+      // the match end is a likely start of the next one
+      if (ip < mf_limit) table[hash(read32(ip - 2))] = ip - 2 - base;
+    }
+  }
+  size_t literals = iend - anchor;
+  if (1 + length_bytes(literals) + literals > (size_t)(oend - op)) return 0;
+  *op++ = (uint8_t)(std::min<size_t>(literals, 15) << 4);
+  if (literals >= 15) op = put_length(op, literals);
+  memcpy(op, anchor, literals);
+  op += literals;
+  return op - (uint8_t*)dst;
+}
+
+int64_t lz_decompress(const void* src, size_t size, void* dst,
+                      size_t capacity) {
+  const uint8_t* ip = (const uint8_t*)src;
+  const uint8_t* iend = ip + size;
+  uint8_t* base = (uint8_t*)dst;
+  uint8_t* op = base;
+  uint8_t* oend = base + capacity;
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !get_length(&ip, iend, &literals)) return -1;
+    if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, literals);
+    ip += literals, op += literals;
+    // the last sequence has no match
+    if (ip == iend) break;
+    if (iend - ip < 2) return -1;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - base)) return -1;
+    size_t len = token & 15;
+    if (len == 15 && !get_length(&ip, iend, &len)) return -1;
+    len += LZ_MIN_MATCH;
+    if (len > (size_t)(oend - op)) return -1;
+    const uint8_t* ref = op - offset;
+    if (offset >= len) {
+      memcpy(op, ref, len);
+      op += len;
+    } else {
+      // overlapping, a run repeating the last offset bytes
+      while (len--) *op++ = *ref++;
+    }
+  }
+  return op - base;
+}
+
+}  // namespace naivefs
@@ -0,0 +1,210 @@
+#include "utils/pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <new>
+
+namespace naivefs {
+
+void* arena_map(size_t size, bool* huge_page) {
+  void* arena = MAP_FAILED;
+  if (*huge_page) {
+    arena = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena == MAP_FAILED) {
+      // no huge pages reserved by the administrator, don't try again
+      WARNING("Failed to map %zu bytes of huge pages: %s", size,
+              strerror(errno));
+      *huge_page = false;
+    }
+  }
+  if (arena == MAP_FAILED) {
+    arena = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+      ERR("Failed to map %zu bytes: %s", size, strerror(errno));
+      return nullptr;
+    }
+#ifdef MADV_HUGEPAGE
+    // transparent huge pages, if the kernel feels like it
+    madvise(arena, size, MADV_HUGEPAGE);
+#endif
+  }
+  return arena;
+}
+
+void arena_unmap(void* arena, size_t size) {
+  if (arena != nullptr) munmap(arena, size);
+}
+
+BufferPool::BufferPool(size_t buffer_size, size_t chunk_size, bool huge_page)
+    : buffer_size_(buffer_size),
+      chunk_size_(chunk_size),
+      huge_page_(huge_page),
+      free_list_(nullptr),
+      capacity_(0) {
+  ASSERT(buffer_size_ >= sizeof(FreeBuffer));
+  ASSERT(chunk_size_ % buffer_size_ == 0);
+}
+
+BufferPool::~BufferPool() {
+  for (auto& chunk : chunks_) arena_unmap(chunk.first, chunk.second);
+}
+
+bool BufferPool::reserve(size_t n) {
+  std::lock_guard<std::mutex> lck(m_);
+  while (capacity_ < n) {
+    if (!grow()) return false;
+  }
+  return true;
+}
+
+void* BufferPool::alloc() {
+  std::lock_guard<std::mutex> lck(m_);
+  if (free_list_ == nullptr && !grow()) {
+    ERR("Failed to grow buffer pool");
+    return nullptr;
+  }
+  FreeBuffer* buf = free_list_;
+  free_list_ = buf->next_;
+  return buf;
+}
+
+void BufferPool::free(void* buf) {
+  if (buf == nullptr) return;
+  std::lock_guard<std::mutex> lck(m_);
+  FreeBuffer* ptr = (FreeBuffer*)buf;
+  ptr->next_ = free_list_;
+  free_list_ = ptr;
+}
+
+bool BufferPool::grow() {
+  void* chunk = arena_map(chunk_size_, &huge_page_);
+  if (chunk == nullptr) return false;
+  chunks_.push_back(std::make_pair(chunk, chunk_size_));
+
+  // thread the new buffers in address order
+  uint8_t* ptr = (uint8_t*)chunk;
+  for (size_t i = chunk_size_ / buffer_size_; i > 0; --i) {
+    FreeBuffer* buf = (FreeBuffer*)(ptr + (i - 1) * buffer_size_);
+    buf->next_ = free_list_;
+    free_list_ = buf;
+  }
+  capacity_ += chunk_size_ / buffer_size_;
+  DEBUG("Buffer pool grows to %zu buffers", capacity_);
+  return true;
+}
+
+BufferPool* BufferPool::block_pool() {
+  static BufferPool pool(BLOCK_SIZE, POOL_CHUNK_SIZE, BLOCK_POOL_HUGE_PAGE);
+  return &pool;
+}
+
+namespace {
+
+class SlabCache;
+
+/**
+ * @brief Placed at the start of every slab. Large objects have a slab of
+ * their own without a cache.
+ */
+struct SlabHeader {
+  SlabCache* cache_;
+  uint64_t reserved_;
+};
+
+class SlabCache {
+  struct FreeObject {
+    FreeObject* next_;
+  };
+
+ public:
+  explicit SlabCache(size_t object_size)
+      : object_size_(object_size), free_list_(nullptr) {}
+
+  void* alloc() {
+    std::lock_guard<std::mutex> lck(m_);
+    if (free_list_ == nullptr && !grow()) return nullptr;
+    FreeObject* obj = free_list_;
+    free_list_ = obj->next_;
+    return obj;
+  }
+
+  void free(void* ptr) {
+    std::lock_guard<std::mutex> lck(m_);
+    FreeObject* obj = (FreeObject*)ptr;
+    obj->next_ = free_list_;
+    free_list_ = obj;
+  }
+
+ private:
+  // slabs are never given back, the pool only grows to its peak usage
+  bool grow() {
+    SlabHeader* slab = (SlabHeader*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (slab == nullptr) {
+      ERR("Failed to alloc slab of %zu bytes objects", object_size_);
+      return false;
+    }
+    slab->cache_ = this;
+    uint8_t* ptr = (uint8_t*)(slab + 1);
+    for (size_t i = (SLAB_SIZE - sizeof(SlabHeader)) / object_size_; i > 0;
+         --i) {
+      FreeObject* obj = (FreeObject*)(ptr + (i - 1) * object_size_);
+      obj->next_ = free_list_;
+      free_list_ = obj;
+    }
+    return true;
+  }
+
+  size_t object_size_;
+  FreeObject* free_list_;
+  std::mutex m_;
+};
+
+const size_t slab_sizes[] = {32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+const size_t num_slab_sizes = sizeof(slab_sizes) / sizeof(slab_sizes[0]);
+
+inline SlabCache* slab_cache(size_t size) {
+  static SlabCache* caches = [] {
+    // never destroyed, objects may be freed during static destruction
+    SlabCache* caches = (SlabCache*)malloc(sizeof(SlabCache) * num_slab_sizes);
+    for (size_t i = 0; i < num_slab_sizes; ++i)
+      new (caches + i) SlabCache(slab_sizes[i]);
+    return caches;
+  }();
+  for (size_t i = 0; i < num_slab_sizes; ++i) {
+    if (size <= slab_sizes[i]) return caches + i;
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+void* slab_alloc(size_t size) {
+  static_assert(SLAB_MAX_OBJECT_SIZE == 1024, "update slab_sizes");
+  SlabCache* cache = slab_cache(size);
+  if (cache != nullptr) return cache->alloc();
+
+  // large object: a slab of its own
+  size_t slab_size =
+      (size + sizeof(SlabHeader) + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE;
+  SlabHeader* slab = (SlabHeader*)aligned_alloc(SLAB_SIZE, slab_size);
+  if (slab == nullptr) return nullptr;
+  slab->cache_ = nullptr;
+  return slab + 1;
+}
+
+void slab_free(void* ptr) {
+  if (ptr == nullptr) return;
+  SlabHeader* slab = (SlabHeader*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+  if (slab->cache_ == nullptr) {
+    ASSERT(ptr == slab + 1);
+    ::free(slab);
+    return;
+  }
+  slab->cache_->free(ptr);
+}
+
+}  // namespace naivefs
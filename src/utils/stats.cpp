@@ -0,0 +1,175 @@
+#include "utils/stats.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace naivefs {
+
+namespace {
+
+const char* histogram_names[NUM_STAT_HISTOGRAMS] = {
+    "op_getattr",      "op_readdir",      "op_open",    "op_read",
+    "op_write",        "op_create",       "op_mkdir",   "op_rmdir",
+    "op_unlink",       "op_rename",       "op_link",    "op_symlink",
+    "op_readlink",     "op_truncate",     "op_chmod",   "op_chown",
+    "op_utimens",      "op_access",       "op_release", "op_fsync",
+    "op_ioctl",        "disk_read",       "disk_write", "big_lock_wait",
+    "block_lock_wait", "group_lock_wait"};
+
+const char* counter_names[NUM_STAT_COUNTERS] = {
+    "cache_hit",             "cache_miss",            "cache_evict",
+    "cache_writeback",       "disk_read_bytes",       "disk_write_bytes",
+    "disk_discard_bytes",    "delalloc_blocks",       "delalloc_dropped",
+    "defrag_blocks",         "csum_errors",           "compress_clusters",
+    "compress_saved_blocks", "decompress_clusters",   "dedup_blocks",
+    "dedup_cow_blocks"};
+
+struct Histogram {
+  std::atomic<uint64_t> buckets_[STAT_NUM_BUCKETS];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
+
+struct ThreadStats {
+  std::atomic<uint64_t> counters_[NUM_STAT_COUNTERS];
+  Histogram histograms_[NUM_STAT_HISTOGRAMS];
+};
+
+// summed up statistics
+struct Totals {
+  uint64_t counters_[NUM_STAT_COUNTERS];
+  uint64_t buckets_[NUM_STAT_HISTOGRAMS][STAT_NUM_BUCKETS];
+  uint64_t count_[NUM_STAT_HISTOGRAMS];
+  uint64_t sum_[NUM_STAT_HISTOGRAMS];
+  uint64_t max_[NUM_STAT_HISTOGRAMS];
+
+  void add(const ThreadStats* stats) {
+    for (int i = 0; i < NUM_STAT_COUNTERS; ++i)
+      counters_[i] += stats->counters_[i].load(std::memory_order_relaxed);
+    for (int i = 0; i < NUM_STAT_HISTOGRAMS; ++i) {
+      const Histogram& h = stats->histograms_[i];
+      for (int j = 0; j < STAT_NUM_BUCKETS; ++j)
+        buckets_[i][j] += h.buckets_[j].load(std::memory_order_relaxed);
+      count_[i] += h.count_.load(std::memory_order_relaxed);
+      sum_[i] += h.sum_.load(std::memory_order_relaxed);
+      max_[i] = std::max(max_[i], h.max_.load(std::memory_order_relaxed));
+    }
+  }
+};
+
+struct Registry {
+  std::mutex m_;
+  std::vector<ThreadStats*> threads_;
+  // statistics of the threads that have exited
+  Totals retired_;
+};
+
+Registry* registry() {
+  // never destroyed, threads may exit during static destruction
+  static Registry* registry = new Registry();
+  return registry;
+}
+
+class ThreadSlot {
+ public:
+  ThreadSlot() : stats_(new ThreadStats()) {
+    Registry* r = registry();
+    std::lock_guard<std::mutex> lck(r->m_);
+    r->threads_.push_back(stats_);
+  }
+
+  ~ThreadSlot() {
+    Registry* r = registry();
+    std::lock_guard<std::mutex> lck(r->m_);
+    r->retired_.add(stats_);
+    r->threads_.erase(
+        std::find(r->threads_.begin(), r->threads_.end(), stats_));
+    delete stats_;
+  }
+
+  ThreadStats* stats_;
+};
+
+thread_local ThreadSlot slot;
+
+// only the owning thread writes, readers may see a slightly stale value
+inline void bump(std::atomic<uint64_t>& value, uint64_t delta) {
+  value.store(value.load(std::memory_order_relaxed) + delta,
+              std::memory_order_relaxed);
+}
+
+inline uint32_t bucket_of(uint64_t ns) {
+  if (ns < (1 << STAT_SUB_BITS)) return ns;
+  uint32_t shift = 63 - __builtin_clzll(ns) - STAT_SUB_BITS;
+  return ((shift + 1) << STAT_SUB_BITS) +
+         ((ns >> shift) & ((1 << STAT_SUB_BITS) - 1));
+}
+
+// the largest value falling into the bucket
+inline uint64_t bucket_value(uint32_t bucket) {
+  if (bucket < (1 << STAT_SUB_BITS)) return bucket;
+  uint32_t shift = (bucket >> STAT_SUB_BITS) - 1;
+  uint64_t sub = bucket & ((1 << STAT_SUB_BITS) - 1);
+  return (((1 << STAT_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+uint64_t percentile(const Totals* totals, int i, double p) {
+  uint64_t rank = (uint64_t)(totals->count_[i] * p);
+  uint64_t seen = 0;
+  for (uint32_t j = 0; j < STAT_NUM_BUCKETS; ++j) {
+    seen += totals->buckets_[i][j];
+    if (seen > rank) return std::min(bucket_value(j), totals->max_[i]);
+  }
+  return totals->max_[i];
+}
+
+}  // namespace
+
+void stat_add(StatCounter counter, uint64_t value) {
+  bump(slot.stats_->counters_[counter], value);
+}
+
+void stat_record(StatHistogram histogram, uint64_t ns) {
+  Histogram& h = slot.stats_->histograms_[histogram];
+  bump(h.buckets_[bucket_of(ns)], 1);
+  bump(h.count_, 1);
+  bump(h.sum_, ns);
+  if (ns > h.max_.load(std::memory_order_relaxed))
+    h.max_.store(ns, std::memory_order_relaxed);
+}
+
+std::string stat_report() {
+  Totals* totals = new Totals();
+  {
+    Registry* r = registry();
+    std::lock_guard<std::mutex> lck(r->m_);
+    *totals = r->retired_;
+    for (auto stats : r->threads_) totals->add(stats);
+  }
+
+  std::string report;
+  char line[256];
+  for (int i = 0; i < NUM_STAT_COUNTERS; ++i) {
+    snprintf(line, sizeof(line), "%s %lu\n", counter_names[i],
+             totals->counters_[i]);
+    report += line;
+  }
+  for (int i = 0; i < NUM_STAT_HISTOGRAMS; ++i) {
+    snprintf(line, sizeof(line),
+             "%s count=%lu sum_ns=%lu max_ns=%lu p50_ns=%lu p90_ns=%lu "
+             "p99_ns=%lu p999_ns=%lu\n",
+             histogram_names[i], totals->count_[i], totals->sum_[i],
+             totals->max_[i], percentile(totals, i, 0.5),
+             percentile(totals, i, 0.9), percentile(totals, i, 0.99),
+             percentile(totals, i, 0.999));
+    report += line;
+  }
+  delete totals;
+  return report;
+}
+
+}  // namespace naivefs
@@ -0,0 +1,155 @@
+#include "utils/trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include "utils/logging.h"
+#include "utils/stats.h"
+
+namespace naivefs {
+
+namespace {
+
+// records are batched by stdio, one fwrite per record under the lock
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+const char *op_names[NUM_TRACE_OPS] = {
+    "getattr", "readdir",  "open",     "read",  "write",   "create",
+    "mkdir",   "rmdir",    "unlink",   "rename", "link",   "symlink",
+    "readlink", "truncate", "chmod",   "chown", "utimens", "access",
+    "release", "fsync",    "flush"};
+
+struct Tracer {
+  std::mutex m_;
+  FILE *file_ = nullptr;
+  char *buffer_ = nullptr;
+  uint64_t base_ = 0;
+  std::atomic<bool> enabled_{false};
+  std::atomic<uint16_t> threads_{0};
+  // open file handles to their trace handles
+  std::unordered_map<uint64_t, uint64_t> handles_;
+  uint64_t next_handle_ = 1;
+};
+
+Tracer tracer;
+
+uint16_t thread_index() {
+  static thread_local int index = -1;
+  if (index < 0) index = tracer.threads_.fetch_add(1);
+  return index;
+}
+
+}  // namespace
+
+const char *trace_op_name(uint8_t op) {
+  return op < NUM_TRACE_OPS ? op_names[op] : "unknown";
+}
+
+int trace_open(const char *path) {
+  std::lock_guard<std::mutex> lck(tracer.m_);
+  if (tracer.file_ != nullptr) return -EBUSY;
+  FILE *file = fopen(path, "wb");
+  if (file == nullptr) {
+    ERR("Failed to open trace %s: %s", path, strerror(errno));
+    return -errno;
+  }
+  tracer.buffer_ = (char *)malloc(TRACE_BUFFER_SIZE);
+  setvbuf(file, tracer.buffer_, _IOFBF, TRACE_BUFFER_SIZE);
+
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  TraceHeader header;
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(TraceRecord);
+  header.realtime = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    ERR("Failed to write trace %s", path);
+    fclose(file);
+    free(tracer.buffer_);
+    tracer.buffer_ = nullptr;
+    return -EIO;
+  }
+  tracer.file_ = file;
+  tracer.base_ = stat_now();
+  tracer.enabled_.store(true);
+  INFO("Tracing into %s", path);
+  return 0;
+}
+
+void trace_close() {
+  std::lock_guard<std::mutex> lck(tracer.m_);
+  if (tracer.file_ == nullptr) return;
+  tracer.enabled_.store(false);
+  fclose(tracer.file_);
+  free(tracer.buffer_);
+  tracer.file_ = nullptr;
+  tracer.buffer_ = nullptr;
+  tracer.handles_.clear();
+}
+
+bool trace_enabled() { return tracer.enabled_.load(std::memory_order_relaxed); }
+
+uint64_t trace_now() { return stat_now() - tracer.base_; }
+
+void trace_record(TraceRecord *record, const char *path, const char *path2) {
+  uint64_t duration = trace_now() - record->start;
+  record->duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+  record->thread = thread_index();
+  record->reserved = 0;
+  record->path_len = path ? strnlen(path, UINT16_MAX) : 0;
+  record->path2_len = path2 ? strnlen(path2, UINT16_MAX) : 0;
+
+  std::lock_guard<std::mutex> lck(tracer.m_);
+  if (tracer.file_ == nullptr) return;
+  fwrite(record, sizeof(*record), 1, tracer.file_);
+  if (record->path_len) fwrite(path, 1, record->path_len, tracer.file_);
+  if (record->path2_len) fwrite(path2, 1, record->path2_len, tracer.file_);
+}
+
+uint64_t trace_handle_open(uint64_t fh) {
+  std::lock_guard<std::mutex> lck(tracer.m_);
+  return tracer.handles_[fh] = tracer.next_handle_++;
+}
+
+uint64_t trace_handle(uint64_t fh) {
+  std::lock_guard<std::mutex> lck(tracer.m_);
+  auto it = tracer.handles_.find(fh);
+  return it == tracer.handles_.end() ? 0 : it->second;
+}
+
+uint64_t trace_handle_release(uint64_t fh) {
+  std::lock_guard<std::mutex> lck(tracer.m_);
+  auto it = tracer.handles_.find(fh);
+  if (it == tracer.handles_.end()) return 0;
+  uint64_t handle = it->second;
+  tracer.handles_.erase(it);
+  return handle;
+}
+
+bool trace_read_header(FILE *file, TraceHeader *header) {
+  if (fread(header, sizeof(*header), 1, file) != 1) return false;
+  return header->magic == TRACE_MAGIC && header->version == TRACE_VERSION &&
+         header->record_size == sizeof(TraceRecord);
+}
+
+bool trace_read(FILE *file, TraceRecord *record, std::string *path,
+                std::string *path2) {
+  if (fread(record, sizeof(*record), 1, file) != 1) return false;
+  path->resize(record->path_len);
+  path2->resize(record->path2_len);
+  if (record->path_len &&
+      fread(&(*path)[0], 1, record->path_len, file) != record->path_len)
+    return false;
+  if (record->path2_len &&
+      fread(&(*path2)[0], 1, record->path2_len, file) != record->path2_len)
+    return false;
+  return true;
+}
+
+}  // namespace naivefs
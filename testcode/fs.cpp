@@ -0,0 +1,226 @@
+// round trips of compressed and deduplicated files through the file system
+// core, without mounting, run by ctest with the path of mkfs.naivefs
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "ext2/super.h"
+#include "operation.h"
+
+using namespace naivefs;
+
+// There is no FUSE session, so the test is the caller of every request
+struct fuse_context* fuse_get_context(void) {
+  static thread_local fuse_context context;
+  context.uid = getuid();
+  context.gid = getgid();
+  context.pid = getpid();
+  return &context;
+}
+
+static const char* image = "naivefs_test_fs.img";
+static const char* mkfs = nullptr;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                 \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (0)
+
+static void mount() {
+  fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  fuse_init(&conn, nullptr);
+}
+
+static void umount() { fuse_destroy(nullptr); }
+
+static bool format(const char* options) {
+  std::string cmd = std::string(mkfs) + " -q -s 128m -i 1024 -b 2048 " +
+                    options + " " + image;
+  unlink(image);
+  if (system(cmd.c_str()) != 0) return false;
+  global_options.device = (char*)image;
+  mount();
+  return true;
+}
+
+/**
+ * @brief Free blocks of the super block written back by a remount, so that
+ * blocks freed on release and delayed allocations are counted
+ */
+static long free_blocks() {
+  umount();
+  ext2_super_block super;
+  FILE* file = fopen(image, "rb");
+  bool ok = file != nullptr && fread(&super, sizeof(super), 1, file) == 1;
+  if (file != nullptr) fclose(file);
+  mount();
+  return ok ? (long)super.s_free_blocks_count : -1;
+}
+
+static uint32_t get_flags(const char* path, bool dir) {
+  uint32_t flags = 0;
+  fuse_ioctl(path, NAIVEFS_IOC_GETFLAGS, nullptr, nullptr,
+             dir ? FUSE_IOCTL_DIR : 0, &flags);
+  return flags;
+}
+
+static int set_flags(const char* path, uint32_t flags, bool dir) {
+  return fuse_ioctl(path, NAIVEFS_IOC_SETFLAGS, nullptr, nullptr,
+                    dir ? FUSE_IOCTL_DIR : 0, &flags);
+}
+
+static bool write_file(const char* path, const std::string& data, off_t offset,
+                       bool create) {
+  fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_RDWR;
+  if ((create ? fuse_create(path, S_IFREG | 0644, &fi)
+              : fuse_open(path, &fi)) != 0)
+    return false;
+  // in 1 MiB requests, as the kernel sends them
+  bool ok = true;
+  for (size_t done = 0; ok && done < data.size(); done += 1 << 20) {
+    size_t size = std::min(data.size() - done, (size_t)1 << 20);
+    ok = fuse_write(path, data.data() + done, size, offset + done, &fi) ==
+         (int)size;
+  }
+  ok = fuse_fsync(path, 1, &fi) == 0 && ok;
+  fuse_release(path, &fi);
+  return ok;
+}
+
+static std::string read_file(const char* path) {
+  struct stat st;
+  if (fuse_getattr(path, &st, nullptr) != 0) return "";
+  fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_RDONLY;
+  if (fuse_open(path, &fi) != 0) return "";
+  std::string data(st.st_size, 0);
+  int size = fuse_read(path, &data[0], data.size(), 0, &fi);
+  fuse_release(path, &fi);
+  data.resize(size < 0 ? 0 : size);
+  return data;
+}
+
+static std::string text(size_t size, unsigned seed) {
+  std::string data;
+  char line[128];
+  for (unsigned i = 0; data.size() < size; ++i) {
+    snprintf(line, sizeof(line), "{\"id\": %u, \"name\": \"user%u\"},\n", i,
+             (i * 7 + seed) % 1000);
+    data += line;
+  }
+  data.resize(size);
+  return data;
+}
+
+static std::string noise(size_t size, unsigned seed) {
+  std::string data(size, 0);
+  for (auto& c : data) {
+    seed = seed * 1103515245 + 12345;
+    c = seed >> 16;
+  }
+  return data;
+}
+
+static void test_compression() {
+  if (!format("")) {
+    CHECK(!"mkfs failed");
+    return;
+  }
+  CHECK(fuse_mkdir("/c", 0755) == 0);
+  CHECK(set_flags("/c", NAIVEFS_COMPR_FL, true) == 0);
+  // not a whole number of clusters, with a cluster that does not compress
+  std::string data = text((3 << 20) + 12345, 1);
+  std::string random = noise(100000, 2);
+  data.replace(1 << 20, random.size(), random);
+  long before = free_blocks();
+  CHECK(write_file("/plain", data, 0, true));
+  long plain = before - free_blocks();
+  before = free_blocks();
+  CHECK(write_file("/c/file", data, 0, true));
+  long compressed = before - free_blocks();
+  CHECK(get_flags("/c/file", false) & NAIVEFS_COMPRBLK_FL);
+  CHECK(compressed > 0 && compressed < plain / 2);
+  CHECK(read_file("/c/file") == data);
+  // rewriting inside a cluster and past the end
+  std::string patch = text(10000, 3);
+  CHECK(write_file("/c/file", patch, 70000, false));
+  data.replace(70000, patch.size(), patch);
+  CHECK(write_file("/c/file", patch, data.size(), false));
+  data += patch;
+  umount();
+  mount();
+  CHECK(read_file("/c/file") == data);
+  // freeing a compressed file gives all of its blocks back
+  before = free_blocks();
+  CHECK(fuse_unlink("/c/file") == 0);
+  CHECK(free_blocks() - before >= compressed);
+  CHECK(read_file("/plain").size() == data.size() - patch.size());
+  umount();
+}
+
+static void test_dedup() {
+  if (!format("-d")) {
+    CHECK(!"mkfs failed");
+    return;
+  }
+  std::string data = noise((3 << 20) + 777, 1);
+  size_t blocks = data.size() / BLOCK_SIZE;
+  long start = free_blocks();
+  CHECK(write_file("/a", data, 0, true));
+  long used_a = start - free_blocks();
+  CHECK(used_a >= (long)blocks);
+  // a copy shares the blocks of the first file
+  long before = free_blocks();
+  CHECK(write_file("/b", data, 0, true));
+  CHECK(before - free_blocks() < 16);
+  CHECK(get_flags("/b", false) & NAIVEFS_DEDUPBLK_FL);
+  // writing to the copy copies the shared blocks it changes
+  std::string patch = noise(10000, 7);
+  std::string copy = data;
+  copy.replace(BLOCK_SIZE * 100 + 5, patch.size(), patch);
+  CHECK(write_file("/b", patch, BLOCK_SIZE * 100 + 5, false));
+  umount();
+  mount();
+  CHECK(read_file("/a") == data);
+  CHECK(read_file("/b") == copy);
+  // a shared block is freed with its last reference
+  before = free_blocks();
+  CHECK(fuse_unlink("/a") == 0);
+  long freed_a = free_blocks() - before;
+  CHECK(freed_a < 16);
+  CHECK(read_file("/b") == copy);
+  CHECK(fuse_unlink("/b") == 0);
+  CHECK(free_blocks() - start >= -4);
+  umount();
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <mkfs.naivefs>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  mkfs = argv[1];
+  test_compression();
+  test_dedup();
+  unlink(image);
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,120 @@
+// checks the codecs and hashes of src/utils against known values and their
+// portable code, run by ctest
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include "utils/crc32c.h"
+#include "utils/hash.h"
+#include "utils/lz.h"
+
+using namespace naivefs;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                 \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (0)
+
+static void lz_round_trip(const std::vector<uint8_t>& data) {
+  // a worst case bound of LZ4 blocks
+  std::vector<uint8_t> packed(data.size() + data.size() / 255 + 16);
+  std::vector<uint8_t> out(data.size());
+  size_t size = lz_compress(data.data(), data.size(), packed.data(),
+                            packed.size());
+  CHECK(size > 0);
+  CHECK(lz_decompress(packed.data(), size, out.data(), out.size()) ==
+        (int64_t)data.size());
+  CHECK(out == data);
+  if (size > 1) {
+    // truncated input and a short output are detected
+    CHECK(lz_decompress(packed.data(), size - 1, out.data(), out.size()) !=
+          (int64_t)data.size());
+    CHECK(lz_decompress(packed.data(), size, out.data(), out.size() - 1) ==
+          -1);
+  }
+}
+
+static void test_lz() {
+  std::mt19937 rng(1);
+  std::vector<uint8_t> data;
+  for (size_t size : {1, 12, 13, 100, 4096, 65536, 200000}) {
+    data.resize(size);
+    // runs, text and noise
+    for (size_t i = 0; i < size; ++i) data[i] = i / 64 % 3 ? 'a' : i % 251;
+    lz_round_trip(data);
+    for (size_t i = 0; i < size; ++i) data[i] = "naivefs block "[i % 14];
+    lz_round_trip(data);
+    for (size_t i = 0; i < size; ++i) data[i] = rng();
+    lz_round_trip(data);
+  }
+  // compressible data shrinks, it does not fit a too small buffer
+  data.assign(65536, 'x');
+  std::vector<uint8_t> packed(64);
+  CHECK(lz_compress(data.data(), data.size(), packed.data(), 16) == 0);
+  packed.resize(1024);
+  CHECK(lz_compress(data.data(), data.size(), packed.data(), packed.size()) >
+        0);
+}
+
+static void test_crc32c() {
+  const char* check = "123456789";
+  printf("crc32c: %s\n", crc32c_impl());
+  CHECK(crc32c(0, check, 9) == 0xe3069283);
+  CHECK(crc32c_portable(0, check, 9) == 0xe3069283);
+  CHECK(crc32c(0, "", 0) == 0);
+  // all alignments and tails, in one piece or continued
+  std::mt19937 rng(2);
+  std::vector<uint8_t> data(4096 + 16);
+  for (auto& b : data) b = rng();
+  for (size_t start = 0; start < 8; ++start) {
+    for (size_t size : {1, 7, 8, 9, 63, 4096}) {
+      uint32_t crc = crc32c(0, data.data() + start, size);
+      CHECK(crc == crc32c_portable(0, data.data() + start, size));
+      size_t half = size / 2;
+      CHECK(crc == crc32c(crc32c(0, data.data() + start, half),
+                          data.data() + start + half, size - half));
+    }
+  }
+}
+
+static void test_block_hash() {
+  std::mt19937 rng(3);
+  std::vector<uint8_t> data(65536);
+  for (auto& b : data) b = rng();
+  for (size_t size : {0, 64, 128, 4096, 65536}) {
+    CHECK(block_hash(data.data(), size) ==
+          block_hash_portable(data.data(), size));
+  }
+  // blocks differing in one byte, or by moved stripes, hash differently
+  uint64_t h = block_hash(data.data(), 4096);
+  data[4000] ^= 1;
+  CHECK(block_hash(data.data(), 4096) != h);
+  data[4000] ^= 1;
+  std::vector<uint8_t> moved(data.begin() + 64, data.begin() + 4096 + 64);
+  memcpy(moved.data() + 4096 - 64, data.data(), 64);
+  CHECK(block_hash(moved.data(), 4096) != h);
+  std::vector<uint8_t> zero(4096, 0);
+  CHECK(block_hash(zero.data(), 4096) ==
+        block_hash_portable(zero.data(), 4096));
+}
+
+int main() {
+  test_lz();
+  test_crc32c();
+  test_block_hash();
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("OK\n");
+  return 0;
+}
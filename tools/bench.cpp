@@ -0,0 +1,405 @@
+/*
+ * naivefs_bench: drive the file system core in-process, without the kernel
+ * and FUSE in the way, and report throughput and latency percentiles.
+ *
+ * usage: naivefs_bench [options] [workload...]
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "operation.h"
+#include "utils/stats.h"
+
+using namespace naivefs;
+
+// There is no FUSE session, so the bench is the caller of every request
+struct fuse_context *fuse_get_context(void) {
+  static thread_local fuse_context context;
+  context.uid = getuid();
+  context.gid = getgid();
+  context.pid = getpid();
+  return &context;
+}
+
+namespace {
+
+struct BenchConfig {
+  std::string device = "/tmp/naivefs_bench.img";
+  uint64_t device_size = 4ULL << 30;
+  uint64_t file_size = 64ULL << 20;
+  size_t io_size = 4096;
+  size_t threads = 1;
+  size_t ops = 10000;
+  size_t depth = 32;
+  bool remount = false;
+  bool ram = false;
+  unsigned seed = 42;
+};
+
+BenchConfig config;
+
+struct Result {
+  std::string name;
+  std::vector<uint64_t> latencies;  // ns
+  uint64_t bytes = 0;
+  uint64_t elapsed = 0;  // ns
+};
+
+void die(const char *what, const std::string &path, int ret) {
+  fprintf(stderr, "%s %s failed: %s\n", what, path.c_str(), strerror(-ret));
+  exit(1);
+}
+
+#define CHECK(__call, __what, __path)      \
+  do {                                     \
+    int __ret = (__call);                  \
+    if (__ret < 0) die(__what, __path, __ret); \
+  } while (0)
+
+void mount() {
+  fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  fuse_init(&conn, nullptr);
+}
+
+void umount() { fuse_destroy(nullptr); }
+
+void remount() {
+  BlockDevice *device = disk();
+  umount();
+  // fuse_destroy detached the device
+  if (config.ram) disk_attach(device);
+  mount();
+}
+
+/**
+ * @brief Run body(thread, latencies) on config.threads threads and merge
+ * the per-thread latencies
+ */
+Result run(const std::string &name, const std::function<uint64_t(size_t, std::vector<uint64_t> *)> &body) {
+  Result result;
+  result.name = name;
+  std::vector<std::vector<uint64_t>> latencies(config.threads);
+  std::vector<uint64_t> bytes(config.threads);
+  std::vector<std::thread> workers;
+  uint64_t start = stat_now();
+  for (size_t t = 0; t < config.threads; ++t) {
+    latencies[t].reserve(config.ops);
+    workers.emplace_back([&, t] { bytes[t] = body(t, &latencies[t]); });
+  }
+  for (auto &worker : workers) worker.join();
+  result.elapsed = stat_now() - start;
+  for (size_t t = 0; t < config.threads; ++t) {
+    result.latencies.insert(result.latencies.end(), latencies[t].begin(), latencies[t].end());
+    result.bytes += bytes[t];
+  }
+  return result;
+}
+
+std::string file_of(size_t thread) { return "/bench/file" + std::to_string(thread); }
+
+void open_file(const std::string &path, bool create, fuse_file_info *fi) {
+  memset(fi, 0, sizeof(*fi));
+  fi->flags = O_RDWR;
+  if (create) {
+    CHECK(fuse_create(path.c_str(), S_IFREG | 0644, fi), "create", path);
+  } else {
+    CHECK(fuse_open(path.c_str(), fi), "open", path);
+  }
+}
+
+void fill(std::vector<char> *buf, unsigned seed) {
+  std::mt19937 rng(seed);
+  for (auto &c : *buf) c = (char)rng();
+}
+
+uint64_t sequential(size_t thread, std::vector<uint64_t> *latencies, bool write) {
+  fuse_file_info fi;
+  std::string path = file_of(thread);
+  open_file(path, false, &fi);
+  std::vector<char> buf(config.io_size);
+  fill(&buf, config.seed + thread);
+  uint64_t bytes = 0;
+  for (uint64_t off = 0; off + config.io_size <= config.file_size; off += config.io_size) {
+    uint64_t start = stat_now();
+    int ret = write ? fuse_write(path.c_str(), buf.data(), config.io_size, off, &fi)
+                    : fuse_read(path.c_str(), buf.data(), config.io_size, off, &fi);
+    latencies->push_back(stat_now() - start);
+    if (ret < 0) die(write ? "write" : "read", path, ret);
+    bytes += config.io_size;
+  }
+  fuse_release(path.c_str(), &fi);
+  return bytes;
+}
+
+uint64_t random_io(size_t thread, std::vector<uint64_t> *latencies, int write_percent) {
+  fuse_file_info fi;
+  std::string path = file_of(thread);
+  open_file(path, false, &fi);
+  std::vector<char> buf(config.io_size);
+  fill(&buf, config.seed + thread);
+  std::mt19937_64 rng(config.seed * 31 + thread);
+  uint64_t slots = config.file_size / config.io_size;
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < config.ops; ++i) {
+    uint64_t off = (rng() % slots) * config.io_size;
+    bool write = (int)(rng() % 100) < write_percent;
+    uint64_t start = stat_now();
+    int ret = write ? fuse_write(path.c_str(), buf.data(), config.io_size, off, &fi)
+                    : fuse_read(path.c_str(), buf.data(), config.io_size, off, &fi);
+    latencies->push_back(stat_now() - start);
+    if (ret < 0) die(write ? "write" : "read", path, ret);
+    bytes += config.io_size;
+  }
+  fuse_release(path.c_str(), &fi);
+  return bytes;
+}
+
+/**
+ * @brief Create the per-thread files (untimed) for the data workloads
+ */
+void prepare_files() {
+  static bool prepared = false;
+  if (prepared) return;
+  prepared = true;
+  std::vector<char> buf(1 << 20);
+  fill(&buf, config.seed);
+  for (size_t t = 0; t < config.threads; ++t) {
+    fuse_file_info fi;
+    std::string path = file_of(t);
+    open_file(path, true, &fi);
+    for (uint64_t off = 0; off < config.file_size; off += buf.size()) {
+      size_t size = std::min((uint64_t)buf.size(), config.file_size - off);
+      CHECK(fuse_write(path.c_str(), buf.data(), size, off, &fi), "write", path);
+    }
+    fuse_release(path.c_str(), &fi);
+  }
+}
+
+std::vector<Result> workload(const std::string &name) {
+  std::vector<Result> results;
+  if (name == "seqwrite" || name == "seqread" || name == "randwrite" || name == "randread" || name == "mixed") {
+    prepare_files();
+    bool reads = name == "seqread" || name == "randread" || name == "mixed";
+    if (reads && config.remount) remount();
+  }
+
+  if (name == "seqwrite") {
+    results.push_back(run(name, [](size_t t, std::vector<uint64_t> *l) { return sequential(t, l, true); }));
+  } else if (name == "seqread") {
+    results.push_back(run(name, [](size_t t, std::vector<uint64_t> *l) { return sequential(t, l, false); }));
+  } else if (name == "randwrite") {
+    results.push_back(run(name, [](size_t t, std::vector<uint64_t> *l) { return random_io(t, l, 100); }));
+  } else if (name == "randread") {
+    results.push_back(run(name, [](size_t t, std::vector<uint64_t> *l) { return random_io(t, l, 0); }));
+  } else if (name == "mixed") {
+    // 70% reads, 30% writes
+    results.push_back(run(name, [](size_t t, std::vector<uint64_t> *l) { return random_io(t, l, 30); }));
+  } else if (name == "meta") {
+    // create/stat/unlink storm, each phase timed on its own
+    for (size_t t = 0; t < config.threads; ++t) {
+      std::string dir = "/bench/meta" + std::to_string(t);
+      CHECK(fuse_mkdir(dir.c_str(), 0755), "mkdir", dir);
+    }
+    auto name_of = [](size_t t, size_t i) { return "/bench/meta" + std::to_string(t) + "/f" + std::to_string(i); };
+    results.push_back(run("create", [&](size_t t, std::vector<uint64_t> *l) {
+      for (size_t i = 0; i < config.ops; ++i) {
+        fuse_file_info fi;
+        std::string path = name_of(t, i);
+        uint64_t start = stat_now();
+        open_file(path, true, &fi);
+        fuse_release(path.c_str(), &fi);
+        l->push_back(stat_now() - start);
+      }
+      return (uint64_t)0;
+    }));
+    results.push_back(run("stat", [&](size_t t, std::vector<uint64_t> *l) {
+      struct stat st;
+      for (size_t i = 0; i < config.ops; ++i) {
+        std::string path = name_of(t, i);
+        uint64_t start = stat_now();
+        CHECK(fuse_getattr(path.c_str(), &st, nullptr), "getattr", path);
+        l->push_back(stat_now() - start);
+      }
+      return (uint64_t)0;
+    }));
+    results.push_back(run("unlink", [&](size_t t, std::vector<uint64_t> *l) {
+      for (size_t i = 0; i < config.ops; ++i) {
+        std::string path = name_of(t, i);
+        uint64_t start = stat_now();
+        CHECK(fuse_unlink(path.c_str()), "unlink", path);
+        l->push_back(stat_now() - start);
+      }
+      return (uint64_t)0;
+    }));
+  } else if (name == "lookup") {
+    // getattr at the bottom of a deep directory chain
+    std::vector<std::string> leaves(config.threads);
+    for (size_t t = 0; t < config.threads; ++t) {
+      std::string path = "/bench/deep" + std::to_string(t);
+      CHECK(fuse_mkdir(path.c_str(), 0755), "mkdir", path);
+      for (size_t d = 0; d < config.depth; ++d) {
+        path += "/d" + std::to_string(d);
+        CHECK(fuse_mkdir(path.c_str(), 0755), "mkdir", path);
+      }
+      leaves[t] = path;
+    }
+    if (config.remount) remount();
+    results.push_back(run(name, [&](size_t t, std::vector<uint64_t> *l) {
+      struct stat st;
+      for (size_t i = 0; i < config.ops; ++i) {
+        uint64_t start = stat_now();
+        CHECK(fuse_getattr(leaves[t].c_str(), &st, nullptr), "getattr", leaves[t]);
+        l->push_back(stat_now() - start);
+      }
+      return (uint64_t)0;
+    }));
+  } else {
+    fprintf(stderr, "Unknown workload: %s\n", name.c_str());
+    exit(1);
+  }
+  return results;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t rank = std::min(sorted.size() - 1, (size_t)(sorted.size() * p));
+  return sorted[rank];
+}
+
+void report(Result *result) {
+  std::sort(result->latencies.begin(), result->latencies.end());
+  double secs = result->elapsed / 1e9;
+  size_t ops = result->latencies.size();
+  printf("%-10s %9zu %8.3f %11.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", result->name.c_str(), ops, secs,
+         ops / secs, result->bytes / secs / (1 << 20), percentile(result->latencies, 0.5) / 1e3,
+         percentile(result->latencies, 0.9) / 1e3, percentile(result->latencies, 0.99) / 1e3,
+         percentile(result->latencies, 0.999) / 1e3, ops ? result->latencies.back() / 1e3 : 0.0);
+}
+
+/**
+ * @brief Image files behind a device spec: the spec itself, or the members of
+ * a striped device
+ */
+std::vector<std::string> image_files(const std::string &spec) {
+  if (spec.compare(0, strlen(STRIPE_DEVICE_PREFIX), STRIPE_DEVICE_PREFIX) != 0) return {spec};
+  std::vector<std::string> files;
+  size_t begin = spec.find(':', strlen(STRIPE_DEVICE_PREFIX)) + 1;
+  while (true) {
+    size_t end = spec.find(STRIPE_MEMBER_SEPARATOR, begin);
+    files.push_back(spec.substr(begin, end - begin));
+    if (end == std::string::npos) break;
+    begin = end + 1;
+  }
+  return files;
+}
+
+void usage(const char *progname) {
+  printf(
+      "usage: %s [options] [workload...]\n\n"
+      "Workloads: seqwrite seqread randwrite randread mixed meta lookup\n"
+      "           (default: all of them, in this order)\n\n"
+      "Options:\n"
+      "    -d, --device=<path>       Disk image, recreated empty (default: %s), or\n"
+      "                              stripe:<chunk>:<image>+<image>... to stripe images\n"
+      "    -D, --device-size=<MB>    Size of the disk image, split among striped\n"
+      "                              images (default: %lu)\n"
+      "    -f, --file-size=<MB>      File size of the data workloads (default: %lu)\n"
+      "    -s, --io-size=<bytes>     Size of every read and write (default: %zu)\n"
+      "    -t, --threads=<n>         Worker threads (default: %zu)\n"
+      "    -n, --ops=<n>             Operations per thread (default: %zu)\n"
+      "    -l, --depth=<n>           Directory depth of lookup (default: %zu)\n"
+      "    -c, --cache-blocks=<n>    Blocks in the block cache (default: %d)\n"
+      "    -e, --io-engine=<s>       direct or buffered (default: direct)\n"
+      "    -m, --ram                 Run on a RAM disk of --device-size\n"
+      "    -r, --remount             Remount before read workloads (cold cache)\n"
+      "    -S, --stats               Dump /.naivefs/stats at the end\n",
+      progname, config.device.c_str(), config.device_size >> 20, config.file_size >> 20, config.io_size,
+      config.threads, config.ops, config.depth, BLOCK_CACHE_SIZE);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+      {"device", required_argument, 0, 'd'},  {"device-size", required_argument, 0, 'D'},
+      {"file-size", required_argument, 0, 'f'}, {"io-size", required_argument, 0, 's'},
+      {"threads", required_argument, 0, 't'}, {"ops", required_argument, 0, 'n'},
+      {"depth", required_argument, 0, 'l'},   {"cache-blocks", required_argument, 0, 'c'},
+      {"io-engine", required_argument, 0, 'e'}, {"remount", no_argument, 0, 'r'},
+      {"ram", no_argument, 0, 'm'},           {"stats", no_argument, 0, 'S'},         {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  bool dump_stats = false;
+  std::string io_engine = IO_ENGINE_DIRECT;
+  int c;
+  while ((c = getopt_long(argc, argv, "d:D:f:s:t:n:l:c:e:rmSh", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'd': config.device = optarg; break;
+      case 'D': config.device_size = strtoull(optarg, NULL, 0) << 20; break;
+      case 'f': config.file_size = strtoull(optarg, NULL, 0) << 20; break;
+      case 's': config.io_size = strtoull(optarg, NULL, 0); break;
+      case 't': config.threads = strtoull(optarg, NULL, 0); break;
+      case 'n': config.ops = strtoull(optarg, NULL, 0); break;
+      case 'l': config.depth = strtoull(optarg, NULL, 0); break;
+      case 'c': global_options.cache_blocks = strtoul(optarg, NULL, 0); break;
+      case 'e': io_engine = optarg; break;
+      case 'r': config.remount = true; break;
+      case 'm': config.ram = true; break;
+      case 'S': dump_stats = true; break;
+      default: usage(argv[0]); return c == 'h' ? 0 : 1;
+    }
+  }
+  if (config.io_size == 0 || config.threads == 0 || config.file_size < config.io_size) {
+    fprintf(stderr, "Invalid sizes\n");
+    return 1;
+  }
+  std::vector<std::string> workloads;
+  for (int i = optind; i < argc; ++i) workloads.push_back(argv[i]);
+  if (workloads.empty()) workloads = {"seqwrite", "seqread", "randwrite", "randread", "mixed", "meta", "lookup"};
+
+  RamDevice *ram = nullptr;
+  std::vector<std::string> images;
+  if (config.ram) {
+    // attached rather than opened by spec, so it outlives remounts
+    ram = new RamDevice("ram", config.device_size);
+    if (ram->open() < 0) return 1;
+    disk_attach(ram);
+  } else {
+    // start from empty (uninitialized) images
+    images = image_files(config.device);
+    for (auto &image : images) {
+      unlink(image.c_str());
+      int fd = open(image.c_str(), O_CREAT | O_RDWR, 0644);
+      if (fd < 0 || ftruncate(fd, config.device_size / images.size()) < 0) {
+        perror(image.c_str());
+        return 1;
+      }
+      close(fd);
+    }
+  }
+  global_options.device = (char *)config.device.c_str();
+  global_options.io_engine = (char *)io_engine.c_str();
+
+  mount();
+  CHECK(fuse_mkdir("/bench", 0755), "mkdir", std::string("/bench"));
+  printf("%-10s %9s %8s %11s %9s %9s %9s %9s %9s %9s\n", "workload", "ops", "secs", "ops/s", "MB/s", "p50_us",
+         "p90_us", "p99_us", "p999_us", "max_us");
+  for (auto &name : workloads) {
+    for (auto &result : workload(name)) report(&result);
+  }
+  if (dump_stats) printf("\n%s", stat_report().c_str());
+  umount();
+  delete ram;
+  for (auto &image : images) unlink(image.c_str());
+  return 0;
+}
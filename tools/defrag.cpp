@@ -0,0 +1,115 @@
+/*
+ * naivefs_defrag: defragment files of a mounted NaiveFS online, through the
+ * NAIVEFS_IOC_DEFRAG ioctl. A file is measured by the runs of adjacent data
+ * blocks (extents) its block map has, and one of several extents is copied
+ * into a single run while it stays open for other readers. Directories are
+ * walked without crossing mount points.
+ *
+ * usage: naivefs_defrag [options] <file|dir>...
+ */
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ioctl.h"
+
+namespace {
+
+struct DefragConfig {
+  bool check = false;  // only measure
+  bool verbose = false;
+};
+
+struct DefragTotals {
+  uint64_t files = 0;
+  uint64_t fragmented = 0;  // files of more than one extent
+  uint64_t defragmented = 0;
+  uint64_t blocks = 0;
+  uint64_t extents_before = 0;
+  uint64_t extents_after = 0;
+  uint64_t errors = 0;
+};
+
+DefragConfig config;
+DefragTotals totals;
+
+int defrag_file(const char *path, const struct stat *st, int type, struct FTW *) {
+  if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    totals.errors++;
+    return 0;
+  }
+  naivefs_defrag arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.flags = config.check ? NAIVEFS_DEFRAG_QUERY : 0;
+  int ret = ioctl(fd, NAIVEFS_IOC_DEFRAG, &arg);
+  close(fd);
+  if (ret < 0) {
+    perror(path);
+    totals.errors++;
+    return 0;
+  }
+  totals.files++;
+  totals.blocks += arg.blocks;
+  totals.extents_before += arg.extents_before;
+  totals.extents_after += arg.extents_after;
+  if (arg.extents_before > 1) totals.fragmented++;
+  if (arg.extents_after < arg.extents_before) totals.defragmented++;
+  if (config.verbose || arg.extents_after < arg.extents_before) {
+    if (config.check)
+      printf("%s: %u blocks, %u extents\n", path, arg.blocks, arg.extents_before);
+    else
+      printf("%s: %u blocks, %u -> %u extents\n", path, arg.blocks, arg.extents_before, arg.extents_after);
+  }
+  return 0;
+}
+
+void usage(const char *progname) {
+  printf(
+      "usage: %s [options] <file|dir>...\n\n"
+      "Options:\n"
+      "    -c, --check    Only report the extents of the files\n"
+      "    -v, --verbose  Print every file, not only the defragmented ones\n",
+      progname);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+      {"check", no_argument, 0, 'c'}, {"verbose", no_argument, 0, 'v'}, {"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "cvh", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'c': config.check = true; break;
+      case 'v': config.verbose = true; break;
+      default: usage(argv[0]); return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind == argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (int i = optind; i < argc; ++i) {
+    if (nftw(argv[i], defrag_file, 64, FTW_PHYS | FTW_MOUNT) < 0) {
+      perror(argv[i]);
+      totals.errors++;
+    }
+  }
+
+  double per_file = totals.files ? (double)totals.extents_before / totals.files : 0;
+  printf("%lu files, %lu blocks, %lu fragmented, %.2f extents per file", totals.files, totals.blocks,
+         totals.fragmented, per_file);
+  if (!config.check)
+    printf(", %lu defragmented, %.2f extents per file after", totals.defragmented,
+           totals.files ? (double)totals.extents_after / totals.files : 0);
+  printf("\n");
+  return totals.errors ? 1 : 0;
+}
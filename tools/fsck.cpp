@@ -0,0 +1,568 @@
+/*
+ * fsck.naivefs: check a file system offline. Block groups are checked in
+ * parallel, each with one sequential read of its bitmaps and inode table.
+ *
+ *   pass 1  inodes and the blocks they reference (per group)
+ *   pass 2  directory entries against the inodes they name
+ *   pass 3  link counts, bitmaps and group descriptor counters (per group)
+ *
+ * With METADATA_CSUM, the super block, bitmaps and inode tables are checked
+ * against their checksums in pass 1. With dedup, the data blocks regular files
+ * share are checked against their reference counts in pass 3.
+ *
+ * The device is only read. The exit status follows e2fsck: 0 clean, 4 errors
+ * found, 8 the check could not run.
+ *
+ * usage: fsck.naivefs [options] <device>
+ */
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block.h"
+#include "utils/bitmap.h"
+#include "utils/disk.h"
+#include "utils/stats.h"
+
+using namespace naivefs;
+
+namespace {
+
+#define FSCK_CLEAN 0
+#define FSCK_ERRORS 4
+#define FSCK_FAILED 8
+
+#define BITS_PER_GROUP (BLOCK_SIZE * 8)
+
+struct FsckConfig {
+  unsigned threads = std::thread::hardware_concurrency();
+  // errors past this are counted but not printed
+  uint64_t max_errors = 100;
+  bool verbose = false;
+};
+
+FsckConfig config;
+
+/**
+ * @brief A directory entry found in pass 1, checked in pass 2
+ */
+struct Entry {
+  uint32_t dir_;
+  uint32_t inode_;
+  uint8_t file_type_;
+  std::string name_;
+};
+
+struct GroupState {
+  bool valid_ = false;
+  uint8_t inode_bitmap_[BLOCK_SIZE];
+  uint8_t block_bitmap_[BLOCK_SIZE];
+  // data blocks referenced by some inode, set concurrently by all workers
+  std::unique_ptr<std::atomic<uint64_t>[]> claimed_{
+      new std::atomic<uint64_t>[BITS_PER_GROUP / 64]()};
+  // with dedup, the references to each data block past the first
+  std::unique_ptr<std::atomic<uint16_t>[]> shares_;
+  uint32_t dirs_ = 0;
+  // entries of the directories whose inodes live in this group
+  std::vector<Entry> entries_;
+};
+
+/**
+ * @brief Per-thread buffers: the metadata of a group, and one block for every
+ * level of indirection (0 holds data blocks)
+ */
+struct Worker {
+  uint8_t *meta_;
+  uint8_t *level_[4];
+};
+
+ext2_super_block super;
+std::vector<ext2_group_desc> descs;
+uint32_t n_groups, ipg, dpg, itb, stride;
+std::vector<GroupState> groups;
+
+// per inode: mode >> 12 (0 if free), i_links_count and directory entries
+std::vector<uint8_t> inode_types;
+std::vector<uint16_t> inode_links;
+std::unique_ptr<std::atomic<uint32_t>[]> inode_refs;
+
+std::atomic<uint64_t> n_errors{0};
+std::mutex report_m;
+
+void report(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void report(const char *fmt, ...) {
+  if (n_errors.fetch_add(1) >= config.max_errors) return;
+  va_list args;
+  va_start(args, fmt);
+  std::lock_guard<std::mutex> lck(report_m);
+  vprintf(fmt, args);
+  putchar('\n');
+  va_end(args);
+}
+
+/**
+ * @brief Run fn(worker, group) for every group on config.threads threads
+ */
+void for_each_group(const std::function<void(Worker &, uint32_t)> &fn) {
+  std::atomic<uint32_t> next{0};
+  std::vector<std::thread> threads;
+  unsigned n = std::max(1u, std::min(config.threads, n_groups));
+  for (unsigned t = 0; t < n; ++t) {
+    threads.emplace_back([&]() {
+      Worker worker;
+      worker.meta_ = (uint8_t *)alloc_aligned(BLOCKS2BYTES(2 + itb));
+      for (auto &level : worker.level_) level = (uint8_t *)alloc_aligned(BLOCK_SIZE);
+      for (uint32_t g; (g = next.fetch_add(1)) < n_groups;) fn(worker, g);
+      free(worker.meta_);
+      for (auto level : worker.level_) free(level);
+    });
+  }
+  for (auto &thread : threads) thread.join();
+}
+
+/**
+ * @brief Record that inode owns block index. False if the block cannot be
+ * used: out of range or already owned, unless it can be shared.
+ */
+bool claim_block(uint32_t inode, uint32_t index, bool shareable = false) {
+  uint32_t g = index / stride, inner = index % stride;
+  if (g >= n_groups || inner >= dpg) {
+    report("inode %u: block %u is out of range", inode, index);
+    return false;
+  }
+  uint64_t bit = 1ULL << (inner & 63);
+  if (groups[g].claimed_[inner >> 6].fetch_or(bit) & bit) {
+    // checked against its reference count in pass 3
+    if (shareable) {
+      groups[g].shares_[inner]++;
+      return true;
+    }
+    report("inode %u: block %u is also used by another inode", inode, index);
+    return false;
+  }
+  return true;
+}
+
+bool read_block(uint32_t inode, uint32_t index, uint8_t *buf) {
+  uint32_t g = index / stride;
+  off_t offset = data_block_offset(&super, g, index % stride);
+  if (disk_read(offset, BLOCK_SIZE, buf) < 0) {
+    report("inode %u: cannot read block %u", inode, index);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Same layout as DentryBlock, but nothing read from the disk is trusted
+ */
+void scan_entries(GroupState *gs, uint32_t dir, const uint8_t *data, size_t capacity) {
+  size_t pos = 0;
+  while (pos + sizeof(ext2_dir_entry_2) <= capacity) {
+    const ext2_dir_entry_2 *dentry = (const ext2_dir_entry_2 *)(data + pos);
+    if (dentry->rec_len == 0) break;
+    if (dentry->rec_len < sizeof(ext2_dir_entry_2) + dentry->name_len || pos + dentry->rec_len > capacity) {
+      report("directory %u: corrupted entry at byte %zu", dir, pos);
+      return;
+    }
+    // unlinked entries keep their space with a zero name length
+    if (dentry->name_len)
+      gs->entries_.push_back({dir, dentry->inode, dentry->file_type, std::string(dentry->name, dentry->name_len)});
+    pos += dentry->rec_len;
+  }
+}
+
+using DataVisitor = std::function<void(uint32_t)>;
+
+/**
+ * @brief claim_block() for a data block of an inode. The entries of its
+ * compressed clusters past their data blocks have none, and those of a
+ * regular file may be shared with dedup.
+ */
+bool claim_data_block(uint32_t inode, const ext2_inode *raw, uint32_t index) {
+  if (index == EXT2_COMPRESSED_BLKADDR && (raw->i_flags & EXT2_COMPRBLK_FL)) return false;
+  return claim_block(inode, index, has_dedup(&super) && S_ISREG(raw->i_mode));
+}
+
+bool walk_indirect(Worker &w, uint32_t inode, const ext2_inode *raw, uint32_t index, int depth, uint32_t *remaining,
+                   const DataVisitor &visitor) {
+  if (!claim_block(inode, index)) return false;
+  uint32_t *ptr = (uint32_t *)w.level_[depth];
+  if (!read_block(inode, index, (uint8_t *)ptr)) return false;
+  for (uint32_t i = 0; i < NUM_INDIRECT_BLOCKS && *remaining; ++i) {
+    if (depth == 1) {
+      (*remaining)--;
+      if (claim_data_block(inode, raw, ptr[i])) visitor(ptr[i]);
+    } else if (!walk_indirect(w, inode, raw, ptr[i], depth - 1, remaining, visitor)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Claim every block of an inode, the way FileSystem::visit_inode_blocks
+ * reads them, and hand the data blocks to visitor
+ */
+void walk_blocks(Worker &w, uint32_t inode, const ext2_inode *raw, const DataVisitor &visitor) {
+  uint32_t remaining = raw->i_blocks / (2 << super.s_log_block_size);
+  for (int i = 0; i < EXT2_NDIR_BLOCKS && remaining; ++i, --remaining) {
+    if (claim_data_block(inode, raw, raw->i_block[i])) visitor(raw->i_block[i]);
+  }
+  for (int depth = 1; depth <= 3 && remaining; ++depth) {
+    if (!walk_indirect(w, inode, raw, raw->i_block[EXT2_IND_BLOCK + depth - 1], depth, &remaining, visitor)) return;
+  }
+}
+
+void check_inode(Worker &w, GroupState *gs, uint32_t inode, const ext2_inode *raw) {
+  inode_types[inode] = raw->i_mode >> 12;
+  inode_links[inode] = raw->i_links_count;
+  uint32_t n_blocks = raw->i_blocks / (2 << super.s_log_block_size);
+  if (INODE_IS_INLINE(raw)) {
+    if (raw->i_blocks) report("inode %u: inline data with %u blocks", inode, n_blocks);
+    if (S_ISDIR(raw->i_mode)) {
+      gs->dirs_++;
+      scan_entries(gs, inode, (const uint8_t *)raw->i_block, INLINE_DATA_SIZE);
+    } else if (!S_ISREG(raw->i_mode)) {
+      report("inode %u: inline data in a special file", inode);
+    } else if (raw->i_size > INLINE_DATA_SIZE) {
+      report("inode %u: inline file of %u bytes", inode, raw->i_size);
+    }
+  } else if (S_ISDIR(raw->i_mode)) {
+    gs->dirs_++;
+    walk_blocks(w, inode, raw, [&](uint32_t index) {
+      if (read_block(inode, index, w.level_[0])) scan_entries(gs, inode, w.level_[0], BLOCK_SIZE);
+    });
+  } else if (S_ISREG(raw->i_mode)) {
+    walk_blocks(w, inode, raw, [](uint32_t) {});
+    if (raw->i_size > BLOCKS2BYTES((uint64_t)n_blocks) && raw->i_size > INLINE_DATA_SIZE)
+      report("inode %u: size %u beyond its %u blocks", inode, raw->i_size, n_blocks);
+  } else if (S_ISLNK(raw->i_mode)) {
+    // short targets are kept in i_block, long ones in one block
+    if (n_blocks > 1) report("inode %u: symlink with %u blocks", inode, n_blocks);
+    if (n_blocks) claim_block(inode, raw->i_block[0]);
+  } else {
+    report("inode %u: unknown type 0%o", inode, raw->i_mode & S_IFMT);
+    inode_types[inode] = 0;
+  }
+}
+
+/**
+ * @brief The bitmaps and inode table of group g, read in w.meta_, match their
+ * slots in the checksum table of the group (0 is no checksum)
+ */
+void check_checksums(Worker &w, uint32_t g) {
+  size_t size = BLOCKS2BYTES(csum_table_blocks(&super));
+  uint32_t *table = (uint32_t *)alloc_aligned(size);
+  if (disk_read(csum_table_offset(&super, g), size, table) < 0) {
+    report("group %u: cannot read the checksum table", g);
+  } else {
+    for (uint32_t j = 0; j < 2 + itb; ++j) {
+      if (table[j] != 0 && table[j] != crc32c(0, w.meta_ + BLOCKS2BYTES(j), BLOCK_SIZE))
+        report("group %u: %s does not match its checksum", g,
+               j == 0 ? "inode bitmap" : j == 1 ? "block bitmap" : "inode table block");
+    }
+  }
+  free(table);
+}
+
+/**
+ * @brief The data blocks of group g are mapped as many times as its dedup
+ * table says, if it says anything (0 is never shared)
+ */
+void check_shares(uint32_t g) {
+  GroupState *gs = &groups[g];
+  size_t size = BLOCKS2BYTES(dedup_ref_blocks(&super));
+  uint16_t *refs = (uint16_t *)alloc_aligned(size);
+  if (disk_read(data_block_offset(&super, g, dedup_table_start(&super, g)), size, refs) < 0) {
+    report("group %u: cannot read the dedup table", g);
+  } else {
+    for (uint32_t i = 0; i < dpg; ++i) {
+      bool claimed = gs->claimed_[i >> 6] & (1ULL << (i & 63));
+      uint32_t maps = claimed ? 1 + gs->shares_[i] : 0;
+      if (refs[i] == 0 && maps > 1) {
+        report("block %u: used by %u inodes but not shared", g * stride + i, maps);
+      } else if (refs[i] != 0 && refs[i] != maps) {
+        report("block %u: %u references, mapped %u times", g * stride + i, refs[i], maps);
+      }
+    }
+  }
+  free(refs);
+}
+
+/**
+ * @brief Pass 1: read the bitmaps and the inode table of a group at once (one
+ * piece at a time when packed by flex group) and check every inode in use
+ */
+void check_group(Worker &w, uint32_t g) {
+  GroupState *gs = &groups[g];
+  const ext2_group_desc *desc = &descs[g];
+  ext2_group_desc expected;
+  set_group_offsets(&super, g, &expected);
+  if (inode_bitmap_offset(desc) != inode_bitmap_offset(&expected) ||
+      block_bitmap_offset(desc) != block_bitmap_offset(&expected) ||
+      inode_table_offset(desc) != inode_table_offset(&expected)) {
+    report("group %u: descriptor does not match the geometry, group skipped", g);
+    return;
+  }
+  int ret;
+  if (flex_layout(&super)) {
+    ret = disk_read(inode_bitmap_offset(desc), BLOCK_SIZE, w.meta_);
+    if (ret == 0) ret = disk_read(block_bitmap_offset(desc), BLOCK_SIZE, w.meta_ + BLOCK_SIZE);
+    if (ret == 0) ret = disk_read(inode_table_offset(desc), BLOCKS2BYTES(itb), w.meta_ + 2 * BLOCK_SIZE);
+  } else {
+    ret = disk_read(inode_bitmap_offset(desc), BLOCKS2BYTES(2 + itb), w.meta_);
+  }
+  if (ret < 0) {
+    report("group %u: cannot read bitmaps and inode table, group skipped", g);
+    return;
+  }
+  if (has_checksums(&super)) check_checksums(w, g);
+  memcpy(gs->inode_bitmap_, w.meta_, BLOCK_SIZE);
+  memcpy(gs->block_bitmap_, w.meta_ + BLOCK_SIZE, BLOCK_SIZE);
+  gs->valid_ = true;
+
+  Bitmap inode_bitmap(gs->inode_bitmap_);
+  const ext2_inode *table = (const ext2_inode *)(w.meta_ + 2 * BLOCK_SIZE);
+  for (uint32_t i = 0; i < ipg; ++i) {
+    if (inode_bitmap.test(i)) check_inode(w, gs, g * ipg + i, &table[i]);
+  }
+}
+
+/**
+ * @brief Pass 2: every entry names an inode in use, of the type it records
+ */
+void check_entries(Worker &, uint32_t g) {
+  for (const Entry &entry : groups[g].entries_) {
+    if (entry.inode_ >= inode_types.size() || inode_types[entry.inode_] == 0) {
+      report("directory %u: entry '%s' points to free inode %u", entry.dir_, entry.name_.c_str(), entry.inode_);
+      continue;
+    }
+    if (entry.file_type_ != inode_types[entry.inode_])
+      report("directory %u: entry '%s' has type %u, inode %u has type %u", entry.dir_, entry.name_.c_str(),
+             entry.file_type_, entry.inode_, inode_types[entry.inode_]);
+    inode_refs[entry.inode_]++;
+  }
+}
+
+/**
+ * @brief Pass 3: link counts against entries, bitmaps against the blocks
+ * referenced in pass 1, descriptor counters against the bitmaps
+ */
+void check_counts(Worker &, uint32_t g) {
+  GroupState *gs = &groups[g];
+  if (!gs->valid_) return;
+  Bitmap inode_bitmap(gs->inode_bitmap_);
+  Bitmap block_bitmap(gs->block_bitmap_);
+
+  uint32_t used_inodes = 0;
+  for (uint32_t i = 0; i < ipg; ++i) {
+    if (!inode_bitmap.test(i)) continue;
+    used_inodes++;
+    uint32_t inode = g * ipg + i;
+    if (inode_types[inode] == 0) continue;
+    uint32_t refs = inode_refs[inode];
+    if (inode == ROOT_INODE) {
+      if (refs) report("root directory is named by %u entries", refs);
+    } else if (refs == 0) {
+      report("inode %u: in use but in no directory", inode);
+    } else if (refs != inode_links[inode]) {
+      report("inode %u: link count %u, named by %u entries", inode, inode_links[inode], refs);
+    } else if (inode_types[inode] == DENTRY_DIR && refs > 1) {
+      report("directory %u: named by %u entries", inode, refs);
+    }
+  }
+
+  uint32_t used_blocks = 0, leaked = 0, unmarked = 0;
+  uint32_t reserved = reserved_data_blocks(&super, g);
+  for (uint32_t i = 0; i < dpg; ++i) {
+    bool used = block_bitmap.test(i);
+    bool claimed = gs->claimed_[i >> 6] & (1ULL << (i & 63));
+    used_blocks += used;
+    if (used && !claimed && i >= reserved) {
+      if (config.verbose) report("block %u: in use but not referenced", g * stride + i);
+      leaked++;
+    } else if (claimed && !used) {
+      if (config.verbose) report("block %u: referenced but free in the bitmap", g * stride + i);
+      unmarked++;
+    }
+  }
+  if (!config.verbose && leaked) report("group %u: %u blocks in use but not referenced", g, leaked);
+  if (!config.verbose && unmarked) report("group %u: %u referenced blocks free in the bitmap", g, unmarked);
+
+  // data block 0 overlaps the inode table, or holds descriptors with FLEX_BG
+  if (reserved && !block_bitmap.test(0)) report("group %u: reserved data block 0 is free in the bitmap", g);
+  if (reserved && (gs->claimed_[0] & 1)) {
+    for (uint32_t i = ipg - INODES_PER_BLOCK; i < ipg && !flex_layout(&super); ++i) {
+      if (inode_bitmap.test(i)) {
+        report("group %u: data block 0 is in use and overlaps inode %u", g, g * ipg + i);
+        break;
+      }
+    }
+    if (flex_layout(&super)) report("group %u: data block 0 is in use and holds group descriptors", g);
+  }
+  // bits past the geometry must never be allocated
+  for (uint32_t i = ipg; i < BITS_PER_GROUP; ++i) {
+    if (!inode_bitmap.test(i)) {
+      report("group %u: inode bitmap is free past inode %u", g, ipg);
+      break;
+    }
+  }
+  for (uint32_t i = dpg; i < BITS_PER_GROUP; ++i) {
+    if (!block_bitmap.test(i)) {
+      report("group %u: block bitmap is free past block %u", g, dpg);
+      break;
+    }
+  }
+
+  const ext2_group_desc *desc = &descs[g];
+  if (desc->bg_free_inodes_count != ipg - used_inodes)
+    report("group %u: %u free inodes, descriptor says %u", g, ipg - used_inodes, desc->bg_free_inodes_count);
+  if (desc->bg_free_blocks_count != dpg - used_blocks)
+    report("group %u: %u free blocks, descriptor says %u", g, dpg - used_blocks, desc->bg_free_blocks_count);
+  if (desc->bg_used_dirs_count != gs->dirs_)
+    report("group %u: %u directories, descriptor says %u", g, gs->dirs_, desc->bg_used_dirs_count);
+  if (has_dedup(&super)) check_shares(g);
+}
+
+/**
+ * @brief Load the super block and the descriptors, false if this is not a
+ * NaiveFS file system that can be checked
+ */
+bool load_super(const char *device) {
+  uint8_t *buf = (uint8_t *)alloc_aligned(BLOCK_SIZE);
+  bool ok = disk_read(0, BLOCK_SIZE, buf) == 0;
+  if (!ok) fprintf(stderr, "%s: cannot read the super block\n", device);
+  memcpy(&super, buf, sizeof(super));
+  ipg = super.s_inodes_per_group;
+  stride = super.s_blocks_per_group;
+  if (ok && super.s_state != FSState::NORMAL) {
+    fprintf(stderr, "%s: not formatted\n", device);
+    ok = false;
+  }
+  if (ok && (super.s_log_block_size != LOG_BLOCK_SIZE || super.s_inode_size != sizeof(ext2_inode) || ipg == 0 ||
+             ipg % INODES_PER_BLOCK || ipg > BITS_PER_GROUP || stride <= 2 + ipg / INODES_PER_BLOCK ||
+             data_blocks_per_group(&super) > BITS_PER_GROUP || first_meta_bg(&super) > MAX_BLOCK_GROUPS ||
+             super.s_log_groups_per_flex >= 31 || groups_per_flex(&super) > MAX_GROUPS_PER_FLEX ||
+             num_block_groups(&super) > max_block_groups(&super) ||
+             data_blocks_per_group(&super) <= csum_table_blocks(&super) + dedup_table_blocks(&super))) {
+    fprintf(stderr, "%s: bad super block\n", device);
+    ok = false;
+  }
+  if (ok && has_checksums(&super) && super.s_checksum != super_block_checksum(buf))
+    report("super block: does not match its checksum");
+  if (ok) {
+    itb = inode_table_blocks(&super);
+    dpg = data_blocks_per_group(&super);
+    n_groups = num_block_groups(&super);
+    disk_set_group_size(BLOCKS2BYTES(stride) << super.s_log_groups_per_flex);
+    // block 0, then one descriptor block per meta group
+    uint32_t first = std::min(first_meta_bg(&super), n_groups);
+    const ext2_group_desc *desc = (const ext2_group_desc *)(buf + sizeof(ext2_super_block));
+    descs.assign(desc, desc + first);
+    for (uint32_t g = first; g < n_groups; g += DESCS_PER_BLOCK) {
+      if (disk_read(meta_desc_block_offset(&super, g), BLOCK_SIZE, buf) < 0) {
+        fprintf(stderr, "%s: cannot read the descriptors of group %u\n", device, g);
+        ok = false;
+        break;
+      }
+      desc = (const ext2_group_desc *)buf;
+      descs.insert(descs.end(), desc, desc + std::min(n_groups - g, (uint32_t)DESCS_PER_BLOCK));
+    }
+  }
+  free(buf);
+  return ok;
+}
+
+void usage(const char *progname) {
+  printf(
+      "usage: %s [options] <device>\n\n"
+      "Options:\n"
+      "    -j, --threads=<n>     Groups checked in parallel (default: one per CPU)\n"
+      "    -m, --max-errors=<n>  Errors printed, all are counted (default: 100)\n"
+      "    -v, --verbose         Print every block and the time of each pass\n",
+      progname);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  static const struct option long_options[] = {{"threads", required_argument, 0, 'j'},
+                                               {"max-errors", required_argument, 0, 'm'},
+                                               {"verbose", no_argument, 0, 'v'},
+                                               {"help", no_argument, 0, 'h'},
+                                               {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "j:m:vh", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'j': config.threads = strtoul(optarg, NULL, 0); break;
+      case 'm': config.max_errors = strtoull(optarg, NULL, 0); break;
+      case 'v': config.verbose = true; break;
+      default: usage(argv[0]); return c == 'h' ? FSCK_CLEAN : FSCK_FAILED;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+    return FSCK_FAILED;
+  }
+  const char *device = argv[optind];
+  if (disk_open(device) < 0) {
+    fprintf(stderr, "Failed to open %s\n", device);
+    return FSCK_FAILED;
+  }
+  if (!load_super(device)) {
+    disk_close();
+    return FSCK_FAILED;
+  }
+
+  groups = std::vector<GroupState>(n_groups);
+  if (has_dedup(&super)) {
+    for (auto &gs : groups) gs.shares_.reset(new std::atomic<uint16_t>[dpg]());
+  }
+  uint64_t n_inodes = (uint64_t)n_groups * ipg;
+  inode_types.assign(n_inodes, 0);
+  inode_links.assign(n_inodes, 0);
+  inode_refs.reset(new std::atomic<uint32_t>[n_inodes]());
+
+  const char *passes[] = {"inodes and blocks", "directory entries", "link counts, bitmaps and counters"};
+  void (*checks[])(Worker &, uint32_t) = {check_group, check_entries, check_counts};
+  uint64_t begin = stat_now();
+  for (int pass = 0; pass < 3; ++pass) {
+    uint64_t start = stat_now();
+    for_each_group(checks[pass]);
+    if (config.verbose) printf("Pass %d: %s, %.3f s\n", pass + 1, passes[pass], (stat_now() - start) / 1e9);
+    if (pass == 0 && groups[0].valid_ && inode_types[ROOT_INODE] != DENTRY_DIR) report("root directory is missing");
+  }
+
+  uint64_t used_inodes = 0, used_blocks = 0;
+  for (auto &gs : groups) {
+    if (!gs.valid_) continue;
+    Bitmap inode_bitmap(gs.inode_bitmap_);
+    Bitmap block_bitmap(gs.block_bitmap_);
+    for (uint32_t i = 0; i < ipg; ++i) used_inodes += inode_bitmap.test(i);
+    for (uint32_t i = 0; i < dpg; ++i) used_blocks += block_bitmap.test(i);
+  }
+  // s_blocks_count counts the first group's metadata on images formatted on
+  // first mount, so only the inode count is exact
+  if (super.s_inodes_count != used_inodes)
+    report("super block: %lu inodes in use, super block says %u", used_inodes, super.s_inodes_count);
+  disk_close();
+
+  uint64_t errors = n_errors.load();
+  if (errors > config.max_errors) printf("... %lu more errors\n", errors - config.max_errors);
+  printf("%s: %lu/%lu inodes, %lu/%lu blocks, %u groups, %.3f s: %s\n", device, used_inodes, n_inodes, used_blocks,
+         (uint64_t)n_groups * dpg, n_groups, (stat_now() - begin) / 1e9,
+         errors ? (std::to_string(errors) + " errors").c_str() : "clean");
+  return errors ? FSCK_ERRORS : FSCK_CLEAN;
+}
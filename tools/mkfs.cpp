@@ -0,0 +1,330 @@
+/*
+ * mkfs.naivefs: format a device up front, with every block group laid out,
+ * instead of letting the first mount format it lazily.
+ *
+ * usage: mkfs.naivefs [options] <device>
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include "block.h"
+#include "utils/bitmap.h"
+#include "utils/disk.h"
+
+using namespace naivefs;
+
+namespace {
+
+struct MkfsConfig {
+  uint32_t inodes_per_group = INODES_PER_GROUP;
+  uint32_t blocks_per_group = BLOCKS_PER_GROUP;  // data blocks
+  uint64_t size = 0;                             // 0: the device size
+  uint32_t groups = 0;                           // 0: as many as fit
+  uint32_t flex = 1 << LOG_GROUPS_PER_FLEX;      // groups per flex group
+  uint32_t ro_compat = 0;                        // checksum features
+  bool dedup = false;                            // share blocks of files
+  bool quiet = false;
+};
+
+MkfsConfig config;
+
+/**
+ * @brief Record the checksum of the block written at offset in the table of
+ * its group, read back and written again
+ */
+int patch_checksum(const ext2_super_block *super, off_t offset, const uint8_t *data, uint8_t *buf) {
+  uint32_t group, slot;
+  if (!csum_slot(super, offset, &group, &slot)) return 0;
+  off_t at = csum_table_offset(super, group) + BLOCKS2BYTES(slot / (BLOCK_SIZE / sizeof(uint32_t)));
+  int ret = disk_read(at, BLOCK_SIZE, buf);
+  if (ret < 0) return ret;
+  ((uint32_t *)buf)[slot % (BLOCK_SIZE / sizeof(uint32_t))] = crc32c(0, data, BLOCK_SIZE);
+  return disk_write(at, BLOCK_SIZE, buf);
+}
+
+/**
+ * @brief Create or resize a regular file image to size bytes
+ */
+int prepare_image(const char *path, uint64_t size) {
+  struct stat st;
+  if (strncmp(path, RAM_DEVICE_PREFIX, strlen(RAM_DEVICE_PREFIX)) == 0 ||
+      strncmp(path, STRIPE_DEVICE_PREFIX, strlen(STRIPE_DEVICE_PREFIX)) == 0 ||
+      (stat(path, &st) == 0 && !S_ISREG(st.st_mode))) {
+    fprintf(stderr, "--size only applies to image files\n");
+    return -1;
+  }
+  int fd = open(path, O_CREAT | O_RDWR, 0644);
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    perror(path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+void usage(const char *progname) {
+  printf(
+      "usage: %s [options] <device>\n\n"
+      "Options:\n"
+      "    -i, --inodes-per-group=<n>  Inodes per block group, a multiple of %zu\n"
+      "                                (default: %d, at most %d)\n"
+      "    -b, --blocks-per-group=<n>  Data blocks per block group\n"
+      "                                (default: %d, at most %d)\n"
+      "    -s, --size=<size>           Create or resize the image file (k/m/g)\n"
+      "    -G, --groups=<n>            Number of block groups (default: fill the\n"
+      "                                device)\n"
+      "    -F, --flex-groups=<n>       Block groups packing their metadata together,\n"
+      "                                a power of 2, 1 to lay out every group on\n"
+      "                                its own (default: %d)\n"
+      "    -c, --checksums=<what>      Keep CRC32C checksums of the metadata\n"
+      "                                ('meta') or of the file data too ('data')\n"
+      "    -d, --dedup                 Share the data blocks of identical data\n"
+      "                                between files\n"
+      "    -q, --quiet                 Only print errors\n",
+      progname, INODES_PER_BLOCK, INODES_PER_GROUP, BLOCK_SIZE * 8, BLOCKS_PER_GROUP, BLOCK_SIZE * 8,
+      1 << LOG_GROUPS_PER_FLEX);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+      {"inodes-per-group", required_argument, 0, 'i'}, {"blocks-per-group", required_argument, 0, 'b'},
+      {"size", required_argument, 0, 's'},             {"groups", required_argument, 0, 'G'},
+      {"flex-groups", required_argument, 0, 'F'},      {"checksums", required_argument, 0, 'c'},
+      {"dedup", no_argument, 0, 'd'},                  {"quiet", no_argument, 0, 'q'},
+      {"help", no_argument, 0, 'h'},                   {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "i:b:s:G:F:c:dqh", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'i': config.inodes_per_group = strtoul(optarg, NULL, 0); break;
+      case 'b': config.blocks_per_group = strtoul(optarg, NULL, 0); break;
+      case 's':
+        if ((config.size = parse_size(optarg)) == 0) {
+          fprintf(stderr, "Invalid size: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'G': config.groups = strtoul(optarg, NULL, 0); break;
+      case 'F': config.flex = strtoul(optarg, NULL, 0); break;
+      case 'c':
+        if (strcmp(optarg, "meta") == 0) {
+          config.ro_compat = EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+        } else if (strcmp(optarg, "data") == 0) {
+          config.ro_compat = EXT4_FEATURE_RO_COMPAT_METADATA_CSUM | NAIVEFS_FEATURE_RO_COMPAT_DATA_CSUM;
+        } else {
+          fprintf(stderr, "Invalid checksums: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'd': config.dedup = true; break;
+      case 'q': config.quiet = true; break;
+      default: usage(argv[0]); return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *device = argv[optind];
+  uint32_t ipg = config.inodes_per_group;
+  uint32_t dpg = config.blocks_per_group;
+  if (ipg == 0 || ipg % INODES_PER_BLOCK || ipg > BLOCK_SIZE * 8) {
+    fprintf(stderr, "Inodes per group must be a multiple of %zu up to %d\n", INODES_PER_BLOCK, BLOCK_SIZE * 8);
+    return 1;
+  }
+  if (dpg < 2 || dpg > BLOCK_SIZE * 8) {
+    fprintf(stderr, "Blocks per group must be between 2 and %d\n", BLOCK_SIZE * 8);
+    return 1;
+  }
+  if (config.flex == 0 || (config.flex & (config.flex - 1)) || config.flex > MAX_GROUPS_PER_FLEX) {
+    fprintf(stderr, "Groups per flex group must be a power of 2 up to %d\n", MAX_GROUPS_PER_FLEX);
+    return 1;
+  }
+
+  if (config.size && prepare_image(device, config.size) < 0) return 1;
+  if (disk_open(device) < 0) {
+    fprintf(stderr, "Failed to open %s\n", device);
+    return 1;
+  }
+
+  // inode bitmap, block bitmap, inode table, data blocks
+  uint32_t itb = ipg / INODES_PER_BLOCK;
+  uint32_t group_blocks = 2 + itb + dpg;
+  uint64_t group_size = BLOCKS2BYTES(group_blocks);
+
+  uint8_t *super_buf = (uint8_t *)alloc_aligned(BLOCK_SIZE);
+  memset(super_buf, 0, BLOCK_SIZE);
+  ext2_super_block *super = (ext2_super_block *)super_buf;
+  super->s_log_block_size = LOG_BLOCK_SIZE;
+  super->s_blocks_per_group = group_blocks;
+  super->s_inodes_per_group = ipg;
+  super->s_first_meta_bg = MAX_BLOCK_GROUPS;
+  super->s_log_groups_per_flex = __builtin_ctz(config.flex);
+  if (flex_layout(super)) super->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_FLEX_BG;
+  super->s_feature_ro_compat = config.ro_compat;
+  if (config.dedup) super->s_feature_ro_compat |= NAIVEFS_FEATURE_RO_COMPAT_DEDUP;
+  // the checksum and dedup tables take data blocks of every group
+  uint32_t table_blocks = csum_table_blocks(super);
+  uint32_t dedup_blocks = dedup_table_blocks(super);
+  if (dpg <= 1 + table_blocks + dedup_blocks) {
+    fprintf(stderr, "Blocks per group must be above %u with checksums and dedup\n", 1 + table_blocks + dedup_blocks);
+    free(super_buf);
+    return 1;
+  }
+  disk_set_group_size(group_size << super->s_log_groups_per_flex);
+
+  // the groups of a partial flex group end later than whole group regions
+  uint64_t size = config.size ? config.size : disk()->size();
+  uint64_t fit = size > BLOCK_SIZE ? (size - BLOCK_SIZE) / group_size : 0;
+  auto group_end = [super, dpg](uint32_t i) {
+    if (!flex_layout(super)) return (uint64_t)block_group_offset(super, i + 1);
+    return (uint64_t)data_block_offset(super, i, dpg);
+  };
+  while (fit && group_end(fit - 1) > size) --fit;
+  // block and inode indexes are 32 bits
+  uint64_t addressable = max_block_groups(super);
+  uint64_t groups = config.groups ? config.groups : std::min(fit, addressable);
+  if (groups == 0 || groups > fit) {
+    fprintf(stderr, "%s is too small: %lu bytes, a block group takes %lu\n", device, size, group_size);
+    free(super_buf);
+    disk_close();
+    return 1;
+  }
+  if (groups > addressable) {
+    fprintf(stderr, "At most %lu block groups are supported\n", addressable);
+    free(super_buf);
+    disk_close();
+    return 1;
+  }
+
+  // bitmaps and inode table of a group, contiguous unless packed by flex
+  // group
+  size_t meta_size = BLOCKS2BYTES(2 + itb);
+  uint8_t *meta = (uint8_t *)alloc_aligned(meta_size);
+  // checksums of the blocks of a group, by slot
+  size_t table_size = BLOCKS2BYTES(table_blocks);
+  uint32_t *table = table_size ? (uint32_t *)alloc_aligned(table_size) : nullptr;
+  // no block is shared nor in the dedup index yet
+  size_t dedup_size = BLOCKS2BYTES(dedup_blocks);
+  uint8_t *dedup = dedup_size ? (uint8_t *)alloc_aligned(dedup_size) : nullptr;
+  if (dedup != nullptr) memset(dedup, 0, dedup_size);
+  uint64_t dedup_entries = groups * dedup_index_blocks(super) * (BLOCK_SIZE / sizeof(dedup_entry));
+  // invalidate the old super block first, an interrupted mkfs is UNINIT
+  memset(meta, 0, BLOCK_SIZE);
+  int ret = disk_write(0, BLOCK_SIZE, meta);
+  std::vector<ext2_group_desc> descs(groups);
+  uint64_t free_blocks = 0;
+  timeval now;
+  gettimeofday(&now, NULL);
+  for (uint64_t i = 0; i < groups && ret == 0; ++i) {
+    memset(meta, 0, meta_size);
+    Bitmap inode_bitmap(meta);
+    Bitmap block_bitmap(meta + BLOCK_SIZE);
+    // reserved data blocks and bits past the geometry are never allocated
+    uint32_t reserved = reserved_data_blocks(super, i);
+    for (uint32_t j = 0; j < reserved; ++j) block_bitmap.set(j);
+    for (uint32_t j = ipg; j < BLOCK_SIZE * 8; ++j) inode_bitmap.set(j);
+    for (uint32_t j = dpg; j < BLOCK_SIZE * 8; ++j) block_bitmap.set(j);
+
+    ext2_group_desc *desc = &descs[i];
+    set_group_offsets(super, i, desc);
+    desc->bg_free_blocks_count = dpg - reserved;
+    free_blocks += dpg - reserved;
+    desc->bg_free_inodes_count = ipg;
+    desc->bg_used_dirs_count = 0;
+
+    if (i == 0) {
+      // the root directory, as the first mount would create it
+      inode_bitmap.set(ROOT_INODE);
+      ext2_inode *root = (ext2_inode *)(meta + 2 * BLOCK_SIZE) + ROOT_INODE;
+      root->i_mode = EXT2_S_IFDIR | EXT2_S_IRUSR | EXT2_S_IRGRP | EXT2_S_IROTH;
+      root->i_ctime = root->i_mtime = root->i_atime = now.tv_sec;
+      root->i_links_count = 1;
+      // inherited by everything created, unless a directory clears it
+      if (config.dedup) root->i_flags = EXT2_DEDUP_FL;
+      desc->bg_free_inodes_count--;
+      desc->bg_used_dirs_count++;
+    }
+    if (table != nullptr) {
+      // slots of the inode bitmap, the block bitmap and the inode table, the
+      // data blocks have none until written
+      memset(table, 0, table_size);
+      for (uint32_t j = 0; j < 2 + itb; ++j) table[j] = crc32c(0, meta + BLOCKS2BYTES(j), BLOCK_SIZE);
+      ret = disk_write(csum_table_offset(super, i), table_size, table);
+    }
+    if (ret == 0 && dedup != nullptr)
+      ret = disk_write(data_block_offset(super, i, dedup_table_start(super, i)), dedup_size, dedup);
+    if (ret < 0) {
+      break;
+    } else if (flex_layout(super)) {
+      ret = disk_write(inode_bitmap_offset(desc), BLOCK_SIZE, meta);
+      if (ret == 0) ret = disk_write(block_bitmap_offset(desc), BLOCK_SIZE, meta + BLOCK_SIZE);
+      if (ret == 0) ret = disk_write(inode_table_offset(desc), BLOCKS2BYTES(itb), meta + 2 * BLOCK_SIZE);
+    } else {
+      ret = disk_write(inode_bitmap_offset(desc), meta_size, meta);
+    }
+  }
+
+  // descriptors of the first groups follow the super block, the others fill
+  // one block per meta group
+  uint32_t first = std::min((uint64_t)MAX_BLOCK_GROUPS, groups);
+  memcpy(super_buf + sizeof(ext2_super_block), descs.data(), first * sizeof(ext2_group_desc));
+  for (uint64_t i = first; i < groups && ret == 0; i += DESCS_PER_BLOCK) {
+    memset(meta, 0, BLOCK_SIZE);
+    memcpy(meta, &descs[i], std::min(groups - i, (uint64_t)DESCS_PER_BLOCK) * sizeof(ext2_group_desc));
+    ret = disk_write(meta_desc_block_offset(super, i), BLOCK_SIZE, meta);
+    if (ret == 0 && table != nullptr)
+      ret = patch_checksum(super, meta_desc_block_offset(super, i), meta, (uint8_t *)table);
+  }
+
+  if (ret == 0) {
+    if (groups > first) super->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_META_BG;
+    if ((uint64_t)block_group_offset(super, groups) > UINT32_MAX)
+      super->s_feature_incompat |= EXT4_FEATURE_INCOMPAT_64BIT;
+    // counts of used data blocks and inodes
+    super->s_blocks_count = 0;
+    super->s_inodes_count = 1;
+    super->s_free_blocks_count = free_blocks;
+    super->s_free_inodes_count = groups * ipg - 1;
+    super->s_first_ino = ROOT_INODE;
+    super->s_inode_size = sizeof(ext2_inode);
+    super->s_prealloc_blocks = PREALLOC_BLOCKS;
+    super->s_prealloc_dir_blocks = PREALLOC_DIR_BLOCKS;
+    super->s_wtime = now.tv_sec;
+    super->s_groups_count = groups;
+    super->s_dedup_groups = config.dedup ? groups : 0;
+    super->s_state = FSState::NORMAL;
+    if (table != nullptr) super->s_checksum = super_block_checksum(super_buf);
+    ret = disk_write(0, BLOCK_SIZE, super_buf);
+  }
+  if (ret == 0) ret = disk()->sync();
+  free(meta);
+  free(table);
+  free(dedup);
+  free(super_buf);
+  disk_close();
+  if (ret < 0) {
+    fprintf(stderr, "Failed to format %s: %s\n", device, strerror(-ret));
+    return 1;
+  }
+
+  if (!config.quiet) {
+    printf("%s: %lu block groups of %u inodes and %u data blocks (%lu MiB each), %u per flex group\n", device,
+           groups, ipg, dpg, group_size >> 20, config.flex);
+    printf("%lu inodes, %lu data blocks of %d bytes\n", groups * ipg, free_blocks, BLOCK_SIZE);
+    if (table_blocks)
+      printf("crc32c checksums of the %s, %u blocks per group\n",
+             config.ro_compat & NAIVEFS_FEATURE_RO_COMPAT_DATA_CSUM ? "metadata and data" : "metadata", table_blocks);
+    if (dedup_blocks)
+      printf("dedup index of %lu entries, %u blocks per group\n", dedup_entries, dedup_blocks);
+  }
+  return 0;
+}
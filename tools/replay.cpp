@@ -0,0 +1,384 @@
+/*
+ * naivefs_replay: re-execute an operation trace (mount option trace=) against
+ * an in-process file system and compare latencies and results with the
+ * recording.
+ *
+ * usage: naivefs_replay [options] <trace>
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "operation.h"
+#include "utils/stats.h"
+#include "utils/trace.h"
+
+using namespace naivefs;
+
+// There is no FUSE session, so the replayer is the caller of every request
+struct fuse_context *fuse_get_context(void) {
+  static thread_local fuse_context context;
+  context.uid = getuid();
+  context.gid = getgid();
+  context.pid = getpid();
+  return &context;
+}
+
+namespace {
+
+struct ReplayConfig {
+  std::string device = "ram:4g";
+  bool timing = false;
+  double speed = 1.0;
+  bool serial = false;
+  // give up on a handle whose open was not replayed after this long
+  uint64_t handle_timeout_ms = 10000;
+};
+
+ReplayConfig config;
+
+struct Op {
+  TraceRecord record_;
+  std::string path_;
+  std::string path2_;
+};
+
+/**
+ * @brief Trace handles to the handles of the replay. Opens, the I/O on their
+ * handle and the release may be recorded on different threads: users of a
+ * handle wait until its open has been replayed, and the release waits until
+ * all of its users are done, as the kernel guarantees.
+ */
+class HandleTable {
+ public:
+  // number of records using the handle, other than its open and release
+  void expect(uint64_t handle) { ++handles_[handle].users_; }
+
+  void put(uint64_t handle, const fuse_file_info &fi) {
+    std::lock_guard<std::mutex> lck(m_);
+    handles_[handle].fi_ = fi;
+    handles_[handle].open_ = true;
+    cv_.notify_all();
+  }
+
+  bool get(uint64_t handle, fuse_file_info *fi) {
+    std::unique_lock<std::mutex> lck(m_);
+    Handle &h = handles_[handle];
+    if (!wait(&lck, [&] { return h.open_; })) return false;
+    *fi = h.fi_;
+    return true;
+  }
+
+  void done(uint64_t handle) {
+    std::lock_guard<std::mutex> lck(m_);
+    --handles_[handle].users_;
+    cv_.notify_all();
+  }
+
+  /**
+   * @brief Wait for the users of the handle before it is released
+   */
+  bool get_for_release(uint64_t handle, fuse_file_info *fi) {
+    std::unique_lock<std::mutex> lck(m_);
+    Handle &h = handles_[handle];
+    if (!wait(&lck, [&] { return h.open_ && h.users_ == 0; })) return false;
+    *fi = h.fi_;
+    handles_.erase(handle);
+    return true;
+  }
+
+ private:
+  struct Handle {
+    fuse_file_info fi_;
+    bool open_ = false;
+    int64_t users_ = 0;
+  };
+
+  template <typename Pred>
+  bool wait(std::unique_lock<std::mutex> *lck, Pred pred) {
+    return cv_.wait_for(*lck, std::chrono::milliseconds(config.handle_timeout_ms), pred);
+  }
+
+  std::mutex m_;
+  std::condition_variable cv_;
+  std::map<uint64_t, Handle> handles_;
+};
+
+HandleTable handles;
+
+struct OpStats {
+  std::vector<uint64_t> latencies_;  // ns
+  uint64_t recorded_ = 0;            // sum of recorded durations, ns
+  uint64_t mismatches_ = 0;          // result differs from the recording
+  uint64_t skipped_ = 0;             // handle never opened or still in use
+};
+
+struct ThreadResult {
+  OpStats ops_[NUM_TRACE_OPS];
+};
+
+int fill_nothing(void *, const char *, const struct stat *, off_t, enum fuse_fill_dir_flags) { return 0; }
+
+inline timespec untrace_time(uint64_t t) {
+  timespec ts;
+  ts.tv_sec = t >> 32;
+  ts.tv_nsec = t & 0xffffffff;
+  return ts;
+}
+
+/**
+ * @brief Replay one operation, false if its handle is unknown
+ */
+bool replay(const Op &op, std::vector<char> *buf, int *ret) {
+  const TraceRecord &r = op.record_;
+  const char *path = op.path_.c_str();
+  const char *path2 = op.path2_.c_str();
+  fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  bool uses_handle = r.fh != 0 && r.op != TRACE_OPEN && r.op != TRACE_CREATE;
+  if (uses_handle) {
+    bool found = r.op == TRACE_RELEASE ? handles.get_for_release(r.fh, &fi) : handles.get(r.fh, &fi);
+    if (!found) return false;
+  }
+  fuse_file_info *fip = uses_handle ? &fi : nullptr;
+
+  switch (r.op) {
+    case TRACE_GETATTR: {
+      struct stat st;
+      *ret = fuse_getattr(path, &st, fip);
+      break;
+    }
+    case TRACE_READDIR:
+      *ret = fuse_readdir(path, nullptr, fill_nothing, r.offset, fip, (fuse_readdir_flags)0);
+      break;
+    case TRACE_OPEN:
+      fi.flags = r.arg;
+      *ret = fuse_open(path, &fi);
+      if (*ret == 0) handles.put(r.fh, fi);
+      break;
+    case TRACE_CREATE:
+      fi.flags = r.arg;
+      *ret = fuse_create(path, r.offset, &fi);
+      if (*ret == 0) handles.put(r.fh, fi);
+      break;
+    case TRACE_READ:
+      if (buf->size() < r.arg) buf->resize(r.arg);
+      *ret = fuse_read(path, buf->data(), r.arg, r.offset, fip);
+      break;
+    case TRACE_WRITE:
+      if (buf->size() < r.arg) buf->resize(r.arg, 'x');
+      *ret = fuse_write(path, buf->data(), r.arg, r.offset, fip);
+      break;
+    case TRACE_MKDIR:
+      *ret = fuse_mkdir(path, r.arg);
+      break;
+    case TRACE_RMDIR:
+      *ret = fuse_rmdir(path);
+      break;
+    case TRACE_UNLINK:
+      *ret = fuse_unlink(path);
+      break;
+    case TRACE_RENAME:
+      *ret = fuse_rename(path, path2, r.arg);
+      break;
+    case TRACE_LINK:
+      *ret = fuse_link(path, path2);
+      break;
+    case TRACE_SYMLINK:
+      *ret = fuse_symlink(path, path2);
+      break;
+    case TRACE_READLINK:
+      if (buf->size() < r.arg) buf->resize(r.arg);
+      *ret = fuse_readlink(path, buf->data(), r.arg);
+      break;
+    case TRACE_TRUNCATE:
+      *ret = fuse_truncate(path, r.arg, fip);
+      break;
+    case TRACE_CHMOD:
+      *ret = fuse_chmod(path, r.arg, fip);
+      break;
+    case TRACE_CHOWN:
+      *ret = fuse_chown(path, r.arg >> 32, r.arg & 0xffffffff, fip);
+      break;
+    case TRACE_UTIMENS: {
+      timespec tv[2] = {untrace_time(r.offset), untrace_time(r.arg)};
+      *ret = fuse_utimens(path, r.offset == ~0ULL ? nullptr : tv, fip);
+      break;
+    }
+    case TRACE_ACCESS:
+      *ret = fuse_access(path, r.arg);
+      break;
+    case TRACE_RELEASE:
+      *ret = fuse_release(path, fip);
+      break;
+    case TRACE_FSYNC:
+      *ret = fuse_fsync(path, r.arg, fip);
+      break;
+    case TRACE_FLUSH:
+      *ret = fuse_flush(path, fip);
+      break;
+    default:
+      *ret = -ENOSYS;
+      break;
+  }
+  if (uses_handle && r.op != TRACE_RELEASE) handles.done(r.fh);
+  return true;
+}
+
+/**
+ * @brief Replay ops in order, optionally waiting for their recorded start
+ * time (scaled by speed) relative to begin
+ */
+void replay_thread(const std::vector<const Op *> &ops, uint64_t begin, ThreadResult *result) {
+  std::vector<char> buf;
+  for (auto op : ops) {
+    const TraceRecord &r = op->record_;
+    if (config.timing) {
+      uint64_t due = begin + (uint64_t)(r.start / config.speed);
+      uint64_t now = stat_now();
+      if (due > now) std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+    }
+    OpStats &stats = result->ops_[std::min<uint8_t>(r.op, NUM_TRACE_OPS - 1)];
+    int ret;
+    uint64_t start = stat_now();
+    if (!replay(*op, &buf, &ret)) {
+      ++stats.skipped_;
+      continue;
+    }
+    stats.latencies_.push_back(stat_now() - start);
+    stats.recorded_ += r.duration;
+    // reads and writes return byte counts, so any difference is a mismatch
+    if (ret != r.ret) ++stats.mismatches_;
+  }
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
+
+void usage(const char *progname) {
+  printf(
+      "usage: %s [options] <trace>\n\n"
+      "Options:\n"
+      "    -d, --device=<spec>       Device to replay on, an image copied from\n"
+      "                              the one traced or ram:<size> for an empty\n"
+      "                              file system (default: %s)\n"
+      "    -T, --timing              Keep the recorded issue times\n"
+      "    -x, --speed=<f>           Speed up the recorded times (default: 1)\n"
+      "    -1, --serial              One thread in recorded order, deterministic\n"
+      "    -c, --cache-blocks=<n>    Blocks in the block cache (default: %d)\n"
+      "    -e, --io-engine=<s>       direct or buffered (default: direct)\n"
+      "    -S, --stats               Dump /.naivefs/stats at the end\n",
+      progname, config.device.c_str(), BLOCK_CACHE_SIZE);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+      {"device", required_argument, 0, 'd'}, {"timing", no_argument, 0, 'T'},
+      {"speed", required_argument, 0, 'x'},  {"serial", no_argument, 0, '1'},
+      {"cache-blocks", required_argument, 0, 'c'}, {"io-engine", required_argument, 0, 'e'},
+      {"stats", no_argument, 0, 'S'},        {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  bool dump_stats = false;
+  std::string io_engine = IO_ENGINE_DIRECT;
+  int c;
+  while ((c = getopt_long(argc, argv, "d:Tx:1c:e:Sh", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'd': config.device = optarg; break;
+      case 'T': config.timing = true; break;
+      case 'x': config.speed = atof(optarg); break;
+      case '1': config.serial = true; break;
+      case 'c': global_options.cache_blocks = strtoul(optarg, NULL, 0); break;
+      case 'e': io_engine = optarg; break;
+      case 'S': dump_stats = true; break;
+      default: usage(argv[0]); return c == 'h' ? 0 : 1;
+    }
+  }
+  // in recorded order every open comes before the uses of its handle
+  if (config.serial) config.handle_timeout_ms = 0;
+  if (optind + 1 != argc || config.speed <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen(argv[optind], "rb");
+  TraceHeader header;
+  if (file == nullptr || !trace_read_header(file, &header)) {
+    fprintf(stderr, "%s is not a NaiveFS trace\n", argv[optind]);
+    return 1;
+  }
+  std::vector<Op> ops;
+  Op op;
+  while (trace_read(file, &op.record_, &op.path_, &op.path2_)) ops.push_back(op);
+  fclose(file);
+  std::stable_sort(ops.begin(), ops.end(), [](const Op &a, const Op &b) { return a.record_.start < b.record_.start; });
+
+  for (auto &op : ops) {
+    uint8_t type = op.record_.op;
+    if (op.record_.fh && type != TRACE_OPEN && type != TRACE_CREATE && type != TRACE_RELEASE)
+      handles.expect(op.record_.fh);
+  }
+
+  // per-thread fidelity: one replay thread per recorded thread
+  std::map<uint16_t, std::vector<const Op *>> threads;
+  for (auto &op : ops) threads[config.serial ? 0 : op.record_.thread].push_back(&op);
+
+  global_options.device = (char *)config.device.c_str();
+  global_options.io_engine = (char *)io_engine.c_str();
+  fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  fuse_init(&conn, nullptr);
+
+  std::vector<ThreadResult> results(threads.size());
+  std::vector<std::thread> workers;
+  uint64_t begin = stat_now();
+  size_t i = 0;
+  for (auto &thread : threads) {
+    workers.emplace_back(replay_thread, std::cref(thread.second), begin, &results[i++]);
+  }
+  for (auto &worker : workers) worker.join();
+  double secs = (stat_now() - begin) / 1e9;
+
+  uint64_t recorded_span = ops.empty() ? 0 : ops.back().record_.start + ops.back().record_.duration;
+  printf("%zu ops on %zu threads in %.3f s (recorded %.3f s), %.1f ops/s\n", ops.size(), threads.size(), secs,
+         recorded_span / 1e9, ops.size() / secs);
+  printf("%-9s %9s %10s %10s %9s %9s %9s %9s\n", "op", "count", "rec_avg_us", "avg_us", "p50_us", "p99_us",
+         "mismatch", "skipped");
+  uint64_t mismatches = 0;
+  for (int op = 0; op < NUM_TRACE_OPS; ++op) {
+    OpStats total;
+    for (auto &result : results) {
+      OpStats &stats = result.ops_[op];
+      total.latencies_.insert(total.latencies_.end(), stats.latencies_.begin(), stats.latencies_.end());
+      total.recorded_ += stats.recorded_;
+      total.mismatches_ += stats.mismatches_;
+      total.skipped_ += stats.skipped_;
+    }
+    if (total.latencies_.empty() && total.skipped_ == 0) continue;
+    std::sort(total.latencies_.begin(), total.latencies_.end());
+    uint64_t sum = 0;
+    for (auto ns : total.latencies_) sum += ns;
+    size_t count = std::max<size_t>(total.latencies_.size(), 1);
+    printf("%-9s %9zu %10.1f %10.1f %9.1f %9.1f %9lu %9lu\n", trace_op_name(op), total.latencies_.size(),
+           total.recorded_ / 1e3 / count, sum / 1e3 / count, percentile(total.latencies_, 0.5) / 1e3,
+           percentile(total.latencies_, 0.99) / 1e3, total.mismatches_, total.skipped_);
+    mismatches += total.mismatches_;
+  }
+  if (dump_stats) printf("\n%s", stat_report().c_str());
+  fuse_destroy(nullptr);
+  // results differing from the recording usually mean a different starting image
+  return mismatches ? 2 : 0;
+}